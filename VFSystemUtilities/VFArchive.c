@@ -0,0 +1,626 @@
+//
+//  VFArchive.c
+//
+//  Created by Dima Bart on 2014-08-04.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <limits.h>
+#import <sys/time.h>
+#import <dispatch/dispatch.h>
+
+#import "VFArchive.h"
+#import "VFTokenCollection.h"
+
+static const char kVFArchiveMagic[4]        = { 'V', 'F', 'P', 'K' };
+static const char kVFArchiveIndexMagic[8]   = { 'V', 'F', 'P', 'K', 'I', 'D', 'X', '\0' };
+static const uint32_t kVFArchiveVersion     = 1;
+static const size_t kVFArchiveBufferSize    = 4 * 1024 * 1024;
+static const size_t kVFArchiveTransferSize  = 1024 * 1024;
+
+typedef struct __VFArchiveHeader {
+    char     magic[4];
+    uint32_t version;
+} _VFArchiveHeader;
+
+typedef struct __VFArchiveRecord {
+    uint64_t offset;
+    uint64_t size;
+    int64_t  time_modified;
+    uint32_t mode;
+    uint32_t user_id;
+    uint32_t group_id;
+    uint32_t path_length;
+} _VFArchiveRecord;
+
+typedef struct __VFArchiveTrailer {
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint64_t count;
+    char     magic[8];
+} _VFArchiveTrailer;
+
+typedef struct __VFArchiveWriter {
+    int      file;
+    uint8_t *buffer;
+    size_t   used;
+    uint64_t offset;
+    BOOL     failed;
+} _VFArchiveWriter;
+typedef _VFArchiveWriter * VFArchiveWriter;
+
+#pragma mark - Private -
+static BOOL VFArchiveWriteAll(int file, const uint8_t *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(file, bytes, length);
+        if (bytes_written == -1) {
+            if (errno == EINTR) continue;
+            return NO;
+        }
+        bytes  += bytes_written;
+        length -= bytes_written;
+    }
+    return YES;
+}
+
+static BOOL VFArchiveReadAll(int file, uint8_t *bytes, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t bytes_read = pread(file, bytes, length, offset);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) continue;
+            return NO;
+        }
+        bytes  += bytes_read;
+        length -= bytes_read;
+        offset += bytes_read;
+    }
+    return YES;
+}
+
+static void VFArchiveWriterFlush(VFArchiveWriter writer) {
+    if (writer->used > 0 && !writer->failed) {
+        writer->failed = !VFArchiveWriteAll(writer->file, writer->buffer, writer->used);
+    }
+    writer->used = 0;
+}
+
+static void VFArchiveWriterAppend(VFArchiveWriter writer, const void *bytes, size_t length) {
+    writer->offset += length;
+    while (length > 0) {
+        size_t available = kVFArchiveBufferSize - writer->used;
+        size_t chunk     = (length < available) ? length : available;
+        memcpy(writer->buffer + writer->used, bytes, chunk);
+        writer->used += chunk;
+        bytes         = (const uint8_t *)bytes + chunk;
+        length       -= chunk;
+        
+        if (writer->used == kVFArchiveBufferSize) {
+            VFArchiveWriterFlush(writer);
+        }
+    }
+}
+
+/*
+ * Reads a file straight into the free space of the pack buffer so that
+ * small files cost one read() and no extra copy.
+ */
+static BOOL VFArchiveWriterAppendFile(VFArchiveWriter writer, const char *path, uint64_t *size) {
+    int file = open(path, O_RDONLY | O_NOFOLLOW);
+    if (file == -1) {
+        return NO;
+    }
+    
+    ssize_t bytes_read = 0;
+    *size              = 0;
+    for (;;) {
+        if (writer->used == kVFArchiveBufferSize) {
+            VFArchiveWriterFlush(writer);
+        }
+        
+        bytes_read = read(file, writer->buffer + writer->used, kVFArchiveBufferSize - writer->used);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        
+        writer->used   += bytes_read;
+        writer->offset += bytes_read;
+        *size          += bytes_read;
+    }
+    
+    close(file);
+    return (bytes_read == 0);
+}
+
+static int VFArchiveCompareRecords(const void *a, const void *b) {
+    const _VFArchiveMember *member1 = a;
+    const _VFArchiveMember *member2 = b;
+    return strcmp(member1->path, member2->path);
+}
+
+static BOOL VFArchiveIsSafePath(const char *path) {
+    if (!path || path[0] == '\0' || path[0] == '/') {
+        return NO;
+    }
+    
+    // Rejects any ".." component so members can't escape the destination
+    for (const char *component = path; component; component = strchr(component, '/')) {
+        if (*component == '/') {
+            component++;
+        }
+        if (component[0] == '.' && component[1] == '.' && (component[2] == '/' || component[2] == '\0')) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+static void VFArchiveApplyTimes(int file, VFArchiveMember member) {
+    struct timeval times[2];
+    times[0].tv_sec  = member->time_modified;
+    times[0].tv_usec = 0;
+    times[1]         = times[0];
+    futimes(file, times);
+}
+
+/*
+ * Opens the directory that holds a member, one component at a time from
+ * root and never through a symbolic link, so neither the archive nor
+ * links already in the destination can lead outside of it. Returns -1 or
+ * the directory, with name pointing at the last component of path.
+ */
+static int VFArchiveOpenParent(int root, const char *path, const char **name) {
+    int directory         = dup(root);
+    const char *component = path;
+    const char *separator;
+    while (directory != -1 && (separator = strchr(component, '/')) != NULL) {
+        size_t length = separator - component;
+        if (length > NAME_MAX) {
+            close(directory);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        
+        if (length > 0) {
+            char directory_name[NAME_MAX + 1];
+            memcpy(directory_name, component, length);
+            directory_name[length] = '\0';
+            
+            int child = openat(directory, directory_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            close(directory);
+            directory = child;
+        }
+        component = separator + 1;
+    }
+    *name = component;
+    return directory;
+}
+
+static BOOL VFArchiveWriteMember(VFArchive archive, VFArchiveMember member, int directory, const char *name) {
+    if (S_ISDIR(member->mode)) {
+        return (mkdirat(directory, name, member->mode & 07777) == 0 || errno == EEXIST);
+    }
+    
+    // Never through a link planted at the destination
+    int file = openat(directory, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, member->mode & 07777);
+    if (file == -1) {
+        return NO;
+    }
+    
+    size_t buffer_size = (member->size < kVFArchiveTransferSize) ? member->size : kVFArchiveTransferSize;
+    uint8_t *buffer    = malloc(buffer_size > 0 ? buffer_size : 1);
+    BOOL success       = (buffer != NULL);
+    
+    uint64_t offset = 0;
+    while (success && offset < member->size) {
+        size_t chunk = (member->size - offset < buffer_size) ? member->size - offset : buffer_size;
+        success      = VFArchiveReadAll(archive->file, buffer, chunk, member->offset + offset) && VFArchiveWriteAll(file, buffer, chunk);
+        offset      += chunk;
+    }
+    free(buffer);
+    
+    if (success) {
+        VFArchiveApplyTimes(file, member);
+    }
+    
+    close(file);
+    if (!success) {
+        unlinkat(directory, name, 0);
+    }
+    return success;
+}
+
+#pragma mark - Packing -
+BOOL VFArchivePack(const char *directory, const char *archive_path, char **error) {
+    return VFArchivePackWithOptions(directory, archive_path, VFArchivePackOptionNone, NULL, error);
+}
+
+BOOL VFArchivePackWithOptions(const char *directory, const char *archive_path, VFArchivePackOption options, size_t *skipped_count, char **error) {
+    if (!directory || !archive_path || directory[0] == '\0') {
+        if (error) {
+            *error = "Invalid directory or archive path";
+        }
+        return NO;
+    }
+    
+    int file = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    
+    __block _VFArchiveWriter writer = { file, malloc(kVFArchiveBufferSize), 0, 0, NO };
+    if (!writer.buffer) {
+        close(file);
+        if (error) {
+            *error = "Could not allocate pack buffer";
+        }
+        return NO;
+    }
+    
+    _VFArchiveHeader header = { { 0 }, kVFArchiveVersion };
+    memcpy(header.magic, kVFArchiveMagic, sizeof(header.magic));
+    VFArchiveWriterAppend(&writer, &header, sizeof(header));
+    
+    // Members are collected as they are streamed into the pack and sorted
+    // by path before the index is written
+    __block size_t count               = 0;
+    __block size_t capacity            = 0;
+    __block _VFArchiveMember *members  = NULL;
+    __block int errors                 = 0;
+    __block size_t skipped             = 0;
+    
+    char *root          = VFJoin(directory, (directory[strlen(directory) - 1] == '/') ? "" : "/");
+    size_t root_length  = strlen(root);
+    
+    VFFileEnumerationOption enumeration_options = VFFileEnumerationOptionDeep | VFFileEnumerationOptionHidden | VFFileEnumerationOptionDetail | VFFileEnumerationOptionNoFollow;
+    VFEnumerateDirectory(directory, enumeration_options, ^(void *item, char *enumeration_error) {
+        VFFileInfo info = item;
+        if (!info || enumeration_error) {
+            errors++;
+            return;
+        }
+        
+        // Only regular files and directories are packed
+        if (info->type != VFFileTypeFile && info->type != VFFileTypeDirectory) {
+            skipped++;
+            return;
+        }
+        
+        if (count == capacity) {
+            capacity                 = (capacity > 0) ? capacity * 2 : 1024;
+            _VFArchiveMember *grown  = realloc(members, sizeof(_VFArchiveMember) * capacity);
+            if (!grown) {
+                errors++;
+                return;
+            }
+            members = grown;
+        }
+        
+        VFArchiveMember member = &members[count];
+        member->path           = strdup(info->path + root_length);
+        member->offset         = writer.offset;
+        member->size           = 0;
+        member->time_modified  = info->time_modified;
+        member->mode           = info->mode;
+        member->user_id        = info->user_id;
+        member->group_id       = info->group_id;
+        
+        if (info->type == VFFileTypeFile && !VFArchiveWriterAppendFile(&writer, info->path, &member->size)) {
+            free(member->path);
+            errors++;
+            return;
+        }
+        count++;
+    });
+    
+    qsort(members, count, sizeof(_VFArchiveMember), VFArchiveCompareRecords);
+    
+    uint64_t index_offset = writer.offset;
+    for (size_t i = 0; i < count; i++) {
+        _VFArchiveRecord record = {
+            .offset        = members[i].offset,
+            .size          = members[i].size,
+            .time_modified = members[i].time_modified,
+            .mode          = members[i].mode,
+            .user_id       = members[i].user_id,
+            .group_id      = members[i].group_id,
+            .path_length   = (uint32_t)strlen(members[i].path),
+        };
+        VFArchiveWriterAppend(&writer, &record, sizeof(record));
+        VFArchiveWriterAppend(&writer, members[i].path, record.path_length);
+        free(members[i].path);
+    }
+    free(members);
+    
+    _VFArchiveTrailer trailer = { index_offset, writer.offset - index_offset, count, { 0 } };
+    memcpy(trailer.magic, kVFArchiveIndexMagic, sizeof(trailer.magic));
+    VFArchiveWriterAppend(&writer, &trailer, sizeof(trailer));
+    VFArchiveWriterFlush(&writer);
+    
+    free(writer.buffer);
+    free(root);
+    close(file);
+    
+    if (skipped_count) {
+        *skipped_count = skipped;
+    }
+    
+    BOOL is_strict = (options & VFArchivePackOptionStrict) != 0;
+    if (writer.failed || errors > 0 || (is_strict && skipped > 0)) {
+        if (error) {
+            if (writer.failed) {
+                *error = "Could not write to archive";
+            } else if (errors > 0) {
+                *error = "Could not pack every entry";
+            } else {
+                *error = "Symbolic links and special files were not packed";
+            }
+        }
+        return NO;
+    }
+    return YES;
+}
+
+#pragma mark - VFArchive -
+VFArchive VFArchiveOpen(const char *archive_path, char **error) {
+    if (!archive_path) {
+        if (error) {
+            *error = "Invalid archive path";
+        }
+        return NULL;
+    }
+    
+    int file = open(archive_path, O_RDONLY);
+    if (file == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NULL;
+    }
+    
+    struct stat file_stat;
+    _VFArchiveHeader header;
+    _VFArchiveTrailer trailer;
+    if (fstat(file, &file_stat) == -1 ||
+        file_stat.st_size < (off_t)(sizeof(header) + sizeof(trailer)) ||
+        !VFArchiveReadAll(file, (uint8_t *)&header, sizeof(header), 0) ||
+        !VFArchiveReadAll(file, (uint8_t *)&trailer, sizeof(trailer), file_stat.st_size - sizeof(trailer)) ||
+        memcmp(header.magic, kVFArchiveMagic, sizeof(header.magic)) != 0 ||
+        memcmp(trailer.magic, kVFArchiveIndexMagic, sizeof(trailer.magic)) != 0 ||
+        header.version != kVFArchiveVersion ||
+        trailer.index_offset > (uint64_t)file_stat.st_size - sizeof(trailer) ||
+        trailer.index_size != (uint64_t)file_stat.st_size - sizeof(trailer) - trailer.index_offset ||
+        trailer.count > trailer.index_size / sizeof(_VFArchiveRecord)) {
+            
+        if (error) {
+            *error = "Not a valid archive";
+        }
+        close(file);
+        return NULL;
+    }
+    
+    uint8_t *index     = malloc(trailer.index_size);
+    VFArchive archive  = calloc(1, sizeof(_VFArchive));
+    if (!index || !archive || !VFArchiveReadAll(file, index, trailer.index_size, trailer.index_offset)) {
+        if (error) {
+            *error = "Could not read archive index";
+        }
+        free(index);
+        free(archive);
+        close(file);
+        return NULL;
+    }
+    
+    // Paths are copied out of the index into one pool with terminators,
+    // so the whole index costs two allocations
+    archive->file    = file;
+    archive->count   = trailer.count;
+    archive->members = malloc(sizeof(_VFArchiveMember) * (trailer.count > 0 ? trailer.count : 1));
+    archive->strings = malloc(trailer.index_size);
+    
+    BOOL valid      = (archive->members && archive->strings);
+    size_t position = 0;
+    char *strings   = archive->strings;
+    for (size_t i = 0; valid && i < trailer.count; i++) {
+        _VFArchiveRecord record;
+        if (position + sizeof(record) > trailer.index_size) {
+            valid = NO;
+            break;
+        }
+        memcpy(&record, index + position, sizeof(record));
+        position += sizeof(record);
+        
+        if (record.path_length > trailer.index_size - position || record.size > trailer.index_offset || record.offset > trailer.index_offset - record.size) {
+            valid = NO;
+            break;
+        }
+        
+        VFArchiveMember member = &archive->members[i];
+        member->path           = strings;
+        member->offset         = record.offset;
+        member->size           = record.size;
+        member->time_modified  = record.time_modified;
+        member->mode           = record.mode;
+        member->user_id        = record.user_id;
+        member->group_id       = record.group_id;
+        
+        memcpy(strings, index + position, record.path_length);
+        strings[record.path_length] = '\0';
+        strings                    += record.path_length + 1;
+        position                   += record.path_length;
+    }
+    free(index);
+    
+    if (!valid) {
+        if (error) {
+            *error = "Archive index is corrupt";
+        }
+        VFArchiveRelease(archive);
+        return NULL;
+    }
+    return archive;
+}
+
+void VFArchiveRelease(VFArchive archive) {
+    if (archive) {
+        close(archive->file);
+        free(archive->members);
+        free(archive->strings);
+        free(archive);
+    }
+}
+
+size_t VFArchiveGetCount(VFArchive archive) {
+    return (archive) ? archive->count : 0;
+}
+
+VFArchiveMember VFArchiveGetMember(VFArchive archive, size_t index) {
+    if (archive && index < archive->count) {
+        return &archive->members[index];
+    }
+    return NULL;
+}
+
+VFArchiveMember VFArchiveFindMember(VFArchive archive, const char *path) {
+    if (!archive || !path) {
+        return NULL;
+    }
+    
+    size_t low  = 0;
+    size_t high = archive->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int result    = strcmp(archive->members[middle].path, path);
+        if (result == 0) {
+            return &archive->members[middle];
+        } else if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+#pragma mark - Unpacking -
+BOOL VFArchiveExtractMember(VFArchive archive, const char *path, const char *destination, char **error) {
+    if (!archive || !path || !destination) {
+        if (error) {
+            *error = "Invalid archive, member or destination path";
+        }
+        return NO;
+    }
+    
+    VFArchiveMember member = VFArchiveFindMember(archive, path);
+    if (!member) {
+        if (error) {
+            *error = "No such member in archive";
+        }
+        return NO;
+    }
+    
+    if (!VFArchiveWriteMember(archive, member, AT_FDCWD, destination)) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    return YES;
+}
+
+BOOL VFArchiveUnpack(VFArchive archive, const char *destination, char **error) {
+    if (!archive || !destination || destination[0] == '\0') {
+        if (error) {
+            *error = "Invalid archive or destination path";
+        }
+        return NO;
+    }
+    
+    if (mkdir(destination, 0755) == -1 && errno != EEXIST) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    
+    int root = open(destination, O_RDONLY | O_DIRECTORY);
+    if (root == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    __block int errors = 0;
+    
+    // The index is sorted, so every directory comes before its contents.
+    // Directories are created up front (writable, their final mode is
+    // applied at the end) and all other members are written in parallel.
+    for (size_t i = 0; i < archive->count; i++) {
+        VFArchiveMember member = &archive->members[i];
+        if (!VFArchiveIsSafePath(member->path)) {
+            errors++;
+            continue;
+        }
+        if (S_ISDIR(member->mode)) {
+            const char *name;
+            int parent = VFArchiveOpenParent(root, member->path, &name);
+            if (parent == -1 || (mkdirat(parent, name, 0700) == -1 && errno != EEXIST)) {
+                errors++;
+            }
+            if (parent != -1) {
+                close(parent);
+            }
+        }
+    }
+    
+    dispatch_apply(archive->count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        VFArchiveMember member = &archive->members[i];
+        if (S_ISDIR(member->mode) || !VFArchiveIsSafePath(member->path)) {
+            return;
+        }
+        
+        const char *name;
+        int parent = VFArchiveOpenParent(root, member->path, &name);
+        if (parent == -1 || !VFArchiveWriteMember(archive, member, parent, name)) {
+            __sync_fetch_and_add(&errors, 1);
+        }
+        if (parent != -1) {
+            close(parent);
+        }
+    });
+    
+    // Deepest directories first so parents' times aren't disturbed
+    for (size_t i = archive->count; i > 0; i--) {
+        VFArchiveMember member = &archive->members[i - 1];
+        if (S_ISDIR(member->mode) && VFArchiveIsSafePath(member->path)) {
+            const char *name;
+            int parent    = VFArchiveOpenParent(root, member->path, &name);
+            int directory = (parent != -1) ? openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW) : -1;
+            if (directory != -1) {
+                fchmod(directory, member->mode & 07777);
+                VFArchiveApplyTimes(directory, member);
+                close(directory);
+            } else {
+                errors++;
+            }
+            if (parent != -1) {
+                close(parent);
+            }
+        }
+    }
+    
+    close(root);
+    
+    if (errors > 0) {
+        if (error) {
+            *error = "Could not unpack every member";
+        }
+        return NO;
+    }
+    return YES;
+}
@@ -0,0 +1,78 @@
+//
+//  VFArchive.h
+//
+//  Created by Dima Bart on 2014-08-04.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFArchivePackOptionNone   = 0,
+    VFArchivePackOptionStrict = 1 << 0, // Fail when symbolic links or special files were left out
+} VFArchivePackOption;
+
+/*
+ * =============================
+ *     VFArchive & Related
+ * =============================
+ *
+ */
+// MARK: - VFArchive -
+
+/*
+ * A pack is a single sequential file that holds an entire directory tree:
+ *
+ *   [header][member data ...][index][trailer]
+ *
+ * Member contents are written back to back with no per-member framing,
+ * the index at the end (sorted by path) records offset, size and
+ * attributes for every member. Packing streams the tree through large
+ * buffered writes, unpacking creates files in parallel and any single
+ * member can be read back through the index without touching the rest.
+ * Numbers are stored in host byte order.
+ *
+ * Only regular files and directories are packed. Symbolic links are
+ * neither followed nor stored, links and special files are skipped and
+ * counted. Unpacking opens every directory on the way to a member without
+ * following links, so nothing is written outside of the destination.
+ */
+
+typedef struct __VFArchiveMember {
+    char     *path;
+    uint64_t  offset;
+    uint64_t  size;
+    int64_t   time_modified;
+    uint32_t  mode;
+    uint32_t  user_id;
+    uint32_t  group_id;
+} _VFArchiveMember;
+typedef _VFArchiveMember * VFArchiveMember;
+
+typedef struct __VFArchive {
+    int              file;
+    size_t           count;
+    VFArchiveMember  members;
+    char            *strings;
+} _VFArchive;
+typedef _VFArchive * VFArchive;
+
+// MARK: - VFArchive Functions -
+BOOL VFArchivePack(const char *directory, const char *archive_path, char **error);
+BOOL VFArchivePackWithOptions(const char *directory, const char *archive_path, VFArchivePackOption options, size_t *skipped_count, char **error); // skipped_count may be NULL
+
+VFArchive VFArchiveOpen(const char *archive_path, char **error);
+void VFArchiveRelease(VFArchive archive);
+
+size_t VFArchiveGetCount(VFArchive archive);
+VFArchiveMember VFArchiveGetMember(VFArchive archive, size_t index);
+VFArchiveMember VFArchiveFindMember(VFArchive archive, const char *path);
+
+BOOL VFArchiveExtractMember(VFArchive archive, const char *path, const char *destination, char **error);
+BOOL VFArchiveUnpack(VFArchive archive, const char *destination, char **error);
@@ -7,28 +7,152 @@
 
 #import "VFByteFormatter.h"
 
-static double _base         = 1024.0f;
-static const char *_sizes[] = {
-    "B",
-    "KB",
-    "MB",
-    "GB",
-    "TB"
+#define kVFByteUnitCount 7
+
+static const _VFByteFormat kVFByteFormatDefault = { VFByteUnitsBinary, 1, NO };
+
+static const char * const kVFByteUnitNames[][kVFByteUnitCount] = {
+    [VFByteUnitsBinary] = { "B", "KB",  "MB",  "GB",  "TB",  "PB",  "EB"  },
+    [VFByteUnitsIEC]    = { "B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB" },
+    [VFByteUnitsSI]     = { "B", "kB",  "MB",  "GB",  "TB",  "PB",  "EB"  },
 };
 
-const char * VFCreateByteFormat(uint8_t bytes, int use_space) {
-    int power           = 0;
-    double bytes_double = 1.0f * bytes;
-    while (bytes_double > _base) {
-        power++;
-        bytes_double /= _base;
+// Powers of the base, the largest still fits in 64 bits
+static const uint64_t kVFByteUnitDivisors[][kVFByteUnitCount] = {
+    [VFByteUnitsBinary] = { 1ULL, 1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40, 1ULL << 50, 1ULL << 60 },
+    [VFByteUnitsIEC]    = { 1ULL, 1ULL << 10, 1ULL << 20, 1ULL << 30, 1ULL << 40, 1ULL << 50, 1ULL << 60 },
+    [VFByteUnitsSI]     = { 1ULL, 1000ULL, 1000000ULL, 1000000000ULL, 1000000000000ULL, 1000000000000000ULL, 1000000000000000000ULL },
+};
+
+#pragma mark - Private -
+static char * VFByteFormatWriteInteger(char *cursor, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value          /= 10;
+    } while (value > 0);
+    
+    while (count > 0) {
+        *cursor++ = digits[--count];
+    }
+    return cursor;
+}
+
+/*
+ * The decimals are produced by long division of the remainder, one digit
+ * at a time. The remainder stays below the divisor, at most 2^60, so ten
+ * times it never overflows.
+ */
+static size_t VFByteFormatWriteUnits(uint64_t bytes, const _VFByteFormat *format, char *buffer) {
+    const uint64_t *divisors = kVFByteUnitDivisors[format->units];
+    uint32_t precision       = (format->precision < kVFByteFormatMaxPrecision) ? format->precision : kVFByteFormatMaxPrecision;
+    
+    uint32_t unit = 0;
+    while (unit + 1 < kVFByteUnitCount && bytes >= divisors[unit + 1]) {
+        unit++;
+    }
+    if (unit == 0) {
+        precision = 0;
+    }
+    
+    uint64_t whole;
+    uint32_t fraction;
+    uint32_t scale;
+    while (YES) {
+        uint64_t divisor   = divisors[unit];
+        uint64_t remainder = bytes % divisor;
+        whole              = bytes / divisor;
+        fraction           = 0;
+        scale              = 1;
+        
+        for (uint32_t i = 0; i < precision; i++) {
+            remainder *= 10;
+            fraction   = fraction * 10 + (uint32_t)(remainder / divisor);
+            remainder %= divisor;
+            scale     *= 10;
+        }
+        
+        // Half up, carrying into the whole number
+        if (remainder >= divisor - remainder) {
+            fraction++;
+            if (fraction == scale) {
+                fraction = 0;
+                whole++;
+            }
+        }
+        
+        if (unit + 1 < kVFByteUnitCount && whole * divisor >= divisors[unit + 1]) {
+            unit++;
+            continue;
+        }
+        break;
+    }
+    
+    char *cursor = VFByteFormatWriteInteger(buffer, whole);
+    if (precision > 0) {
+        *cursor++ = '.';
+        for (uint32_t digit = scale / 10; digit > 0; digit /= 10) {
+            *cursor++ = (char)('0' + fraction / digit % 10);
+        }
+    }
+    if (format->use_space) {
+        *cursor++ = ' ';
+    }
+    
+    const char *name = kVFByteUnitNames[format->units][unit];
+    while (*name) {
+        *cursor++ = *name++;
+    }
+    *cursor = '\0';
+    return cursor - buffer;
+}
+
+#pragma mark - VFByteFormat -
+size_t VFByteFormatWrite(uint64_t bytes, const _VFByteFormat *format, char *buffer, size_t length) {
+    if (!format) {
+        format = &kVFByteFormatDefault;
+    }
+    if (!buffer || length == 0 || format->units > VFByteUnitsSI) {
+        return 0;
+    }
+    
+    if (length >= kVFByteFormatLength) {
+        return VFByteFormatWriteUnits(bytes, format, buffer);
     }
     
+    // Short buffers take the result only when it fits
+    char scratch[kVFByteFormatLength];
+    size_t written = VFByteFormatWriteUnits(bytes, format, scratch);
+    if (written >= length) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    memcpy(buffer, scratch, written + 1);
+    return written;
+}
+
+size_t VFByteFormatWriteArray(const uint64_t *sizes, size_t count, const _VFByteFormat *format, char *buffer, size_t stride) {
+    if (!sizes || !buffer) {
+        return 0;
+    }
+    
+    size_t written = 0;
+    while (written < count && VFByteFormatWrite(sizes[written], format, buffer + written * stride, stride) > 0) {
+        written++;
+    }
+    return written;
+}
+
+const char * VFCreateByteFormat(uint64_t bytes, int use_space) {
     if (bytes > 0) {
-        char *string;
-        char *space = (use_space) ? " " : "";
-        asprintf(&string, "%0.1f%s%s", bytes_double, space, _sizes[power]);
+        _VFByteFormat format = kVFByteFormatDefault;
+        format.use_space     = (use_space != 0);
         
+        char *string = malloc(kVFByteFormatLength);
+        if (string) {
+            VFByteFormatWrite(bytes, &format, string, kVFByteFormatLength);
+        }
         return string;
     }
     return NULL;
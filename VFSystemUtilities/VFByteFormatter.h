@@ -8,5 +8,57 @@
 #import <stdlib.h>
 #import <stdio.h>
 #import <string.h>
+#import <stdint.h>
 
-const char * VFCreateByteFormat(uint8_t bytes, int use_space);
\ No newline at end of file
+#import "VFFileManager.h"
+
+#define kVFByteFormatLength       16 // Longest result with its terminator, "1023.999 KiB"
+#define kVFByteFormatMaxPrecision 3
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFByteUnitsBinary = 0, // Powers of 1024 named KB, MB, GB...
+    VFByteUnitsIEC    = 1, // Powers of 1024 named KiB, MiB, GiB...
+    VFByteUnitsSI     = 2, // Powers of 1000 named kB, MB, GB...
+} VFByteUnits;
+
+/*
+ * =============================
+ *     VFByteFormat & Related
+ * =============================
+ *
+ */
+// MARK: - VFByteFormat -
+
+/*
+ * Sizes below one kilobyte are written as whole bytes, larger ones in the
+ * largest unit that keeps the number at least 1, rounded half up to
+ * precision decimals. A size that rounds up to a whole next unit is
+ * written in that unit instead, 1048575 bytes is "1.0 MB" and not
+ * "1024.0 KB". Only integer arithmetic is used, no printf and no
+ * allocation.
+ */
+typedef struct __VFByteFormat {
+    VFByteUnits units;
+    uint8_t     precision; // Decimals, at most kVFByteFormatMaxPrecision
+    BOOL        use_space;
+} _VFByteFormat;
+typedef _VFByteFormat * VFByteFormat;
+
+// MARK: - VFByteFormat Functions -
+
+/*
+ * Writes bytes into buffer, terminated, and returns the length without the
+ * terminator, or 0 when length is too short. kVFByteFormatLength is always
+ * enough. A NULL format is binary units with 1 decimal and no space.
+ */
+size_t VFByteFormatWrite(uint64_t bytes, const _VFByteFormat *format, char *buffer, size_t length);
+
+/*
+ * Formats count sizes, the result for sizes[i] going to buffer + i *
+ * stride. Returns the number of sizes written, which stops short when
+ * stride is too small.
+ */
+size_t VFByteFormatWriteArray(const uint64_t *sizes, size_t count, const _VFByteFormat *format, char *buffer, size_t stride);
+
+const char * VFCreateByteFormat(uint64_t bytes, int use_space); // Binary units with 1 decimal, caller frees, NULL for 0 bytes
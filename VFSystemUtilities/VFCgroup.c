@@ -0,0 +1,475 @@
+//
+//  VFCgroup.c
+//
+//  Created by Dima Bart on 2014-08-27.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <Block.h>
+#import <poll.h>
+#import <fcntl.h>
+#import <errno.h>
+#import <stddef.h>
+#import <unistd.h>
+#import <limits.h>
+
+#import "VFCgroup.h"
+
+#if defined(__linux__)
+
+#define kVFCgroupBufferSize 8192
+
+typedef struct __VFCgroupKey {
+    const char *name;
+    size_t      length;
+    size_t      offset; // Of the field in _VFCgroupSnapshot
+} _VFCgroupKey;
+
+#define VFCgroupKey(literal, field) { literal, sizeof(literal) - 1, offsetof(_VFCgroupSnapshot, field) }
+
+static const _VFCgroupKey kVFCgroupMemoryStatKeys[] = {
+    VFCgroupKey("anon",       memory_anon),
+    VFCgroupKey("file",       memory_file),
+    VFCgroupKey("kernel",     memory_kernel),
+    VFCgroupKey("file_dirty", memory_file_dirty),
+    VFCgroupKey("pgmajfault", major_faults),
+};
+
+static const _VFCgroupKey kVFCgroupCPUStatKeys[] = {
+    VFCgroupKey("usage_usec",     cpu_usage_usec),
+    VFCgroupKey("user_usec",      cpu_user_usec),
+    VFCgroupKey("system_usec",    cpu_system_usec),
+    VFCgroupKey("nr_periods",     cpu_periods),
+    VFCgroupKey("nr_throttled",   cpu_throttled_periods),
+    VFCgroupKey("throttled_usec", cpu_throttled_usec),
+};
+
+static const char * const kVFPressureNames[] = {
+    [VFPressureResourceMemory] = "memory",
+    [VFPressureResourceCPU]    = "cpu",
+    [VFPressureResourceIO]     = "io",
+};
+
+#pragma mark - Private - Parsing -
+static ssize_t VFCgroupRead(int file, char *buffer, size_t size) {
+    if (file < 0) {
+        return 0;
+    }
+    
+    ssize_t length;
+    do {
+        length = pread(file, buffer, size - 1, 0);
+    } while (length == -1 && errno == EINTR);
+    
+    if (length >= 0) {
+        buffer[length] = '\0';
+    }
+    return length;
+}
+
+static uint64_t VFCgroupParseNumber(const char **position) {
+    const char *c = *position;
+    while (*c == ' ') {
+        c++;
+    }
+    if (strncmp(c, "max", 3) == 0) {
+        *position = c + 3;
+        return UINT64_MAX;
+    }
+    
+    uint64_t value = 0;
+    while (*c >= '0' && *c <= '9') {
+        value = value * 10 + (*c++ - '0');
+    }
+    *position = c;
+    return value;
+}
+
+static void VFCgroupParseKeys(const char *buffer, const _VFCgroupKey *keys, size_t key_count, VFCgroupSnapshot snapshot) {
+    for (const char *line = buffer; *line;) {
+        const char *key_end  = strchr(line, ' ');
+        const char *line_end = strchr(line, '\n');
+        if (!line_end) {
+            line_end = line + strlen(line);
+        }
+        
+        if (key_end && key_end < line_end) {
+            size_t key_length = key_end - line;
+            for (size_t i = 0; i < key_count; i++) {
+                if (keys[i].length == key_length && memcmp(keys[i].name, line, key_length) == 0) {
+                    *(uint64_t *)((char *)snapshot + keys[i].offset) = VFCgroupParseNumber(&key_end);
+                    break;
+                }
+            }
+        }
+        line = (*line_end) ? line_end + 1 : line_end;
+    }
+}
+
+// "some avg10=1.25 avg60=0.40 avg300=0.08 total=1234567"
+static void VFPressureParseLine(const char *line, VFPressure pressure) {
+    memset(pressure, 0, sizeof(_VFPressure));
+    
+    const char *line_end = strchr(line, '\n');
+    if (!line_end) {
+        line_end = line + strlen(line);
+    }
+    
+    for (const char *c = strchr(line, ' '); c && c < line_end; c = strchr(c, ' ')) {
+        c++;
+        const char *value = strchr(c, '=');
+        if (!value || value > line_end) {
+            break;
+        }
+        value++;
+        
+        if (strncmp(c, "total=", 6) == 0) {
+            pressure->total = VFCgroupParseNumber(&value);
+            continue;
+        }
+        
+        // Two decimal places, parsed as hundredths
+        uint64_t whole      = VFCgroupParseNumber(&value);
+        uint64_t hundredths = 0;
+        if (*value == '.') {
+            value++;
+            hundredths = VFCgroupParseNumber(&value);
+        }
+        double percent = whole + hundredths / 100.0;
+        
+        if (strncmp(c, "avg10=", 6) == 0)  pressure->avg10  = percent;
+        if (strncmp(c, "avg60=", 6) == 0)  pressure->avg60  = percent;
+        if (strncmp(c, "avg300=", 7) == 0) pressure->avg300 = percent;
+    }
+}
+
+static BOOL VFPressureParse(int file, VFPressure some, VFPressure full, char **error) {
+    char buffer[512];
+    ssize_t length = VFCgroupRead(file, buffer, sizeof(buffer));
+    if (length < 0) {
+        if (error) *error = strerror(errno);
+        return NO;
+    }
+    
+    if (some) memset(some, 0, sizeof(_VFPressure));
+    if (full) memset(full, 0, sizeof(_VFPressure));
+    for (const char *line = buffer; line && *line;) {
+        if (some && strncmp(line, "some ", 5) == 0) VFPressureParseLine(line, some);
+        if (full && strncmp(line, "full ", 5) == 0) VFPressureParseLine(line, full);
+        
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    return YES;
+}
+
+#pragma mark - Private - Paths -
+static char * VFCgroupCopyMountPoint(void) {
+    FILE *file = fopen("/proc/self/mountinfo", "re");
+    if (!file) {
+        return NULL;
+    }
+    
+    char *mount_point = NULL;
+    char *line        = NULL;
+    size_t capacity   = 0;
+    while (!mount_point && getline(&line, &capacity, file) != -1) {
+        // "id parent major:minor root mount_point options ... - type source ..."
+        char *separator = strstr(line, " - ");
+        if (!separator || strncmp(separator + 3, "cgroup2 ", 8) != 0) {
+            continue;
+        }
+        
+        char *field = line;
+        for (int i = 0; i < 4 && field; i++) {
+            field = strchr(field, ' ');
+            if (field) field++;
+        }
+        if (field) {
+            mount_point = strndup(field, strcspn(field, " "));
+        }
+    }
+    
+    free(line);
+    fclose(file);
+    return mount_point;
+}
+
+static char * VFCgroupCopySelfPath(void) {
+    FILE *file = fopen("/proc/self/cgroup", "re");
+    if (!file) {
+        return NULL;
+    }
+    
+    char *group     = NULL;
+    char *line      = NULL;
+    size_t capacity = 0;
+    while (!group && getline(&line, &capacity, file) != -1) {
+        if (strncmp(line, "0::", 3) == 0) {
+            group = strndup(line + 3, strcspn(line + 3, "\n"));
+        }
+    }
+    free(line);
+    fclose(file);
+    
+    char *mount_point = (group) ? VFCgroupCopyMountPoint() : NULL;
+    char *path        = NULL;
+    if (mount_point) {
+        size_t length = strlen(mount_point) + strlen(group) + 1;
+        path          = malloc(length);
+        snprintf(path, length, "%s%s", mount_point, (strcmp(group, "/") == 0) ? "" : group);
+    }
+    
+    free(mount_point);
+    free(group);
+    return path;
+}
+
+static int VFCgroupOpenFile(const char *path, const char *name, int flags) {
+    char file_path[PATH_MAX];
+    snprintf(file_path, sizeof(file_path), "%s/%s", path, name);
+    return open(file_path, flags | O_CLOEXEC);
+}
+
+#pragma mark - VFCgroup -
+VFCgroup VFCgroupOpen(const char *path, char **error) {
+    char *group_path = (path) ? strdup(path) : VFCgroupCopySelfPath();
+    if (!group_path) {
+        if (error) *error = "Failed to find the cgroup v2 group of the process";
+        return NULL;
+    }
+    
+    int controllers = VFCgroupOpenFile(group_path, "cgroup.controllers", O_RDONLY);
+    if (controllers == -1) {
+        if (error) *error = "The path is not a cgroup v2 group";
+        free(group_path);
+        return NULL;
+    }
+    close(controllers);
+    
+    VFCgroup cgroup         = calloc(1, sizeof(_VFCgroup));
+    cgroup->path            = group_path;
+    cgroup->memory_current  = VFCgroupOpenFile(group_path, "memory.current", O_RDONLY);
+    cgroup->memory_max      = VFCgroupOpenFile(group_path, "memory.max", O_RDONLY);
+    cgroup->memory_high     = VFCgroupOpenFile(group_path, "memory.high", O_RDONLY);
+    cgroup->memory_stat     = VFCgroupOpenFile(group_path, "memory.stat", O_RDONLY);
+    cgroup->memory_pressure = VFCgroupOpenFile(group_path, "memory.pressure", O_RDONLY);
+    cgroup->cpu_stat        = VFCgroupOpenFile(group_path, "cpu.stat", O_RDONLY);
+    cgroup->cpu_max         = VFCgroupOpenFile(group_path, "cpu.max", O_RDONLY);
+    cgroup->cpu_pressure    = VFCgroupOpenFile(group_path, "cpu.pressure", O_RDONLY);
+    
+    return cgroup;
+}
+
+void VFCgroupRelease(VFCgroup cgroup) {
+    if (cgroup) {
+        int files[] = {
+            cgroup->memory_current, cgroup->memory_max, cgroup->memory_high, cgroup->memory_stat,
+            cgroup->memory_pressure, cgroup->cpu_stat, cgroup->cpu_max, cgroup->cpu_pressure,
+        };
+        for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+            if (files[i] >= 0) close(files[i]);
+        }
+        
+        free(cgroup->path);
+        free(cgroup);
+    }
+}
+
+BOOL VFCgroupSnapshotFill(VFCgroup cgroup, VFCgroupSnapshot snapshot, char **error) {
+    if (!cgroup || !snapshot) {
+        if (error) *error = "Invalid cgroup or snapshot";
+        return NO;
+    }
+    
+    memset(snapshot, 0, sizeof(_VFCgroupSnapshot));
+    snapshot->memory_max  = UINT64_MAX;
+    snapshot->memory_high = UINT64_MAX;
+    snapshot->cpu_quota   = UINT64_MAX;
+    
+    char buffer[kVFCgroupBufferSize];
+    const char *position;
+    
+    if (VFCgroupRead(cgroup->memory_current, buffer, sizeof(buffer)) > 0) {
+        position                 = buffer;
+        snapshot->memory_current = VFCgroupParseNumber(&position);
+    }
+    if (VFCgroupRead(cgroup->memory_max, buffer, sizeof(buffer)) > 0) {
+        position             = buffer;
+        snapshot->memory_max = VFCgroupParseNumber(&position);
+    }
+    if (VFCgroupRead(cgroup->memory_high, buffer, sizeof(buffer)) > 0) {
+        position              = buffer;
+        snapshot->memory_high = VFCgroupParseNumber(&position);
+    }
+    if (VFCgroupRead(cgroup->memory_stat, buffer, sizeof(buffer)) > 0) {
+        VFCgroupParseKeys(buffer, kVFCgroupMemoryStatKeys, sizeof(kVFCgroupMemoryStatKeys) / sizeof(kVFCgroupMemoryStatKeys[0]), snapshot);
+    }
+    if (VFCgroupRead(cgroup->cpu_stat, buffer, sizeof(buffer)) > 0) {
+        VFCgroupParseKeys(buffer, kVFCgroupCPUStatKeys, sizeof(kVFCgroupCPUStatKeys) / sizeof(kVFCgroupCPUStatKeys[0]), snapshot);
+    }
+    if (VFCgroupRead(cgroup->cpu_max, buffer, sizeof(buffer)) > 0) {
+        position             = buffer;
+        snapshot->cpu_quota  = VFCgroupParseNumber(&position);
+        snapshot->cpu_period = VFCgroupParseNumber(&position);
+    }
+    
+    VFPressureParse(cgroup->memory_pressure, &snapshot->memory_pressure, NULL, NULL);
+    VFPressureParse(cgroup->cpu_pressure, &snapshot->cpu_pressure, NULL, NULL);
+    
+    return YES;
+}
+
+#pragma mark - Private - Pressure -
+static int VFPressureOpenFile(VFCgroup cgroup, VFPressureResource resource, int flags) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s.pressure", kVFPressureNames[resource]);
+    return (cgroup) ? VFCgroupOpenFile(cgroup->path, name, flags) : VFCgroupOpenFile("/proc/pressure", kVFPressureNames[resource], flags);
+}
+
+static void * VFPressureMonitorRun(void *context) {
+    VFPressureMonitor monitor = context;
+    
+    struct pollfd descriptors[2] = {
+        { .fd = monitor->file,    .events = POLLPRI },
+        { .fd = monitor->wake[0], .events = POLLIN },
+    };
+    
+    while (YES) {
+        if (poll(descriptors, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        
+        // POLLERR means the group went away, the trigger will never fire again
+        if (descriptors[1].revents || (descriptors[0].revents & (POLLERR | POLLNVAL))) {
+            break;
+        }
+        if (descriptors[0].revents & POLLPRI) {
+            _VFPressure some;
+            _VFPressure full;
+            if (VFPressureParse(monitor->file, &some, &full, NULL)) {
+                monitor->block(monitor->resource, &some, &full);
+            }
+        }
+    }
+    return NULL;
+}
+
+#pragma mark - VFPressureMonitor -
+VFPressureMonitor VFPressureMonitorCreate(VFCgroup cgroup, VFPressureResource resource, VFPressureKind kind, uint32_t stall, uint32_t window, VFPressureBlock block, char **error) {
+    if (resource < VFPressureResourceMemory || resource > VFPressureResourceIO || !block) {
+        if (error) *error = "Invalid resource or block";
+        return NULL;
+    }
+    
+    int file = VFPressureOpenFile(cgroup, resource, O_RDWR | O_NONBLOCK);
+    if (file == -1) {
+        if (error) *error = strerror(errno);
+        return NULL;
+    }
+    
+    /* ---------------------------------------
+     * The trigger lives as long as the file
+     * descriptor it was written to, the
+     * terminating NUL is part of the write.
+     */
+    char trigger[64];
+    int length = snprintf(trigger, sizeof(trigger), "%s %u %u", (kind == VFPressureKindFull) ? "full" : "some", stall, window);
+    if (write(file, trigger, length + 1) < 0) {
+        if (error) *error = strerror(errno);
+        close(file);
+        return NULL;
+    }
+    
+    VFPressureMonitor monitor = calloc(1, sizeof(_VFPressureMonitor));
+    monitor->resource         = resource;
+    monitor->block            = Block_copy(block);
+    monitor->file             = file;
+    monitor->wake[0]          = -1;
+    monitor->wake[1]          = -1;
+    
+    if (pipe(monitor->wake) != 0) {
+        if (error) *error = strerror(errno);
+        VFPressureMonitorRelease(monitor);
+        return NULL;
+    }
+    
+    if (pthread_create(&monitor->thread, NULL, VFPressureMonitorRun, monitor) != 0) {
+        if (error) *error = "Failed to start the pressure monitor thread";
+        close(monitor->wake[1]);
+        monitor->wake[1] = -1;
+        VFPressureMonitorRelease(monitor);
+        return NULL;
+    }
+    return monitor;
+}
+
+void VFPressureMonitorRelease(VFPressureMonitor monitor) {
+    if (monitor) {
+        if (monitor->wake[1] >= 0) {
+            char signal = 0;
+            write(monitor->wake[1], &signal, 1);
+            pthread_join(monitor->thread, NULL);
+            close(monitor->wake[1]);
+        }
+        if (monitor->wake[0] >= 0) close(monitor->wake[0]);
+        if (monitor->file >= 0)    close(monitor->file);
+        if (monitor->block)        Block_release(monitor->block);
+        
+        free(monitor);
+    }
+}
+
+BOOL VFPressureRead(VFCgroup cgroup, VFPressureResource resource, VFPressure some, VFPressure full, char **error) {
+    if (resource < VFPressureResourceMemory || resource > VFPressureResourceIO) {
+        if (error) *error = "Invalid resource";
+        return NO;
+    }
+    
+    int file = VFPressureOpenFile(cgroup, resource, O_RDONLY);
+    if (file == -1) {
+        if (error) *error = strerror(errno);
+        return NO;
+    }
+    
+    BOOL success = VFPressureParse(file, some, full, error);
+    close(file);
+    return success;
+}
+
+#else
+
+#pragma mark - VFCgroup -
+VFCgroup VFCgroupOpen(const char *path, char **error) {
+    if (error) *error = "Control groups are not supported on this platform";
+    return NULL;
+}
+
+void VFCgroupRelease(VFCgroup cgroup) {
+    
+}
+
+BOOL VFCgroupSnapshotFill(VFCgroup cgroup, VFCgroupSnapshot snapshot, char **error) {
+    if (error) *error = "Control groups are not supported on this platform";
+    return NO;
+}
+
+#pragma mark - VFPressureMonitor -
+VFPressureMonitor VFPressureMonitorCreate(VFCgroup cgroup, VFPressureResource resource, VFPressureKind kind, uint32_t stall, uint32_t window, VFPressureBlock block, char **error) {
+    if (error) *error = "Pressure stall information is not supported on this platform";
+    return NULL;
+}
+
+void VFPressureMonitorRelease(VFPressureMonitor monitor) {
+    
+}
+
+BOOL VFPressureRead(VFCgroup cgroup, VFPressureResource resource, VFPressure some, VFPressure full, char **error) {
+    if (error) *error = "Pressure stall information is not supported on this platform";
+    return NO;
+}
+
+#endif
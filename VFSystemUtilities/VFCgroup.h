@@ -0,0 +1,147 @@
+//
+//  VFCgroup.h
+//
+//  Created by Dima Bart on 2014-08-27.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <pthread.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFPressureResourceMemory = 0,
+    VFPressureResourceCPU    = 1,
+    VFPressureResourceIO     = 2,
+} VFPressureResource;
+
+typedef enum {
+    VFPressureKindSome = 0, // At least one task stalled
+    VFPressureKindFull = 1, // Every non-idle task stalled at the same time
+} VFPressureKind;
+
+/*
+ * =============================
+ *     VFPressure & Related
+ * =============================
+ *
+ */
+// MARK: - VFPressure -
+
+/*
+ * One line of a pressure stall (PSI) file. The averages are the share of
+ * wall time spent stalled over the last 10, 60 and 300 seconds, in percent,
+ * the total is the stalled time in microseconds.
+ */
+typedef struct __VFPressure {
+    double   avg10;
+    double   avg60;
+    double   avg300;
+    uint64_t total;
+} _VFPressure;
+typedef _VFPressure * VFPressure;
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFPressureBlock)(VFPressureResource resource, const _VFPressure *some, const _VFPressure *full);
+
+/*
+ * =============================
+ *      VFCgroup & Related
+ * =============================
+ *
+ */
+// MARK: - VFCgroupSnapshot -
+
+/*
+ * Limits without a value ("max") are UINT64_MAX, files of controllers that
+ * are not enabled for the group leave their fields at 0. The cpu quota and
+ * period come from cpu.max, quota / period is the number of CPUs the group
+ * may use.
+ */
+typedef struct __VFCgroupSnapshot {
+    uint64_t    memory_current;
+    uint64_t    memory_max;
+    uint64_t    memory_high;
+    uint64_t    memory_anon;
+    uint64_t    memory_file;
+    uint64_t    memory_kernel;
+    uint64_t    memory_file_dirty;
+    uint64_t    major_faults;
+    uint64_t    cpu_usage_usec;
+    uint64_t    cpu_user_usec;
+    uint64_t    cpu_system_usec;
+    uint64_t    cpu_throttled_usec;
+    uint64_t    cpu_periods;
+    uint64_t    cpu_throttled_periods;
+    uint64_t    cpu_quota;
+    uint64_t    cpu_period;
+    _VFPressure memory_pressure; // "some" line of memory.pressure
+    _VFPressure cpu_pressure;    // "some" line of cpu.pressure
+} _VFCgroupSnapshot;
+typedef _VFCgroupSnapshot * VFCgroupSnapshot;
+
+// MARK: - VFCgroup -
+
+/*
+ * A cgroup v2 group with its interface files kept open, so filling a
+ * snapshot is a handful of preads without allocations. Opening with a NULL
+ * path uses the group of the calling process, found through
+ * /proc/self/cgroup under wherever cgroup2 is mounted.
+ *
+ * Linux only, opening a group fails elsewhere.
+ */
+typedef struct __VFCgroup {
+    char *path;
+    int   memory_current;
+    int   memory_max;
+    int   memory_high;
+    int   memory_stat;
+    int   memory_pressure;
+    int   cpu_stat;
+    int   cpu_max;
+    int   cpu_pressure;
+} _VFCgroup;
+typedef _VFCgroup * VFCgroup;
+
+// MARK: - VFCgroup Functions -
+VFCgroup VFCgroupOpen(const char *path, char **error);
+void VFCgroupRelease(VFCgroup cgroup);
+
+BOOL VFCgroupSnapshotFill(VFCgroup cgroup, VFCgroupSnapshot snapshot, char **error);
+
+/*
+ * =============================
+ *  VFPressureMonitor & Related
+ * =============================
+ *
+ */
+// MARK: - VFPressureMonitor -
+
+/*
+ * Registers a PSI trigger, "stall microseconds of kind stall within any
+ * window microseconds", on the group's pressure file or on
+ * /proc/pressure when the group is NULL. The kernel wakes the monitor's
+ * thread through poll() when the threshold is crossed, which then reads
+ * the current averages and invokes the block on that thread. Nothing is
+ * polled in between. The window must be between 500 ms and 10 s, and
+ * unprivileged processes are limited to windows that are multiples of 2 s.
+ */
+typedef struct __VFPressureMonitor {
+    VFPressureResource resource;
+    VFPressureBlock    block;
+    int                file;
+    int                wake[2];
+    pthread_t          thread;
+} _VFPressureMonitor;
+typedef _VFPressureMonitor * VFPressureMonitor;
+
+// MARK: - VFPressureMonitor Functions -
+VFPressureMonitor VFPressureMonitorCreate(VFCgroup cgroup, VFPressureResource resource, VFPressureKind kind, uint32_t stall, uint32_t window, VFPressureBlock block, char **error);
+void VFPressureMonitorRelease(VFPressureMonitor monitor);
+
+BOOL VFPressureRead(VFCgroup cgroup, VFPressureResource resource, VFPressure some, VFPressure full, char **error);
@@ -0,0 +1,222 @@
+//
+//  VFContentType.c
+//
+//  Created by Dima Bart on 2014-08-23.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <fcntl.h>
+#import <errno.h>
+#import <unistd.h>
+#import <pthread.h>
+
+#import "VFFileManager.h"
+#import "VFContentType.h"
+
+#define kVFContentTrieCapacity  1024
+#define kVFContentTypeSniffSize 512
+
+typedef struct __VFContentSignature {
+    VFContentType  type;
+    uint16_t       offset;
+    uint16_t       length;
+    const uint8_t *bytes;
+    const char    *mask; // '.' for any byte, NULL when every byte must match
+} _VFContentSignature;
+
+typedef struct __VFContentTrieNode {
+    uint16_t      child;
+    uint16_t      sibling;
+    uint8_t       byte;
+    BOOL          is_any;
+    VFContentType type;
+} _VFContentTrieNode;
+
+#define VFContentSignature(type, offset, literal, mask) { type, offset, sizeof(literal) - 1, (const uint8_t *)literal, mask }
+
+static const _VFContentSignature kVFContentSignatures[] = {
+    VFContentSignature(VFContentTypePNG,    0,   "\x89PNG\r\n\x1a\n",      NULL),
+    VFContentSignature(VFContentTypeJPEG,   0,   "\xff\xd8\xff",           NULL),
+    VFContentSignature(VFContentTypeGIF,    0,   "GIF87a",                 NULL),
+    VFContentSignature(VFContentTypeGIF,    0,   "GIF89a",                 NULL),
+    VFContentSignature(VFContentTypeTIFF,   0,   "II*\0",                  NULL),
+    VFContentSignature(VFContentTypeTIFF,   0,   "MM\0*",                  NULL),
+    VFContentSignature(VFContentTypeBMP,    0,   "BM\0\0\0\0\0\0\0\0",     "xx....xxxx"),
+    VFContentSignature(VFContentTypeWebP,   0,   "RIFF\0\0\0\0WEBP",       "xxxx....xxxx"),
+    VFContentSignature(VFContentTypeWAV,    0,   "RIFF\0\0\0\0WAVE",       "xxxx....xxxx"),
+    VFContentSignature(VFContentTypePDF,    0,   "%PDF-",                  NULL),
+    VFContentSignature(VFContentTypeZip,    0,   "PK\x03\x04",             NULL),
+    VFContentSignature(VFContentTypeZip,    0,   "PK\x05\x06",             NULL),
+    VFContentSignature(VFContentTypeGzip,   0,   "\x1f\x8b",               NULL),
+    VFContentSignature(VFContentTypeBzip2,  0,   "BZh",                    NULL),
+    VFContentSignature(VFContentTypeXZ,     0,   "\xfd" "7zXZ\0",          NULL),
+    VFContentSignature(VFContentTypeZstd,   0,   "\x28\xb5\x2f\xfd",       NULL),
+    VFContentSignature(VFContentType7z,     0,   "7z\xbc\xaf\x27\x1c",     NULL),
+    VFContentSignature(VFContentTypeRAR,    0,   "Rar!\x1a\x07",           NULL),
+    VFContentSignature(VFContentTypeTar,    257, "ustar",                  NULL),
+    VFContentSignature(VFContentTypeELF,    0,   "\x7f" "ELF",             NULL),
+    VFContentSignature(VFContentTypeMachO,  0,   "\xfe\xed\xfa\xce",       NULL),
+    VFContentSignature(VFContentTypeMachO,  0,   "\xfe\xed\xfa\xcf",       NULL),
+    VFContentSignature(VFContentTypeMachO,  0,   "\xce\xfa\xed\xfe",       NULL),
+    VFContentSignature(VFContentTypeMachO,  0,   "\xcf\xfa\xed\xfe",       NULL),
+    VFContentSignature(VFContentTypeSQLite, 0,   "SQLite format 3\0",      NULL),
+    VFContentSignature(VFContentTypeMP3,    0,   "ID3",                    NULL),
+    VFContentSignature(VFContentTypeMP3,    0,   "\xff\xfb",               NULL),
+    VFContentSignature(VFContentTypeMP4,    4,   "ftyp",                   NULL),
+    VFContentSignature(VFContentTypeOgg,    0,   "OggS",                   NULL),
+    VFContentSignature(VFContentTypeFLAC,   0,   "fLaC",                   NULL),
+};
+
+static const char * const kVFContentTypeNames[VFContentTypeCount] = {
+    [VFContentTypeUnknown] = "application/octet-stream",
+    [VFContentTypeEmpty]   = "application/x-empty",
+    [VFContentTypeText]    = "text/plain",
+    [VFContentTypeBinary]  = "application/octet-stream",
+    [VFContentTypePNG]     = "image/png",
+    [VFContentTypeJPEG]    = "image/jpeg",
+    [VFContentTypeGIF]     = "image/gif",
+    [VFContentTypeTIFF]    = "image/tiff",
+    [VFContentTypeBMP]     = "image/bmp",
+    [VFContentTypeWebP]    = "image/webp",
+    [VFContentTypePDF]     = "application/pdf",
+    [VFContentTypeZip]     = "application/zip",
+    [VFContentTypeGzip]    = "application/gzip",
+    [VFContentTypeBzip2]   = "application/x-bzip2",
+    [VFContentTypeXZ]      = "application/x-xz",
+    [VFContentTypeZstd]    = "application/zstd",
+    [VFContentType7z]      = "application/x-7z-compressed",
+    [VFContentTypeRAR]     = "application/vnd.rar",
+    [VFContentTypeTar]     = "application/x-tar",
+    [VFContentTypeELF]     = "application/x-executable",
+    [VFContentTypeMachO]   = "application/x-mach-binary",
+    [VFContentTypeSQLite]  = "application/vnd.sqlite3",
+    [VFContentTypeMP3]     = "audio/mpeg",
+    [VFContentTypeMP4]     = "video/mp4",
+    [VFContentTypeWAV]     = "audio/wav",
+    [VFContentTypeOgg]     = "audio/ogg",
+    [VFContentTypeFLAC]    = "audio/flac",
+};
+
+static _VFContentTrieNode kVFContentTrie[kVFContentTrieCapacity];
+static uint16_t           kVFContentTrieCount = 1;
+static pthread_once_t     kVFContentTrieOnce  = PTHREAD_ONCE_INIT;
+
+#pragma mark - Private - Trie -
+static uint16_t VFContentTrieAddChild(uint16_t parent, uint8_t byte, BOOL is_any) {
+    for (uint16_t child = kVFContentTrie[parent].child; child; child = kVFContentTrie[child].sibling) {
+        if (kVFContentTrie[child].is_any == is_any && (is_any || kVFContentTrie[child].byte == byte)) {
+            return child;
+        }
+    }
+    
+    uint16_t child                = kVFContentTrieCount++;
+    kVFContentTrie[child].byte    = byte;
+    kVFContentTrie[child].is_any  = is_any;
+    kVFContentTrie[child].sibling = kVFContentTrie[parent].child;
+    kVFContentTrie[parent].child  = child;
+    return child;
+}
+
+/*
+ * Leading offsets become a chain of wildcard nodes, which the signatures
+ * at the same or a larger offset share.
+ */
+static void VFContentTrieBuild(void) {
+    size_t count = sizeof(kVFContentSignatures) / sizeof(kVFContentSignatures[0]);
+    for (size_t i = 0; i < count; i++) {
+        const _VFContentSignature *signature = &kVFContentSignatures[i];
+        
+        uint16_t node = 0;
+        for (uint16_t j = 0; j < signature->offset; j++) {
+            node = VFContentTrieAddChild(node, 0, YES);
+        }
+        for (uint16_t j = 0; j < signature->length; j++) {
+            BOOL is_any = (signature->mask && signature->mask[j] == '.');
+            node        = VFContentTrieAddChild(node, signature->bytes[j], is_any);
+        }
+        kVFContentTrie[node].type = signature->type;
+    }
+}
+
+static void VFContentTrieMatch(uint16_t node, const uint8_t *bytes, size_t length, size_t depth, VFContentType *type, size_t *best_depth) {
+    if (kVFContentTrie[node].type != VFContentTypeUnknown && depth > *best_depth) {
+        *type       = kVFContentTrie[node].type;
+        *best_depth = depth;
+    }
+    if (depth == length) {
+        return;
+    }
+    
+    for (uint16_t child = kVFContentTrie[node].child; child; child = kVFContentTrie[child].sibling) {
+        if (kVFContentTrie[child].is_any || kVFContentTrie[child].byte == bytes[depth]) {
+            VFContentTrieMatch(child, bytes, length, depth + 1, type, best_depth);
+        }
+    }
+}
+
+#pragma mark - Private - Text -
+static BOOL VFContentTypeIsText(const uint8_t *bytes, size_t length) {
+    if (length >= 2 && ((bytes[0] == 0xff && bytes[1] == 0xfe) || (bytes[0] == 0xfe && bytes[1] == 0xff))) {
+        return YES;
+    }
+    
+    // Tab, newline, form feed, carriage return, backspace and escape are the
+    // only control bytes allowed, any encoding of text above that is fine
+    for (size_t i = 0; i < length; i++) {
+        uint8_t byte = bytes[i];
+        if (byte < 0x20 && byte != '\t' && byte != '\n' && byte != '\f' && byte != '\r' && byte != '\b' && byte != 0x1b) {
+            return NO;
+        }
+        if (byte == 0x7f) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+#pragma mark - VFContentType -
+VFContentType VFContentTypeDetect(const uint8_t *bytes, size_t length) {
+    if (!bytes || length == 0) {
+        return VFContentTypeEmpty;
+    }
+    
+    pthread_once(&kVFContentTrieOnce, VFContentTrieBuild);
+    
+    VFContentType type = VFContentTypeUnknown;
+    size_t best_depth  = 0;
+    VFContentTrieMatch(0, bytes, length, 0, &type, &best_depth);
+    if (type != VFContentTypeUnknown) {
+        return type;
+    }
+    return VFContentTypeIsText(bytes, length) ? VFContentTypeText : VFContentTypeBinary;
+}
+
+VFContentType VFContentTypeDetectFile(const char *path, char **error) {
+    int file = (path) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (file == -1) {
+        if (error) *error = (path) ? strerror(errno) : "Invalid path";
+        return VFContentTypeUnknown;
+    }
+    
+    uint8_t buffer[kVFContentTypeSniffSize];
+    ssize_t bytes_read;
+    do {
+        bytes_read = pread(file, buffer, sizeof(buffer), 0);
+    } while (bytes_read == -1 && errno == EINTR);
+    
+    if (bytes_read == -1) {
+        if (error) *error = strerror(errno);
+        close(file);
+        return VFContentTypeUnknown;
+    }
+    close(file);
+    
+    return VFContentTypeDetect(buffer, bytes_read);
+}
+
+const char * VFContentTypeGetName(VFContentType type) {
+    if (type < 0 || type >= VFContentTypeCount) {
+        type = VFContentTypeUnknown;
+    }
+    return kVFContentTypeNames[type];
+}
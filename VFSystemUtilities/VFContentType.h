@@ -0,0 +1,66 @@
+//
+//  VFContentType.h
+//
+//  Created by Dima Bart on 2014-08-23.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFContentTypeUnknown   = 0, // Not detected, not a regular file or not readable
+    VFContentTypeEmpty     = 1,
+    VFContentTypeText      = 2,
+    VFContentTypeBinary    = 3,
+    VFContentTypePNG       = 4,
+    VFContentTypeJPEG      = 5,
+    VFContentTypeGIF       = 6,
+    VFContentTypeTIFF      = 7,
+    VFContentTypeBMP       = 8,
+    VFContentTypeWebP      = 9,
+    VFContentTypePDF       = 10,
+    VFContentTypeZip       = 11,
+    VFContentTypeGzip      = 12,
+    VFContentTypeBzip2     = 13,
+    VFContentTypeXZ        = 14,
+    VFContentTypeZstd      = 15,
+    VFContentType7z        = 16,
+    VFContentTypeRAR       = 17,
+    VFContentTypeTar       = 18,
+    VFContentTypeELF       = 19,
+    VFContentTypeMachO     = 20,
+    VFContentTypeSQLite    = 21,
+    VFContentTypeMP3       = 22,
+    VFContentTypeMP4       = 23,
+    VFContentTypeWAV       = 24,
+    VFContentTypeOgg       = 25,
+    VFContentTypeFLAC      = 26,
+    VFContentTypeCount     = 27,
+} VFContentType;
+
+/*
+ * =============================
+ *    VFContentType & Related
+ * =============================
+ *
+ */
+// MARK: - VFContentType -
+
+/*
+ * Detects the type of a file from its first 512 bytes. Known signatures
+ * (magic numbers, some of them at an offset such as "ustar" at 257) are
+ * compiled once into a trie that is walked over the leading bytes, the
+ * longest signature that matches wins. Anything else is text unless it
+ * contains NUL or other control bytes that do not appear in text.
+ *
+ * VFContentTypeDetectFile reads the leading bytes with a single pread()
+ * and is safe to call from any number of threads.
+ */
+VFContentType VFContentTypeDetect(const uint8_t *bytes, size_t length);
+VFContentType VFContentTypeDetectFile(const char *path, char **error);
+
+const char * VFContentTypeGetName(VFContentType type); // MIME type
@@ -0,0 +1,472 @@
+//
+//  VFDeviceProfile.c
+//
+//  Created by Dima Bart on 2014-08-30.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
+#import <fcntl.h>
+#import <errno.h>
+#import <unistd.h>
+#import <limits.h>
+#import <libgen.h>
+#import <pthread.h>
+#import <time.h>
+#import <sys/stat.h>
+
+#if defined(__linux__)
+    #import <sys/sysmacros.h>
+#elif defined(__APPLE__)
+    #import <sys/param.h>
+    #import <sys/mount.h>
+#endif
+
+#import "VFDeviceProfile.h"
+
+static const size_t   kVFDeviceCalibrationSize   = 8 * 1024 * 1024;
+static const size_t   kVFDeviceCalibrationBlock  = 1024 * 1024;
+static const size_t   kVFDeviceRandomReadSize    = 4096;
+static const uint32_t kVFDeviceRandomReadCount   = 64;
+static const size_t   kVFDeviceMinimumChunkSize  = 256 * 1024;
+static const size_t   kVFDeviceMaximumChunkSize  = 8 * 1024 * 1024;
+
+typedef struct __VFDeviceTuning {
+    size_t   chunk_size;
+    uint32_t queue_depth;
+    uint32_t parallelism;
+} _VFDeviceTuning;
+
+static const _VFDeviceTuning kVFDeviceTunings[] = {
+    [VFDeviceKindUnknown]    = { 1024 * 1024,     4,  2 },
+    [VFDeviceKindRotational] = { 1024 * 1024,     2,  1 },
+    [VFDeviceKindSolidState] = { 1024 * 1024,     8,  4 },
+    [VFDeviceKindNVMe]       = { 2 * 1024 * 1024, 32, 8 },
+    [VFDeviceKindMemory]     = { 1024 * 1024,     8,  8 },
+    [VFDeviceKindNetwork]    = { 1024 * 1024,     4,  4 },
+};
+
+static const char * const kVFDeviceMemoryFileSystems[]  = { "tmpfs", "ramfs", "devtmpfs", "hugetlbfs", NULL };
+static const char * const kVFDeviceNetworkFileSystems[] = { "nfs", "nfs4", "cifs", "smb3", "9p", "ceph", "afs", "fuse.sshfs", "smbfs", "afpfs", "webdav", NULL };
+
+typedef struct __VFDeviceEntry {
+    _VFDeviceProfile        profile;
+    char                   *failure; // Why the profile couldn't be built, NULL when it was
+    struct __VFDeviceEntry *next;
+} _VFDeviceEntry;
+typedef _VFDeviceEntry * VFDeviceEntry;
+
+static VFDeviceEntry   kVFDeviceEntries = NULL;
+static pthread_mutex_t kVFDeviceLock    = PTHREAD_MUTEX_INITIALIZER;
+
+#pragma mark - Private - Tuning -
+static BOOL VFDeviceIsListed(const char * const *list, const char *name) {
+    for (size_t i = 0; list[i]; i++) {
+        if (strcmp(list[i], name) == 0) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+static void VFDeviceProfileTune(VFDeviceProfile profile) {
+    if (profile->kind == VFDeviceKindUnknown) {
+        if (VFDeviceIsListed(kVFDeviceMemoryFileSystems, profile->file_system)) {
+            profile->kind = VFDeviceKindMemory;
+        } else if (VFDeviceIsListed(kVFDeviceNetworkFileSystems, profile->file_system)) {
+            profile->kind = VFDeviceKindNetwork;
+        }
+    }
+    
+    const _VFDeviceTuning *tuning = &kVFDeviceTunings[profile->kind];
+    profile->chunk_size           = tuning->chunk_size;
+    profile->queue_depth          = tuning->queue_depth;
+    profile->parallelism          = tuning->parallelism;
+    
+    // Whole optimal sized requests, and no more of them than the queue holds
+    if (profile->optimal_io_size > 0) {
+        if (profile->chunk_size < profile->optimal_io_size) {
+            profile->chunk_size = profile->optimal_io_size;
+        }
+        profile->chunk_size -= profile->chunk_size % profile->optimal_io_size;
+    }
+    if (profile->nr_requests > 0 && profile->queue_depth > profile->nr_requests) {
+        profile->queue_depth = profile->nr_requests;
+    }
+}
+
+/*
+ * Chunks are sized to take about 10 ms to read. A random read slower than
+ * 2 ms is a seek, so requests go one at a time, while one under 200 us
+ * can keep several workers busy whatever the device claimed to be.
+ */
+static void VFDeviceProfileApplyCalibration(VFDeviceProfile profile) {
+    size_t chunk_size = kVFDeviceMinimumChunkSize;
+    while (chunk_size < kVFDeviceMaximumChunkSize && chunk_size < profile->read_bandwidth / 100) {
+        chunk_size <<= 1;
+    }
+    profile->chunk_size = chunk_size;
+    
+    if (profile->read_latency > 2000000) {
+        profile->queue_depth = 1;
+        profile->parallelism = 1;
+    } else if (profile->read_latency < 200000 && profile->parallelism < 4) {
+        profile->parallelism = 4;
+        if (profile->queue_depth < 4) {
+            profile->queue_depth = 4;
+        }
+    }
+    profile->is_calibrated = YES;
+}
+
+#pragma mark - Private - Cache -
+
+/*
+ * Devices without a profile are cached too, with the reason, so tmpfs,
+ * overlay or network mounts missing from the tables aren't looked up
+ * again for every operation on them.
+ */
+static BOOL VFDeviceProfileLookup(dev_t device, VFDeviceProfile profile, char **failure) {
+    BOOL found = NO;
+    pthread_mutex_lock(&kVFDeviceLock);
+    for (VFDeviceEntry entry = kVFDeviceEntries; entry; entry = entry->next) {
+        if (entry->profile.device == device) {
+            *profile = entry->profile;
+            *failure = entry->failure;
+            found    = YES;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&kVFDeviceLock);
+    return found;
+}
+
+static void VFDeviceProfileStore(VFDeviceProfile profile, char *failure) {
+    pthread_mutex_lock(&kVFDeviceLock);
+    VFDeviceEntry entry = kVFDeviceEntries;
+    while (entry && entry->profile.device != profile->device) {
+        entry = entry->next;
+    }
+    if (!entry) {
+        entry = calloc(1, sizeof(_VFDeviceEntry));
+        if (!entry) {
+            // Not remembered, the next lookup builds it again
+            pthread_mutex_unlock(&kVFDeviceLock);
+            return;
+        }
+        entry->next      = kVFDeviceEntries;
+        kVFDeviceEntries = entry;
+    }
+    entry->profile = *profile;
+    entry->failure = failure;
+    pthread_mutex_unlock(&kVFDeviceLock);
+}
+
+#if defined(__linux__)
+
+#pragma mark - Private - Reading -
+static uint32_t VFDeviceReadNumber(const char *directory, const char *name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file == -1) {
+        return 0;
+    }
+    
+    char buffer[32];
+    ssize_t length = read(file, buffer, sizeof(buffer) - 1);
+    close(file);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    return (uint32_t)strtoul(buffer, NULL, 10);
+}
+
+// "id parent major:minor root mount_point options ... - type source ..."
+static BOOL VFDeviceProfileReadMount(VFDeviceProfile profile) {
+    FILE *file = fopen("/proc/self/mountinfo", "re");
+    if (!file) {
+        return NO;
+    }
+    
+    BOOL found      = NO;
+    char *line      = NULL;
+    size_t capacity = 0;
+    while (!found && getline(&line, &capacity, file) != -1) {
+        unsigned int device_major;
+        unsigned int device_minor;
+        if (sscanf(line, "%*u %*u %u:%u", &device_major, &device_minor) != 2) {
+            continue;
+        }
+        if (device_major != major(profile->device) || device_minor != minor(profile->device)) {
+            continue;
+        }
+        
+        char *separator = strstr(line, " - ");
+        if (separator) {
+            separator += 3;
+            size_t length = strcspn(separator, " \n");
+            if (length >= sizeof(profile->file_system)) {
+                length = sizeof(profile->file_system) - 1;
+            }
+            memcpy(profile->file_system, separator, length);
+            profile->file_system[length] = '\0';
+        }
+        found = YES;
+    }
+    
+    free(line);
+    fclose(file);
+    return found;
+}
+
+/*
+ * /sys/dev/block/major:minor links to the device, a partition has a
+ * "partition" attribute and its queue lives with the parent disk.
+ */
+static void VFDeviceProfileReadQueue(VFDeviceProfile profile) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(profile->device), minor(profile->device));
+    
+    char *directory = realpath(path, NULL);
+    if (!directory) {
+        return;
+    }
+    
+    snprintf(path, sizeof(path), "%s/partition", directory);
+    if (access(path, F_OK) == 0) {
+        char *slash = strrchr(directory, '/');
+        if (slash) {
+            *slash = '\0';
+        }
+    }
+    
+    const char *name = strrchr(directory, '/');
+    snprintf(profile->block_device, sizeof(profile->block_device), "%s", (name) ? name + 1 : directory);
+    
+    snprintf(path, sizeof(path), "%s/queue", directory);
+    profile->is_rotational      = (VFDeviceReadNumber(path, "rotational") != 0);
+    profile->logical_block_size = VFDeviceReadNumber(path, "logical_block_size");
+    profile->optimal_io_size    = VFDeviceReadNumber(path, "optimal_io_size");
+    profile->read_ahead_size    = VFDeviceReadNumber(path, "read_ahead_kb") * 1024;
+    profile->nr_requests        = VFDeviceReadNumber(path, "nr_requests");
+    
+    if (strncmp(profile->block_device, "nvme", 4) == 0) {
+        profile->kind = VFDeviceKindNVMe;
+    } else {
+        profile->kind = (profile->is_rotational) ? VFDeviceKindRotational : VFDeviceKindSolidState;
+    }
+    free(directory);
+}
+
+static BOOL VFDeviceProfileBuild(dev_t device, VFDeviceProfile profile, char **error) {
+    memset(profile, 0, sizeof(_VFDeviceProfile));
+    profile->device = device;
+    
+    if (!VFDeviceProfileReadMount(profile)) {
+        if (error) *error = "Failed to find the mount of the device";
+        return NO;
+    }
+    
+    // File systems without a device get anonymous numbers with major 0
+    if (major(device) != 0) {
+        VFDeviceProfileReadQueue(profile);
+    }
+    VFDeviceProfileTune(profile);
+    return YES;
+}
+
+#else
+
+#pragma mark - Private - Reading -
+static BOOL VFDeviceProfileBuild(dev_t device, VFDeviceProfile profile, char **error) {
+    memset(profile, 0, sizeof(_VFDeviceProfile));
+    profile->device = device;
+    
+    struct statfs *mounts;
+    int count = getmntinfo(&mounts, MNT_NOWAIT);
+    for (int i = 0; i < count; i++) {
+        if ((dev_t)mounts[i].f_fsid.val[0] != device) {
+            continue;
+        }
+        
+        snprintf(profile->file_system, sizeof(profile->file_system), "%s", mounts[i].f_fstypename);
+        snprintf(profile->block_device, sizeof(profile->block_device), "%s", mounts[i].f_mntfromname);
+        if (!(mounts[i].f_flags & MNT_LOCAL)) {
+            profile->kind = VFDeviceKindNetwork;
+        }
+        profile->optimal_io_size = (uint32_t)mounts[i].f_iosize;
+        VFDeviceProfileTune(profile);
+        return YES;
+    }
+    
+    if (error) *error = "Failed to find the mount of the device";
+    return NO;
+}
+
+#endif
+
+#pragma mark - Private - Calibration -
+static uint64_t VFDeviceGetTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Without O_DIRECT the pages read by one phase stay cached
+// and would answer the next one, so they are dropped again
+static void VFDeviceDropCache(int file) {
+#if defined(__linux__)
+    posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+static int VFDeviceOpenUncached(const char *path) {
+#if defined(__linux__)
+    int file = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (file == -1 && errno == EINVAL) {
+        file = open(path, O_RDONLY | O_CLOEXEC);
+        if (file != -1) {
+            VFDeviceDropCache(file);
+        }
+    }
+    return file;
+#else
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file != -1) {
+        fcntl(file, F_NOCACHE, 1);
+    }
+    return file;
+#endif
+}
+
+static BOOL VFDeviceWriteScratch(const char *path, uint8_t *buffer) {
+    int file = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (file == -1) {
+        return NO;
+    }
+    
+    BOOL success = YES;
+    for (size_t offset = 0; success && offset < kVFDeviceCalibrationSize; offset += kVFDeviceCalibrationBlock) {
+        memset(buffer, (int)(offset / kVFDeviceCalibrationBlock) + 1, kVFDeviceCalibrationBlock);
+        success = (pwrite(file, buffer, kVFDeviceCalibrationBlock, offset) == (ssize_t)kVFDeviceCalibrationBlock);
+    }
+    success = (fsync(file) == 0) && success;
+    close(file);
+    return success;
+}
+
+static BOOL VFDeviceMeasure(const char *path, uint8_t *buffer, VFDeviceProfile profile) {
+    int file = VFDeviceOpenUncached(path);
+    if (file == -1) {
+        return NO;
+    }
+    
+    BOOL success   = YES;
+    uint64_t start = VFDeviceGetTime();
+    for (size_t offset = 0; success && offset < kVFDeviceCalibrationSize; offset += kVFDeviceCalibrationBlock) {
+        success = (pread(file, buffer, kVFDeviceCalibrationBlock, offset) == (ssize_t)kVFDeviceCalibrationBlock);
+    }
+    uint64_t elapsed = VFDeviceGetTime() - start;
+    if (success) {
+        profile->read_bandwidth = (elapsed > 0) ? kVFDeviceCalibrationSize * 1000000000ULL / elapsed : 0;
+    }
+    
+    /* ---------------------------------------
+     * Random block aligned reads, with a
+     * fixed seed so runs stay comparable.
+     */
+    VFDeviceDropCache(file);
+    uint32_t seed  = 2463534242U;
+    size_t blocks  = kVFDeviceCalibrationSize / kVFDeviceRandomReadSize;
+    start          = VFDeviceGetTime();
+    for (uint32_t i = 0; success && i < kVFDeviceRandomReadCount; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        off_t offset = (off_t)(seed % blocks) * kVFDeviceRandomReadSize;
+        success      = (pread(file, buffer, kVFDeviceRandomReadSize, offset) == (ssize_t)kVFDeviceRandomReadSize);
+    }
+    if (success) {
+        profile->read_latency = (VFDeviceGetTime() - start) / kVFDeviceRandomReadCount;
+    }
+    
+    close(file);
+    return success;
+}
+
+#pragma mark - VFDeviceProfile -
+BOOL VFDeviceProfileGetForDevice(dev_t device, VFDeviceProfile profile, char **error) {
+    if (!profile) {
+        if (error) *error = "Invalid profile";
+        return NO;
+    }
+    char *failure = NULL;
+    if (VFDeviceProfileLookup(device, profile, &failure)) {
+        if (failure) {
+            if (error) *error = failure;
+            return NO;
+        }
+        return YES;
+    }
+    
+    if (!VFDeviceProfileBuild(device, profile, &failure)) {
+        failure = (failure) ? failure : "Failed to find the mount of the device";
+        if (error) *error = failure;
+        VFDeviceProfileStore(profile, failure);
+        return NO;
+    }
+    VFDeviceProfileStore(profile, NULL);
+    return YES;
+}
+
+BOOL VFDeviceProfileGet(const char *path, VFDeviceProfile profile, char **error) {
+    struct stat file_stat;
+    if (!path || stat(path, &file_stat) != 0) {
+        if (error) *error = (path) ? strerror(errno) : "Invalid path";
+        return NO;
+    }
+    return VFDeviceProfileGetForDevice(file_stat.st_dev, profile, error);
+}
+
+BOOL VFDeviceProfileCalibrate(const char *path, VFDeviceProfile profile, char **error) {
+    struct stat file_stat;
+    if (!path || !profile || stat(path, &file_stat) != 0 || !S_ISDIR(file_stat.st_mode)) {
+        if (error) *error = (path && profile && errno != 0) ? strerror(errno) : "Calibration needs a directory to write to";
+        return NO;
+    }
+    
+    _VFDeviceProfile calibrated;
+    if (!VFDeviceProfileGetForDevice(file_stat.st_dev, &calibrated, error)) {
+        return NO;
+    }
+    
+    // Aligned for O_DIRECT
+    uint8_t *buffer = NULL;
+    if (posix_memalign((void **)&buffer, 4096, kVFDeviceCalibrationBlock) != 0) {
+        if (error) *error = "Failed to allocate the calibration buffer";
+        return NO;
+    }
+    
+    char scratch[PATH_MAX];
+    snprintf(scratch, sizeof(scratch), "%s/.vfcalibrate.%d.tmp", path, getpid());
+    
+    BOOL success = VFDeviceWriteScratch(scratch, buffer) && VFDeviceMeasure(scratch, buffer, &calibrated);
+    if (!success && error) {
+        *error = strerror(errno);
+    }
+    unlink(scratch);
+    free(buffer);
+    
+    if (success) {
+        VFDeviceProfileApplyCalibration(&calibrated);
+        VFDeviceProfileStore(&calibrated, NULL);
+        *profile = calibrated;
+    }
+    return success;
+}
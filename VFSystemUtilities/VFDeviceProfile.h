@@ -0,0 +1,80 @@
+//
+//  VFDeviceProfile.h
+//
+//  Created by Dima Bart on 2014-08-30.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <sys/types.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFDeviceKindUnknown    = 0,
+    VFDeviceKindRotational = 1,
+    VFDeviceKindSolidState = 2,
+    VFDeviceKindNVMe       = 3,
+    VFDeviceKindMemory     = 4, // tmpfs, ramfs and other file systems without a device
+    VFDeviceKindNetwork    = 5,
+} VFDeviceKind;
+
+/*
+ * =============================
+ *   VFDeviceProfile & Related
+ * =============================
+ *
+ */
+// MARK: - VFDeviceProfile -
+
+/*
+ * Describes the storage behind a file system and how to drive it. The
+ * mount is found in /proc/self/mountinfo by the device number of a path,
+ * its block device through /sys/dev/block, and for partitions the queue
+ * attributes are those of the whole disk.
+ *
+ * chunk_size, queue_depth and parallelism are picked from the kind of
+ * device: few large sequential requests for spinning disks, many for
+ * NVMe, chunks of at least the optimal I/O size and never more requests
+ * than the device queue holds. Calibration replaces the guesswork with a
+ * short measurement of sequential bandwidth and random read latency.
+ *
+ * Profiles are cached per device for the lifetime of the process, and so
+ * are the devices without one. Copies, VFPipeline and VFOperationQueue
+ * follow them.
+ */
+typedef struct __VFDeviceProfile {
+    dev_t        device;
+    VFDeviceKind kind;
+    char         file_system[32];
+    char         block_device[32]; // Empty without a block device
+    BOOL         is_rotational;
+    uint32_t     logical_block_size;
+    uint32_t     optimal_io_size; // 0 when the device doesn't report one
+    uint32_t     read_ahead_size;
+    uint32_t     nr_requests;
+    size_t       chunk_size;
+    uint32_t     queue_depth;
+    uint32_t     parallelism;
+    BOOL         is_calibrated;
+    uint64_t     read_bandwidth;  // Bytes per second, when calibrated
+    uint64_t     read_latency;    // Nanoseconds per random 4KB read, when calibrated
+} _VFDeviceProfile;
+typedef _VFDeviceProfile * VFDeviceProfile;
+
+// MARK: - VFDeviceProfile Functions -
+BOOL VFDeviceProfileGet(const char *path, VFDeviceProfile profile, char **error);
+BOOL VFDeviceProfileGetForDevice(dev_t device, VFDeviceProfile profile, char **error);
+
+/*
+ * Writes an 8MB scratch file into the directory at path, reads it back
+ * bypassing the page cache (O_DIRECT where supported, otherwise after
+ * dropping it from the cache), removes it and retunes the cached profile
+ * of its device from the results. Takes well under a second on anything
+ * but slow disks, the result is kept for later lookups.
+ */
+BOOL VFDeviceProfileCalibrate(const char *path, VFDeviceProfile profile, char **error);
@@ -0,0 +1,310 @@
+//
+//  VFFileFollow.c
+//
+//  Created by Dima Bart on 2014-08-22.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
+#import <Block.h>
+#import <poll.h>
+#import <fcntl.h>
+#import <errno.h>
+#import <unistd.h>
+#import <limits.h>
+
+#if defined(__linux__)
+    #import <sys/inotify.h>
+#endif
+
+#import "VFFileFollow.h"
+
+#if defined(__linux__)
+
+static const size_t kVFFileFollowBufferSize      = 64 * 1024;
+static const size_t kVFFileFollowEventBufferSize = 16 * 1024;
+
+static const uint32_t kVFFileFollowFileMask      = IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+static const uint32_t kVFFileFollowDirectoryMask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+
+#pragma mark - Private -
+static void VFFileFollowerSave(VFFileFollower follower) {
+    if (follower->checkpoint_file >= 0) {
+        pwrite(follower->checkpoint_file, &follower->checkpoint, sizeof(_VFFileCheckpoint), 0);
+        if (follower->options & VFFileFollowOptionSynchronous) {
+            fdatasync(follower->checkpoint_file);
+        }
+    }
+}
+
+static void VFFileFollowerSetCheckpoint(VFFileFollower follower, const struct stat *file_stat, uint64_t offset) {
+    pthread_mutex_lock(&follower->lock);
+    if (file_stat) {
+        follower->checkpoint.device = file_stat->st_dev;
+        follower->checkpoint.inode  = file_stat->st_ino;
+    }
+    follower->checkpoint.offset = offset;
+    pthread_mutex_unlock(&follower->lock);
+    VFFileFollowerSave(follower);
+}
+
+static void VFFileFollowerDrain(VFFileFollower follower) {
+    while (YES) {
+        ssize_t bytes_read = pread(follower->file, follower->buffer, kVFFileFollowBufferSize, follower->checkpoint.offset);
+        if (bytes_read == -1) {
+            if (errno == EINTR) continue;
+            follower->block(NULL, -1, strerror(errno));
+            return;
+        }
+        if (bytes_read == 0) {
+            return;
+        }
+        
+        follower->block(follower->buffer, bytes_read, NULL);
+        VFFileFollowerSetCheckpoint(follower, NULL, follower->checkpoint.offset + bytes_read);
+    }
+}
+
+/*
+ * Reads whatever is new in the current file, then switches to the file
+ * at path if it was replaced, until both are the same and at their end.
+ */
+static void VFFileFollowerCatchUp(VFFileFollower follower) {
+    while (YES) {
+        struct stat file_stat;
+        if (fstat(follower->file, &file_stat) == 0 && (uint64_t)file_stat.st_size < follower->checkpoint.offset) {
+            VFFileFollowerSetCheckpoint(follower, NULL, 0);
+        }
+        VFFileFollowerDrain(follower);
+        
+        struct stat path_stat;
+        if (stat(follower->path, &path_stat) != 0 || ((uint64_t)path_stat.st_dev == follower->checkpoint.device && (uint64_t)path_stat.st_ino == follower->checkpoint.inode)) {
+            return;
+        }
+        
+        int file = open(follower->path, O_RDONLY | O_CLOEXEC);
+        if (file == -1 || fstat(file, &path_stat) != 0) {
+            if (file != -1) close(file);
+            return;
+        }
+        
+        inotify_rm_watch(follower->notify, follower->file_watch);
+        follower->file_watch = inotify_add_watch(follower->notify, follower->path, kVFFileFollowFileMask);
+        
+        close(follower->file);
+        follower->file = file;
+        VFFileFollowerSetCheckpoint(follower, &path_stat, 0);
+    }
+}
+
+// Only events for the file itself or its name in the directory matter
+static BOOL VFFileFollowerReadEvents(VFFileFollower follower, char *buffer) {
+    BOOL is_relevant = NO;
+    while (YES) {
+        ssize_t length = read(follower->notify, buffer, kVFFileFollowEventBufferSize);
+        if (length <= 0) {
+            break;
+        }
+        
+        for (char *position = buffer; position < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *)position;
+            if (event->wd == follower->file_watch || (event->mask & IN_Q_OVERFLOW)) {
+                is_relevant = YES;
+            } else if (event->wd == follower->directory_watch && event->len > 0 && strcmp(event->name, follower->name) == 0) {
+                is_relevant = YES;
+            }
+            position += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return is_relevant;
+}
+
+static void * VFFileFollowerRun(void *context) {
+    VFFileFollower follower = context;
+    char *buffer            = malloc(kVFFileFollowEventBufferSize);
+    
+    struct pollfd descriptors[2] = {
+        { .fd = follower->notify,  .events = POLLIN },
+        { .fd = follower->wake[0], .events = POLLIN },
+    };
+    
+    VFFileFollowerCatchUp(follower);
+    while (YES) {
+        if (poll(descriptors, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (descriptors[1].revents) {
+            break;
+        }
+        if (VFFileFollowerReadEvents(follower, buffer)) {
+            VFFileFollowerCatchUp(follower);
+        }
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Resumes from the checkpoint when it describes the file now at path and
+ * the file did not shrink below it. A checkpoint of a rotated or truncated
+ * file means everything in the file now is new, so it is read from the
+ * start. Only without any checkpoint does it start at the end (or at the
+ * start with VFFileFollowOptionFromStart).
+ */
+static void VFFileFollowerLoadCheckpoint(VFFileFollower follower, const struct stat *file_stat) {
+    _VFFileCheckpoint checkpoint;
+    BOOL is_found = follower->checkpoint_file >= 0 &&
+        pread(follower->checkpoint_file, &checkpoint, sizeof(checkpoint), 0) == sizeof(checkpoint);
+    BOOL is_valid = is_found &&
+        checkpoint.device == (uint64_t)file_stat->st_dev &&
+        checkpoint.inode == (uint64_t)file_stat->st_ino &&
+        checkpoint.offset <= (uint64_t)file_stat->st_size;
+    
+    follower->checkpoint.device = file_stat->st_dev;
+    follower->checkpoint.inode  = file_stat->st_ino;
+    if (is_valid) {
+        follower->checkpoint.offset = checkpoint.offset;
+    } else if (is_found) {
+        follower->checkpoint.offset = 0;
+    } else {
+        follower->checkpoint.offset = (follower->options & VFFileFollowOptionFromStart) ? 0 : file_stat->st_size;
+    }
+    VFFileFollowerSave(follower);
+}
+
+static char * VFFileFollowerCreateDirectory(const char *path) {
+    const char *separator = strrchr(path, '/');
+    if (!separator) {
+        return strdup(".");
+    }
+    if (separator == path) {
+        return strdup("/");
+    }
+    return strndup(path, separator - path);
+}
+
+#pragma mark - VFFileFollower -
+VFFileFollower VFFileFollowerCreate(const char *path, const char *checkpoint_path, VFFileFollowOption options, VFFileBytesEnumerationBlock block, char **error) {
+    if (!path || !block) {
+        if (error) *error = "Invalid path or block";
+        return NULL;
+    }
+    
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (file == -1 || fstat(file, &file_stat) != 0) {
+        if (error) *error = strerror(errno);
+        if (file != -1) close(file);
+        return NULL;
+    }
+    if (!S_ISREG(file_stat.st_mode)) {
+        if (error) *error = "Failed to follow file. File is not a regular file";
+        close(file);
+        return NULL;
+    }
+    
+    const char *separator       = strrchr(path, '/');
+    VFFileFollower follower     = calloc(1, sizeof(_VFFileFollower));
+    follower->path              = strdup(path);
+    follower->name              = strdup(separator ? separator + 1 : path);
+    follower->options           = options;
+    follower->block             = Block_copy(block);
+    follower->file              = file;
+    follower->checkpoint_file   = -1;
+    follower->notify            = -1;
+    follower->file_watch        = -1;
+    follower->directory_watch   = -1;
+    follower->wake[0]           = -1;
+    follower->wake[1]           = -1;
+    follower->buffer            = malloc(kVFFileFollowBufferSize);
+    pthread_mutex_init(&follower->lock, NULL);
+    
+    if (checkpoint_path) {
+        follower->checkpoint_file = open(checkpoint_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (follower->checkpoint_file == -1) {
+            if (error) *error = strerror(errno);
+            VFFileFollowerRelease(follower);
+            return NULL;
+        }
+    }
+    VFFileFollowerLoadCheckpoint(follower, &file_stat);
+    
+    /* ---------------------------------------
+     * The file is watched for writes and for
+     * being moved or deleted, the directory
+     * for a new file appearing under its name.
+     */
+    char *directory           = VFFileFollowerCreateDirectory(path);
+    follower->notify          = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    follower->file_watch      = (follower->notify >= 0) ? inotify_add_watch(follower->notify, path, kVFFileFollowFileMask) : -1;
+    follower->directory_watch = (follower->notify >= 0) ? inotify_add_watch(follower->notify, directory, kVFFileFollowDirectoryMask) : -1;
+    free(directory);
+    
+    if (follower->file_watch < 0 || follower->directory_watch < 0 || pipe2(follower->wake, O_CLOEXEC) != 0) {
+        if (error) *error = strerror(errno);
+        VFFileFollowerRelease(follower);
+        return NULL;
+    }
+    
+    if (pthread_create(&follower->thread, NULL, VFFileFollowerRun, follower) != 0) {
+        if (error) *error = "Failed to start the follower thread";
+        close(follower->wake[1]);
+        follower->wake[1] = -1;
+        VFFileFollowerRelease(follower);
+        return NULL;
+    }
+    return follower;
+}
+
+void VFFileFollowerRelease(VFFileFollower follower) {
+    if (follower) {
+        if (follower->wake[1] >= 0) {
+            char signal = 0;
+            write(follower->wake[1], &signal, 1);
+            pthread_join(follower->thread, NULL);
+            close(follower->wake[1]);
+        }
+        if (follower->wake[0] >= 0)         close(follower->wake[0]);
+        if (follower->notify >= 0)          close(follower->notify);
+        if (follower->checkpoint_file >= 0) close(follower->checkpoint_file);
+        if (follower->file >= 0)            close(follower->file);
+        if (follower->block)                Block_release(follower->block);
+        
+        pthread_mutex_destroy(&follower->lock);
+        free(follower->buffer);
+        free(follower->name);
+        free(follower->path);
+        free(follower);
+    }
+}
+
+void VFFileFollowerGetCheckpoint(VFFileFollower follower, VFFileCheckpoint checkpoint) {
+    pthread_mutex_lock(&follower->lock);
+    *checkpoint = follower->checkpoint;
+    pthread_mutex_unlock(&follower->lock);
+}
+
+#else
+
+#pragma mark - VFFileFollower -
+VFFileFollower VFFileFollowerCreate(const char *path, const char *checkpoint_path, VFFileFollowOption options, VFFileBytesEnumerationBlock block, char **error) {
+    if (error) *error = "Following files is not supported on this platform";
+    return NULL;
+}
+
+void VFFileFollowerRelease(VFFileFollower follower) {
+    
+}
+
+void VFFileFollowerGetCheckpoint(VFFileFollower follower, VFFileCheckpoint checkpoint) {
+    memset(checkpoint, 0, sizeof(_VFFileCheckpoint));
+}
+
+#endif
@@ -0,0 +1,82 @@
+//
+//  VFFileFollow.h
+//
+//  Created by Dima Bart on 2014-08-22.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <pthread.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFFileFollowOptionNone        = 0,
+    VFFileFollowOptionFromStart   = 1 << 0, // Without a checkpoint, deliver what is already in the file
+    VFFileFollowOptionSynchronous = 1 << 1, // fdatasync() the checkpoint after every delivery
+} VFFileFollowOption;
+
+/*
+ * =============================
+ *    VFFileFollower & Related
+ * =============================
+ *
+ */
+// MARK: - VFFileCheckpoint -
+typedef struct __VFFileCheckpoint {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t offset;
+} _VFFileCheckpoint;
+typedef _VFFileCheckpoint * VFFileCheckpoint;
+
+// MARK: - VFFileFollower -
+
+/*
+ * Delivers bytes appended to a file through the same block as
+ * VFEnumerateFileBuffer, on the follower's own thread. The thread sleeps
+ * in poll() on inotify watches for the file and its directory, so new
+ * data is delivered as soon as it is written and nothing runs while the
+ * file is idle.
+ *
+ * The position is kept in a checkpoint file (device, inode and offset)
+ * that is rewritten after every delivered chunk. A follower created with
+ * the same checkpoint resumes where the previous one stopped, as long as
+ * the file is still the same inode. If the file was rotated or truncated
+ * meanwhile, the new one is read from its start. Chunks are delivered at
+ * least once: a chunk that was delivered but not yet recorded is
+ * delivered again.
+ *
+ * When the file shrinks below the offset it is read again from the start.
+ * When a different file appears at the path (rotation), the old file is
+ * read to its end first and the new one is followed from its start.
+ *
+ * Linux only, creating a follower fails elsewhere.
+ */
+typedef struct __VFFileFollower {
+    char                        *path;
+    char                        *name;
+    VFFileFollowOption           options;
+    VFFileBytesEnumerationBlock  block;
+    _VFFileCheckpoint            checkpoint;
+    int                          file;
+    int                          checkpoint_file;
+    int                          notify;
+    int                          file_watch;
+    int                          directory_watch;
+    int                          wake[2];
+    pthread_t                    thread;
+    pthread_mutex_t              lock;
+    uint8_t                     *buffer;
+} _VFFileFollower;
+typedef _VFFileFollower * VFFileFollower;
+
+// MARK: - VFFileFollower Functions -
+VFFileFollower VFFileFollowerCreate(const char *path, const char *checkpoint_path, VFFileFollowOption options, VFFileBytesEnumerationBlock block, char **error);
+void VFFileFollowerRelease(VFFileFollower follower);
+
+void VFFileFollowerGetCheckpoint(VFFileFollower follower, VFFileCheckpoint checkpoint);
@@ -5,12 +5,124 @@
 //  Copyright (c) 2014 Dima Bart. All rights reserved.
 //
 
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
 #import <sys/xattr.h>
+#import <sys/time.h>
+#import <libgen.h>
+#import <pthread.h>
+#import <dispatch/dispatch.h>
+
+#if defined(__APPLE__)
+    #import <copyfile.h>
+#elif defined(__linux__)
+    #import <sys/sendfile.h>
+#endif
 
 #import "VFFileManager.h"
 #import "VFTokenCollection.h"
+#import "VFGovernor.h"
+#import "VFDeviceProfile.h"
+
+#if defined(__linux__)
+    #define st_atimespec st_atim
+    #define st_mtimespec st_mtim
+    #define st_ctimespec st_ctim
+#endif
+
+#ifndef S_ISWHT
+    #define S_ISWHT(mode) 0
+#endif
+
+#if defined(__APPLE__)
+    #define VFListAttributes(file, buffer, size)     flistxattr(file, buffer, size, 0)
+    #define VFGetAttribute(file, name, buffer, size) fgetxattr(file, name, buffer, size, 0, 0)
+    #define VFSetAttribute(file, name, buffer, size) fsetxattr(file, name, buffer, size, 0, 0)
+#else
+    #define VFListAttributes(file, buffer, size)     flistxattr(file, buffer, size)
+    #define VFGetAttribute(file, name, buffer, size) fgetxattr(file, name, buffer, size)
+    #define VFSetAttribute(file, name, buffer, size) fsetxattr(file, name, buffer, size, 0)
+#endif
+
+static const size_t kVFCopyChunkSize = 8 * 1024 * 1024;
+
+#define kVFInodeMapStripes 64
+
+typedef enum {
+    VFInodeStatePending = 0,
+    VFInodeStateReady   = 1,
+    VFInodeStateFailed  = 2,
+} VFInodeState;
+
+typedef struct __VFInodeEntry {
+    dev_t                  device;
+    ino_t                  inode;
+    char                  *path;
+    VFInodeState           state;
+    struct __VFInodeEntry *next;
+} _VFInodeEntry;
+typedef _VFInodeEntry * VFInodeEntry;
+
+typedef struct __VFInodeStripe {
+    pthread_mutex_t lock;
+    pthread_cond_t  resolved;
+    VFInodeEntry   *buckets;
+    size_t          capacity;
+    size_t          count;
+} _VFInodeStripe;
+
+/*
+ * Maps (st_dev, st_ino) of hardlinked sources to the destination path of
+ * their first copy. Lock striping keeps parallel tree copies from
+ * contending on a single mutex.
+ */
+typedef struct __VFInodeMap {
+    _VFInodeStripe stripes[kVFInodeMapStripes];
+} _VFInodeMap;
+typedef _VFInodeMap * VFInodeMap;
+
+typedef struct __VFTreeCopyContext {
+    VFFileProgressBlock block;
+    VFInodeMap          inodes;
+    BOOL                sync;
+    uint64_t            bytes_total;
+    uint64_t            bytes_done;
+    uint64_t            files_copied;
+    uint64_t            links_created;
+    uint64_t            bytes_saved;
+    int                 errors;
+} _VFTreeCopyContext;
+typedef _VFTreeCopyContext * VFTreeCopyContext;
 
 #pragma mark - Private -
+
+/*
+ * The chunk size that suits the device the file is on, as long as the
+ * governor allows each worker that much memory, otherwise the governor's
+ * buffer size. Either way in whole blocks of the file.
+ */
+static size_t VFFileGetBufferSize(const struct stat *file_stat) {
+    size_t block_size = file_stat->st_blksize;
+    if (block_size < 1) {
+        block_size = 4096;
+    }
+    
+    _VFDeviceProfile profile;
+    if (VFDeviceProfileGetForDevice(file_stat->st_dev, &profile, NULL)) {
+        size_t chunk_size   = profile.chunk_size;
+        size_t buffer_limit = VFGovernorGetBufferLimit();
+        if (chunk_size > buffer_limit) {
+            chunk_size = buffer_limit;
+        }
+        if (chunk_size >= block_size) {
+            return chunk_size - chunk_size % block_size;
+        }
+    }
+    return VFGovernorGetBufferSize(block_size);
+}
+
 static VFFileType VFFileInfoGetType(VFFileInfo info) {
     mode_t mode = info->mode;
     if (S_ISBLK(mode) != 0) {
@@ -72,15 +184,6 @@ static struct stat VFFileStat(const char *path, char **error) {
     return file;
 }
 
-static struct statvfs VFSystemStat(const char *path, char **error) {
-    struct statvfs system;
-    int status = statvfs(path, &system);
-    if (status == -1 && error) {
-        *error = strerror(errno);
-    }
-    return system;
-}
-
 static BOOL VFFileCopy(const char *from, const char *to, char **error) {
     
     BOOL success = NO;
@@ -102,11 +205,8 @@ static BOOL VFFileCopy(const char *from, const char *to, char **error) {
         return success;
     }
     
-    // Optimal buffer size for copy
-    size_t block_size = from_stat.st_blksize;
-    if (block_size < 1) {
-        block_size = 4096;
-    }
+    // Optimal buffer size for copy, scaled by the governor and the device
+    size_t block_size = VFFileGetBufferSize(&from_stat);
     
     // Open source file
     int from_file = open(from, O_RDONLY);
@@ -120,14 +220,18 @@ static BOOL VFFileCopy(const char *from, const char *to, char **error) {
             ssize_t bytes_read    = 0;
             ssize_t bytes_written = 0;
             
-            uint8_t buffer[block_size];
+            uint8_t *buffer = malloc(block_size);
+            if (!buffer) {
+                error_occured = 1;
+            }
             
-            while ((bytes_read = read(from_file, buffer, block_size)) > 0) {
+            while (buffer && (bytes_read = read(from_file, buffer, block_size)) > 0) {
                 if ((bytes_written = write(to_file, buffer, bytes_read)) != bytes_read) {
                     error_occured = 1;
                     break;
                 }
             }
+            free(buffer);
             
             // Extended attribute support
           #ifdef _SYS_XATTR_H_
@@ -182,6 +286,762 @@ static BOOL VFIsHidden(const char *name) {
     return NO;
 }
 
+static VFInodeMap VFInodeMapCreate(void) {
+    VFInodeMap map = calloc(1, sizeof(_VFInodeMap));
+    if (map) {
+        for (size_t i = 0; i < kVFInodeMapStripes; i++) {
+            pthread_mutex_init(&map->stripes[i].lock, NULL);
+            pthread_cond_init(&map->stripes[i].resolved, NULL);
+        }
+    }
+    return map;
+}
+
+static void VFInodeMapRelease(VFInodeMap map) {
+    if (map) {
+        for (size_t i = 0; i < kVFInodeMapStripes; i++) {
+            _VFInodeStripe *stripe = &map->stripes[i];
+            for (size_t j = 0; j < stripe->capacity; j++) {
+                VFInodeEntry entry = stripe->buckets[j];
+                while (entry) {
+                    VFInodeEntry next = entry->next;
+                    free(entry->path);
+                    free(entry);
+                    entry = next;
+                }
+            }
+            free(stripe->buckets);
+            pthread_mutex_destroy(&stripe->lock);
+            pthread_cond_destroy(&stripe->resolved);
+        }
+        free(map);
+    }
+}
+
+static uint64_t VFInodeHash(dev_t device, ino_t inode) {
+    uint64_t hash = ((uint64_t)inode * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)device * 0xC2B2AE3D27D4EB4FULL);
+    return hash ^ (hash >> 29);
+}
+
+static void VFInodeStripeGrow(_VFInodeStripe *stripe) {
+    size_t capacity       = (stripe->capacity > 0) ? stripe->capacity * 2 : 64;
+    VFInodeEntry *buckets = calloc(capacity, sizeof(VFInodeEntry));
+    if (!buckets) {
+        return;
+    }
+    
+    for (size_t i = 0; i < stripe->capacity; i++) {
+        VFInodeEntry entry = stripe->buckets[i];
+        while (entry) {
+            VFInodeEntry next = entry->next;
+            size_t index      = (VFInodeHash(entry->device, entry->inode) / kVFInodeMapStripes) % capacity;
+            entry->next       = buckets[index];
+            buckets[index]    = entry;
+            entry             = next;
+        }
+    }
+    
+    free(stripe->buckets);
+    stripe->buckets  = buckets;
+    stripe->capacity = capacity;
+}
+
+/*
+ * Returns NULL if the caller is the first to see the inode and must copy
+ * it, after which it has to call VFInodeMapResolve(). Everyone else waits
+ * for that copy to finish and gets its entry back.
+ */
+static VFInodeEntry VFInodeMapClaim(VFInodeMap map, const struct stat *from_stat, const char *to) {
+    uint64_t hash          = VFInodeHash(from_stat->st_dev, from_stat->st_ino);
+    _VFInodeStripe *stripe = &map->stripes[hash % kVFInodeMapStripes];
+    VFInodeEntry entry     = NULL;
+    
+    pthread_mutex_lock(&stripe->lock);
+    
+    if (stripe->capacity > 0) {
+        entry = stripe->buckets[(hash / kVFInodeMapStripes) % stripe->capacity];
+        while (entry && (entry->device != from_stat->st_dev || entry->inode != from_stat->st_ino)) {
+            entry = entry->next;
+        }
+    }
+    
+    if (entry) {
+        while (entry->state == VFInodeStatePending) {
+            pthread_cond_wait(&stripe->resolved, &stripe->lock);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+        return entry;
+    }
+    
+    if (stripe->count >= stripe->capacity) {
+        VFInodeStripeGrow(stripe);
+    }
+    
+    VFInodeEntry claimed = malloc(sizeof(_VFInodeEntry));
+    if (claimed && stripe->capacity > 0) {
+        size_t index            = (hash / kVFInodeMapStripes) % stripe->capacity;
+        claimed->device         = from_stat->st_dev;
+        claimed->inode          = from_stat->st_ino;
+        claimed->path           = strdup(to);
+        claimed->state          = VFInodeStatePending;
+        claimed->next           = stripe->buckets[index];
+        stripe->buckets[index]  = claimed;
+        stripe->count++;
+    } else {
+        free(claimed);
+    }
+    
+    pthread_mutex_unlock(&stripe->lock);
+    return NULL;
+}
+
+static void VFInodeMapResolve(VFInodeMap map, const struct stat *from_stat, BOOL success) {
+    uint64_t hash          = VFInodeHash(from_stat->st_dev, from_stat->st_ino);
+    _VFInodeStripe *stripe = &map->stripes[hash % kVFInodeMapStripes];
+    
+    pthread_mutex_lock(&stripe->lock);
+    
+    VFInodeEntry entry = NULL;
+    if (stripe->capacity > 0) {
+        entry = stripe->buckets[(hash / kVFInodeMapStripes) % stripe->capacity];
+        while (entry && (entry->device != from_stat->st_dev || entry->inode != from_stat->st_ino)) {
+            entry = entry->next;
+        }
+    }
+    if (entry) {
+        entry->state = (success) ? VFInodeStateReady : VFInodeStateFailed;
+        pthread_cond_broadcast(&stripe->resolved);
+    }
+    
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+static void VFTreeCopyContextAdvance(VFTreeCopyContext context, const char *path, uint64_t bytes) {
+    uint64_t bytes_done = __sync_add_and_fetch(&context->bytes_done, bytes);
+    if (context->block) {
+        context->block(path, bytes_done, context->bytes_total);
+    }
+}
+
+static void VFTreeCopyContextFail(VFTreeCopyContext context) {
+    __sync_fetch_and_add(&context->errors, 1);
+}
+
+#if defined(__APPLE__)
+typedef struct __VFCopyProgress {
+    VFTreeCopyContext context;
+    const char       *path;
+    off_t             bytes_reported;
+} _VFCopyProgress;
+
+static int VFCopyProgressCallback(int what, int stage, copyfile_state_t state, const char *from, const char *to, void *info) {
+    if (what == COPYFILE_COPY_DATA && stage == COPYFILE_PROGRESS) {
+        _VFCopyProgress *progress = info;
+        off_t bytes_copied        = 0;
+        copyfile_state_get(state, COPYFILE_STATE_COPIED, &bytes_copied);
+        if (bytes_copied > progress->bytes_reported) {
+            VFTreeCopyContextAdvance(progress->context, progress->path, bytes_copied - progress->bytes_reported);
+            progress->bytes_reported = bytes_copied;
+        }
+    }
+    return COPYFILE_CONTINUE;
+}
+#endif
+
+static BOOL VFFileCopyBufferedBytes(int from_file, int to_file, const char *path, VFTreeCopyContext context) {
+    struct stat from_stat;
+    size_t buffer_size = (fstat(from_file, &from_stat) == 0) ? VFFileGetBufferSize(&from_stat) : VFGovernorGetBufferSize(0);
+    uint8_t *buffer    = malloc(buffer_size);
+    if (!buffer) {
+        return NO;
+    }
+    
+    BOOL success       = YES;
+    ssize_t bytes_read = 0;
+    while (success && (bytes_read = read(from_file, buffer, buffer_size)) > 0) {
+        
+        ssize_t offset = 0;
+        while (offset < bytes_read) {
+            ssize_t bytes_written = write(to_file, buffer + offset, bytes_read - offset);
+            if (bytes_written == -1) {
+                if (errno == EINTR) continue;
+                success = NO;
+                break;
+            }
+            offset += bytes_written;
+        }
+        
+        if (success) {
+            VFTreeCopyContextAdvance(context, path, bytes_read);
+        }
+    }
+    
+    free(buffer);
+    return (success && bytes_read == 0);
+}
+
+/*
+ * Copies file contents with the fastest path the kernel offers:
+ * fcopyfile() on Darwin (which clones where the file system allows it),
+ * copy_file_range() and then sendfile() on Linux. Anything those refuse
+ * falls through to a plain buffered read / write loop from the current
+ * file offsets.
+ */
+static BOOL VFFileCopyBytes(int from_file, int to_file, const char *path, VFTreeCopyContext context) {
+#if defined(__APPLE__)
+    _VFCopyProgress progress = { context, path, 0 };
+    copyfile_state_t state   = copyfile_state_alloc();
+    copyfile_state_set(state, COPYFILE_STATE_STATUS_CB, &VFCopyProgressCallback);
+    copyfile_state_set(state, COPYFILE_STATE_STATUS_CTX, &progress);
+    
+    int status = fcopyfile(from_file, to_file, state, COPYFILE_DATA);
+    copyfile_state_free(state);
+    
+    if (status == 0) {
+        struct stat to_stat;
+        if (fstat(to_file, &to_stat) == 0 && to_stat.st_size > progress.bytes_reported) {
+            VFTreeCopyContextAdvance(context, path, to_stat.st_size - progress.bytes_reported);
+        }
+        return YES;
+    }
+    
+#elif defined(__linux__)
+    ssize_t bytes_copied = 0;
+    
+    while ((bytes_copied = copy_file_range(from_file, NULL, to_file, NULL, kVFCopyChunkSize, 0)) != 0) {
+        if (bytes_copied > 0) {
+            VFTreeCopyContextAdvance(context, path, bytes_copied);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    if (bytes_copied == 0) {
+        return YES;
+    }
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+        return NO;
+    }
+    
+    while ((bytes_copied = sendfile(to_file, from_file, NULL, kVFCopyChunkSize)) != 0) {
+        if (bytes_copied > 0) {
+            VFTreeCopyContextAdvance(context, path, bytes_copied);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    if (bytes_copied == 0) {
+        return YES;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+        return NO;
+    }
+#endif
+    
+    return VFFileCopyBufferedBytes(from_file, to_file, path, context);
+}
+
+static void VFFileCopyExtendedAttributes(int from_file, int to_file) {
+    ssize_t list_size = VFListAttributes(from_file, NULL, 0);
+    if (list_size <= 0) {
+        return;
+    }
+    
+    char *names = malloc(list_size);
+    if (names) {
+        list_size = VFListAttributes(from_file, names, list_size);
+        
+        for (char *name = names; list_size > 0 && name < names + list_size; name += strlen(name) + 1) {
+            ssize_t size = VFGetAttribute(from_file, name, NULL, 0);
+            if (size < 0) {
+                continue;
+            }
+            
+            void *value = malloc(size > 0 ? size : 1);
+            if (value) {
+                size = VFGetAttribute(from_file, name, value, size);
+                if (size >= 0) {
+                    VFSetAttribute(to_file, name, value, size);
+                }
+                free(value);
+            }
+        }
+        free(names);
+    }
+}
+
+/*
+ * Ownership is best effort, it requires privileges we usually don't have.
+ * The mode is applied after the owner since chown() may clear set-id bits
+ * and the times are applied last since everything else updates them.
+ */
+static void VFFileCopyAttributes(int from_file, int to_file, const struct stat *from_stat) {
+    VFFileCopyExtendedAttributes(from_file, to_file);
+    
+    fchown(to_file, from_stat->st_uid, from_stat->st_gid);
+    fchmod(to_file, from_stat->st_mode & 07777);
+    
+#if defined(__APPLE__)
+    struct timeval times[2];
+    TIMESPEC_TO_TIMEVAL(&times[0], &from_stat->st_atimespec);
+    TIMESPEC_TO_TIMEVAL(&times[1], &from_stat->st_mtimespec);
+    futimes(to_file, times);
+#else
+    struct timespec times[2] = { from_stat->st_atimespec, from_stat->st_mtimespec };
+    futimens(to_file, times);
+#endif
+}
+
+static void VFSymlinkCopyAttributes(const char *to, const struct stat *from_stat) {
+    lchown(to, from_stat->st_uid, from_stat->st_gid);
+    
+#if defined(__APPLE__)
+    struct timeval times[2];
+    TIMESPEC_TO_TIMEVAL(&times[0], &from_stat->st_atimespec);
+    TIMESPEC_TO_TIMEVAL(&times[1], &from_stat->st_mtimespec);
+    lutimes(to, times);
+#else
+    struct timespec times[2] = { from_stat->st_atimespec, from_stat->st_mtimespec };
+    utimensat(AT_FDCWD, to, times, AT_SYMLINK_NOFOLLOW);
+#endif
+}
+
+static void VFSyncParentDirectory(const char *path) {
+    char *stack     = strdup(path);
+    int   directory = open(dirname(stack), O_RDONLY | O_DIRECTORY);
+    if (directory != -1) {
+        fsync(directory);
+        close(directory);
+    }
+    free(stack);
+}
+
+static BOOL VFFileTransfer(const char *from, const char *to, const struct stat *from_stat, VFTreeCopyContext context) {
+    BOOL success  = NO;
+    int from_file = open(from, O_RDONLY);
+    if (from_file != -1) {
+        
+        // The final mode is applied once the contents are in place
+        int to_file = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (to_file != -1) {
+            
+            success = VFFileCopyBytes(from_file, to_file, to, context);
+            if (success) {
+                VFFileCopyAttributes(from_file, to_file, from_stat);
+                if (context->sync) {
+                    success = (fsync(to_file) == 0);
+                }
+            }
+            
+            close(to_file);
+            if (!success) {
+                unlink(to);
+            }
+        }
+        close(from_file);
+    }
+    return success;
+}
+
+static BOOL VFSymlinkTransfer(const char *from, const char *to, const struct stat *from_stat) {
+    size_t size   = (from_stat->st_size > 0) ? from_stat->st_size + 1 : PATH_MAX;
+    char *target  = malloc(size);
+    BOOL success  = NO;
+    if (target) {
+        ssize_t length = readlink(from, target, size - 1);
+        if (length != -1) {
+            target[length] = '\0';
+            success        = (symlink(target, to) == 0);
+            if (success) {
+                VFSymlinkCopyAttributes(to, from_stat);
+            }
+        }
+        free(target);
+    }
+    return success;
+}
+
+static char ** VFDirectoryCopyNames(const char *path, size_t *count) {
+    *count = 0;
+    
+    DIR *directory = opendir(path);
+    if (!directory) {
+        return NULL;
+    }
+    
+    size_t capacity = 16;
+    char **names    = malloc(sizeof(char *) * capacity);
+    for (struct dirent *entry = NULL; names && (entry = readdir(directory)) != NULL;) {
+        if (VFIsFile(entry->d_name)) {
+            if (*count == capacity) {
+                capacity *= 2;
+                names     = realloc(names, sizeof(char *) * capacity);
+                if (!names) break;
+            }
+            names[(*count)++] = strdup(entry->d_name);
+        }
+    }
+    closedir(directory);
+    
+    return names;
+}
+
+static void VFDirectoryReleaseNames(char **names, size_t count) {
+    if (names) {
+        for (size_t i = 0; i < count; i++) {
+            free(names[i]);
+        }
+        free(names);
+    }
+}
+
+static uint64_t VFTreeSize(const char *path) {
+    struct stat file;
+    if (lstat(path, &file) == -1) {
+        return 0;
+    }
+    
+    if (!S_ISDIR(file.st_mode)) {
+        return S_ISREG(file.st_mode) ? file.st_size : 0;
+    }
+    
+    uint64_t size         = 0;
+    size_t count          = 0;
+    char **names          = VFDirectoryCopyNames(path, &count);
+    char *directory_path  = VFCreateDirectoryPath(path);
+    for (size_t i = 0; i < count; i++) {
+        char *entry_path = VFJoin(directory_path, names[i]);
+        size            += VFTreeSize(entry_path);
+        free(entry_path);
+    }
+    free(directory_path);
+    VFDirectoryReleaseNames(names, count);
+    
+    return size;
+}
+
+static BOOL VFTreeDeleteAppendName(char ***names, size_t *count, size_t *capacity, const char *name) {
+    if (*count == *capacity) {
+        size_t grown_capacity = (*capacity > 0) ? *capacity * 2 : 16;
+        char **grown          = realloc(*names, sizeof(char *) * grown_capacity);
+        if (!grown) {
+            return NO;
+        }
+        *names    = grown;
+        *capacity = grown_capacity;
+    }
+    
+    char *copy = strdup(name);
+    if (!copy) {
+        return NO;
+    }
+    (*names)[(*count)++] = copy;
+    return YES;
+}
+
+static BOOL VFTreeDeleteAt(int parent, const char *name) {
+    int directory = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (directory == -1) {
+        return NO;
+    }
+    
+    DIR *stream = fdopendir(directory);
+    if (!stream) {
+        close(directory);
+        return NO;
+    }
+    
+    // The listing is read in full before anything is unlinked,
+    // removing entries mid-readdir can make it skip others. Files
+    // go first, subdirectories are then removed in parallel
+    __block BOOL success = YES;
+    size_t count         = 0;
+    size_t capacity      = 0;
+    char **names         = NULL;
+    size_t file_count    = 0;
+    size_t file_capacity = 0;
+    char **file_names    = NULL;
+    
+    for (struct dirent *entry = NULL; (entry = readdir(stream)) != NULL;) {
+        if (!VFIsFile(entry->d_name)) {
+            continue;
+        }
+        
+        BOOL is_directory = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat file;
+            is_directory = (fstatat(directory, entry->d_name, &file, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(file.st_mode));
+        }
+        
+        BOOL is_added = (is_directory) ?
+            VFTreeDeleteAppendName(&names, &count, &capacity, entry->d_name) :
+            VFTreeDeleteAppendName(&file_names, &file_count, &file_capacity, entry->d_name);
+        if (!is_added) {
+            success = NO;
+            break;
+        }
+    }
+    
+    for (size_t i = 0; i < file_count; i++) {
+        if (unlinkat(directory, file_names[i], 0) == -1) {
+            success = NO;
+        }
+    }
+    VFDirectoryReleaseNames(file_names, file_count);
+    
+    if (count == 1) {
+        success = VFTreeDeleteAt(directory, names[0]) && success;
+        
+    } else if (count > 1) {
+        dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+            if (!VFTreeDeleteAt(directory, names[i])) {
+                success = NO;
+            }
+        });
+    }
+    
+    VFDirectoryReleaseNames(names, count);
+    closedir(stream);
+    
+    return (unlinkat(parent, name, AT_REMOVEDIR) == 0) && success;
+}
+
+static BOOL VFTreeDelete(const char *path) {
+    struct stat file;
+    if (lstat(path, &file) == -1) {
+        return NO;
+    }
+    
+    if (!S_ISDIR(file.st_mode)) {
+        return (unlink(path) == 0);
+    }
+    
+    char *parent_stack = strdup(path);
+    char *name_stack   = strdup(path);
+    BOOL success       = NO;
+    
+    int parent = open(dirname(parent_stack), O_RDONLY | O_DIRECTORY);
+    if (parent != -1) {
+        success = VFTreeDeleteAt(parent, basename(name_stack));
+        close(parent);
+    }
+    
+    free(parent_stack);
+    free(name_stack);
+    return success;
+}
+
+/*
+ * Renames the path into a ".vftrash" directory that shares its parent
+ * and therefore its file system. Returns the new location or NULL when
+ * the rename isn't possible (mount points, permissions).
+ */
+static char * VFTreeMoveToTrash(const char *path) {
+    static uint32_t counter = 0;
+    
+    char *parent_stack = strdup(path);
+    char *name_stack   = strdup(path);
+    char *trash        = NULL;
+    char *trash_path   = NULL;
+    
+    asprintf(&trash, "%s/.vftrash", dirname(parent_stack));
+    if (trash && (mkdir(trash, 0700) == 0 || errno == EEXIST)) {
+        asprintf(&trash_path, "%s/%s.%d.%u", trash, basename(name_stack), getpid(), __sync_add_and_fetch(&counter, 1));
+        if (trash_path && rename(path, trash_path) == -1) {
+            free(trash_path);
+            trash_path = NULL;
+        }
+    }
+    
+    free(trash);
+    free(parent_stack);
+    free(name_stack);
+    return trash_path;
+}
+
+static void VFTreeCopyEntry(const char *from, const char *to, VFTreeCopyContext context);
+
+/*
+ * The data copy holds a governor worker, waiting on another name of the
+ * same inode happens outside of it so that a single worker can't deadlock.
+ */
+static BOOL VFTreeCopyTransfer(const char *from, const char *to, const struct stat *from_stat, VFTreeCopyContext context) {
+    VFGovernorBeginWork();
+    BOOL success = VFFileTransfer(from, to, from_stat, context);
+    VFGovernorEndWork();
+    return success;
+}
+
+/*
+ * Sources with more than one link are looked up in the inode map, every
+ * name after the first becomes a link() to the first copy instead of a
+ * second copy of the data.
+ */
+static BOOL VFTreeCopyFile(const char *from, const char *to, const struct stat *from_stat, VFTreeCopyContext context) {
+    if (context->inodes && from_stat->st_nlink > 1) {
+        
+        VFInodeEntry entry = VFInodeMapClaim(context->inodes, from_stat, to);
+        if (!entry) {
+            BOOL success = VFTreeCopyTransfer(from, to, from_stat, context);
+            VFInodeMapResolve(context->inodes, from_stat, success);
+            if (success) {
+                __sync_fetch_and_add(&context->files_copied, 1);
+            }
+            return success;
+        }
+        
+        if (entry->state == VFInodeStateReady && link(entry->path, to) == 0) {
+            __sync_fetch_and_add(&context->links_created, 1);
+            __sync_fetch_and_add(&context->bytes_saved, (uint64_t)from_stat->st_size);
+            VFTreeCopyContextAdvance(context, to, from_stat->st_size);
+            return YES;
+        }
+    }
+    
+    BOOL success = VFTreeCopyTransfer(from, to, from_stat, context);
+    if (success) {
+        __sync_fetch_and_add(&context->files_copied, 1);
+    }
+    return success;
+}
+
+/*
+ * Creates the destination directory and copies its entries in parallel,
+ * returns NO only if the destination directory itself couldn't be made.
+ * Attributes are applied after the entries so that neither the mode nor
+ * the times get disturbed by the copy.
+ */
+static BOOL VFTreeCopyDirectory(const char *from, const char *to, const struct stat *from_stat, VFTreeCopyContext context) {
+    if (mkdir(to, 0700) == -1) {
+        VFTreeCopyContextFail(context);
+        return NO;
+    }
+    
+    size_t count          = 0;
+    char **names          = VFDirectoryCopyNames(from, &count);
+    char *from_directory  = VFCreateDirectoryPath(from);
+    char *to_directory    = VFCreateDirectoryPath(to);
+    if (!names) {
+        VFTreeCopyContextFail(context);
+    }
+    
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        char *from_path = VFJoin(from_directory, names[i]);
+        char *to_path   = VFJoin(to_directory, names[i]);
+        VFTreeCopyEntry(from_path, to_path, context);
+        free(from_path);
+        free(to_path);
+    });
+    
+    free(from_directory);
+    free(to_directory);
+    VFDirectoryReleaseNames(names, count);
+    
+    int from_file = open(from, O_RDONLY | O_DIRECTORY);
+    int to_file   = open(to, O_RDONLY | O_DIRECTORY);
+    if (from_file != -1 && to_file != -1) {
+        VFFileCopyAttributes(from_file, to_file, from_stat);
+        if (context->sync && fsync(to_file) == -1) {
+            VFTreeCopyContextFail(context);
+        }
+    } else {
+        VFTreeCopyContextFail(context);
+    }
+    if (from_file != -1) close(from_file);
+    if (to_file != -1)   close(to_file);
+    
+    return YES;
+}
+
+static void VFTreeCopyEntry(const char *from, const char *to, VFTreeCopyContext context) {
+    struct stat from_stat;
+    if (lstat(from, &from_stat) == -1) {
+        VFTreeCopyContextFail(context);
+        return;
+    }
+    
+    BOOL success = YES;
+    if (S_ISDIR(from_stat.st_mode)) {
+        VFTreeCopyDirectory(from, to, &from_stat, context);
+        
+    } else if (S_ISREG(from_stat.st_mode)) {
+        success = VFTreeCopyFile(from, to, &from_stat, context);
+        
+    } else if (S_ISLNK(from_stat.st_mode)) {
+        success = VFSymlinkTransfer(from, to, &from_stat);
+        
+    } else if (S_ISFIFO(from_stat.st_mode)) {
+        success = (mkfifo(to, from_stat.st_mode & 07777) == 0);
+        
+    } else {
+        success = (mknod(to, from_stat.st_mode, from_stat.st_rdev) == 0);
+    }
+    
+    if (!success) {
+        VFTreeCopyContextFail(context);
+    }
+}
+
+static BOOL VFMoveFileAcrossDevices(const char *from, const char *to, VFFileProgressBlock block, char **error) {
+    struct stat from_stat;
+    if (lstat(from, &from_stat) == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    
+    _VFTreeCopyContext context = {
+        .block       = block,
+        .inodes      = VFInodeMapCreate(),
+        .sync        = YES,
+        .bytes_total = VFTreeSize(from),
+    };
+    
+    if (S_ISDIR(from_stat.st_mode)) {
+        if (VFTreeCopyDirectory(from, to, &from_stat, &context) && context.errors > 0) {
+            VFTreeDelete(to);
+        }
+        
+    } else {
+        
+        // Files are copied next to the destination and renamed into place
+        // so that an existing destination survives a failed copy
+        char *temporary_path = NULL;
+        asprintf(&temporary_path, "%s.vfmove-%d", to, getpid());
+        if (temporary_path) {
+            VFTreeCopyEntry(from, temporary_path, &context);
+            if (context.errors == 0 && rename(temporary_path, to) == -1) {
+                VFTreeCopyContextFail(&context);
+            }
+            if (context.errors > 0) {
+                unlink(temporary_path);
+            }
+            free(temporary_path);
+        } else {
+            VFTreeCopyContextFail(&context);
+        }
+    }
+    
+    VFInodeMapRelease(context.inodes);
+    
+    if (context.errors > 0) {
+        if (error) {
+            *error = "Could not copy source to the destination file system";
+        }
+        return NO;
+    }
+    
+    // Destination is synced, only now is it safe to remove the source
+    VFSyncParentDirectory(to);
+    if (!VFTreeDelete(from)) {
+        if (error) {
+            *error = "Copied to destination but could not remove the source";
+        }
+        return NO;
+    }
+    return YES;
+}
+
 #pragma mark - Path Operations -
 char * VFPathCopyLastComponent(const char *path) {
     char *reference;
@@ -207,20 +1067,29 @@ VFFileInfo VFFileInfoCreate(const char *path, char **error) {
     }
     
     struct stat file = VFFileStat(path, error);
-    VFFileInfo info  = malloc(sizeof(_VFFileInfo));
+    return VFFileInfoCreateWithStat(path, &file);
+}
+
+VFFileInfo VFFileInfoCreateWithStat(const char *path, const struct stat *file) {
+    if (!path || !file) {
+        return NULL;
+    }
+    
+    VFFileInfo info = malloc(sizeof(_VFFileInfo));
     if (info) {
-        info->time_accessed       = file.st_atimespec.tv_sec;
-        info->time_modified       = file.st_mtimespec.tv_sec;
-        info->time_status_changed = file.st_ctimespec.tv_sec;
-        info->mode                = file.st_mode;
-        info->user_id             = file.st_uid;
-        info->group_id            = file.st_gid;
-        info->file_serial         = file.st_ino;
-        info->device_id           = file.st_dev;
-        info->size                = file.st_size;
+        info->time_accessed       = file->st_atimespec.tv_sec;
+        info->time_modified       = file->st_mtimespec.tv_sec;
+        info->time_status_changed = file->st_ctimespec.tv_sec;
+        info->mode                = file->st_mode;
+        info->user_id             = file->st_uid;
+        info->group_id            = file->st_gid;
+        info->file_serial         = file->st_ino;
+        info->device_id           = file->st_dev;
+        info->size                = file->st_size;
         info->path                = strdup(path);
         info->type                = VFFileInfoGetType(info);
-        info->permissions         = VFGetPermissions(file.st_mode);
+        info->content_type        = VFContentTypeUnknown;
+        info->permissions         = VFGetPermissions(file->st_mode);
         
         return info;
     }
@@ -242,6 +1111,7 @@ VFFileInfo VFFileInfoCopy(VFFileInfo info) {
             new_info->size                = info->size;
             new_info->path                = strdup(info->path);
             new_info->type                = info->type;
+            new_info->content_type        = info->content_type;
             new_info->permissions         = strdup(info->permissions);
 
             return new_info;
@@ -319,18 +1189,25 @@ VFSystemInfo VFSystemInfoCreate(const char *path, char **error) {
         return NO;
     }
     
-    struct statvfs system_stat = VFSystemStat(path, error);
-    VFSystemInfo info          = malloc(sizeof(_VFSystemInfo));
+    struct statvfs system_stat;
+    if (statvfs(path, &system_stat) != 0) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NULL;
+    }
+    
+    VFSystemInfo info = malloc(sizeof(_VFSystemInfo));
     if (info) {
         info->system_id        = system_stat.f_fsid;
         info->max_file_length  = system_stat.f_namemax;
         info->block_size       = system_stat.f_frsize;
-        info->blocks_count     = system_stat.f_blocks;
-        info->blocks_available = system_stat.f_bavail;
-        info->blocks_free      = system_stat.f_bfree;
-        info->files_count      = system_stat.f_files;
-        info->files_available  = system_stat.f_favail;
-        info->files_free       = system_stat.f_ffree;
+        info->blocks_count     = (uint64_t)system_stat.f_blocks;
+        info->blocks_available = (uint64_t)system_stat.f_bavail;
+        info->blocks_free      = (uint64_t)system_stat.f_bfree;
+        info->files_count      = (uint64_t)system_stat.f_files;
+        info->files_available  = (uint64_t)system_stat.f_favail;
+        info->files_free       = (uint64_t)system_stat.f_ffree;
         
         return info;
     }
@@ -343,7 +1220,7 @@ void VFSystemInfoRelease(VFSystemInfo info) {
     }
 }
 
-#pragma mark - VFSystemDescription -
+#pragma mark - VFDiskDescription -
 VFDiskDescription VFDiskDescriptionCreate(const char *path, char **error) {
     if (!path) {
         if (error) {
@@ -352,8 +1229,15 @@ VFDiskDescription VFDiskDescriptionCreate(const char *path, char **error) {
         return NO;
     }
     
-    struct statvfs system_stat = VFSystemStat(path, error);
-    VFDiskDescription info     = malloc(sizeof(_VFDiskDescription));
+    struct statvfs system_stat;
+    if (statvfs(path, &system_stat) != 0) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NULL;
+    }
+    
+    VFDiskDescription info = malloc(sizeof(_VFDiskDescription));
     if (info) {
         info->system_id        = system_stat.f_fsid;
         info->max_file_length  = system_stat.f_namemax;
@@ -366,8 +1250,10 @@ VFDiskDescription VFDiskDescriptionCreate(const char *path, char **error) {
     return NULL;
 }
 
-void VFSystemDescriptionRelease(VFSystemInfo info) {
-    
+void VFDiskDescriptionRelease(VFDiskDescription info) {
+    if (info) {
+        free(info);
+    }
 }
 
 #pragma mark - File Operations -
@@ -431,7 +1317,66 @@ BOOL VFFileDelete(const char *path, char **error) {
     return (status == 0);
 }
 
+BOOL VFFileDeleteRecursive(const char *path, VFFileDeleteOption options, VFFileDeleteCompletionBlock completion, char **error) {
+    if (!path) {
+        if (error) {
+            *error = "Invalid path specified";
+        }
+        return NO;
+    }
+    
+    struct stat file;
+    if (lstat(path, &file) == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    
+    char *delete_path = NULL;
+    if (options & VFFileDeleteOptionTrash) {
+        delete_path = VFTreeMoveToTrash(path);
+    }
+    
+    // Falls back to deleting in place if the trash rename didn't work
+    BOOL is_trashed = (delete_path != NULL);
+    if (!is_trashed) {
+        delete_path = strdup(path);
+    }
+    
+    if (is_trashed || (options & VFFileDeleteOptionAsync)) {
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+            BOOL success = VFTreeDelete(delete_path);
+            if (is_trashed) {
+                char *trash = strdup(delete_path);
+                rmdir(dirname(trash)); // Only succeeds once the trash is empty
+                free(trash);
+            }
+            if (completion) {
+                completion(success, success ? NULL : "Could not delete every entry");
+            }
+            free(delete_path);
+        });
+        return YES;
+    }
+    
+    BOOL success = VFTreeDelete(delete_path);
+    free(delete_path);
+    
+    if (!success && error) {
+        *error = "Could not delete every entry";
+    }
+    if (completion) {
+        completion(success, success ? NULL : "Could not delete every entry");
+    }
+    return success;
+}
+
 BOOL VFMoveFile(const char *from, const char *to, char **error) {
+    return VFMoveFileProgress(from, to, NULL, error);
+}
+
+BOOL VFMoveFileProgress(const char *from, const char *to, VFFileProgressBlock block, char **error) {
     if (!from || !to || strcmp(from, to) == 0) {
         if (error) {
             *error = "Invalid origin or destination path";
@@ -440,6 +1385,10 @@ BOOL VFMoveFile(const char *from, const char *to, char **error) {
     }
     
     int status = rename(from, to);
+    if (status == -1 && errno == EXDEV) {
+        return VFMoveFileAcrossDevices(from, to, block, error);
+    }
+    
     if (status == -1 && error) {
         *error = strerror(errno);
     }
@@ -447,6 +1396,10 @@ BOOL VFMoveFile(const char *from, const char *to, char **error) {
 }
 
 BOOL VFCopyFile(const char *from, const char *to, char **error) {
+    return VFCopyFileStatistics(from, to, NULL, error);
+}
+
+BOOL VFCopyFileStatistics(const char *from, const char *to, VFCopyStatistics statistics, char **error) {
     
     BOOL success = NO;
     
@@ -458,34 +1411,44 @@ BOOL VFCopyFile(const char *from, const char *to, char **error) {
         return success;
     }
     
+    if (statistics) {
+        memset(statistics, 0, sizeof(_VFCopyStatistics));
+    }
+    
     // Check file type
     struct stat from_stat = VFFileStat(from, NULL);
     if (S_ISDIR(from_stat.st_mode)) {
         
-        if (VFCreateDirectory(to, error)) {
-            __block int errors = 0;
-            VFEnumerateDirectory(from, VFFileEnumerationOptionHidden, ^(void *info, char *error) {
-                if (info) {
-                    
-                    char *file_name   = VFPathCopyLastComponent(info);
-                    char *destination = VFCreateDirectoryPath(to);
-                    char *new_path    = VFJoin(destination, file_name);
-                    if (!VFCopyFile(info, new_path, NULL)) {
-                        errors++;
-                        return;
-                    }
-                    
-                    free(file_name);
-                    free(destination);
-                    free(new_path);
-                }
-            });
-            
-            success = (errors == 0);
+        _VFTreeCopyContext context = {
+            .inodes = VFInodeMapCreate(),
+        };
+        
+        if (!VFTreeCopyDirectory(from, to, &from_stat, &context)) {
+            if (error) {
+                *error = "Could not create destination directory";
+            }
+        } else if (context.errors > 0) {
+            if (error) {
+                *error = "Could not copy every entry";
+            }
+        } else {
+            success = YES;
         }
         
+        if (statistics) {
+            statistics->files_copied  = context.files_copied;
+            statistics->bytes_copied  = context.bytes_done - context.bytes_saved;
+            statistics->links_created = context.links_created;
+            statistics->bytes_saved   = context.bytes_saved;
+        }
+        VFInodeMapRelease(context.inodes);
+        
     } else {
         success = VFFileCopy(from, to, error);
+        if (success && statistics) {
+            statistics->files_copied = 1;
+            statistics->bytes_copied = from_stat.st_size;
+        }
     }
 
     return success;
@@ -501,33 +1464,93 @@ void VFEnumerateFileBuffer(const char *path, VFFileBytesEnumerationBlock block)
         return;
     }
     
-    // Setup buffer
-    size_t block_size = file_stat.st_blksize;
-    if (block_size < 1) {
-        block_size = 4096;
-    }
+    // Setup buffer, scaled by the governor and the device
+    size_t block_size = VFFileGetBufferSize(&file_stat);
     
     int from_file = open(path, O_RDONLY);
     if (from_file != -1) {
         
-        uint8_t buffer[block_size];
-        ssize_t bytes_read = 0;
+        uint8_t *buffer = malloc(block_size);
+        if (!buffer) {
+            block(NULL, -1, "Failed to allocate the read buffer");
+            close(from_file);
+            return;
+        }
         
-        while ((bytes_read = read(from_file, buffer, block_size)) > 0) {
-            
-            if (bytes_read > 0) {
-                uint8_t clean_buffer[bytes_read];
-                memcpy(clean_buffer, buffer, bytes_read);
-                block(buffer, bytes_read, NULL);
+        ssize_t bytes_read = 0;
+        while ((bytes_read = read(from_file, buffer, block_size)) != 0) {
+            if (bytes_read == -1) {
+                if (errno == EINTR) continue;
+                block(NULL, -1, strerror(errno));
+                break;
             }
+            block(buffer, bytes_read, NULL);
         }
         
+        free(buffer);
+        close(from_file);
+        
     } else {
         block(NULL, -1, strerror(errno));
     }
 }
 
 #pragma mark - Directory Enumeration -
+static void VFEnumerateDirectoryEntry(const char *clean_path, const char *name, unsigned char type, VFFileEnumerationOption options, VFDirectoryEnumerationBlock block) {
+    
+    BOOL is_deep    = (options & VFFileEnumerationOptionDeep);
+    BOOL is_content = (options & VFFileEnumerationOptionContentType);
+    BOOL is_detail  = (options & VFFileEnumerationOptionDetail) || is_content;
+    
+    char *file_path = VFJoin(clean_path, name);
+    
+    // File path option (default)
+    if (!is_detail) {
+        
+        block(file_path, NULL);
+        
+        // Deep option set
+        if (is_deep && S_ISDIR(DTTOIF(type))) {
+            VFEnumerateDirectory(file_path, options, block);
+        }
+        
+    // VFFileInfo struct (detail option)
+    } else {
+        
+        char *error     = NULL;
+        VFFileInfo info = NULL;
+        if (options & VFFileEnumerationOptionNoFollow) {
+            struct stat file;
+            if (lstat(file_path, &file) == 0) {
+                info = VFFileInfoCreateWithStat(file_path, &file);
+            } else {
+                error = strerror(errno);
+            }
+        } else {
+            info = VFFileInfoCreate(file_path, &error);
+        }
+        
+        // Content type option, one bounded read per regular file
+        if (is_content && info && info->type == VFFileTypeFile) {
+            info->content_type = VFContentTypeDetectFile(file_path, NULL);
+        }
+        
+        block(info, error);
+        
+        // Deep option set
+        if (is_deep && info) {
+            if (info->type == VFFileTypeDirectory) {
+                VFEnumerateDirectory(file_path, options, block);
+            }
+        }
+        
+        VFFileInfoRelease(info);
+        
+    }
+    
+    free(file_path);
+}
+
 void VFEnumerateDirectory(const char *path, VFFileEnumerationOption options, VFDirectoryEnumerationBlock block) {
     if (!path || !block) {
         return;
@@ -538,51 +1561,54 @@ void VFEnumerateDirectory(const char *path, VFFileEnumerationOption options, VFD
     DIR *directory = opendir(path);
     if (directory) {
         
-        BOOL is_deep   = (options & VFFileEnumerationOptionDeep);
-        BOOL is_detail = (options & VFFileEnumerationOptionDetail);
-        BOOL is_hidden = (options & VFFileEnumerationOptionHidden);
+        BOOL is_hidden     = (options & VFFileEnumerationOptionHidden);
+        BOOL is_concurrent = (options & VFFileEnumerationOptionConcurrent);
+        
+        // Concurrent option collects the entries first and then
+        // handles them (and their subdirectories) in parallel
+        size_t count         = 0;
+        size_t capacity      = 0;
+        char **names         = NULL;
+        unsigned char *types = NULL;
         
         for (struct dirent *entry = NULL; (entry = readdir(directory)) != NULL;) {
             
             if (VFIsFile(entry->d_name)) {
                 if (!VFIsHidden(entry->d_name) || is_hidden) {
-                    char *file_path = VFJoin(clean_path, entry->d_name);
                     
-                    // File path option (default)
-                    if (!is_detail) {
-                        
-                        block(file_path, NULL);
-                        
-                        // Deep option set
-                        if (is_deep && S_ISDIR(DTTOIF(entry->d_type))) {
-                            VFEnumerateDirectory(file_path, options, block);
-                        }
-                        
-                    // VFFileInfo struct (detail option)
-                    } else {
-                        
-                        char *error     = NULL;
-                        VFFileInfo info = VFFileInfoCreate(file_path, &error);
-                        block(info, error);
-                        
-                        // Deep option set
-                        if (is_deep) {
-                            if (info->type == VFFileTypeDirectory) {
-                                VFEnumerateDirectory(file_path, options, block);
-                            }
-                        }
-                        
-                        VFFileInfoRelease(info);
-                        
+                    if (!is_concurrent) {
+                        VFEnumerateDirectoryEntry(clean_path, entry->d_name, entry->d_type, options, block);
+                        continue;
                     }
                     
-                    free(file_path);
+                    if (count == capacity) {
+                        capacity               = (capacity > 0) ? capacity * 2 : 64;
+                        char **grown           = realloc(names, sizeof(char *) * capacity);
+                        unsigned char *regrown = (grown) ? realloc(types, sizeof(unsigned char) * capacity) : NULL;
+                        if (grown)   names = grown;
+                        if (regrown) types = regrown;
+                        if (!grown || !regrown) {
+                            break;
+                        }
+                    }
+                    names[count] = strdup(entry->d_name);
+                    types[count] = entry->d_type;
+                    count++;
                 }
             }
             
         }
         
         closedir(directory);
+        
+        if (count > 0) {
+            dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+                VFEnumerateDirectoryEntry(clean_path, names[i], types[i], options, block);
+            });
+        }
+        
+        VFDirectoryReleaseNames(names, count);
+        free(types);
     } else {
         block(NULL, strerror(errno));
     }
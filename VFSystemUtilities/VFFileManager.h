@@ -15,9 +15,11 @@
 #import <grp.h>
 #import <sys/stat.h>
 #import <sys/statvfs.h>
-#import <sys/dirent.h>
+#import <dirent.h>
 #import <stdbool.h>
 
+#import "VFContentType.h"
+
 #ifndef OBJC_BOOL_DEFINED
     typedef signed char BOOL;
     #define YES (BOOL)1
@@ -27,6 +29,8 @@
 // MARK: - Type Definitions - Blocks -
 typedef void (^VFDirectoryEnumerationBlock)(void *info, char *error);
 typedef void (^VFFileBytesEnumerationBlock)(uint8_t *bytes, ssize_t bytes_read, char *error);
+typedef void (^VFFileProgressBlock)(const char *path, uint64_t bytes_done, uint64_t bytes_total);
+typedef void (^VFFileDeleteCompletionBlock)(BOOL success, char *error);
 
 // MARK: - Type Definitions - Enums -
 typedef enum {
@@ -42,12 +46,21 @@ typedef enum {
 } VFFileType;
 
 typedef enum {
-    VFFileEnumerationOptionNone   = 0,
-    VFFileEnumerationOptionDeep   = 1 << 0,
-    VFFileEnumerationOptionHidden = 1 << 1,
-    VFFileEnumerationOptionDetail = 1 << 2,
+    VFFileEnumerationOptionNone        = 0,
+    VFFileEnumerationOptionDeep        = 1 << 0,
+    VFFileEnumerationOptionHidden      = 1 << 1,
+    VFFileEnumerationOptionDetail      = 1 << 2,
+    VFFileEnumerationOptionContentType = 1 << 3, // Implies Detail, fills content_type of regular files
+    VFFileEnumerationOptionConcurrent  = 1 << 4, // Entries of a directory are handled in parallel, the block must be thread safe
+    VFFileEnumerationOptionNoFollow    = 1 << 5, // Details come from lstat, symbolic links are reported as links and never descended
 } VFFileEnumerationOption;
 
+typedef enum {
+    VFFileDeleteOptionNone  = 0,
+    VFFileDeleteOptionAsync = 1 << 0,
+    VFFileDeleteOptionTrash = 1 << 1,
+} VFFileDeleteOption;
+
 /*
  * =============================
  *       Path Operations
@@ -89,18 +102,19 @@ char * VFPathCopyLastComponent(const char *path);
  */
 
 typedef struct __VFFileInfo {
-    long       time_accessed;
-    long       time_modified;
-    long       time_status_changed;
-    uint16_t   mode;
-    uint64_t   file_serial;
-    uint32_t   user_id;
-    uint32_t   group_id;
-    int32_t    device_id;
-    int64_t    size;
-    VFFileType type;
-    char      *permissions;
-    char      *path;
+    long          time_accessed;
+    long          time_modified;
+    long          time_status_changed;
+    uint16_t      mode;
+    uint64_t      file_serial;
+    uint32_t      user_id;
+    uint32_t      group_id;
+    int32_t       device_id;
+    int64_t       size;
+    VFFileType    type;
+    VFContentType content_type; // VFContentTypeUnknown unless detected
+    char         *permissions;
+    char         *path;
     
 } _VFFileInfo;
 typedef _VFFileInfo * VFFileInfo;
@@ -123,6 +137,7 @@ typedef _VFFileGroup * VFFileGroup;
 
 // MARK: - VFFileInfo Functions -
 VFFileInfo VFFileInfoCreate(const char *path, char **error);
+VFFileInfo VFFileInfoCreateWithStat(const char *path, const struct stat *file); // For callers that already did a (l)stat
 VFFileInfo VFFileInfoCopy(VFFileInfo info);
 
 VFFileUser VFFileInfoCopyUser(VFFileInfo info, char **error);
@@ -156,12 +171,12 @@ typedef struct __VFSystemInfo {
     uint64_t system_id;
     uint64_t max_file_length;
     uint64_t block_size;
-    uint32_t blocks_count;
-    uint32_t blocks_available;
-    uint32_t blocks_free;
-    uint32_t files_count;
-    uint32_t files_available;
-    uint32_t files_free;
+    uint64_t blocks_count;
+    uint64_t blocks_available;
+    uint64_t blocks_free;
+    uint64_t files_count;
+    uint64_t files_available;
+    uint64_t files_free;
 } _VFSystemInfo;
 typedef _VFSystemInfo * VFSystemInfo;
 
@@ -187,10 +202,25 @@ typedef struct __VFDiskDescription {
 } _VFDiskDescription;
 typedef _VFDiskDescription * VFDiskDescription;
 
-// MARK: - VFSystemInfo Functions -
+// MARK: - VFDiskDescription Functions -
 VFDiskDescription VFDiskDescriptionCreate(const char *path, char **error);
 void VFDiskDescriptionRelease(VFDiskDescription info);
 
+/*
+ * =============================
+ *   VFCopyStatistics & Related
+ * =============================
+ *
+ */
+// MARK: - VFCopyStatistics -
+typedef struct __VFCopyStatistics {
+    uint64_t files_copied;
+    uint64_t bytes_copied;
+    uint64_t links_created;
+    uint64_t bytes_saved;
+} _VFCopyStatistics;
+typedef _VFCopyStatistics * VFCopyStatistics;
+
 /*
  * =============================
  *     VFFileInfo & Related
@@ -204,9 +234,39 @@ BOOL VFFileIsDirectory(const char *path, char **error);
 BOOL VFCreateDirectoryPermissions(const char *path, mode_t permissions, char **error);
 BOOL VFCreateDirectory(const char *path, char **error);
 
+BOOL VFFileDelete(const char *path, char **error); // Single file or empty directory
+
+/*
+ * Deletes a file or an entire directory tree. Directories are walked
+ * relative to their file descriptors and subdirectories are removed in
+ * parallel. VFFileDeleteOptionTrash renames the tree into a hidden
+ * ".vftrash" directory next to it first, so the path disappears at once
+ * and the real deletion finishes in the background. VFFileDeleteOptionAsync
+ * deletes in place in the background. The completion block is invoked when
+ * the deletion is done, on a background thread for asynchronous deletes.
+ */
+BOOL VFFileDeleteRecursive(const char *path, VFFileDeleteOption options, VFFileDeleteCompletionBlock completion, char **error);
+
+/*
+ * Moves are a rename() when possible. When the source and destination
+ * live on different file systems (EXDEV) the move falls back to a copy
+ * that preserves mode, owner, timestamps and extended attributes, syncs
+ * the destination and only then removes the source. Directories are
+ * copied in parallel, so the progress block may be invoked concurrently
+ * from multiple threads.
+ */
 BOOL VFMoveFile(const char *from, const char *to, char **error);
+BOOL VFMoveFileProgress(const char *from, const char *to, VFFileProgressBlock block, char **error);
 BOOL VFCopyFile(const char *from, const char *to, char **error); // Recursive copy of files / directories
 
+/*
+ * Directory trees are copied in parallel and hardlinks are preserved:
+ * every additional name of a source inode is recreated with link()
+ * instead of copying its data again. bytes_saved is the data that the
+ * links avoided writing.
+ */
+BOOL VFCopyFileStatistics(const char *from, const char *to, VFCopyStatistics statistics, char **error);
+
 
 /*
  * =============================
@@ -0,0 +1,575 @@
+//
+//  VFFileQuery.c
+//
+//  Created by Dima Bart on 2014-08-18.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <ctype.h>
+#import <dispatch/dispatch.h>
+
+#import "VFFileQuery.h"
+
+typedef int64_t  VFInt64Vector  __attribute__((vector_size(32)));
+typedef uint32_t VFUInt32Vector __attribute__((vector_size(32)));
+
+static const uint64_t kVFFileTableBlockRows   = 64;
+static const uint64_t kVFFileTableChunkBlocks = 1024;
+
+typedef struct __VFFileQueryPlan {
+    BOOL     has_size;
+    BOOL     has_time;
+    BOOL     has_mode;
+    BOOL     has_user;
+    BOOL     has_extension;
+    int64_t  min_size;
+    int64_t  max_size;
+    int64_t  modified_after;
+    int64_t  modified_before;
+    uint32_t mode_mask;
+    uint32_t mode_value;
+    uint32_t user_id;
+    uint32_t extension;
+} _VFFileQueryPlan;
+typedef _VFFileQueryPlan * VFFileQueryPlan;
+
+#pragma mark - Private - Dictionary -
+static uint32_t VFFileTableHash(const char *string, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t VFFileTableDictionaryFind(VFFileTableDictionary dictionary, const char *string, size_t length, uint32_t *slot) {
+    if (dictionary->slot_capacity == 0) {
+        return UINT32_MAX;
+    }
+    
+    uint32_t position = VFFileTableHash(string, length) & (dictionary->slot_capacity - 1);
+    while (dictionary->slots[position] != 0) {
+        uint32_t identifier = dictionary->slots[position] - 1;
+        const char *name    = dictionary->names[identifier];
+        if (strncmp(name, string, length) == 0 && name[length] == '\0') {
+            return identifier;
+        }
+        position = (position + 1) & (dictionary->slot_capacity - 1);
+    }
+    if (slot) {
+        *slot = position;
+    }
+    return UINT32_MAX;
+}
+
+static uint32_t VFFileTableDictionaryIntern(VFFileTableDictionary dictionary, const char *string, size_t length) {
+    
+    /* ---------------------------------------
+     * Keep the slots at most half full, growing
+     * re-inserts every name by its id.
+     */
+    if ((dictionary->count + 1) * 2 > dictionary->slot_capacity) {
+        uint32_t capacity = (dictionary->slot_capacity > 0) ? dictionary->slot_capacity * 2 : 1024;
+        uint32_t *slots   = calloc(capacity, sizeof(uint32_t));
+        if (!slots) {
+            return UINT32_MAX;
+        }
+        for (uint32_t identifier = 0; identifier < dictionary->count; identifier++) {
+            const char *name  = dictionary->names[identifier];
+            uint32_t position = VFFileTableHash(name, strlen(name)) & (capacity - 1);
+            while (slots[position] != 0) {
+                position = (position + 1) & (capacity - 1);
+            }
+            slots[position] = identifier + 1;
+        }
+        free(dictionary->slots);
+        dictionary->slots         = slots;
+        dictionary->slot_capacity = capacity;
+    }
+    
+    uint32_t slot       = 0;
+    uint32_t identifier = VFFileTableDictionaryFind(dictionary, string, length, &slot);
+    if (identifier != UINT32_MAX) {
+        return identifier;
+    }
+    
+    if (dictionary->count == dictionary->capacity) {
+        uint32_t capacity = (dictionary->capacity > 0) ? dictionary->capacity * 2 : 256;
+        char **names      = realloc(dictionary->names, capacity * sizeof(char *));
+        if (!names) {
+            return UINT32_MAX;
+        }
+        dictionary->names    = names;
+        dictionary->capacity = capacity;
+    }
+    
+    char *name = malloc(length + 1);
+    if (!name) {
+        return UINT32_MAX;
+    }
+    memcpy(name, string, length);
+    name[length] = '\0';
+    
+    identifier                        = dictionary->count++;
+    dictionary->names[identifier]     = name;
+    dictionary->slots[slot]           = identifier + 1;
+    return identifier;
+}
+
+static void VFFileTableDictionaryRelease(VFFileTableDictionary dictionary) {
+    for (uint32_t i = 0; i < dictionary->count; i++) {
+        free(dictionary->names[i]);
+    }
+    free(dictionary->names);
+    free(dictionary->slots);
+}
+
+#pragma mark - Private - Columns -
+
+/*
+ * Capacity is always a whole number of blocks, so the kernels can read
+ * every block in full and mask off the rows past the end.
+ */
+static BOOL VFFileTableReserve(VFFileTable table, uint64_t count) {
+    if (count <= table->capacity) {
+        return YES;
+    }
+    
+    uint64_t capacity = (table->capacity > 0) ? table->capacity * 2 : 4096;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    
+    #define VFFileTableGrow(column) { \
+        void *grown = realloc(table->column, capacity * sizeof(*table->column)); \
+        if (!grown) return NO; \
+        table->column = grown; \
+    }
+    VFFileTableGrow(sizes);
+    VFFileTableGrow(times_modified);
+    VFFileTableGrow(modes);
+    VFFileTableGrow(user_ids);
+    VFFileTableGrow(extensions);
+    VFFileTableGrow(directories);
+    VFFileTableGrow(paths);
+    #undef VFFileTableGrow
+    
+    table->capacity = capacity;
+    return YES;
+}
+
+static BOOL VFFileTableAddString(VFFileTable table, const char *string, uint64_t *offset) {
+    size_t length = strlen(string) + 1;
+    if (table->strings_size + length > table->strings_capacity) {
+        uint64_t capacity = (table->strings_capacity > 0) ? table->strings_capacity * 2 : 65536;
+        while (capacity < table->strings_size + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(table->strings, capacity);
+        if (!grown) {
+            return NO;
+        }
+        table->strings          = grown;
+        table->strings_capacity = capacity;
+    }
+    
+    *offset = table->strings_size;
+    memcpy(table->strings + table->strings_size, string, length);
+    table->strings_size += length;
+    return YES;
+}
+
+#pragma mark - Private - Kernels -
+static inline uint64_t VFFileQueryMask64(VFInt64Vector lanes) {
+    return ((uint64_t)lanes[0] & 1) | ((uint64_t)lanes[1] & 2) | ((uint64_t)lanes[2] & 4) | ((uint64_t)lanes[3] & 8);
+}
+
+static inline uint64_t VFFileQueryMask32(VFUInt32Vector lanes) {
+    return (lanes[0] & 1)  | (lanes[1] & 2)  | (lanes[2] & 4)  | (lanes[3] & 8) |
+           (lanes[4] & 16) | (lanes[5] & 32) | (lanes[6] & 64) | (lanes[7] & 128);
+}
+
+// Rows where low <= value <= high
+static uint64_t VFFileQueryRange64(const int64_t *column, int64_t low, int64_t high) {
+    VFInt64Vector lows  = { low, low, low, low };
+    VFInt64Vector highs = { high, high, high, high };
+    uint64_t mask       = 0;
+    for (uint64_t i = 0; i < kVFFileTableBlockRows; i += 4) {
+        VFInt64Vector values;
+        memcpy(&values, column + i, sizeof(values));
+        mask |= VFFileQueryMask64((VFInt64Vector)((values >= lows) & (values <= highs))) << i;
+    }
+    return mask;
+}
+
+// Rows where (value & bits) == expected
+static uint64_t VFFileQueryMasked32(const uint32_t *column, uint32_t bits, uint32_t expected) {
+    VFUInt32Vector masks     = { bits, bits, bits, bits, bits, bits, bits, bits };
+    VFUInt32Vector expecteds = { expected, expected, expected, expected, expected, expected, expected, expected };
+    uint64_t mask            = 0;
+    for (uint64_t i = 0; i < kVFFileTableBlockRows; i += 8) {
+        VFUInt32Vector values;
+        memcpy(&values, column + i, sizeof(values));
+        mask |= VFFileQueryMask32((VFUInt32Vector)((values & masks) == expecteds)) << i;
+    }
+    return mask;
+}
+
+static uint64_t VFFileQueryEvaluateBlock(VFFileTable table, VFFileQueryPlan plan, uint64_t row) {
+    uint64_t mask = ~(uint64_t)0;
+    if (table->count - row < kVFFileTableBlockRows) {
+        mask = ((uint64_t)1 << (table->count - row)) - 1;
+    }
+    
+    if (plan->has_size) {
+        mask &= VFFileQueryRange64(table->sizes + row, plan->min_size, plan->max_size);
+    }
+    if (mask && plan->has_time) {
+        mask &= VFFileQueryRange64(table->times_modified + row, plan->modified_after, plan->modified_before);
+    }
+    if (mask && plan->has_mode) {
+        mask &= VFFileQueryMasked32(table->modes + row, plan->mode_mask, plan->mode_value);
+    }
+    if (mask && plan->has_user) {
+        mask &= VFFileQueryMasked32(table->user_ids + row, UINT32_MAX, plan->user_id);
+    }
+    if (mask && plan->has_extension) {
+        mask &= VFFileQueryMasked32(table->extensions + row, UINT32_MAX, plan->extension);
+    }
+    return mask;
+}
+
+/*
+ * Turns a query into the predicates that actually narrow anything down.
+ * Returns NO when the query can't match a single row.
+ */
+static BOOL VFFileQueryPlanCreate(VFFileTable table, VFFileQuery query, VFFileQueryPlan plan) {
+    memset(plan, 0, sizeof(_VFFileQueryPlan));
+    
+    plan->has_size = (query->min_size != INT64_MIN || query->max_size != INT64_MAX);
+    plan->min_size = query->min_size;
+    plan->max_size = query->max_size;
+    
+    // Both bounds are exclusive
+    if (query->modified_after != INT64_MIN || query->modified_before != INT64_MAX) {
+        if (query->modified_after == INT64_MAX || query->modified_before == INT64_MIN) {
+            return NO;
+        }
+        plan->has_time        = YES;
+        plan->modified_after  = query->modified_after + 1;
+        plan->modified_before = query->modified_before - 1;
+    }
+    
+    plan->has_mode   = (query->mode_mask != 0);
+    plan->mode_mask  = query->mode_mask;
+    plan->mode_value = query->mode_value;
+    
+    if (query->user_id >= 0) {
+        if (query->user_id > UINT32_MAX) {
+            return NO;
+        }
+        plan->has_user = YES;
+        plan->user_id  = (uint32_t)query->user_id;
+    }
+    
+    if (query->extension) {
+        char extension[256];
+        size_t length = strlen(query->extension);
+        if (length >= sizeof(extension)) {
+            return NO;
+        }
+        for (size_t i = 0; i < length; i++) {
+            extension[i] = tolower((unsigned char)query->extension[i]);
+        }
+        plan->has_extension = YES;
+        plan->extension     = VFFileTableDictionaryFind(&table->extension_names, extension, length, NULL);
+        if (plan->extension == UINT32_MAX) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+#pragma mark - VFFileTable -
+VFFileTable VFFileTableCreate(void) {
+    return calloc(1, sizeof(_VFFileTable));
+}
+
+VFFileTable VFFileTableCreateWithDirectory(const char *path, VFFileEnumerationOption options, char **error) {
+    VFFileTable table = VFFileTableCreate();
+    if (!table) {
+        if (error) *error = strerror(errno);
+        return NULL;
+    }
+    
+    __block BOOL failed = NO;
+    VFEnumerateDirectory(path, options | VFFileEnumerationOptionDetail, ^(void *info, char *enumeration_error) {
+        if (info && !failed) {
+            failed = !VFFileTableAppend(table, info);
+        }
+    });
+    
+    if (failed) {
+        if (error) *error = "Failed to allocate the file table";
+        VFFileTableRelease(table);
+        return NULL;
+    }
+    return table;
+}
+
+BOOL VFFileTableAppend(VFFileTable table, VFFileInfo info) {
+    if (!table || !info || !info->path) {
+        return NO;
+    }
+    if (!VFFileTableReserve(table, table->count + 1)) {
+        return NO;
+    }
+    
+    const char *path      = info->path;
+    const char *separator = strrchr(path, '/');
+    const char *name      = (separator) ? separator + 1 : path;
+    size_t directory_size = (separator) ? (size_t)(separator - path) : 0;
+    if (separator == path) {
+        directory_size = 1;
+    }
+    
+    // A leading dot names a hidden file, not an extension
+    char extension[256];
+    size_t extension_size = 0;
+    const char *dot       = strrchr(name, '.');
+    if (dot && dot != name && info->type != VFFileTypeDirectory) {
+        for (const char *character = dot + 1; *character && extension_size < sizeof(extension) - 1; character++) {
+            extension[extension_size++] = tolower((unsigned char)*character);
+        }
+    }
+    
+    uint32_t directory_identifier = VFFileTableDictionaryIntern(&table->directory_names, path, directory_size);
+    uint32_t extension_identifier = VFFileTableDictionaryIntern(&table->extension_names, extension, extension_size);
+    uint64_t path_offset          = 0;
+    if (directory_identifier == UINT32_MAX || extension_identifier == UINT32_MAX || !VFFileTableAddString(table, path, &path_offset)) {
+        return NO;
+    }
+    
+    uint64_t row                = table->count++;
+    table->sizes[row]           = info->size;
+    table->times_modified[row]  = info->time_modified;
+    table->modes[row]           = info->mode;
+    table->user_ids[row]        = info->user_id;
+    table->extensions[row]      = extension_identifier;
+    table->directories[row]     = directory_identifier;
+    table->paths[row]           = path_offset;
+    return YES;
+}
+
+void VFFileTableRelease(VFFileTable table) {
+    if (table) {
+        free(table->sizes);
+        free(table->times_modified);
+        free(table->modes);
+        free(table->user_ids);
+        free(table->extensions);
+        free(table->directories);
+        free(table->paths);
+        free(table->strings);
+        VFFileTableDictionaryRelease(&table->extension_names);
+        VFFileTableDictionaryRelease(&table->directory_names);
+        free(table);
+    }
+}
+
+uint64_t VFFileTableGetCount(VFFileTable table) {
+    return (table) ? table->count : 0;
+}
+
+const char * VFFileTableGetPath(VFFileTable table, uint64_t row) {
+    if (!table || row >= table->count) {
+        return NULL;
+    }
+    return table->strings + table->paths[row];
+}
+
+#pragma mark - VFFileQuery -
+void VFFileQueryInit(VFFileQuery query) {
+    if (query) {
+        query->min_size        = INT64_MIN;
+        query->max_size        = INT64_MAX;
+        query->modified_after  = INT64_MIN;
+        query->modified_before = INT64_MAX;
+        query->mode_mask       = 0;
+        query->mode_value      = 0;
+        query->user_id         = -1;
+        query->extension       = NULL;
+    }
+}
+
+VFFileSelection VFFileTableSelect(VFFileTable table, VFFileQuery query) {
+    if (!table || !query) {
+        return NULL;
+    }
+    
+    uint64_t words            = (table->count + kVFFileTableBlockRows - 1) / kVFFileTableBlockRows;
+    VFFileSelection selection = malloc(sizeof(_VFFileSelection));
+    uint64_t *bits            = calloc((words > 0) ? words : 1, sizeof(uint64_t));
+    if (!selection || !bits) {
+        free(selection);
+        free(bits);
+        return NULL;
+    }
+    selection->bits    = bits;
+    selection->count   = table->count;
+    selection->matches = 0;
+    
+    _VFFileQueryPlan plan;
+    if (!VFFileQueryPlanCreate(table, query, &plan)) {
+        return selection;
+    }
+    
+    __block uint64_t matches = 0;
+    VFFileQueryPlan shared   = &plan;
+    uint64_t chunks          = (words + kVFFileTableChunkBlocks - 1) / kVFFileTableChunkBlocks;
+    dispatch_apply(chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk) {
+        uint64_t start = chunk * kVFFileTableChunkBlocks;
+        uint64_t end   = (start + kVFFileTableChunkBlocks < words) ? start + kVFFileTableChunkBlocks : words;
+        uint64_t found = 0;
+        for (uint64_t word = start; word < end; word++) {
+            bits[word] = VFFileQueryEvaluateBlock(table, shared, word * kVFFileTableBlockRows);
+            found     += __builtin_popcountll(bits[word]);
+        }
+        __sync_fetch_and_add(&matches, found);
+    });
+    
+    selection->matches = matches;
+    return selection;
+}
+
+uint64_t VFFileSelectionGetCount(VFFileSelection selection) {
+    return (selection) ? selection->matches : 0;
+}
+
+void VFFileSelectionEnumerate(VFFileSelection selection, VFFileSelectionEnumerationBlock block) {
+    if (!selection || !block) {
+        return;
+    }
+    
+    BOOL stop      = NO;
+    uint64_t words = (selection->count + kVFFileTableBlockRows - 1) / kVFFileTableBlockRows;
+    for (uint64_t word = 0; word < words && !stop; word++) {
+        uint64_t bits = selection->bits[word];
+        while (bits && !stop) {
+            block(word * kVFFileTableBlockRows + __builtin_ctzll(bits), &stop);
+            bits &= bits - 1;
+        }
+    }
+}
+
+void VFFileSelectionRelease(VFFileSelection selection) {
+    if (selection) {
+        free(selection->bits);
+        free(selection);
+    }
+}
+
+#pragma mark - Grouping -
+static BOOL VFFileTableGroupIsLess(VFFileTableGroup group1, VFFileTableGroup group2) {
+    if (group1->total_size != group2->total_size) {
+        return group1->total_size < group2->total_size;
+    }
+    return group1->count < group2->count;
+}
+
+static void VFFileTableGroupSiftDown(VFFileTableGroup heap, size_t count, size_t position) {
+    while (YES) {
+        size_t smallest = position;
+        size_t left     = position * 2 + 1;
+        size_t right    = left + 1;
+        if (left < count && VFFileTableGroupIsLess(&heap[left], &heap[smallest]))   smallest = left;
+        if (right < count && VFFileTableGroupIsLess(&heap[right], &heap[smallest])) smallest = right;
+        if (smallest == position) {
+            return;
+        }
+        _VFFileTableGroup swap = heap[position];
+        heap[position]         = heap[smallest];
+        heap[smallest]         = swap;
+        position               = smallest;
+    }
+}
+
+static int VFFileTableGroupCompare(const void *group1, const void *group2) {
+    if (VFFileTableGroupIsLess((VFFileTableGroup)group2, (VFFileTableGroup)group1)) return -1;
+    if (VFFileTableGroupIsLess((VFFileTableGroup)group1, (VFFileTableGroup)group2)) return 1;
+    return 0;
+}
+
+VFFileTableGroup VFFileTableGroupBy(VFFileTable table, VFFileSelection selection, VFFileTableGroupKey key, size_t limit, size_t *count) {
+    if (count) *count = 0;
+    if (!table || (selection && selection->count != table->count)) {
+        return NULL;
+    }
+    
+    VFFileTableDictionary dictionary = (key == VFFileTableGroupKeyDirectory) ? &table->directory_names : &table->extension_names;
+    const uint32_t *column           = (key == VFFileTableGroupKeyDirectory) ? table->directories : table->extensions;
+    
+    uint64_t *counts = calloc(dictionary->count + 1, sizeof(uint64_t));
+    int64_t *sums    = calloc(dictionary->count + 1, sizeof(int64_t));
+    if (!counts || !sums) {
+        free(counts);
+        free(sums);
+        return NULL;
+    }
+    
+    // Only the rows that were selected are visited, a word at a time
+    uint64_t words = (table->count + kVFFileTableBlockRows - 1) / kVFFileTableBlockRows;
+    for (uint64_t word = 0; word < words; word++) {
+        uint64_t bits = (selection) ? selection->bits[word] : ~(uint64_t)0;
+        if (!selection && table->count - word * kVFFileTableBlockRows < kVFFileTableBlockRows) {
+            bits = ((uint64_t)1 << (table->count - word * kVFFileTableBlockRows)) - 1;
+        }
+        while (bits) {
+            uint64_t row = word * kVFFileTableBlockRows + __builtin_ctzll(bits);
+            counts[column[row]]++;
+            sums[column[row]] += table->sizes[row];
+            bits &= bits - 1;
+        }
+    }
+    
+    /* ---------------------------------------
+     * Keep the largest groups in a min-heap of
+     * the requested size so that asking for the
+     * top few of a million directories doesn't
+     * sort all of them.
+     */
+    size_t capacity        = (limit > 0 && limit < dictionary->count) ? limit : dictionary->count;
+    VFFileTableGroup heap  = malloc((capacity > 0 ? capacity : 1) * sizeof(_VFFileTableGroup));
+    size_t heap_count      = 0;
+    if (heap) {
+        for (uint32_t identifier = 0; identifier < dictionary->count; identifier++) {
+            if (counts[identifier] == 0) {
+                continue;
+            }
+            
+            _VFFileTableGroup group = { dictionary->names[identifier], counts[identifier], sums[identifier] };
+            if (heap_count < capacity) {
+                heap[heap_count++] = group;
+                if (heap_count == capacity) {
+                    for (size_t position = capacity / 2; position-- > 0;) {
+                        VFFileTableGroupSiftDown(heap, heap_count, position);
+                    }
+                }
+            } else if (VFFileTableGroupIsLess(&heap[0], &group)) {
+                heap[0] = group;
+                VFFileTableGroupSiftDown(heap, heap_count, 0);
+            }
+        }
+        qsort(heap, heap_count, sizeof(_VFFileTableGroup), VFFileTableGroupCompare);
+        if (count) *count = heap_count;
+    }
+    
+    free(counts);
+    free(sums);
+    return heap;
+}
+
+void VFFileTableGroupRelease(VFFileTableGroup groups) {
+    free(groups);
+}
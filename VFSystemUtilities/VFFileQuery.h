@@ -0,0 +1,119 @@
+//
+//  VFFileQuery.h
+//
+//  Created by Dima Bart on 2014-08-18.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFFileTableGroupKeyDirectory = 0,
+    VFFileTableGroupKeyExtension = 1,
+} VFFileTableGroupKey;
+
+/*
+ * =============================
+ *     VFFileTable & Related
+ * =============================
+ *
+ */
+// MARK: - VFFileTableDictionary -
+typedef struct __VFFileTableDictionary {
+    char     **names;
+    uint32_t   count;
+    uint32_t   capacity;
+    uint32_t  *slots;
+    uint32_t   slot_capacity;
+} _VFFileTableDictionary;
+typedef _VFFileTableDictionary * VFFileTableDictionary;
+
+// MARK: - VFFileTable -
+
+/*
+ * File metadata stored one column per attribute. Directories and
+ * extensions (lower-cased, without the dot, "" when there is none) are
+ * kept as ids into a dictionary, so filtering or grouping on them compares
+ * integers instead of strings.
+ *
+ * Selecting evaluates every predicate of a query 64 rows at a time with
+ * vector compares over the columns, producing a bit per row. Blocks are
+ * spread over all cores and a predicate is skipped for a block once no
+ * row in it can match anymore.
+ */
+typedef struct __VFFileTable {
+    uint64_t                count;
+    uint64_t                capacity;
+    int64_t                *sizes;
+    int64_t                *times_modified;
+    uint32_t               *modes;
+    uint32_t               *user_ids;
+    uint32_t               *extensions;
+    uint32_t               *directories;
+    uint64_t               *paths;
+    char                   *strings;
+    uint64_t                strings_size;
+    uint64_t                strings_capacity;
+    _VFFileTableDictionary  extension_names;
+    _VFFileTableDictionary  directory_names;
+} _VFFileTable;
+typedef _VFFileTable * VFFileTable;
+
+// MARK: - VFFileQuery -
+typedef struct __VFFileQuery {
+    int64_t     min_size;
+    int64_t     max_size;
+    int64_t     modified_after;
+    int64_t     modified_before;
+    uint32_t    mode_mask;  // Matches when (mode & mode_mask) == mode_value
+    uint32_t    mode_value;
+    int64_t     user_id;    // -1 for any
+    const char *extension;  // NULL for any
+} _VFFileQuery;
+typedef _VFFileQuery * VFFileQuery;
+
+// MARK: - VFFileSelection -
+typedef struct __VFFileSelection {
+    uint64_t *bits;
+    uint64_t  count;
+    uint64_t  matches;
+} _VFFileSelection;
+typedef _VFFileSelection * VFFileSelection;
+
+// MARK: - VFFileTableGroup -
+typedef struct __VFFileTableGroup {
+    const char *key;
+    uint64_t    count;
+    int64_t     total_size;
+} _VFFileTableGroup;
+typedef _VFFileTableGroup * VFFileTableGroup;
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFFileSelectionEnumerationBlock)(uint64_t row, BOOL *stop);
+
+// MARK: - VFFileTable Functions -
+VFFileTable VFFileTableCreate(void);
+VFFileTable VFFileTableCreateWithDirectory(const char *path, VFFileEnumerationOption options, char **error);
+BOOL VFFileTableAppend(VFFileTable table, VFFileInfo info);
+void VFFileTableRelease(VFFileTable table);
+
+uint64_t VFFileTableGetCount(VFFileTable table);
+const char * VFFileTableGetPath(VFFileTable table, uint64_t row);
+
+// MARK: - VFFileQuery Functions -
+void VFFileQueryInit(VFFileQuery query); // Matches everything
+
+VFFileSelection VFFileTableSelect(VFFileTable table, VFFileQuery query);
+uint64_t VFFileSelectionGetCount(VFFileSelection selection);
+void VFFileSelectionEnumerate(VFFileSelection selection, VFFileSelectionEnumerationBlock block);
+void VFFileSelectionRelease(VFFileSelection selection);
+
+// Largest total size first, limit of 0 returns every group. A NULL selection groups all rows.
+VFFileTableGroup VFFileTableGroupBy(VFFileTable table, VFFileSelection selection, VFFileTableGroupKey key, size_t limit, size_t *count);
+void VFFileTableGroupRelease(VFFileTableGroup groups);
@@ -0,0 +1,165 @@
+//
+//  VFGovernor.c
+//
+//  Created by Dima Bart on 2014-08-28.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <time.h>
+#import <unistd.h>
+#import <pthread.h>
+
+#import "VFGovernor.h"
+
+static const uint64_t kVFGovernorInterval      = 250;
+static const uint32_t kVFGovernorHysteresis    = 25;
+static const size_t   kVFGovernorMinimumBuffer = 64 * 1024;
+
+typedef struct __VFGovernorLevelInfo {
+    uint32_t available;   // Minimum available memory, in permille of the total
+    size_t   buffer_size;
+    uint32_t queue_depth;
+    uint32_t workers;     // Per two CPUs
+} _VFGovernorLevelInfo;
+
+static const _VFGovernorLevelInfo kVFGovernorLevels[] = {
+    [VFGovernorLevelPlentiful]   = { 500, 4 * 1024 * 1024, 8, 4 },
+    [VFGovernorLevelNormal]      = { 200, 1024 * 1024,     4, 2 },
+    [VFGovernorLevelConstrained] = { 50,  256 * 1024,      2, 1 },
+    [VFGovernorLevelCritical]    = { 0,   64 * 1024,       1, 0 },
+};
+
+static pthread_mutex_t     kVFGovernorLock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      kVFGovernorIdle     = PTHREAD_COND_INITIALIZER;
+static _VFGovernorDecision kVFGovernorDecision = { .level = VFGovernorLevelNormal };
+static uint32_t            kVFGovernorRunning  = 0;
+
+#pragma mark - Private -
+static uint64_t VFGovernorGetTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static VFGovernorLevel VFGovernorGetLevel(uint32_t available, VFGovernorLevel current) {
+    VFGovernorLevel level = VFGovernorLevelCritical;
+    while (level > VFGovernorLevelPlentiful && available >= kVFGovernorLevels[level - 1].available) {
+        level--;
+    }
+    
+    // Lighter levels must be cleared by the hysteresis margin
+    while (level < current && available < kVFGovernorLevels[level].available + kVFGovernorHysteresis) {
+        level++;
+    }
+    return level;
+}
+
+// Must be called with the lock held
+static void VFGovernorEvaluate(VFGovernorDecision decision) {
+    _VFMemorySnapshot snapshot;
+    VFGovernorLevel level = decision->level;
+    if (VFMemorySnapshotFill(&snapshot, NULL) && snapshot.total_bytes > 0) {
+        uint32_t available        = (uint32_t)(snapshot.available_bytes * 1000 / snapshot.total_bytes);
+        level                     = VFGovernorGetLevel(available, decision->level);
+        decision->total_bytes     = snapshot.total_bytes;
+        decision->available_bytes = snapshot.available_bytes;
+    }
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    
+    const _VFGovernorLevelInfo *info = &kVFGovernorLevels[level];
+    uint32_t workers                 = (uint32_t)(cpus * info->workers / 2);
+    if (workers < 1) {
+        workers = 1;
+    }
+    
+    size_t buffer_size = info->buffer_size;
+    while (decision->available_bytes > 0 && buffer_size > kVFGovernorMinimumBuffer && (uint64_t)buffer_size * workers > decision->available_bytes / 8) {
+        buffer_size /= 2;
+    }
+    
+    if (decision->evaluations > 0 && level != decision->level) {
+        decision->changes++;
+    }
+    decision->level       = level;
+    decision->buffer_size = buffer_size;
+    decision->queue_depth = info->queue_depth;
+    decision->workers     = workers;
+    decision->timestamp   = VFGovernorGetTime();
+    decision->evaluations++;
+    
+    // More workers may be allowed now
+    pthread_cond_broadcast(&kVFGovernorIdle);
+}
+
+static void VFGovernorUpdate(void) {
+    if (kVFGovernorDecision.evaluations == 0 || VFGovernorGetTime() - kVFGovernorDecision.timestamp >= kVFGovernorInterval) {
+        VFGovernorEvaluate(&kVFGovernorDecision);
+    }
+}
+
+#pragma mark - VFGovernor -
+void VFGovernorGetDecision(VFGovernorDecision decision) {
+    pthread_mutex_lock(&kVFGovernorLock);
+    VFGovernorUpdate();
+    *decision = kVFGovernorDecision;
+    pthread_mutex_unlock(&kVFGovernorLock);
+}
+
+void VFGovernorRefresh(void) {
+    pthread_mutex_lock(&kVFGovernorLock);
+    VFGovernorEvaluate(&kVFGovernorDecision);
+    pthread_mutex_unlock(&kVFGovernorLock);
+}
+
+size_t VFGovernorGetBufferSize(size_t block_size) {
+    _VFGovernorDecision decision;
+    VFGovernorGetDecision(&decision);
+    
+    size_t buffer_size = decision.buffer_size;
+    if (block_size > 0) {
+        buffer_size = (buffer_size > block_size) ? buffer_size - buffer_size % block_size : block_size;
+    }
+    return buffer_size;
+}
+
+size_t VFGovernorGetBufferLimit(void) {
+    _VFGovernorDecision decision;
+    VFGovernorGetDecision(&decision);
+    
+    size_t buffer_limit = (size_t)(decision.available_bytes / 8 / decision.workers);
+    return (buffer_limit > decision.buffer_size) ? buffer_limit : decision.buffer_size;
+}
+
+uint32_t VFGovernorGetQueueDepth(void) {
+    _VFGovernorDecision decision;
+    VFGovernorGetDecision(&decision);
+    return decision.queue_depth;
+}
+
+uint32_t VFGovernorGetWorkers(void) {
+    _VFGovernorDecision decision;
+    VFGovernorGetDecision(&decision);
+    return decision.workers;
+}
+
+void VFGovernorBeginWork(void) {
+    pthread_mutex_lock(&kVFGovernorLock);
+    VFGovernorUpdate();
+    while (kVFGovernorRunning >= kVFGovernorDecision.workers) {
+        pthread_cond_wait(&kVFGovernorIdle, &kVFGovernorLock);
+    }
+    kVFGovernorRunning++;
+    pthread_mutex_unlock(&kVFGovernorLock);
+}
+
+void VFGovernorEndWork(void) {
+    pthread_mutex_lock(&kVFGovernorLock);
+    kVFGovernorRunning--;
+    VFGovernorUpdate();
+    pthread_cond_signal(&kVFGovernorIdle);
+    pthread_mutex_unlock(&kVFGovernorLock);
+}
@@ -0,0 +1,74 @@
+//
+//  VFGovernor.h
+//
+//  Created by Dima Bart on 2014-08-28.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFFileManager.h"
+#import "VFMachine.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFGovernorLevelPlentiful   = 0, // At least half of the memory is available
+    VFGovernorLevelNormal      = 1, // At least 20%
+    VFGovernorLevelConstrained = 2, // At least 5%
+    VFGovernorLevelCritical    = 3,
+} VFGovernorLevel;
+
+/*
+ * =============================
+ *      VFGovernor & Related
+ * =============================
+ *
+ */
+// MARK: - VFGovernorDecision -
+
+/*
+ * The governor sizes file operations from the share of memory that is
+ * available, taken from a VFMemorySnapshot at most every 250 ms. Each
+ * level sets the I/O buffer size, the number of operations in flight per
+ * device and the number of files copied at once, from 4MB buffers and two
+ * workers per CPU when memory is plentiful down to 64KB buffers and a
+ * single worker when it is critical. Buffers are halved further while all
+ * workers' buffers together would exceed an eighth of the available
+ * memory. Returning to a lighter level needs 2.5% more available memory
+ * than entering it, so the decision doesn't flap around a threshold.
+ *
+ * VFCopyFile, VFMoveFile, VFEnumerateFileBuffer, VFPipeline and
+ * VFOperationQueue follow the current decision.
+ */
+typedef struct __VFGovernorDecision {
+    VFGovernorLevel level;
+    uint64_t        total_bytes;
+    uint64_t        available_bytes;
+    size_t          buffer_size;
+    uint32_t        queue_depth;
+    uint32_t        workers;
+    uint64_t        timestamp;   // CLOCK_MONOTONIC, in milliseconds
+    uint64_t        evaluations; // Snapshots taken so far
+    uint64_t        changes;     // Evaluations that moved to another level
+} _VFGovernorDecision;
+typedef _VFGovernorDecision * VFGovernorDecision;
+
+// MARK: - VFGovernor Functions -
+void VFGovernorGetDecision(VFGovernorDecision decision);
+void VFGovernorRefresh(void); // Re-evaluates now instead of when the decision expires
+
+size_t VFGovernorGetBufferSize(size_t block_size); // A multiple of block_size when given
+size_t VFGovernorGetBufferLimit(void); // Largest buffer each worker may hold, never below the buffer size
+uint32_t VFGovernorGetQueueDepth(void);
+uint32_t VFGovernorGetWorkers(void);
+
+/*
+ * Bracket a unit of work that holds a buffer, such as copying one file.
+ * Begin blocks while the current number of workers is busy. Only call it
+ * around work that doesn't itself wait on other bracketed work.
+ */
+void VFGovernorBeginWork(void);
+void VFGovernorEndWork(void);
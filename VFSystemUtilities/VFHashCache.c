@@ -0,0 +1,324 @@
+//
+//  VFHashCache.c
+//
+//  Created by Dima Bart on 2014-08-25.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
+#import <sys/mman.h>
+#import <sys/file.h>
+#import <sys/xattr.h>
+
+#import "VFHashCache.h"
+
+#if defined(__linux__)
+    #define st_mtimespec st_mtim
+    #define st_ctimespec st_ctim
+#endif
+
+#if defined(__APPLE__)
+    #define VFGetAttribute(file, name, buffer, size) fgetxattr(file, name, buffer, size, 0, 0)
+    #define VFSetAttribute(file, name, buffer, size) fsetxattr(file, name, buffer, size, 0, 0)
+#else
+    #define VFGetAttribute(file, name, buffer, size) fgetxattr(file, name, buffer, size)
+    #define VFSetAttribute(file, name, buffer, size) fsetxattr(file, name, buffer, size, 0)
+#endif
+
+static const char kVFHashCacheMagic[8]      = { 'V', 'F', 'H', 'C', 'A', 'C', '1', '\0' };
+static const uint32_t kVFHashCacheVersion   = 1;
+static const uint32_t kVFHashCacheAlgorithm = 1; // XXH64, seed 0
+static const uint64_t kVFHashCacheCapacity  = 4096;
+static const char *kVFHashCacheAttribute    = "user.vf.hash";
+
+typedef struct __VFHashCacheHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t algorithm;
+    uint64_t capacity;
+    uint64_t count;
+} _VFHashCacheHeader;
+
+typedef struct __VFHashCacheSlot {
+    uint64_t device;
+    uint64_t inode; // 0 for an empty slot
+    int64_t  size;
+    int64_t  time_modified;
+    int64_t  time_changed;
+    uint64_t hash;
+} _VFHashCacheSlot;
+typedef _VFHashCacheSlot * VFHashCacheSlot;
+
+typedef struct __VFHashCacheAttribute {
+    uint32_t version;
+    uint32_t algorithm;
+    int64_t  size;
+    int64_t  time_modified;
+    uint64_t hash;
+} _VFHashCacheAttribute;
+
+static VFHashCache volatile kVFHashCacheDefault = NULL;
+
+#pragma mark - Private -
+static inline int64_t VFHashCacheTime(const struct timespec *time) {
+    return (int64_t)time->tv_sec * 1000000000LL + time->tv_nsec;
+}
+
+static inline _VFHashCacheHeader * VFHashCacheGetHeader(VFHashCache cache) {
+    return cache->base;
+}
+
+static inline VFHashCacheSlot VFHashCacheGetSlots(VFHashCache cache) {
+    return (VFHashCacheSlot)((uint8_t *)cache->base + sizeof(_VFHashCacheHeader));
+}
+
+static size_t VFHashCacheLength(uint64_t capacity) {
+    return sizeof(_VFHashCacheHeader) + capacity * sizeof(_VFHashCacheSlot);
+}
+
+/*
+ * The slot of the file, or the empty one it would go in. NULL when a full
+ * or corrupt table has neither after probing every slot once.
+ */
+static VFHashCacheSlot VFHashCacheFind(VFHashCacheSlot slots, uint64_t capacity, uint64_t device, uint64_t inode) {
+    uint64_t key   = (inode ^ (device * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    uint64_t index = (key ^ (key >> 32)) & (capacity - 1);
+    for (uint64_t probes = 0; probes < capacity; probes++) {
+        if (slots[index].inode == 0 || (slots[index].inode == inode && slots[index].device == device)) {
+            return &slots[index];
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Maps a cache file of the given capacity, initializing it when it is
+ * new. Returns NULL when the file holds something else.
+ */
+static void * VFHashCacheMap(int file, uint64_t capacity, BOOL is_new) {
+    size_t length = VFHashCacheLength(capacity);
+    if (is_new && ftruncate(file, length) != 0) {
+        return NULL;
+    }
+    
+    void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    
+    _VFHashCacheHeader *header = base;
+    if (is_new) {
+        memcpy(header->magic, kVFHashCacheMagic, sizeof(header->magic));
+        header->version   = kVFHashCacheVersion;
+        header->algorithm = kVFHashCacheAlgorithm;
+        header->capacity  = capacity;
+        header->count     = 0;
+    }
+    return base;
+}
+
+static BOOL VFHashCacheGrow(VFHashCache cache) {
+    char *temporary_path = NULL;
+    asprintf(&temporary_path, "%s.%d.tmp", cache->path, getpid());
+    if (!temporary_path) {
+        return NO;
+    }
+    
+    uint64_t capacity = cache->capacity * 2;
+    int file          = open(temporary_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    void *base        = (file != -1 && flock(file, LOCK_EX | LOCK_NB) == 0) ? VFHashCacheMap(file, capacity, YES) : NULL;
+    if (!base || rename(temporary_path, cache->path) != 0) {
+        if (base) munmap(base, VFHashCacheLength(capacity));
+        if (file != -1) close(file);
+        unlink(temporary_path);
+        free(temporary_path);
+        return NO;
+    }
+    free(temporary_path);
+    
+    VFHashCacheSlot slots      = VFHashCacheGetSlots(cache);
+    VFHashCacheSlot new_slots  = (VFHashCacheSlot)((uint8_t *)base + sizeof(_VFHashCacheHeader));
+    _VFHashCacheHeader *header = base;
+    for (uint64_t i = 0; i < cache->capacity; i++) {
+        VFHashCacheSlot new_slot = (slots[i].inode != 0) ? VFHashCacheFind(new_slots, capacity, slots[i].device, slots[i].inode) : NULL;
+        if (new_slot) {
+            *new_slot = slots[i];
+            header->count++;
+        }
+    }
+    
+    munmap(cache->base, cache->length);
+    close(cache->file);
+    cache->file     = file;
+    cache->base     = base;
+    cache->length   = VFHashCacheLength(capacity);
+    cache->capacity = capacity;
+    return YES;
+}
+
+#pragma mark - VFHashCache -
+VFHashCache VFHashCacheOpen(const char *path, VFHashCacheOption options, char **error) {
+    if (!path) {
+        if (error) *error = "Invalid path";
+        return NULL;
+    }
+    
+    int file = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (file == -1) {
+        if (error) *error = strerror(errno);
+        return NULL;
+    }
+    if (flock(file, LOCK_EX | LOCK_NB) != 0) {
+        if (error) *error = (errno == EWOULDBLOCK) ? "Hash cache is already open elsewhere" : strerror(errno);
+        close(file);
+        return NULL;
+    }
+    
+    struct stat file_stat;
+    _VFHashCacheHeader header;
+    BOOL is_new   = (fstat(file, &file_stat) == 0 && file_stat.st_size == 0);
+    BOOL is_read  = !is_new && pread(file, &header, sizeof(header), 0) == sizeof(header);
+    BOOL is_valid = is_new || (is_read &&
+        memcmp(header.magic, kVFHashCacheMagic, sizeof(header.magic)) == 0 &&
+        header.version == kVFHashCacheVersion &&
+        header.algorithm == kVFHashCacheAlgorithm &&
+        header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0 &&
+        (uint64_t)file_stat.st_size == VFHashCacheLength(header.capacity));
+        
+    uint64_t capacity = (is_new) ? kVFHashCacheCapacity : header.capacity;
+    void *base        = (is_valid) ? VFHashCacheMap(file, capacity, is_new) : NULL;
+    if (!base) {
+        if (error) *error = (is_valid) ? strerror(errno) : "Not a valid hash cache";
+        close(file);
+        return NULL;
+    }
+    
+    VFHashCache cache = calloc(1, sizeof(_VFHashCache));
+    cache->path       = strdup(path);
+    cache->options    = options;
+    cache->file       = file;
+    cache->base       = base;
+    cache->length     = VFHashCacheLength(capacity);
+    cache->capacity   = capacity;
+    pthread_mutex_init(&cache->lock, NULL);
+    
+    return cache;
+}
+
+void VFHashCacheRelease(VFHashCache cache) {
+    if (cache) {
+        __sync_bool_compare_and_swap(&kVFHashCacheDefault, cache, NULL);
+        
+        munmap(cache->base, cache->length);
+        close(cache->file);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->path);
+        free(cache);
+    }
+}
+
+uint64_t VFHashCacheGetCount(VFHashCache cache) {
+    pthread_mutex_lock(&cache->lock);
+    uint64_t count = VFHashCacheGetHeader(cache)->count;
+    pthread_mutex_unlock(&cache->lock);
+    return count;
+}
+
+BOOL VFHashCacheLookup(VFHashCache cache, int file, const struct stat *file_stat, uint64_t *hash) {
+    if (!cache || !file_stat || !hash) {
+        return NO;
+    }
+    
+    int64_t time_modified = VFHashCacheTime(&file_stat->st_mtimespec);
+    int64_t time_changed  = VFHashCacheTime(&file_stat->st_ctimespec);
+    
+    pthread_mutex_lock(&cache->lock);
+    VFHashCacheSlot slot = VFHashCacheFind(VFHashCacheGetSlots(cache), cache->capacity, file_stat->st_dev, file_stat->st_ino);
+    BOOL is_found        = slot && slot->inode != 0 &&
+        slot->size == (int64_t)file_stat->st_size &&
+        slot->time_modified == time_modified &&
+        slot->time_changed == time_changed;
+    if (is_found) {
+        *hash = slot->hash;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    
+    if (!is_found && file != -1 && (cache->options & VFHashCacheOptionAttributes)) {
+        _VFHashCacheAttribute attribute;
+        is_found = VFGetAttribute(file, kVFHashCacheAttribute, &attribute, sizeof(attribute)) == sizeof(attribute) &&
+            attribute.version == kVFHashCacheVersion &&
+            attribute.algorithm == kVFHashCacheAlgorithm &&
+            attribute.size == (int64_t)file_stat->st_size &&
+            attribute.time_modified == time_modified;
+        if (is_found) {
+            *hash = attribute.hash;
+            VFHashCacheStore(cache, -1, file_stat, attribute.hash);
+        }
+    }
+    return is_found;
+}
+
+void VFHashCacheStore(VFHashCache cache, int file, const struct stat *file_stat, uint64_t hash) {
+    if (!cache || !file_stat || file_stat->st_ino == 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&cache->lock);
+    _VFHashCacheHeader *header = VFHashCacheGetHeader(cache);
+    if ((header->count + 1) * 4 > cache->capacity * 3 && VFHashCacheGrow(cache)) {
+        header = VFHashCacheGetHeader(cache);
+    }
+    
+    // Full, as growing failed, keeps what it has
+    VFHashCacheSlot slot = VFHashCacheFind(VFHashCacheGetSlots(cache), cache->capacity, file_stat->st_dev, file_stat->st_ino);
+    if (slot && (slot->inode != 0 || header->count + 1 < cache->capacity)) {
+        if (slot->inode == 0) {
+            header->count++;
+        }
+        
+        /* ---------------------------------------
+         * The slot is shared with the file, so a
+         * crash can leave it half written. It is
+         * emptied first and the inode, which makes
+         * it an entry again, is written last.
+         */
+        __atomic_store_n(&slot->inode, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->device        = file_stat->st_dev;
+        slot->size          = file_stat->st_size;
+        slot->time_modified = VFHashCacheTime(&file_stat->st_mtimespec);
+        slot->time_changed  = VFHashCacheTime(&file_stat->st_ctimespec);
+        slot->hash          = hash;
+        __atomic_store_n(&slot->inode, (uint64_t)file_stat->st_ino, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    
+    if (file != -1 && (cache->options & VFHashCacheOptionAttributes)) {
+        _VFHashCacheAttribute attribute;
+        attribute.version       = kVFHashCacheVersion;
+        attribute.algorithm     = kVFHashCacheAlgorithm;
+        attribute.size          = file_stat->st_size;
+        attribute.time_modified = VFHashCacheTime(&file_stat->st_mtimespec);
+        attribute.hash          = hash;
+        
+        // Writing the attribute moved the status change time, the entry
+        // takes the new one so the next lookup does not miss
+        struct stat new_stat;
+        if (VFSetAttribute(file, kVFHashCacheAttribute, &attribute, sizeof(attribute)) == 0 && fstat(file, &new_stat) == 0 &&
+            new_stat.st_size == file_stat->st_size && VFHashCacheTime(&new_stat.st_mtimespec) == attribute.time_modified) {
+            VFHashCacheStore(cache, -1, &new_stat, hash);
+        }
+    }
+}
+
+void VFHashCacheSetDefault(VFHashCache cache) {
+    __atomic_store_n(&kVFHashCacheDefault, cache, __ATOMIC_RELEASE);
+}
+
+VFHashCache VFHashCacheGetDefault(void) {
+    return __atomic_load_n(&kVFHashCacheDefault, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,69 @@
+//
+//  VFHashCache.h
+//
+//  Created by Dima Bart on 2014-08-25.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <pthread.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFHashCacheOptionNone       = 0,
+    VFHashCacheOptionAttributes = 1 << 0, // Also keep hashes in a "user.vf.hash" extended attribute of each file
+} VFHashCacheOption;
+
+/*
+ * =============================
+ *     VFHashCache & Related
+ * =============================
+ *
+ */
+// MARK: - VFHashCache -
+
+/*
+ * Content hashes (the XXH64 of VFFileHash) of files, remembered by device
+ * and inode. An entry is only used while the file's size, modification
+ * time and status change time (to the nanosecond) are the ones it was
+ * hashed with, so checking a file costs the fstat() that the caller does
+ * anyway.
+ *
+ * Entries live in a memory-mapped file, an open-addressing table of fixed
+ * size slots that doubles (by writing a new file and renaming it over the
+ * old one) at a load of 3/4. The file is locked while it is open, a
+ * second open of the same cache, in this or another process, fails.
+ *
+ * With VFHashCacheOptionAttributes the hash is also written to the file
+ * itself and read back from there when the table has no entry. Writing
+ * the attribute changes the status change time, so those records are
+ * matched on size and modification time only.
+ *
+ * VFFileHash consults the default cache, when one is set.
+ */
+typedef struct __VFHashCache {
+    char               *path;
+    VFHashCacheOption   options;
+    int                 file;
+    void               *base;
+    size_t              length;
+    uint64_t            capacity;
+    pthread_mutex_t     lock;
+} _VFHashCache;
+typedef _VFHashCache * VFHashCache;
+
+// MARK: - VFHashCache Functions -
+VFHashCache VFHashCacheOpen(const char *path, VFHashCacheOption options, char **error);
+void VFHashCacheRelease(VFHashCache cache);
+
+uint64_t VFHashCacheGetCount(VFHashCache cache);
+BOOL VFHashCacheLookup(VFHashCache cache, int file, const struct stat *file_stat, uint64_t *hash);
+void VFHashCacheStore(VFHashCache cache, int file, const struct stat *file_stat, uint64_t hash);
+
+void VFHashCacheSetDefault(VFHashCache cache); // Not retained, NULL to stop using one
+VFHashCache VFHashCacheGetDefault(void);
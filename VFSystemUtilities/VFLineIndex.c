@@ -0,0 +1,421 @@
+//
+//  VFLineIndex.c
+//
+//  Created by Dima Bart on 2014-08-21.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
+#import <sys/mman.h>
+
+#import "VFLineIndex.h"
+
+typedef uint8_t  VFLineVector     __attribute__((vector_size(32)));
+typedef uint64_t VFLineWordVector __attribute__((vector_size(32)));
+
+static const char kVFLineIndexMagic[8]   = { 'V', 'F', 'L', 'I', 'D', 'X', '1', '\0' };
+static const uint32_t kVFLineIndexVersion = 1;
+static const uint32_t kVFLineIndexStride  = 256;
+static const size_t kVFLineIndexReadSize  = 64 * 1024;
+
+typedef struct __VFLineIndexHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t stride;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t newlines;
+    uint64_t last_line_start;
+    uint64_t checkpoint_count;
+} _VFLineIndexHeader;
+
+#pragma mark - Private -
+/*
+ * Returns the position just past the newline that brings remaining down
+ * to zero, or length when there are not enough newlines. Whole vectors
+ * that cannot contain it are only counted.
+ */
+static size_t VFLineIndexSkipLines(const uint8_t *bytes, size_t length, uint64_t *remaining) {
+    VFLineVector newlines;
+    memset(&newlines, '\n', sizeof(newlines));
+    
+    size_t i = 0;
+    for (; i + sizeof(VFLineVector) <= length; i += sizeof(VFLineVector)) {
+        VFLineVector values;
+        memcpy(&values, bytes + i, sizeof(values));
+        VFLineWordVector hits = (VFLineWordVector)(values == newlines);
+        uint64_t count        = (__builtin_popcountll(hits[0]) + __builtin_popcountll(hits[1]) + __builtin_popcountll(hits[2]) + __builtin_popcountll(hits[3])) / 8;
+        if (count >= *remaining) {
+            break;
+        }
+        *remaining -= count;
+    }
+    for (; i < length; i++) {
+        if (bytes[i] == '\n' && --*remaining == 0) {
+            return i + 1;
+        }
+    }
+    return length;
+}
+
+static BOOL VFLineIndexAddCheckpoint(VFLineIndex index, uint64_t offset) {
+    if (index->checkpoint_count == index->checkpoint_capacity) {
+        uint64_t capacity     = (index->checkpoint_capacity > 0) ? index->checkpoint_capacity * 2 : 1024;
+        uint64_t *checkpoints = realloc(index->checkpoints, capacity * sizeof(uint64_t));
+        if (!checkpoints) {
+            return NO;
+        }
+        index->checkpoints         = checkpoints;
+        index->checkpoint_capacity = capacity;
+    }
+    index->checkpoints[index->checkpoint_count++] = offset;
+    return YES;
+}
+
+// Bytes start at index->size
+static BOOL VFLineIndexScan(VFLineIndex index, const uint8_t *bytes, size_t length) {
+    uint64_t newlines = index->newlines;
+    size_t position   = 0;
+    while (position < length) {
+        uint64_t remaining = index->stride - (index->newlines % index->stride);
+        uint64_t expected  = remaining;
+        position          += VFLineIndexSkipLines(bytes + position, length - position, &remaining);
+        index->newlines   += expected - remaining;
+        if (remaining == 0 && !VFLineIndexAddCheckpoint(index, index->size + position)) {
+            return NO;
+        }
+    }
+    
+    if (index->newlines > newlines) {
+        size_t last_newline = length;
+        while (bytes[last_newline - 1] != '\n') {
+            last_newline--;
+        }
+        index->last_line_start = index->size + last_newline;
+    }
+    index->size += length;
+    return YES;
+}
+
+static void VFLineIndexReset(VFLineIndex index, const struct stat *file_stat) {
+    index->device           = file_stat->st_dev;
+    index->inode            = file_stat->st_ino;
+    index->size             = 0;
+    index->newlines         = 0;
+    index->last_line_start  = 0;
+    index->stride           = kVFLineIndexStride;
+    index->checkpoint_count = 0;
+    VFLineIndexAddCheckpoint(index, 0);
+}
+
+static char * VFLineIndexCreateIndexPath(VFLineIndex index) {
+    char *index_path = NULL;
+    asprintf(&index_path, "%s.vfli", index->path);
+    return index_path;
+}
+
+static BOOL VFLineIndexReadAll(int file, void *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_read = read(file, bytes, length);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return NO;
+        }
+        bytes   = (uint8_t *)bytes + bytes_read;
+        length -= bytes_read;
+    }
+    return YES;
+}
+
+static BOOL VFLineIndexWriteAll(int file, const void *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(file, bytes, length);
+        if (bytes_written == -1) {
+            if (errno == EINTR) continue;
+            return NO;
+        }
+        bytes   = (const uint8_t *)bytes + bytes_written;
+        length -= bytes_written;
+    }
+    return YES;
+}
+
+// Adopts the stored index when it was built from this same file
+// Checkpoint 0 is the start of the file, every later one follows
+// a newline, so they strictly increase and none lies past the
+// start of the last line
+static BOOL VFLineIndexCheckpointsAreValid(const uint64_t *checkpoints, uint64_t count, uint64_t last_line_start) {
+    if (checkpoints[0] != 0) {
+        return NO;
+    }
+    for (uint64_t i = 1; i < count; i++) {
+        if (checkpoints[i] <= checkpoints[i - 1] || checkpoints[i] > last_line_start) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+static BOOL VFLineIndexLoad(VFLineIndex index, const struct stat *file_stat) {
+    char *index_path = VFLineIndexCreateIndexPath(index);
+    int file         = (index_path) ? open(index_path, O_RDONLY) : -1;
+    free(index_path);
+    if (file == -1) {
+        return NO;
+    }
+    
+    _VFLineIndexHeader header;
+    BOOL success = VFLineIndexReadAll(file, &header, sizeof(header)) &&
+        memcmp(header.magic, kVFLineIndexMagic, sizeof(header.magic)) == 0 &&
+        header.version == kVFLineIndexVersion &&
+        header.stride > 0 &&
+        header.device == (uint64_t)file_stat->st_dev &&
+        header.inode == (uint64_t)file_stat->st_ino &&
+        header.size <= (uint64_t)file_stat->st_size &&
+        header.last_line_start <= header.size &&
+        header.newlines <= header.size &&
+        header.checkpoint_count == header.newlines / header.stride + 1;
+    
+    uint64_t *checkpoints = (success) ? malloc(header.checkpoint_count * sizeof(uint64_t)) : NULL;
+    success               = checkpoints && VFLineIndexReadAll(file, checkpoints, header.checkpoint_count * sizeof(uint64_t)) &&
+        VFLineIndexCheckpointsAreValid(checkpoints, header.checkpoint_count, header.last_line_start);
+    close(file);
+    
+    if (!success) {
+        free(checkpoints);
+        return NO;
+    }
+    
+    free(index->checkpoints);
+    index->device              = header.device;
+    index->inode               = header.inode;
+    index->size                = header.size;
+    index->newlines            = header.newlines;
+    index->last_line_start     = header.last_line_start;
+    index->stride              = header.stride;
+    index->checkpoints         = checkpoints;
+    index->checkpoint_count    = header.checkpoint_count;
+    index->checkpoint_capacity = header.checkpoint_count;
+    return YES;
+}
+
+#pragma mark - VFLineIndex -
+VFLineIndex VFLineIndexCreate(const char *path, char **error) {
+    if (!path) {
+        if (error) {
+            *error = "Invalid path";
+        }
+        return NULL;
+    }
+    
+    VFLineIndex index = calloc(1, sizeof(_VFLineIndex));
+    if (!index) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NULL;
+    }
+    
+    index->path = strdup(path);
+    index->file = open(path, O_RDONLY);
+    
+    struct stat file_stat;
+    if (!index->path || index->file == -1 || fstat(index->file, &file_stat) == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        VFLineIndexRelease(index);
+        return NULL;
+    }
+    
+    if (!VFLineIndexLoad(index, &file_stat)) {
+        VFLineIndexReset(index, &file_stat);
+    }
+    
+    if (!VFLineIndexUpdate(index, error)) {
+        VFLineIndexRelease(index);
+        return NULL;
+    }
+    return index;
+}
+
+BOOL VFLineIndexUpdate(VFLineIndex index, char **error) {
+    if (!index) {
+        if (error) {
+            *error = "Invalid line index";
+        }
+        return NO;
+    }
+    
+    struct stat file_stat;
+    if (stat(index->path, &file_stat) == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    
+    // Rotated or truncated, start over with the file now at path
+    if ((uint64_t)file_stat.st_dev != index->device || (uint64_t)file_stat.st_ino != index->inode || (uint64_t)file_stat.st_size < index->size) {
+        int file = open(index->path, O_RDONLY);
+        if (file == -1 || fstat(file, &file_stat) == -1) {
+            if (error) {
+                *error = strerror(errno);
+            }
+            if (file != -1) {
+                close(file);
+            }
+            return NO;
+        }
+        close(index->file);
+        index->file = file;
+        VFLineIndexReset(index, &file_stat);
+    }
+    
+    if ((uint64_t)file_stat.st_size == index->size) {
+        return YES;
+    }
+    
+    uint64_t page_size  = sysconf(_SC_PAGESIZE);
+    uint64_t map_offset = index->size - (index->size % page_size);
+    size_t map_length   = file_stat.st_size - map_offset;
+    uint8_t *base       = mmap(NULL, map_length, PROT_READ, MAP_SHARED, index->file, map_offset);
+    if (base == MAP_FAILED) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    madvise(base, map_length, MADV_SEQUENTIAL);
+    
+    BOOL success = VFLineIndexScan(index, base + (index->size - map_offset), file_stat.st_size - index->size);
+    munmap(base, map_length);
+    
+    if (!success && error) {
+        *error = "Could not grow line index";
+    }
+    return success;
+}
+
+BOOL VFLineIndexWrite(VFLineIndex index, char **error) {
+    if (!index) {
+        if (error) {
+            *error = "Invalid line index";
+        }
+        return NO;
+    }
+    
+    char *index_path     = VFLineIndexCreateIndexPath(index);
+    char *temporary_path = NULL;
+    if (index_path) {
+        asprintf(&temporary_path, "%s.%d.tmp", index_path, getpid());
+    }
+    int file = (temporary_path) ? open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (file == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        free(temporary_path);
+        free(index_path);
+        return NO;
+    }
+    
+    _VFLineIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kVFLineIndexMagic, sizeof(header.magic));
+    header.version          = kVFLineIndexVersion;
+    header.stride           = index->stride;
+    header.device           = index->device;
+    header.inode            = index->inode;
+    header.size             = index->size;
+    header.newlines         = index->newlines;
+    header.last_line_start  = index->last_line_start;
+    header.checkpoint_count = index->checkpoint_count;
+    
+    BOOL success = VFLineIndexWriteAll(file, &header, sizeof(header)) &&
+        VFLineIndexWriteAll(file, index->checkpoints, index->checkpoint_count * sizeof(uint64_t));
+    success      = (close(file) == 0) && success;
+    if (success) {
+        success = (rename(temporary_path, index_path) == 0);
+    }
+    if (!success) {
+        if (error) {
+            *error = "Could not write line index";
+        }
+        unlink(temporary_path);
+    }
+    free(temporary_path);
+    free(index_path);
+    
+    return success;
+}
+
+void VFLineIndexRelease(VFLineIndex index) {
+    if (index) {
+        if (index->file != -1) {
+            close(index->file);
+        }
+        free(index->checkpoints);
+        free(index->path);
+        free(index);
+    }
+}
+
+uint64_t VFLineIndexGetLineCount(VFLineIndex index) {
+    return index->newlines + ((index->size > index->last_line_start) ? 1 : 0);
+}
+
+BOOL VFLineIndexGetLineOffset(VFLineIndex index, uint64_t line_number, uint64_t *offset, char **error) {
+    if (!index || !offset || line_number == 0 || line_number > VFLineIndexGetLineCount(index)) {
+        if (error) {
+            *error = "Line number out of range";
+        }
+        return NO;
+    }
+    
+    uint64_t position  = index->checkpoints[(line_number - 1) / index->stride];
+    uint64_t remaining = (line_number - 1) % index->stride;
+    if (remaining == 0) {
+        *offset = position;
+        return YES;
+    }
+    
+    uint8_t *buffer = malloc(kVFLineIndexReadSize);
+    if (!buffer) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    
+    BOOL success = NO;
+    while (position < index->size) {
+        size_t length      = (index->size - position < kVFLineIndexReadSize) ? index->size - position : kVFLineIndexReadSize;
+        ssize_t bytes_read = pread(index->file, buffer, length, position);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        
+        position += VFLineIndexSkipLines(buffer, bytes_read, &remaining);
+        if (remaining == 0) {
+            *offset = position;
+            success = YES;
+            break;
+        }
+    }
+    free(buffer);
+    
+    if (!success && error) {
+        *error = "Could not read line";
+    }
+    return success;
+}
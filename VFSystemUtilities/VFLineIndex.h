@@ -0,0 +1,60 @@
+//
+//  VFLineIndex.h
+//
+//  Created by Dima Bart on 2014-08-21.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFFileManager.h"
+
+/*
+ * =============================
+ *    VFLineIndex & Related
+ * =============================
+ *
+ */
+// MARK: - VFLineIndex -
+
+/*
+ * A sparse index of line offsets into a text file. The start of every
+ * 256th line is recorded while the file is scanned, newlines being
+ * counted 32 bytes at a time, so the index is about 32 bytes per 1000
+ * lines. Finding a line reads forward from the closest checkpoint and
+ * never skips more than 255 lines, however large the file is.
+ *
+ * The file is treated as append-only: VFLineIndexUpdate only scans bytes
+ * added since the last update. When the file was truncated or replaced
+ * (its inode changed) the index is built again from the start.
+ *
+ * The index is stored next to the file as "<path>.vfli" and picked up by
+ * VFLineIndexCreate when it still describes the same file.
+ */
+typedef struct __VFLineIndex {
+    char     *path;
+    int       file;
+    uint64_t  device;
+    uint64_t  inode;
+    uint64_t  size;
+    uint64_t  newlines;
+    uint64_t  last_line_start;
+    uint32_t  stride;
+    uint64_t *checkpoints;
+    uint64_t  checkpoint_count;
+    uint64_t  checkpoint_capacity;
+} _VFLineIndex;
+typedef _VFLineIndex * VFLineIndex;
+
+// MARK: - VFLineIndex Functions -
+VFLineIndex VFLineIndexCreate(const char *path, char **error);
+BOOL VFLineIndexUpdate(VFLineIndex index, char **error);
+BOOL VFLineIndexWrite(VFLineIndex index, char **error);
+void VFLineIndexRelease(VFLineIndex index);
+
+// A last line without a newline is counted. Line numbers start at 1.
+uint64_t VFLineIndexGetLineCount(VFLineIndex index);
+BOOL VFLineIndexGetLineOffset(VFLineIndex index, uint64_t line_number, uint64_t *offset, char **error);
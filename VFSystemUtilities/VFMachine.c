@@ -5,35 +5,216 @@
 //  Copyright (c) 2014 Dima Bart. All rights reserved.
 //
 
+#import <time.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <pthread.h>
+#import <sys/resource.h>
+
+#if defined(__linux__)
+    #import <sys/utsname.h>
+#elif defined(__APPLE__)
+    #import <libproc.h>
+#endif
+
 #import "VFMachine.h"
-#import "VFTokenCollection.h"
+#import "VFTopology.h"
 
-#pragma mark - Private -
-const char * VFHardwareCopyName(const char *name, char **error) {
-    size_t size;
-    sysctlbyname(name, NULL, &size, NULL, 0);
-    char *buffer = malloc(size);
-    if (sysctlbyname(name, buffer, &size, NULL, 0) == -1) {
-        if (error) {
-            *error = strerror(errno);
+#define kVFHardwareParameterCount (VFHardwareNumberKeyCount + VFHardwareStringKeyCount)
+#define kVFHardwareStringLength   256
+#define kVFHardwareNameSlots      64
+#define kVFHardwareMaximumSeed    65536
+#define kVFMachineModelMajors     32
+#define kVFMachineModelMinors     16
+
+#define VFMachineModelIndex(device, major, minor) (((device) * kVFMachineModelMajors + (major)) * kVFMachineModelMinors + (minor))
+
+typedef struct __VFHardwareRegistry {
+    uint64_t     numbers[VFHardwareNumberKeyCount];
+    BOOL         has_number[VFHardwareNumberKeyCount];
+    char         strings[VFHardwareStringKeyCount][kVFHardwareStringLength];
+    BOOL         has_string[VFHardwareStringKeyCount];
+    uint8_t      name_slots[kVFHardwareNameSlots]; // Parameter index + 1, 0 for an empty slot
+    uint32_t     name_seed;
+    BOOL         is_hashed;
+    VFDeviceType device_type;
+    int          model;
+} _VFHardwareRegistry;
+typedef _VFHardwareRegistry * VFHardwareRegistry;
+
+#if defined(__linux__)
+
+#define kVFMemoryInfoBufferSize 4096
+#define kVFMemoryStatBufferSize 8192
+
+// Indices into the parsed values, in the order the keys appear in the files
+typedef enum {
+    VFMemoryInfoTotal       = 0,
+    VFMemoryInfoFree        = 1,
+    VFMemoryInfoAvailable   = 2,
+    VFMemoryInfoBuffers     = 3,
+    VFMemoryInfoCached      = 4,
+    VFMemoryInfoActive      = 5,
+    VFMemoryInfoInactive    = 6,
+    VFMemoryInfoUnevictable = 7,
+    VFMemoryInfoSwapTotal   = 8,
+    VFMemoryInfoSwapFree    = 9,
+    VFMemoryInfoSUnreclaim  = 10,
+    VFMemoryInfoKernelStack = 11,
+    VFMemoryInfoPageTables  = 12,
+    VFMemoryInfoCount       = 13,
+} VFMemoryInfoField;
+
+typedef enum {
+    VFMemoryStatSwapIn  = 0,
+    VFMemoryStatSwapOut = 1,
+    VFMemoryStatCount   = 2,
+} VFMemoryStatField;
+
+typedef struct __VFMemoryKey {
+    const char *name;
+    size_t      length;
+} _VFMemoryKey;
+
+#define VFMemoryKey(literal) { literal, sizeof(literal) - 1 }
+
+static const _VFMemoryKey kVFMemoryInfoKeys[VFMemoryInfoCount] = {
+    [VFMemoryInfoTotal]       = VFMemoryKey("MemTotal"),
+    [VFMemoryInfoFree]        = VFMemoryKey("MemFree"),
+    [VFMemoryInfoAvailable]   = VFMemoryKey("MemAvailable"),
+    [VFMemoryInfoBuffers]     = VFMemoryKey("Buffers"),
+    [VFMemoryInfoCached]      = VFMemoryKey("Cached"),
+    [VFMemoryInfoActive]      = VFMemoryKey("Active"),
+    [VFMemoryInfoInactive]    = VFMemoryKey("Inactive"),
+    [VFMemoryInfoUnevictable] = VFMemoryKey("Unevictable"),
+    [VFMemoryInfoSwapTotal]   = VFMemoryKey("SwapTotal"),
+    [VFMemoryInfoSwapFree]    = VFMemoryKey("SwapFree"),
+    [VFMemoryInfoSUnreclaim]  = VFMemoryKey("SUnreclaim"),
+    [VFMemoryInfoKernelStack] = VFMemoryKey("KernelStack"),
+    [VFMemoryInfoPageTables]  = VFMemoryKey("PageTables"),
+};
+
+static const _VFMemoryKey kVFMemoryStatKeys[VFMemoryStatCount] = {
+    [VFMemoryStatSwapIn]  = VFMemoryKey("pswpin"),
+    [VFMemoryStatSwapOut] = VFMemoryKey("pswpout"),
+};
+
+static int            kVFMemoryInfoFile  = -1;
+static int            kVFMemoryStatFile  = -1;
+static int            kVFMemoryOpenError = 0;
+static pthread_once_t kVFMemoryFilesOnce = PTHREAD_ONCE_INIT;
+
+#pragma mark - Private - Memory -
+static void VFMemoryOpenFiles(void) {
+    kVFMemoryInfoFile  = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+    kVFMemoryOpenError = (kVFMemoryInfoFile == -1) ? errno : 0;
+    kVFMemoryStatFile  = open("/proc/vmstat", O_RDONLY | O_CLOEXEC);
+}
+
+static ssize_t VFMemoryRead(int file, char *buffer, size_t size) {
+    ssize_t length;
+    do {
+        length = pread(file, buffer, size, 0);
+    } while (length == -1 && errno == EINTR);
+    return length;
+}
+
+/*
+ * Both files are "key value" lines, with a ':' after the key in meminfo.
+ * Keys are looked for in file order, so the next expected key is usually
+ * the first one compared and the scan stops once every key was found.
+ */
+static void VFMemoryParse(const char *buffer, size_t length, const _VFMemoryKey *keys, size_t key_count, uint64_t *values) {
+    const char *end = buffer + length;
+    size_t next     = 0;
+    size_t found    = 0;
+    
+    for (const char *line = buffer; line < end && found < key_count;) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if (!line_end) {
+            line_end = end;
+        }
+        
+        const char *key_end = line;
+        while (key_end < line_end && *key_end != ':' && *key_end != ' ') {
+            key_end++;
+        }
+        
+        size_t key_length = key_end - line;
+        for (size_t i = 0; i < key_count; i++) {
+            size_t index = (next + i) % key_count;
+            if (keys[index].length == key_length && memcmp(keys[index].name, line, key_length) == 0) {
+                uint64_t value = 0;
+                for (const char *c = key_end + 1; c < line_end; c++) {
+                    if (*c >= '0' && *c <= '9') {
+                        value = value * 10 + (*c - '0');
+                    } else if (*c != ' ') {
+                        break;
+                    }
+                }
+                
+                values[index] = value;
+                next          = index + 1;
+                found++;
+                break;
+            }
         }
+        line = line_end + 1;
     }
-    return buffer;
 }
 
-uint64_t VFHardwareGetNumber(const char *name, char **error) {
-    size_t size     = sizeof(uint64_t);
-    uint64_t buffer = 0;
-    if (sysctlbyname(name, &buffer, &size, NULL, 0) == -1) {
-        if (error) {
-            *error = strerror(errno);
+#pragma mark - VFMemorySnapshot -
+BOOL VFMemorySnapshotFill(VFMemorySnapshot snapshot, char **error) {
+    if (!snapshot) {
+        if (error) *error = "Invalid snapshot";
+        return NO;
+    }
+    
+    pthread_once(&kVFMemoryFilesOnce, VFMemoryOpenFiles);
+    if (kVFMemoryInfoFile == -1) {
+        if (error) *error = strerror(kVFMemoryOpenError);
+        return NO;
+    }
+    
+    char buffer[kVFMemoryStatBufferSize];
+    ssize_t length = VFMemoryRead(kVFMemoryInfoFile, buffer, kVFMemoryInfoBufferSize);
+    if (length <= 0) {
+        if (error) *error = (length == 0) ? "Failed to read /proc/meminfo" : strerror(errno);
+        return NO;
+    }
+    
+    uint64_t info[VFMemoryInfoCount] = {0};
+    VFMemoryParse(buffer, length, kVFMemoryInfoKeys, VFMemoryInfoCount, info);
+    
+    uint64_t stat[VFMemoryStatCount] = {0};
+    if (kVFMemoryStatFile != -1) {
+        length = VFMemoryRead(kVFMemoryStatFile, buffer, kVFMemoryStatBufferSize);
+        if (length > 0) {
+            VFMemoryParse(buffer, length, kVFMemoryStatKeys, VFMemoryStatCount, stat);
         }
     }
-    return buffer;
+    
+    // meminfo is in kB
+    snapshot->total_bytes      = info[VFMemoryInfoTotal] * 1024;
+    snapshot->wired_bytes      = (info[VFMemoryInfoUnevictable] + info[VFMemoryInfoSUnreclaim] + info[VFMemoryInfoKernelStack] + info[VFMemoryInfoPageTables]) * 1024;
+    snapshot->active_bytes     = info[VFMemoryInfoActive] * 1024;
+    snapshot->inactive_bytes   = info[VFMemoryInfoInactive] * 1024;
+    snapshot->free_bytes       = info[VFMemoryInfoFree] * 1024;
+    snapshot->available_bytes  = info[VFMemoryInfoAvailable] * 1024;
+    snapshot->cached_bytes     = (info[VFMemoryInfoCached] + info[VFMemoryInfoBuffers]) * 1024;
+    snapshot->swap_total_bytes = info[VFMemoryInfoSwapTotal] * 1024;
+    snapshot->swap_free_bytes  = info[VFMemoryInfoSwapFree] * 1024;
+    snapshot->page_ins         = stat[VFMemoryStatSwapIn];
+    snapshot->page_outs        = stat[VFMemoryStatSwapOut];
+    
+    return YES;
 }
 
+#else
+
+#pragma mark - Private -
 uint64_t VFMemoryCopyPagesize(char **error) {
-    return VFHardwareGetNumber("hw.pagesize", error);
+    return VFParameterGetNumberForKey(VFHardwareNumberKeyPagesize, error);
 }
 
 vm_statistics_data_t VFMemoryGetStat(char **error) {
@@ -48,26 +229,47 @@ vm_statistics_data_t VFMemoryGetStat(char **error) {
 }
 
 #pragma mark - VFMemorySnapshot -
-VFMemorySnapshot VFMemorySnapshotCreate(char **error) {
+BOOL VFMemorySnapshotFill(VFMemorySnapshot snapshot, char **error) {
     if (error) *error = NULL;
+    if (!snapshot) {
+        if (error) *error = "Invalid snapshot";
+        return NO;
+    }
     
     uint64_t pagesize = VFMemoryCopyPagesize(error);
-    if (error && *error) return NULL;
+    if (error && *error) return NO;
     
     vm_statistics_data_t info = VFMemoryGetStat(error);
-    if (error && *error) return NULL;
+    if (error && *error) return NO;
+    
+    struct xsw_usage swap = {0};
+    size_t size           = sizeof(swap);
+    sysctlbyname("vm.swapusage", &swap, &size, NULL, 0);
     
+    snapshot->total_bytes      = (uint64_t)(info.wire_count + info.active_count + info.inactive_count + info.free_count) * pagesize;
+    snapshot->wired_bytes      = (uint64_t)info.wire_count * pagesize;
+    snapshot->active_bytes     = (uint64_t)info.active_count * pagesize;
+    snapshot->inactive_bytes   = (uint64_t)info.inactive_count * pagesize;
+    snapshot->free_bytes       = (uint64_t)info.free_count * pagesize;
+    snapshot->available_bytes  = (uint64_t)(info.free_count + info.inactive_count) * pagesize;
+    snapshot->cached_bytes     = (uint64_t)(info.purgeable_count + info.speculative_count) * pagesize;
+    snapshot->swap_total_bytes = swap.xsu_total;
+    snapshot->swap_free_bytes  = swap.xsu_avail;
+    snapshot->page_ins         = info.pageins;
+    snapshot->page_outs        = info.pageouts;
+    
+    return YES;
+}
+
+#endif
+
+VFMemorySnapshot VFMemorySnapshotCreate(char **error) {
     VFMemorySnapshot snapshot = malloc(sizeof(_VFMemorySnapshot));
-    if (snapshot) {
-        snapshot->total_bytes    = (info.wire_count + info.active_count + info.inactive_count + info.free_count) * pagesize;
-        snapshot->wired_bytes    = info.wire_count * pagesize;
-        snapshot->active_bytes   = info.active_count * pagesize;
-        snapshot->inactive_bytes = info.inactive_count * pagesize;
-        snapshot->free_bytes     = info.free_count * pagesize;
-        
-        return snapshot;
+    if (snapshot && !VFMemorySnapshotFill(snapshot, error)) {
+        free(snapshot);
+        return NULL;
     }
-    return NULL;
+    return snapshot;
 }
 
 void VFMemorySnapshotRelease(VFMemorySnapshot snapshot) {
@@ -76,113 +278,553 @@ void VFMemorySnapshotRelease(VFMemorySnapshot snapshot) {
     }
 }
 
-#pragma mark - VFParameters -
-const char * VFParameterCopyHardwareName(const char *name, char **error) {
-    return VFHardwareCopyName(name, error);
+#pragma mark - Private - Process -
+static uint64_t VFProcessGetTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-uint64_t VFParameterGetHardwareNumber(const char *name, char **error) {
-    return VFHardwareGetNumber(name, error);
+static uint64_t VFProcessGetDifference(uint64_t from, uint64_t to) {
+    return (to > from) ? to - from : 0;
 }
 
-#pragma mark - Device Types -
-const char * VFCopyDeviceName(char **error) {
-    return VFParameterCopyHardwareName("hw.machine", error);
+#if defined(__linux__)
+
+#define kVFProcessStatBufferSize 1024
+#define kVFProcessIOBufferSize   512
+
+typedef enum {
+    VFProcessIOCharsRead    = 0,
+    VFProcessIOCharsWritten = 1,
+    VFProcessIOReadCalls    = 2,
+    VFProcessIOWriteCalls   = 3,
+    VFProcessIOBytesRead    = 4,
+    VFProcessIOBytesWritten = 5,
+    VFProcessIOCount        = 6,
+} VFProcessIOField;
+
+static const _VFMemoryKey kVFProcessIOKeys[VFProcessIOCount] = {
+    [VFProcessIOCharsRead]    = VFMemoryKey("rchar"),
+    [VFProcessIOCharsWritten] = VFMemoryKey("wchar"),
+    [VFProcessIOReadCalls]    = VFMemoryKey("syscr"),
+    [VFProcessIOWriteCalls]   = VFMemoryKey("syscw"),
+    [VFProcessIOBytesRead]    = VFMemoryKey("read_bytes"),
+    [VFProcessIOBytesWritten] = VFMemoryKey("write_bytes"),
+};
+
+static int            kVFProcessStatFile  = -1;
+static int            kVFProcessIOFile    = -1;
+static int            kVFProcessOpenError = 0;
+static pthread_once_t kVFProcessFilesOnce = PTHREAD_ONCE_INIT;
+
+static void VFProcessReopenFiles(void) {
+    if (kVFProcessStatFile != -1) close(kVFProcessStatFile);
+    if (kVFProcessIOFile   != -1) close(kVFProcessIOFile);
+    
+    kVFProcessStatFile  = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    kVFProcessOpenError = (kVFProcessStatFile == -1) ? errno : 0;
+    kVFProcessIOFile    = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
 }
 
-VFDeviceType VFGetDeviceType(char **error) {
-    const char *device_name = VFCopyDeviceName(error);
-    VFDeviceType type       = VFDeviceTypeUndetermined;
-    if (device_name) {
-        if (VFContains(device_name, "iPhone")) type = VFDeviceTypeiPhone;
-        if (VFContains(device_name, "iPad"))   type = VFDeviceTypeiPad;
-        if (VFContains(device_name, "iPod"))   type = VFDeviceTypeiPod;
+// /proc/self is resolved when the file is opened, so a forked
+// child would keep reading its parent. The child reopens both
+// files while it is still single threaded
+static void VFProcessOpenFiles(void) {
+    VFProcessReopenFiles();
+    pthread_atfork(NULL, NULL, VFProcessReopenFiles);
+}
+
+/*
+ * "pid (comm) state ppid ...", the command may hold spaces and
+ * parentheses of its own, so fields are counted from the last ')'. Field
+ * 20 is the thread count, 23 the virtual size in bytes and 24 the
+ * resident size in pages.
+ */
+static BOOL VFProcessReadStat(VFProcessSnapshot snapshot) {
+    char buffer[kVFProcessStatBufferSize];
+    ssize_t length = VFMemoryRead(kVFProcessStatFile, buffer, sizeof(buffer) - 1);
+    if (length <= 0) {
+        return NO;
     }
+    buffer[length] = '\0';
     
-    free((char *)device_name);
-    return type;
+    char *cursor = strrchr(buffer, ')');
+    if (!cursor) {
+        return NO;
+    }
+    
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    for (int field = 3; field <= 24 && *++cursor; field++) {
+        while (*cursor == ' ') {
+            cursor++;
+        }
+        
+        switch (field) {
+            case 20: snapshot->thread_count   = strtoull(cursor, NULL, 10);             break;
+            case 23: snapshot->virtual_bytes  = strtoull(cursor, NULL, 10);             break;
+            case 24: snapshot->resident_bytes = strtoull(cursor, NULL, 10) * page_size; break;
+        }
+        
+        while (*cursor && *cursor != ' ') {
+            cursor++;
+        }
+    }
+    return YES;
 }
 
-VFiPhoneType VFGetiPhoneType(char **error) {
-    const char *device_name = VFCopyDeviceName(error);
-    VFiPhoneType type       = VFiPhoneTypeUndetermined;
-    if (device_name) {
-        if (VFCompare(device_name, "iPhone1,1")) type = VFiPhoneTypeOriginal;
-        if (VFCompare(device_name, "iPhone1,2")) type = VFiPhoneType3G;
-        if (VFCompare(device_name, "iPhone2,1")) type = VFiPhoneType3GS;
-        if (VFCompare(device_name, "iPhone3,1")) type = VFiPhoneType4GSM;
-        if (VFCompare(device_name, "iPhone3,2")) type = VFiPhoneType4Budget;
-        if (VFCompare(device_name, "iPhone3,3")) type = VFiPhoneType4CDMA;
-        if (VFCompare(device_name, "iPhone4,1")) type = VFiPhoneType4S;
-        if (VFCompare(device_name, "iPhone5,1")) type = VFiPhoneType5GSM;
-        if (VFCompare(device_name, "iPhone5,2")) type = VFiPhoneType5Dual;
-        if (VFCompare(device_name, "iPhone5,3")) type = VFiPhoneType5CDual;
-        if (VFCompare(device_name, "iPhone5,4")) type = VFiPhoneType5CCDMA;
-        if (VFCompare(device_name, "iPhone6,1")) type = VFiPhoneType5SGSM;
-        if (VFCompare(device_name, "iPhone6,2")) type = VFiPhoneType5SDual;
-    }
-    
-    free((char *)device_name);
-    return type;
+static BOOL VFProcessSnapshotFillPlatform(VFProcessSnapshot snapshot, char **error) {
+    pthread_once(&kVFProcessFilesOnce, VFProcessOpenFiles);
+    if (kVFProcessStatFile == -1) {
+        if (error) *error = strerror(kVFProcessOpenError);
+        return NO;
+    }
+    
+    if (!VFProcessReadStat(snapshot)) {
+        if (error) *error = "Failed to read /proc/self/stat";
+        return NO;
+    }
+    
+    if (kVFProcessIOFile != -1) {
+        char buffer[kVFProcessIOBufferSize];
+        ssize_t length = VFMemoryRead(kVFProcessIOFile, buffer, sizeof(buffer));
+        if (length > 0) {
+            uint64_t io[VFProcessIOCount] = {0};
+            VFMemoryParse(buffer, length, kVFProcessIOKeys, VFProcessIOCount, io);
+            
+            snapshot->has_io        = YES;
+            snapshot->bytes_read    = io[VFProcessIOBytesRead];
+            snapshot->bytes_written = io[VFProcessIOBytesWritten];
+            snapshot->chars_read    = io[VFProcessIOCharsRead];
+            snapshot->chars_written = io[VFProcessIOCharsWritten];
+            snapshot->read_calls    = io[VFProcessIOReadCalls];
+            snapshot->write_calls   = io[VFProcessIOWriteCalls];
+        }
+    }
+    return YES;
 }
 
-VFiPadType VFGetiPadType(char **error) {
-    const char *device_name = VFCopyDeviceName(error);
-    VFiPadType type         = VFiPadTypeUndetermined;
-    if (device_name) {
-        if (VFCompare(device_name, "iPad1,1")) type = VFiPadTypeOriginal;
-        if (VFCompare(device_name, "iPad2,1")) type = VFiPadType2WiFi;
-        if (VFCompare(device_name, "iPad2,2")) type = VFiPadType2GSM;
-        if (VFCompare(device_name, "iPad2,3")) type = VFiPadType2CDMA;
-        if (VFCompare(device_name, "iPad2,4")) type = VFiPadType2WiFi;
-        if (VFCompare(device_name, "iPad2,5")) type = VFiPadTypeMiniWifi;
-        if (VFCompare(device_name, "iPad2,6")) type = VFiPadTypeMiniGSM;
-        if (VFCompare(device_name, "iPad2,7")) type = VFiPadTypeMiniMM;
-        if (VFCompare(device_name, "iPad3,1")) type = VFiPadType3Wifi;
-        if (VFCompare(device_name, "iPad3,2")) type = VFiPadType3Verizon;
-        if (VFCompare(device_name, "iPad3,3")) type = VFiPadType3GSM;
-        if (VFCompare(device_name, "iPad3,4")) type = VFiPadType4Wifi;
-        if (VFCompare(device_name, "iPad3,5")) type = VFiPadType4GSM;
-        if (VFCompare(device_name, "iPad3,6")) type = VFiPadType4MM;
-        if (VFCompare(device_name, "iPad4,1")) type = VFiPadTypeAirWifi;
-        if (VFCompare(device_name, "iPad4,2")) type = VFiPadTypeAirGSM;
-        if (VFCompare(device_name, "iPad4,3")) type = VFiPadTypeMystery;
-        if (VFCompare(device_name, "iPad4,4")) type = VFiPadTypeMini2Wifi;
-        if (VFCompare(device_name, "iPad4,5")) type = VFiPadTypeMini2GSM;
-    }
-    
-    free((char *)device_name);
-    return type;
+#else
+
+static BOOL VFProcessSnapshotFillPlatform(VFProcessSnapshot snapshot, char **error) {
+    struct proc_taskinfo task;
+    if (proc_pidinfo(getpid(), PROC_PIDTASKINFO, 0, &task, sizeof(task)) != sizeof(task)) {
+        if (error) *error = strerror(errno);
+        return NO;
+    }
+    snapshot->resident_bytes = task.pti_resident_size;
+    snapshot->virtual_bytes  = task.pti_virtual_size;
+    snapshot->thread_count   = task.pti_threadnum;
+    
+    struct rusage_info_v2 usage;
+    if (proc_pid_rusage(getpid(), RUSAGE_INFO_V2, (rusage_info_t *)&usage) == 0) {
+        snapshot->has_io        = YES;
+        snapshot->bytes_read    = usage.ri_diskio_bytesread;
+        snapshot->bytes_written = usage.ri_diskio_byteswritten;
+    }
+    return YES;
 }
 
-VFiPodType VFGetiPodType(char **error) {
-    const char *device_name = VFCopyDeviceName(error);
-    VFiPodType type         = VFiPodTypeUndetermined;
-    if (device_name) {
-        if (VFCompare(device_name, "iPod1,1")) type = VFiPodTypeOriginal;
-        if (VFCompare(device_name, "iPod2,1")) type = VFiPodType2G;
-        if (VFCompare(device_name, "iPod3,1")) type = VFiPodType3G;
-        if (VFCompare(device_name, "iPod4,1")) type = VFiPodType4G;
-        if (VFCompare(device_name, "iPod5,1")) type = VFiPodType5G;
+#endif
+
+#pragma mark - VFProcessSnapshot -
+BOOL VFProcessSnapshotFill(VFProcessSnapshot snapshot, char **error) {
+    if (!snapshot) {
+        if (error) *error = "Invalid snapshot";
+        return NO;
+    }
+    
+    memset(snapshot, 0, sizeof(_VFProcessSnapshot));
+    snapshot->timestamp = VFProcessGetTime();
+    if (!VFProcessSnapshotFillPlatform(snapshot, error)) {
+        return NO;
+    }
+    
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        if (error) *error = strerror(errno);
+        return NO;
+    }
+    
+    snapshot->user_time            = (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+    snapshot->system_time          = (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+    snapshot->minor_faults         = (uint64_t)usage.ru_minflt;
+    snapshot->major_faults         = (uint64_t)usage.ru_majflt;
+    snapshot->voluntary_switches   = (uint64_t)usage.ru_nvcsw;
+    snapshot->involuntary_switches = (uint64_t)usage.ru_nivcsw;
+    
+    // Kilobytes on Linux, bytes on Darwin
+#if defined(__APPLE__)
+    snapshot->peak_resident_bytes = (uint64_t)usage.ru_maxrss;
+#else
+    snapshot->peak_resident_bytes = (uint64_t)usage.ru_maxrss * 1024;
+#endif
+
+    return YES;
+}
+
+VFProcessSnapshot VFProcessSnapshotCreate(char **error) {
+    VFProcessSnapshot snapshot = malloc(sizeof(_VFProcessSnapshot));
+    if (snapshot && !VFProcessSnapshotFill(snapshot, error)) {
+        free(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void VFProcessSnapshotRelease(VFProcessSnapshot snapshot) {
+    if (snapshot) {
+        free(snapshot);
+    }
+}
+
+void VFProcessSnapshotGetDelta(const _VFProcessSnapshot *from, const _VFProcessSnapshot *to, VFProcessDelta delta) {
+    if (!from || !to || !delta) {
+        return;
     }
     
-    free((char *)device_name);
-    return type;
+    delta->elapsed              = VFProcessGetDifference(from->timestamp, to->timestamp);
+    delta->user_time            = VFProcessGetDifference(from->user_time, to->user_time);
+    delta->system_time          = VFProcessGetDifference(from->system_time, to->system_time);
+    delta->resident_bytes       = (int64_t)to->resident_bytes - (int64_t)from->resident_bytes;
+    delta->minor_faults         = VFProcessGetDifference(from->minor_faults, to->minor_faults);
+    delta->major_faults         = VFProcessGetDifference(from->major_faults, to->major_faults);
+    delta->voluntary_switches   = VFProcessGetDifference(from->voluntary_switches, to->voluntary_switches);
+    delta->involuntary_switches = VFProcessGetDifference(from->involuntary_switches, to->involuntary_switches);
+    delta->bytes_read           = VFProcessGetDifference(from->bytes_read, to->bytes_read);
+    delta->bytes_written        = VFProcessGetDifference(from->bytes_written, to->bytes_written);
+    delta->chars_read           = VFProcessGetDifference(from->chars_read, to->chars_read);
+    delta->chars_written        = VFProcessGetDifference(from->chars_written, to->chars_written);
+    delta->read_calls           = VFProcessGetDifference(from->read_calls, to->read_calls);
+    delta->write_calls          = VFProcessGetDifference(from->write_calls, to->write_calls);
+}
+
+// The block runs even when the first snapshot fails
+BOOL VFProcessMeasure(VFProcessDelta delta, VFProcessMeasureBlock block, char **error) {
+    if (!delta || !block) {
+        if (error) *error = "Invalid delta or block";
+        return NO;
+    }
+    
+    _VFProcessSnapshot before;
+    _VFProcessSnapshot after;
+    BOOL measured = VFProcessSnapshotFill(&before, error);
+    block();
+    measured = measured && VFProcessSnapshotFill(&after, error);
+    
+    if (measured) {
+        VFProcessSnapshotGetDelta(&before, &after, delta);
+    }
+    return measured;
 }
 
+#pragma mark - Private - Registry -
+static _VFHardwareRegistry kVFHardwareRegistry;
+static pthread_once_t      kVFHardwareRegistryOnce = PTHREAD_ONCE_INIT;
+
+static const char * const kVFHardwareNames[kVFHardwareParameterCount] = {
+#define VFHardwareNumber(key, name) name,
+#define VFHardwareString(key, name) name,
+#include "VFHardwareParameters.def"
+#undef VFHardwareNumber
+#undef VFHardwareString
+};
+
+/*
+ * Models are indexed straight by device, major and minor number, which
+ * makes the identifier itself the perfect hash. The compiler lays the
+ * table out from VFMachineModels.def, a duplicate line would override an
+ * earlier initializer.
+ */
+static const uint8_t kVFMachineModels[VFMachineModelIndex(VFDeviceTypeiPod + 1, 0, 0)] = {
+#define VFMachineModel(device, major, minor, model) [VFMachineModelIndex(VFDeviceType##device, major, minor)] = model,
+#include "VFMachineModels.def"
+#undef VFMachineModel
+};
+
+static const char * const kVFMachineDevices[] = {
+    [VFDeviceTypeiPhone] = "iPhone",
+    [VFDeviceTypeiPad]   = "iPad",
+    [VFDeviceTypeiPod]   = "iPod",
+};
+
+static uint32_t VFHardwareHashName(const char *name, uint32_t seed) {
+    uint32_t hash = 2166136261U ^ seed;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Tries seeds until every name lands in a slot of its own. The names are
+ * fixed, so this ends within a few dozen seeds. Without a seed lookups
+ * fall back to comparing every name.
+ */
+static void VFHardwareRegistryHashNames(VFHardwareRegistry registry) {
+    for (uint32_t seed = 0; seed < kVFHardwareMaximumSeed; seed++) {
+        memset(registry->name_slots, 0, sizeof(registry->name_slots));
+        
+        BOOL is_perfect = YES;
+        for (uint32_t i = 0; i < kVFHardwareParameterCount && is_perfect; i++) {
+            uint32_t slot = VFHardwareHashName(kVFHardwareNames[i], seed) % kVFHardwareNameSlots;
+            is_perfect    = (registry->name_slots[slot] == 0);
+            registry->name_slots[slot] = (uint8_t)(i + 1);
+        }
+        
+        if (is_perfect) {
+            registry->name_seed = seed;
+            registry->is_hashed = YES;
+            return;
+        }
+    }
+}
+
+static int VFHardwareRegistryFindName(const _VFHardwareRegistry *registry, const char *name) {
+    if (!name) {
+        return -1;
+    }
+    
+    if (registry->is_hashed) {
+        int index = registry->name_slots[VFHardwareHashName(name, registry->name_seed) % kVFHardwareNameSlots] - 1;
+        return (index >= 0 && strcmp(kVFHardwareNames[index], name) == 0) ? index : -1;
+    }
+    
+    for (int i = 0; i < kVFHardwareParameterCount; i++) {
+        if (strcmp(kVFHardwareNames[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void VFHardwareRegistrySetNumber(VFHardwareRegistry registry, VFHardwareNumberKey key, uint64_t value) {
+    if (value > 0) {
+        registry->numbers[key]    = value;
+        registry->has_number[key] = YES;
+    }
+}
+
+static void VFHardwareRegistrySetString(VFHardwareRegistry registry, VFHardwareStringKey key, const char *value) {
+    if (value && *value) {
+        snprintf(registry->strings[key], kVFHardwareStringLength, "%s", value);
+        registry->has_string[key] = YES;
+    }
+}
+
+#if defined(__linux__)
+
+// Without sysctl, whatever has an equivalent is filled in
+static void VFHardwareRegistryQuery(VFHardwareRegistry registry) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    long pages     = sysconf(_SC_PHYS_PAGES);
+    VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyCPUCount,     (uint64_t)sysconf(_SC_NPROCESSORS_CONF));
+    VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyCPUAvailable, (uint64_t)sysconf(_SC_NPROCESSORS_ONLN));
+    VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyPagesize,     (uint64_t)page_size);
+    VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyPhysicalMem,  (page_size > 0 && pages > 0) ? (uint64_t)pages * page_size : 0);
+    VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyByteOrder,    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) ? 1234 : 4321);
+    
+    VFTopology topology = VFTopologyGet();
+    VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyCacheLineSize, topology->cache_line_size);
+    for (uint32_t i = 0; i < topology->cache_count; i++) {
+        const _VFTopologyCache *cache = &topology->caches[i];
+        switch (cache->level) {
+            case 1: VFHardwareRegistrySetNumber(registry, (cache->type == VFCacheTypeInstruction) ? VFHardwareNumberKeyL1CacheSize : VFHardwareNumberKeyL1DCacheSize, cache->size); break;
+            case 2: VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyL2CacheSize, cache->size); break;
+            case 3: VFHardwareRegistrySetNumber(registry, VFHardwareNumberKeyL3CacheSize, cache->size); break;
+        }
+    }
+    
+    struct utsname system;
+    if (uname(&system) == 0) {
+        VFHardwareRegistrySetString(registry, VFHardwareStringKeyMachineName, system.machine);
+        VFHardwareRegistrySetString(registry, VFHardwareStringKeyMachineArch, system.machine);
+    }
+    
+    // Boards without DMI name themselves in the device tree
+    const char *model_files[] = { "/sys/devices/virtual/dmi/id/product_name", "/proc/device-tree/model" };
+    for (size_t i = 0; i < 2 && !registry->has_string[VFHardwareStringKeyModelName]; i++) {
+        int file = open(model_files[i], O_RDONLY | O_CLOEXEC);
+        if (file != -1) {
+            char model[kVFHardwareStringLength];
+            ssize_t length = read(file, model, sizeof(model) - 1);
+            close(file);
+            if (length > 0) {
+                model[length] = '\0';
+                model[strcspn(model, "\n")] = '\0';
+                VFHardwareRegistrySetString(registry, VFHardwareStringKeyModelName, model);
+            }
+        }
+    }
+}
 
+#else
 
+static void VFHardwareRegistryQuery(VFHardwareRegistry registry) {
+    for (uint32_t i = 0; i < VFHardwareNumberKeyCount; i++) {
+        uint64_t value = 0;
+        size_t size    = sizeof(value);
+        if (sysctlbyname(kVFHardwareNames[i], &value, &size, NULL, 0) == 0) {
+            registry->numbers[i]    = value;
+            registry->has_number[i] = YES;
+        }
+    }
+    
+    for (uint32_t i = 0; i < VFHardwareStringKeyCount; i++) {
+        size_t size = kVFHardwareStringLength;
+        if (sysctlbyname(kVFHardwareNames[VFHardwareNumberKeyCount + i], registry->strings[i], &size, NULL, 0) == 0) {
+            registry->strings[i][kVFHardwareStringLength - 1] = '\0';
+            registry->has_string[i]                            = YES;
+        }
+    }
+}
 
+#endif
 
+static void VFHardwareRegistryLoad(void) {
+    VFHardwareRegistry registry = &kVFHardwareRegistry;
+    VFHardwareRegistryQuery(registry);
+    VFHardwareRegistryHashNames(registry);
+    
+    if (registry->has_string[VFHardwareStringKeyMachineName]) {
+        VFLookupModel(registry->strings[VFHardwareStringKeyMachineName], &registry->device_type, &registry->model);
+    }
+}
 
+static const _VFHardwareRegistry * VFHardwareRegistryGet(void) {
+    pthread_once(&kVFHardwareRegistryOnce, VFHardwareRegistryLoad);
+    return &kVFHardwareRegistry;
+}
 
+#pragma mark - VFParameters -
+const char * VFParameterGetStringForKey(VFHardwareStringKey key, char **error) {
+    const _VFHardwareRegistry *registry = VFHardwareRegistryGet();
+    if (key >= VFHardwareStringKeyCount || !registry->has_string[key]) {
+        if (error) *error = "Hardware parameter is not available on this machine";
+        return NULL;
+    }
+    return registry->strings[key];
+}
 
+uint64_t VFParameterGetNumberForKey(VFHardwareNumberKey key, char **error) {
+    const _VFHardwareRegistry *registry = VFHardwareRegistryGet();
+    if (key >= VFHardwareNumberKeyCount || !registry->has_number[key]) {
+        if (error) *error = "Hardware parameter is not available on this machine";
+        return 0;
+    }
+    return registry->numbers[key];
+}
 
+const char * VFParameterGetHardwareString(const char *name, char **error) {
+    int index = VFHardwareRegistryFindName(VFHardwareRegistryGet(), name);
+    if (index < VFHardwareNumberKeyCount) {
+        if (error) *error = "Unknown hardware string";
+        return NULL;
+    }
+    return VFParameterGetStringForKey(index - VFHardwareNumberKeyCount, error);
+}
 
+uint64_t VFParameterGetHardwareNumber(const char *name, char **error) {
+    int index = VFHardwareRegistryFindName(VFHardwareRegistryGet(), name);
+    if (index >= 0 && index < VFHardwareNumberKeyCount) {
+        return VFParameterGetNumberForKey(index, error);
+    }
+    
+#if defined(__APPLE__)
+    uint64_t value = 0;
+    size_t size    = sizeof(value);
+    if (sysctlbyname(name, &value, &size, NULL, 0) == -1) {
+        if (error) *error = strerror(errno);
+        return 0;
+    }
+    return value;
+#else
+    if (error) *error = "Unknown hardware number";
+    return 0;
+#endif
+}
 
+const char * VFParameterCopyHardwareName(const char *name, char **error) {
+    int index = VFHardwareRegistryFindName(VFHardwareRegistryGet(), name);
+    if (index >= VFHardwareNumberKeyCount) {
+        const char *value = VFParameterGetStringForKey(index - VFHardwareNumberKeyCount, error);
+        return (value) ? strdup(value) : NULL;
+    }
+    
+#if defined(__APPLE__)
+    size_t size = 0;
+    if (sysctlbyname(name, NULL, &size, NULL, 0) == -1) {
+        if (error) *error = strerror(errno);
+        return NULL;
+    }
+    
+    char *buffer = malloc(size + 1);
+    if (!buffer || sysctlbyname(name, buffer, &size, NULL, 0) == -1) {
+        if (error) *error = strerror(errno);
+        free(buffer);
+        return NULL;
+    }
+    buffer[size] = '\0';
+    return buffer;
+#else
+    if (error) *error = "Unknown hardware string";
+    return NULL;
+#endif
+}
 
+#pragma mark - Device Types -
+BOOL VFLookupModel(const char *identifier, VFDeviceType *device_type, int *model) {
+    VFDeviceType device = VFDeviceTypeUndetermined;
+    int found_model     = 0;
+    
+    size_t length = 0;
+    for (VFDeviceType type = VFDeviceTypeiPhone; identifier && type <= VFDeviceTypeiPod; type++) {
+        length = strlen(kVFMachineDevices[type]);
+        if (strncmp(identifier, kVFMachineDevices[type], length) == 0) {
+            device = type;
+            break;
+        }
+    }
+    
+    if (device != VFDeviceTypeUndetermined) {
+        char *end;
+        unsigned long major = strtoul(identifier + length, &end, 10);
+        unsigned long minor = (*end == ',') ? strtoul(end + 1, &end, 10) : kVFMachineModelMinors;
+        if (*end == '\0' && major < kVFMachineModelMajors && minor < kVFMachineModelMinors) {
+            found_model = kVFMachineModels[VFMachineModelIndex(device, major, minor)];
+        }
+    }
+    
+    if (device_type) *device_type = device;
+    if (model)       *model       = found_model;
+    return (found_model != 0);
+}
 
+const char * VFCopyDeviceName(char **error) {
+    const char *name = VFParameterGetStringForKey(VFHardwareStringKeyMachineName, error);
+    return (name) ? strdup(name) : NULL;
+}
 
+VFDeviceType VFGetDeviceType(char **error) {
+    const _VFHardwareRegistry *registry = VFHardwareRegistryGet();
+    if (!registry->has_string[VFHardwareStringKeyMachineName] && error) {
+        *error = "Hardware parameter is not available on this machine";
+    }
+    return registry->device_type;
+}
 
+VFiPhoneType VFGetiPhoneType(char **error) {
+    const _VFHardwareRegistry *registry = VFHardwareRegistryGet();
+    return (VFGetDeviceType(error) == VFDeviceTypeiPhone) ? registry->model : VFiPhoneTypeUndetermined;
+}
 
+VFiPadType VFGetiPadType(char **error) {
+    const _VFHardwareRegistry *registry = VFHardwareRegistryGet();
+    return (VFGetDeviceType(error) == VFDeviceTypeiPad) ? registry->model : VFiPadTypeUndetermined;
+}
 
+VFiPodType VFGetiPodType(char **error) {
+    const _VFHardwareRegistry *registry = VFHardwareRegistryGet();
+    return (VFGetDeviceType(error) == VFDeviceTypeiPod) ? registry->model : VFiPodTypeUndetermined;
+}
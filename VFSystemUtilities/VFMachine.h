@@ -7,10 +7,17 @@
 
 #import <stdlib.h>
 #import <stdio.h>
+#import <string.h>
+#import <stdint.h>
 #import <errno.h>
-#import <sys/sysctl.h>
-#import <mach/mach_host.h>
-#import <mach/host_info.h>
+
+#if defined(__APPLE__)
+    #import <sys/sysctl.h>
+    #import <mach/mach_host.h>
+    #import <mach/host_info.h>
+#endif
+
+#import "VFFileManager.h"
 
 /*
  * =============================
@@ -19,12 +26,25 @@
  *
  */
 // MARK: - VFMemorySnapshot -
+
+/*
+ * On Linux the fields come from /proc/meminfo and /proc/vmstat. Wired is
+ * the memory the kernel will not reclaim (unevictable pages, unreclaimable
+ * slab, kernel stacks and page tables) and cached is the page cache plus
+ * buffers. Page ins and outs are pages swapped in and out since boot.
+ */
 typedef struct __VFMemorySnapshot {
     uint64_t total_bytes;
     uint64_t wired_bytes;
     uint64_t active_bytes;
     uint64_t inactive_bytes;
     uint64_t free_bytes;
+    uint64_t available_bytes;
+    uint64_t cached_bytes;
+    uint64_t swap_total_bytes;
+    uint64_t swap_free_bytes;
+    uint64_t page_ins;
+    uint64_t page_outs;
 } _VFMemorySnapshot;
 typedef _VFMemorySnapshot * VFMemorySnapshot;
 
@@ -32,31 +52,109 @@ typedef _VFMemorySnapshot * VFMemorySnapshot;
 VFMemorySnapshot VFMemorySnapshotCreate(char **error);
 void VFMemorySnapshotRelease(VFMemorySnapshot snapshot);
 
+/*
+ * Fills a caller provided snapshot without allocating. On Linux the proc
+ * files are opened once and read with pread on every call, which keeps
+ * a sample in the order of a few microseconds, cheap enough for control
+ * loops. Safe to call from multiple threads.
+ */
+BOOL VFMemorySnapshotFill(VFMemorySnapshot snapshot, char **error);
+
+/*
+ * =============================
+ *  VFProcessSnapshot & Related
+ * =============================
+ *
+ */
+// MARK: - VFProcessSnapshot -
+
+/*
+ * Counters of the calling process. On Linux the sizes and thread count
+ * come from /proc/self/stat, the I/O counters from /proc/self/io and
+ * times, faults and context switches from getrusage, with both files
+ * opened once like the memory snapshot's. Reading /proc/self/io needs
+ * ptrace access to ourselves, which some sandboxes deny, has_io is NO then
+ * and the I/O counters stay 0. On Darwin the I/O counters are limited to
+ * the bytes that reached storage.
+ *
+ * Bytes read and written are the ones that went to storage, chars read
+ * and written everything passed through read and write, the page cache
+ * included.
+ */
+typedef struct __VFProcessSnapshot {
+    uint64_t timestamp;            // CLOCK_MONOTONIC, in nanoseconds
+    uint64_t user_time;            // Microseconds
+    uint64_t system_time;          // Microseconds
+    uint64_t resident_bytes;
+    uint64_t peak_resident_bytes;
+    uint64_t virtual_bytes;
+    uint64_t thread_count;
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    BOOL     has_io;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t chars_read;
+    uint64_t chars_written;
+    uint64_t read_calls;
+    uint64_t write_calls;
+} _VFProcessSnapshot;
+typedef _VFProcessSnapshot * VFProcessSnapshot;
+
+// MARK: - VFProcessDelta -
+typedef struct __VFProcessDelta {
+    uint64_t elapsed;              // Nanoseconds
+    uint64_t user_time;
+    uint64_t system_time;
+    int64_t  resident_bytes;       // Negative when memory was given back
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t chars_read;
+    uint64_t chars_written;
+    uint64_t read_calls;
+    uint64_t write_calls;
+} _VFProcessDelta;
+typedef _VFProcessDelta * VFProcessDelta;
+
+typedef void (^VFProcessMeasureBlock)(void);
+
+// MARK: - VFProcessSnapshot Functions -
+VFProcessSnapshot VFProcessSnapshotCreate(char **error);
+void VFProcessSnapshotRelease(VFProcessSnapshot snapshot);
+
+BOOL VFProcessSnapshotFill(VFProcessSnapshot snapshot, char **error); // A few microseconds, safe from multiple threads
+void VFProcessSnapshotGetDelta(const _VFProcessSnapshot *from, const _VFProcessSnapshot *to, VFProcessDelta delta);
+
+/*
+ * Runs block on the calling thread and fills delta with what the process
+ * spent meanwhile, e.g. around a VFCopyFile or an enumeration. The
+ * counters are process wide, so work running on other threads at the
+ * same time is counted too.
+ */
+BOOL VFProcessMeasure(VFProcessDelta delta, VFProcessMeasureBlock block, char **error);
+
 /*
  * =============================
  *    Hardware Number Types
  * =============================
  *
  */
-static const char *kVFHardwareNumberCPUCount      = "hw.ncpu";
-static const char *kVFHardwareNumberByteOrder     = "hw.byteorder";
-static const char *kVFHardwareNumberPhysicalMem   = "hw.physmem";
-static const char *kVFHardwareNumberUserMem       = "hw.usermem";
-static const char *kVFHardwareNumberPagesize      = "hw.pagesize";
-static const char *kVFHardwareNumberEpoch         = "hw.epoch";
-static const char *kVFHardwareNumberFloat         = "hw.floatingpoint";
-static const char *kVFHardwareNumberVectorUnit    = "hw.vectorunit";
-static const char *kVFHardwareNumberBusFrequency  = "hw.busfrequency";
-static const char *kVFHardwareNumberCPUFrequency  = "hw.cpufrequency";
-static const char *kVFHardwareNumberCacheLineSize = "hw.cachelinesize";
-static const char *kVFHardwareNumberL1CacheSize   = "hw.l1icachesize";
-static const char *kVFHardwareNumberL1DCacheSize  = "hw.l1dcachesize";
-static const char *kVFHardwareNumberL2CacheSize   = "hw.l2cachesize";
-static const char *kVFHardwareNumberL2Settings    = "hw.l2settings";
-static const char *kVFHardwareNumberL3CacheSize   = "hw.l3cachesize";
-static const char *kVFHardwareNumberL3Settings    = "hw.l3settings";
-static const char *kVFHardwareNumberTBFrequency   = "hw.tbfrequency";
-static const char *kVFHardwareNumberCPUAvailable  = "hw.availcpu";
+#define VFHardwareNumber(key, name) static const char *kVFHardwareNumber##key = name;
+#include "VFHardwareParameters.def"
+#undef VFHardwareNumber
+
+typedef enum {
+#define VFHardwareNumber(key, name) VFHardwareNumberKey##key,
+#include "VFHardwareParameters.def"
+#undef VFHardwareNumber
+    VFHardwareNumberKeyCount,
+} VFHardwareNumberKey;
 
 /*
  * =============================
@@ -64,9 +162,16 @@ static const char *kVFHardwareNumberCPUAvailable  = "hw.availcpu";
  * =============================
  *
  */
-static const char *kVFHardwareStringMachineName = "hw.machine";
-static const char *kVFHardwareStringMachineArch = "hw.machinearch";
-static const char *kVFHardwareStringModelName   = "hw.model";
+#define VFHardwareString(key, name) static const char *kVFHardwareString##key = name;
+#include "VFHardwareParameters.def"
+#undef VFHardwareString
+
+typedef enum {
+#define VFHardwareString(key, name) VFHardwareStringKey##key,
+#include "VFHardwareParameters.def"
+#undef VFHardwareString
+    VFHardwareStringKeyCount,
+} VFHardwareStringKey;
 
 /*
  * =============================
@@ -135,9 +240,24 @@ typedef enum {
  * =============================
  *
  */
-const char * VFParameterCopyHardwareName(const char *name, char **error);
+
+/*
+ * Every parameter is read once, on first use, into a table that never
+ * changes afterwards, so lookups take no lock and don't allocate. Keys
+ * index the table directly and sysctl names go through a perfect hash
+ * built along with it. On Darwin, names outside the table fall back to
+ * a live sysctl when copying a string or reading a number, only the
+ * borrowed string getter is limited to the table. On Linux the numbers
+ * come from sysconf and VFTopology and the strings from uname and DMI,
+ * parameters without an equivalent there report an error.
+ */
+const char * VFParameterCopyHardwareName(const char *name, char **error); // Caller frees
+const char * VFParameterGetHardwareString(const char *name, char **error);
 uint64_t VFParameterGetHardwareNumber(const char *name, char **error);
 
+const char * VFParameterGetStringForKey(VFHardwareStringKey key, char **error);
+uint64_t VFParameterGetNumberForKey(VFHardwareNumberKey key, char **error);
+
 /*
  * =============================
  *     Convenience Functions
@@ -146,6 +266,13 @@ uint64_t VFParameterGetHardwareNumber(const char *name, char **error);
  */
 const char * VFCopyDeviceName(char **error);
 
+/*
+ * Device and model of any hw.machine identifier, such as "iPhone6,2",
+ * from VFMachineModels.def. Model is one of the VFiPhoneType, VFiPadType
+ * or VFiPodType values, 0 when the device is known but not the model.
+ */
+BOOL VFLookupModel(const char *identifier, VFDeviceType *device_type, int *model);
+
 VFDeviceType VFGetDeviceType(char **error);
 VFiPhoneType VFGetiPhoneType(char **error);
 VFiPadType VFGetiPadType(char **error);
@@ -0,0 +1,514 @@
+//
+//  VFMountTable.c
+//
+//  Created by Dima Bart on 2014-08-31.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <poll.h>
+#import <time.h>
+#import <fcntl.h>
+#import <errno.h>
+#import <unistd.h>
+#import <limits.h>
+#import <sys/stat.h>
+#import <sys/statvfs.h>
+
+#if defined(__linux__)
+    #import <sys/sysmacros.h>
+#elif defined(__APPLE__)
+    #import <sys/param.h>
+    #import <sys/mount.h>
+#endif
+
+#import "VFMountTable.h"
+
+static const uint32_t kVFMountTableDefaultInterval = 1000;
+static const size_t   kVFMountTableBufferSize      = 16 * 1024;
+
+#pragma mark - Private -
+static uint64_t VFMountTableGetTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int VFMountCompare(const void *a, const void *b) {
+    const _VFMount *lhs = a;
+    const _VFMount *rhs = b;
+    if (lhs->path_length != rhs->path_length) {
+        return (lhs->path_length > rhs->path_length) ? -1 : 1;
+    }
+    return (lhs->order > rhs->order) ? -1 : (lhs->order < rhs->order);
+}
+
+// Automounter triggers would mount their file system just to be measured
+static void VFMountStat(VFMount mount) {
+    struct statvfs system_stat;
+    mount->is_valid = (strcmp(mount->file_system, "autofs") != 0 && statvfs(mount->path, &system_stat) == 0);
+    if (!mount->is_valid) {
+        return;
+    }
+    
+    uint64_t block_size    = (uint64_t)system_stat.f_frsize;
+    mount->system_id       = system_stat.f_fsid;
+    mount->max_file_length = system_stat.f_namemax;
+    mount->block_size      = block_size;
+    mount->bytes_total     = (uint64_t)system_stat.f_blocks * block_size;
+    mount->bytes_free      = (uint64_t)system_stat.f_bfree  * block_size;
+    mount->bytes_available = (uint64_t)system_stat.f_bavail * block_size;
+    mount->files_total     = (uint64_t)system_stat.f_files;
+    mount->files_free      = (uint64_t)system_stat.f_ffree;
+    mount->files_available = (uint64_t)system_stat.f_favail;
+}
+
+#if defined(__linux__)
+
+#pragma mark - Private - Loading -
+
+// Mount points escape spaces, tabs, newlines and backslashes as \ooo
+static void VFMountUnescape(char *string) {
+    char *output = string;
+    while (*string) {
+        if (string[0] == '\\' && string[1] >= '0' && string[1] <= '7' && string[2] >= '0' && string[2] <= '7' && string[3] >= '0' && string[3] <= '7') {
+            *output++ = (char)((string[1] - '0') * 64 + (string[2] - '0') * 8 + (string[3] - '0'));
+            string   += 4;
+        } else {
+            *output++ = *string++;
+        }
+    }
+    *output = '\0';
+}
+
+static char * VFMountTableReadFile(int file, char **error) {
+    size_t capacity = kVFMountTableBufferSize;
+    size_t length   = 0;
+    char *buffer    = malloc(capacity);
+    
+    lseek(file, 0, SEEK_SET);
+    while (buffer) {
+        if (length + 1 >= capacity) {
+            capacity   *= 2;
+            char *grown = realloc(buffer, capacity);
+            if (!grown) {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+        }
+        
+        ssize_t bytes_read = read(file, buffer + length, capacity - length - 1);
+        if (bytes_read > 0) {
+            length += bytes_read;
+        } else if (bytes_read == 0) {
+            buffer[length] = '\0';
+            return buffer;
+        } else if (errno != EINTR) {
+            free(buffer);
+            buffer = NULL;
+        }
+    }
+    if (error) *error = "Failed to read the mount table";
+    return NULL;
+}
+
+/*
+ * "id parent major:minor root mount_point options [optional ...] - type
+ * source super_options". The mount table points straight into the file's
+ * contents, which are split and unescaped in place and kept as strings.
+ */
+static BOOL VFMountTableLoad(VFMountTable table, VFMount *mounts, size_t *count, char **strings, char **error) {
+    char *buffer = VFMountTableReadFile(table->mount_file, error);
+    if (!buffer) {
+        return NO;
+    }
+    
+    size_t lines = 0;
+    for (char *line = buffer; (line = strchr(line, '\n')); line++) {
+        lines++;
+    }
+    
+    VFMount list = calloc(lines + 1, sizeof(_VFMount));
+    if (!list) {
+        if (error) *error = "Failed to allocate the mount table";
+        free(buffer);
+        return NO;
+    }
+    
+    size_t index = 0;
+    char *next   = buffer;
+    while (next && *next) {
+        char *line = next;
+        next       = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        
+        char *fields[6];
+        char *cursor = line;
+        size_t field = 0;
+        for (; field < 6 && cursor; field++) {
+            fields[field] = strsep(&cursor, " ");
+        }
+        char *separator = (cursor) ? strstr(cursor, "- ") : NULL;
+        if (field < 6 || !separator || (separator != cursor && separator[-1] != ' ')) {
+            continue;
+        }
+        
+        cursor            = separator + 2;
+        char *file_system = strsep(&cursor, " ");
+        char *source      = (cursor) ? strsep(&cursor, " ") : "";
+        
+        unsigned int device_major;
+        unsigned int device_minor;
+        if (sscanf(fields[2], "%u:%u", &device_major, &device_minor) != 2) {
+            continue;
+        }
+        
+        VFMountUnescape(fields[4]);
+        VFMountUnescape(source);
+        
+        VFMount mount      = &list[index];
+        mount->path        = fields[4];
+        mount->source      = source;
+        mount->file_system = file_system;
+        mount->path_length = strlen(mount->path);
+        mount->device      = makedev(device_major, device_minor);
+        mount->order       = (uint32_t)index;
+        index++;
+    }
+    
+    *mounts  = list;
+    *count   = index;
+    *strings = buffer;
+    return YES;
+}
+
+#else
+
+#pragma mark - Private - Loading -
+static BOOL VFMountTableLoad(VFMountTable table, VFMount *mounts, size_t *count, char **strings, char **error) {
+    struct statfs *systems;
+    int system_count = getmntinfo(&systems, MNT_NOWAIT);
+    if (system_count <= 0) {
+        if (error) *error = strerror(errno);
+        return NO;
+    }
+    
+    size_t length = 0;
+    for (int i = 0; i < system_count; i++) {
+        length += strlen(systems[i].f_mntonname) + strlen(systems[i].f_mntfromname) + strlen(systems[i].f_fstypename) + 3;
+    }
+    
+    VFMount list = calloc(system_count, sizeof(_VFMount));
+    char *buffer = malloc(length);
+    if (!list || !buffer) {
+        if (error) *error = "Failed to allocate the mount table";
+        free(list);
+        free(buffer);
+        return NO;
+    }
+    
+    char *cursor = buffer;
+    for (int i = 0; i < system_count; i++) {
+        VFMount mount      = &list[i];
+        mount->path        = strcpy(cursor, systems[i].f_mntonname);
+        cursor            += strlen(cursor) + 1;
+        mount->source      = strcpy(cursor, systems[i].f_mntfromname);
+        cursor            += strlen(cursor) + 1;
+        mount->file_system = strcpy(cursor, systems[i].f_fstypename);
+        cursor            += strlen(cursor) + 1;
+        mount->path_length = strlen(mount->path);
+        mount->device      = (dev_t)systems[i].f_fsid.val[0];
+        mount->order       = (uint32_t)i;
+    }
+    
+    *mounts  = list;
+    *count   = system_count;
+    *strings = buffer;
+    return YES;
+}
+
+#endif
+
+#pragma mark - Private - Updating -
+
+/*
+ * Only one update runs at a time, which keeps the mount points stable
+ * while they are measured without holding the read write lock. Readers
+ * are only locked out for the swap of the arrays.
+ */
+static BOOL VFMountTableUpdate(VFMountTable table, BOOL reload, char **error) {
+    pthread_mutex_lock(&table->update_lock);
+    
+#if !defined(__linux__)
+    reload = YES;
+#endif
+
+    VFMount mounts = NULL;
+    size_t count   = table->count;
+    char *strings  = table->strings;
+    if (reload || !table->mounts) {
+        if (!VFMountTableLoad(table, &mounts, &count, &strings, error)) {
+            pthread_mutex_unlock(&table->update_lock);
+            return NO;
+        }
+        qsort(mounts, count, sizeof(_VFMount), VFMountCompare);
+        reload = YES;
+        
+    } else {
+        mounts = malloc(count * sizeof(_VFMount));
+        if (!mounts) {
+            if (error) *error = "Failed to allocate the mount table";
+            pthread_mutex_unlock(&table->update_lock);
+            return NO;
+        }
+        memcpy(mounts, table->mounts, count * sizeof(_VFMount));
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        VFMountStat(&mounts[i]);
+    }
+    
+    pthread_rwlock_wrlock(&table->lock);
+    VFMount old_mounts = table->mounts;
+    char *old_strings  = table->strings;
+    table->mounts      = mounts;
+    table->count       = count;
+    table->strings     = strings;
+    if (reload) {
+        table->generation++;
+    }
+    table->refreshes++;
+    pthread_rwlock_unlock(&table->lock);
+    
+    free(old_mounts);
+    if (old_strings != strings) {
+        free(old_strings);
+    }
+    
+    pthread_mutex_unlock(&table->update_lock);
+    return YES;
+}
+
+static void * VFMountTableRun(void *context) {
+    VFMountTable table           = context;
+    struct pollfd descriptors[2] = {
+        { .fd = table->wake[0],    .events = POLLIN },
+        { .fd = table->mount_file, .events = POLLPRI },
+    };
+    nfds_t descriptor_count = (table->mount_file >= 0) ? 2 : 1;
+    uint64_t deadline       = VFMountTableGetTime() + table->interval;
+    
+    while (YES) {
+        uint64_t now = VFMountTableGetTime();
+        int ready    = poll(descriptors, descriptor_count, (deadline > now) ? (int)(deadline - now) : 0);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (descriptors[0].revents) {
+            break;
+        }
+        
+        if (descriptor_count > 1 && (descriptors[1].revents & (POLLPRI | POLLERR))) {
+            VFMountTableUpdate(table, YES, NULL);
+            deadline = VFMountTableGetTime() + table->interval;
+            
+        } else if (ready == 0) {
+            VFMountTableUpdate(table, NO, NULL);
+            
+            // Without trying to catch up on missed refreshes
+            now       = VFMountTableGetTime();
+            deadline += table->interval;
+            if (deadline < now) {
+                deadline = now;
+            }
+        }
+    }
+    return NULL;
+}
+
+#pragma mark - Private - Lookup -
+static const char * VFMountTableResolve(const char *path, char *resolved) {
+    if (!path) {
+        return NULL;
+    }
+    return (path[0] == '/') ? path : realpath(path, resolved);
+}
+
+// Must be called with the read lock held
+static VFMount VFMountTableFind(VFMountTable table, const char *path) {
+    for (size_t i = 0; i < table->count; i++) {
+        VFMount mount = &table->mounts[i];
+        size_t length = mount->path_length;
+        if (length > 0 && strncmp(path, mount->path, length) == 0 && (path[length] == '/' || path[length] == '\0' || mount->path[length - 1] == '/')) {
+            return mount;
+        }
+    }
+    return NULL;
+}
+
+static void VFMountCopy(const _VFMount *source, VFMount mount, char *buffer, size_t length) {
+    *mount = *source;
+    
+    const char *strings[3] = { source->path, source->source, source->file_system };
+    char **targets[3]      = { &mount->path, &mount->source, &mount->file_system };
+    for (int i = 0; i < 3; i++) {
+        *targets[i] = NULL;
+        if (buffer && length > 0) {
+            size_t copied = (size_t)snprintf(buffer, length, "%s", strings[i]) + 1;
+            *targets[i]   = buffer;
+            copied        = (copied < length) ? copied : length;
+            buffer       += copied;
+            length       -= copied;
+        }
+    }
+}
+
+#pragma mark - VFMountTable -
+VFMountTable VFMountTableCreate(uint32_t interval, char **error) {
+    VFMountTable table = calloc(1, sizeof(_VFMountTable));
+    if (!table) {
+        if (error) *error = "Failed to allocate the mount table";
+        return NULL;
+    }
+    
+    table->interval   = (interval > 0) ? interval : kVFMountTableDefaultInterval;
+    table->mount_file = -1;
+    table->wake[0]    = -1;
+    table->wake[1]    = -1;
+    pthread_rwlock_init(&table->lock, NULL);
+    pthread_mutex_init(&table->update_lock, NULL);
+    
+#if defined(__linux__)
+    table->mount_file = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (table->mount_file == -1) {
+        if (error) *error = strerror(errno);
+        VFMountTableRelease(table);
+        return NULL;
+    }
+#endif
+
+    if (pipe(table->wake) != 0) {
+        if (error) *error = strerror(errno);
+        VFMountTableRelease(table);
+        return NULL;
+    }
+    
+    if (!VFMountTableUpdate(table, YES, error)) {
+        VFMountTableRelease(table);
+        return NULL;
+    }
+    
+    if (pthread_create(&table->thread, NULL, VFMountTableRun, table) != 0) {
+        if (error) *error = "Failed to start the mount table thread";
+        VFMountTableRelease(table);
+        return NULL;
+    }
+    table->is_running = YES;
+    return table;
+}
+
+void VFMountTableRelease(VFMountTable table) {
+    if (table) {
+        if (table->is_running) {
+            char signal = 0;
+            write(table->wake[1], &signal, 1);
+            pthread_join(table->thread, NULL);
+        }
+        if (table->wake[1] >= 0)    close(table->wake[1]);
+        if (table->wake[0] >= 0)    close(table->wake[0]);
+        if (table->mount_file >= 0) close(table->mount_file);
+        
+        pthread_rwlock_destroy(&table->lock);
+        pthread_mutex_destroy(&table->update_lock);
+        free(table->mounts);
+        free(table->strings);
+        free(table);
+    }
+}
+
+BOOL VFMountTableRefresh(VFMountTable table, char **error) {
+    if (!table) {
+        if (error) *error = "Invalid mount table";
+        return NO;
+    }
+    return VFMountTableUpdate(table, YES, error);
+}
+
+size_t VFMountTableGetCount(VFMountTable table) {
+    pthread_rwlock_rdlock(&table->lock);
+    size_t count = table->count;
+    pthread_rwlock_unlock(&table->lock);
+    return count;
+}
+
+uint64_t VFMountTableGetGeneration(VFMountTable table) {
+    __sync_synchronize();
+    return table->generation;
+}
+
+BOOL VFMountTableGetDescription(VFMountTable table, const char *path, VFDiskDescription description, char **error) {
+    char resolved[PATH_MAX];
+    path = VFMountTableResolve(path, resolved);
+    if (!table || !path || !description) {
+        if (error) *error = "Invalid path specified";
+        return NO;
+    }
+    
+    pthread_rwlock_rdlock(&table->lock);
+    VFMount mount = VFMountTableFind(table, path);
+    BOOL success  = (mount && mount->is_valid);
+    if (success) {
+        description->system_id       = mount->system_id;
+        description->max_file_length = mount->max_file_length;
+        description->bytes_total     = mount->bytes_total;
+        description->bytes_free      = mount->bytes_free;
+        description->bytes_available = mount->bytes_available;
+    }
+    pthread_rwlock_unlock(&table->lock);
+    
+    if (!success && error) {
+        *error = (mount) ? "The file system of the path could not be measured" : "No mount holds the path";
+    }
+    return success;
+}
+
+uint64_t VFMountTableGetAvailableBytes(VFMountTable table, const char *path) {
+    _VFDiskDescription description;
+    return (VFMountTableGetDescription(table, path, &description, NULL)) ? description.bytes_available : 0;
+}
+
+BOOL VFMountTableCopyMount(VFMountTable table, size_t index, VFMount mount, char *buffer, size_t length) {
+    if (!table || !mount) {
+        return NO;
+    }
+    
+    pthread_rwlock_rdlock(&table->lock);
+    BOOL success = (index < table->count);
+    if (success) {
+        VFMountCopy(&table->mounts[index], mount, buffer, length);
+    }
+    pthread_rwlock_unlock(&table->lock);
+    return success;
+}
+
+BOOL VFMountTableCopyMountForPath(VFMountTable table, const char *path, VFMount mount, char *buffer, size_t length) {
+    char resolved[PATH_MAX];
+    path = VFMountTableResolve(path, resolved);
+    if (!table || !path || !mount) {
+        return NO;
+    }
+    
+    pthread_rwlock_rdlock(&table->lock);
+    VFMount found = VFMountTableFind(table, path);
+    if (found) {
+        VFMountCopy(found, mount, buffer, length);
+    }
+    pthread_rwlock_unlock(&table->lock);
+    return (found != NULL);
+}
@@ -0,0 +1,93 @@
+//
+//  VFMountTable.h
+//
+//  Created by Dima Bart on 2014-08-31.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <pthread.h>
+#import <sys/types.h>
+
+#import "VFFileManager.h"
+
+/*
+ * =============================
+ *     VFMountTable & Related
+ * =============================
+ *
+ */
+// MARK: - VFMount -
+typedef struct __VFMount {
+    char     *path;
+    char     *source;
+    char     *file_system;
+    size_t    path_length;
+    dev_t     device;
+    uint32_t  order;           // Position in the mount table, later mounts cover earlier ones
+    BOOL      is_valid;        // NO when statvfs failed for the mount point
+    uint64_t  system_id;
+    uint64_t  max_file_length;
+    uint64_t  block_size;
+    uint64_t  bytes_total;
+    uint64_t  bytes_free;
+    uint64_t  bytes_available;
+    uint64_t  files_total;
+    uint64_t  files_free;
+    uint64_t  files_available;
+} _VFMount;
+typedef _VFMount * VFMount;
+
+// MARK: - VFMountTable -
+
+/*
+ * Every mount of the system with its statvfs results, loaded once and
+ * refreshed by a background thread in one batch every interval
+ * milliseconds. The thread also polls /proc/self/mountinfo, which the
+ * kernel flags with POLLPRI whenever a file system is mounted or
+ * unmounted, and reloads the table right away. On Darwin the table is
+ * reloaded from getmntinfo at every refresh instead.
+ *
+ * Queries find the mount of a path by the longest mount point that is a
+ * prefix of it, under a read lock and without a system call, and answer
+ * with numbers at most one interval old. Paths are taken as they are,
+ * symbolic links in them aren't resolved, relative paths are made
+ * absolute with realpath first.
+ */
+typedef struct __VFMountTable {
+    pthread_rwlock_t  lock;
+    pthread_mutex_t   update_lock;
+    VFMount           mounts;      // Longest mount point first
+    size_t            count;
+    char             *strings;
+    volatile uint64_t generation;  // Bumped on every reload
+    volatile uint64_t refreshes;
+    uint32_t          interval;
+    int               mount_file;
+    int               wake[2];
+    pthread_t         thread;
+    BOOL              is_running;  // The thread was started and must be joined
+} _VFMountTable;
+typedef _VFMountTable * VFMountTable;
+
+// MARK: - VFMountTable Functions -
+VFMountTable VFMountTableCreate(uint32_t interval, char **error); // 0 for the default of 1000 ms
+void VFMountTableRelease(VFMountTable table);
+
+BOOL VFMountTableRefresh(VFMountTable table, char **error); // Reloads the mounts and their statvfs right away
+size_t VFMountTableGetCount(VFMountTable table);
+uint64_t VFMountTableGetGeneration(VFMountTable table);
+
+BOOL VFMountTableGetDescription(VFMountTable table, const char *path, VFDiskDescription description, char **error);
+uint64_t VFMountTableGetAvailableBytes(VFMountTable table, const char *path); // 0 when unknown
+
+/*
+ * Copies the mount at index, or the one holding path, into mount. The
+ * strings are copied into buffer, which should be PATH_MAX * 2 bytes to
+ * never truncate them.
+ */
+BOOL VFMountTableCopyMount(VFMountTable table, size_t index, VFMount mount, char *buffer, size_t length);
+BOOL VFMountTableCopyMountForPath(VFMountTable table, const char *path, VFMount mount, char *buffer, size_t length);
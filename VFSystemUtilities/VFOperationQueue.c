@@ -0,0 +1,463 @@
+//
+//  VFOperationQueue.c
+//
+//  Created by Dima Bart on 2014-08-06.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <libgen.h>
+#import <Block.h>
+
+#import "VFOperationQueue.h"
+#import "VFGovernor.h"
+#import "VFDeviceProfile.h"
+
+static const long kVFOperationDispatchPriorities[] = {
+    DISPATCH_QUEUE_PRIORITY_BACKGROUND,
+    DISPATCH_QUEUE_PRIORITY_LOW,
+    DISPATCH_QUEUE_PRIORITY_DEFAULT,
+    DISPATCH_QUEUE_PRIORITY_HIGH,
+};
+
+static const int kVFOperationPriorityCount = 4;
+
+#pragma mark - Private -
+static void VFOperationRun(VFOperation operation);
+
+static dev_t VFOperationGetDevice(const char *path, BOOL use_parent) {
+    struct stat file;
+    if (!use_parent) {
+        return (lstat(path, &file) == 0) ? file.st_dev : 0;
+    }
+    
+    char *stack  = strdup(path);
+    dev_t device = (stack && stat(dirname(stack), &file) == 0) ? file.st_dev : 0;
+    free(stack);
+    return device;
+}
+
+static VFOperation VFOperationCreate(VFOperationQueue queue, VFOperationKind kind, const char *from, const char *to, VFOperationPriority priority, VFOperationCompletionBlock completion) {
+    VFOperation operation = calloc(1, sizeof(_VFOperation));
+    if (operation) {
+        operation->kind        = kind;
+        operation->priority    = (priority < kVFOperationPriorityCount) ? priority : VFOperationPriorityDefault;
+        operation->state       = VFOperationStatePending;
+        operation->from        = strdup(from);
+        operation->to          = (to) ? strdup(to) : NULL;
+        operation->device      = VFOperationGetDevice(from, NO);
+        operation->references  = 2; // Caller and queue
+        operation->completion  = (completion) ? Block_copy(completion) : NULL;
+        operation->queue       = queue;
+        
+        pthread_mutex_init(&operation->lock, NULL);
+        pthread_cond_init(&operation->finished, NULL);
+        
+        struct stat file;
+        switch (kind) {
+            case VFOperationKindCreateDirectory:
+                operation->is_metadata = YES;
+                break;
+                
+            case VFOperationKindDelete:
+                operation->is_metadata = (lstat(from, &file) == 0 && !S_ISDIR(file.st_mode));
+                break;
+                
+            case VFOperationKindMove:
+                operation->is_metadata = (operation->device != 0 && operation->device == VFOperationGetDevice(to, YES));
+                break;
+                
+            default:
+                operation->is_metadata = NO;
+                break;
+        }
+    }
+    return operation;
+}
+
+static void VFOperationComplete(VFOperation operation, VFOperationState state, const char *error) {
+    BOOL success      = (state == VFOperationStateFinished);
+    char *error_copy  = (!success && error) ? strdup(error) : NULL;
+    
+    if (operation->completion) {
+        operation->completion(operation, success, error_copy);
+    }
+    
+    // Waiters are only woken once the completion block has run
+    pthread_mutex_lock(&operation->lock);
+    operation->error = error_copy;
+    operation->state = state;
+    pthread_cond_broadcast(&operation->finished);
+    pthread_mutex_unlock(&operation->lock);
+}
+
+static VFOperationDevice VFOperationQueueGetDevice(VFOperationQueue queue, dev_t device_id) {
+    VFOperationDevice device = queue->devices;
+    while (device && device->device != device_id) {
+        device = device->next;
+    }
+    
+    if (!device) {
+        device = calloc(1, sizeof(_VFOperationDevice));
+        if (device) {
+            device->device  = device_id;
+            device->next    = queue->devices;
+            queue->devices  = device;
+        }
+    }
+    return device;
+}
+
+static VFOperation VFOperationDeviceDequeue(VFOperationDevice device) {
+    for (int priority = kVFOperationPriorityCount - 1; priority >= 0; priority--) {
+        VFOperation operation = device->pending_head[priority];
+        if (operation) {
+            device->pending_head[priority] = operation->next;
+            if (!operation->next) {
+                device->pending_tail[priority] = NULL;
+            }
+            operation->next = NULL;
+            return operation;
+        }
+    }
+    return NULL;
+}
+
+static void VFOperationDeviceEnqueue(VFOperationDevice device, VFOperation operation) {
+    int priority = operation->priority;
+    if (device->pending_tail[priority]) {
+        device->pending_tail[priority]->next = operation;
+    } else {
+        device->pending_head[priority] = operation;
+    }
+    device->pending_tail[priority] = operation;
+}
+
+/*
+ * Takes pending operations, highest priority and oldest first, for as
+ * long as the device is under limit. They come back chained in the order
+ * they were taken, ready to be dispatched once the lock is released.
+ */
+static VFOperation VFOperationDeviceStart(VFOperationDevice device, long limit) {
+    VFOperation head = NULL;
+    VFOperation tail = NULL;
+    VFOperation pending;
+    while (device->running < limit && (pending = VFOperationDeviceDequeue(device))) {
+        if (tail) {
+            tail->next = pending;
+        } else {
+            head = pending;
+        }
+        tail = pending;
+        device->running++;
+    }
+    return head;
+}
+
+static BOOL VFOperationDeviceRemove(VFOperationDevice device, VFOperation operation) {
+    int priority          = operation->priority;
+    VFOperation previous  = NULL;
+    VFOperation current   = device->pending_head[priority];
+    while (current && current != operation) {
+        previous = current;
+        current  = current->next;
+    }
+    
+    if (!current) {
+        return NO;
+    }
+    
+    if (previous) {
+        previous->next = current->next;
+    } else {
+        device->pending_head[priority] = current->next;
+    }
+    if (device->pending_tail[priority] == current) {
+        device->pending_tail[priority] = previous;
+    }
+    current->next = NULL;
+    return YES;
+}
+
+static void VFOperationDispatch(VFOperation operation) {
+    dispatch_async(dispatch_get_global_queue(kVFOperationDispatchPriorities[operation->priority], 0), ^{
+        VFOperationRun(operation);
+    });
+}
+
+static void VFOperationDispatchAll(VFOperation operation) {
+    while (operation) {
+        VFOperation next = operation->next;
+        operation->next  = NULL;
+        VFOperationDispatch(operation);
+        operation = next;
+    }
+}
+
+// The governor and the device profile lower the limit, never raise it
+static long VFOperationQueueGetLimit(VFOperationQueue queue, VFOperation operation) {
+    long limit = VFGovernorGetQueueDepth();
+    if (limit > queue->device_limit) {
+        limit = queue->device_limit;
+    }
+    
+    _VFDeviceProfile profile;
+    if (!operation->is_metadata && operation->device != 0 && VFDeviceProfileGetForDevice(operation->device, &profile, NULL)) {
+        if (limit > (long)profile.parallelism) {
+            limit = profile.parallelism;
+        }
+        if (profile.queue_depth > 0 && limit > (long)profile.queue_depth) {
+            limit = profile.queue_depth;
+        }
+    }
+    return limit;
+}
+
+static void VFOperationQueueFinish(VFOperationQueue queue, VFOperation operation) {
+    VFOperation next = NULL;
+    long limit       = VFOperationQueueGetLimit(queue, operation);
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    /* ---------------------------------------
+     * Start as many pending operations as the
+     * current limit allows, which may be none
+     * when it went down since they started.
+     */
+    if (!operation->is_metadata) {
+        VFOperationDevice device = VFOperationQueueGetDevice(queue, operation->device);
+        if (device) {
+            device->running--;
+            next = VFOperationDeviceStart(device, limit);
+        }
+    }
+    
+    queue->outstanding--;
+    if (queue->outstanding == 0) {
+        pthread_cond_broadcast(&queue->drained);
+    }
+    
+    pthread_mutex_unlock(&queue->lock);
+    
+    VFOperationRelease(operation);
+    VFOperationDispatchAll(next);
+}
+
+static void VFOperationRun(VFOperation operation) {
+    pthread_mutex_lock(&operation->lock);
+    operation->state = VFOperationStateRunning;
+    pthread_mutex_unlock(&operation->lock);
+    
+    char *error  = NULL;
+    BOOL success = NO;
+    switch (operation->kind) {
+        case VFOperationKindCopy:
+            success = VFCopyFile(operation->from, operation->to, &error);
+            break;
+            
+        case VFOperationKindMove:
+            success = VFMoveFile(operation->from, operation->to, &error);
+            break;
+            
+        case VFOperationKindDelete:
+            success = VFFileDeleteRecursive(operation->from, VFFileDeleteOptionNone, NULL, &error);
+            break;
+            
+        case VFOperationKindCreateDirectory:
+            success = VFCreateDirectory(operation->from, &error);
+            break;
+    }
+    
+    VFOperationComplete(operation, (success) ? VFOperationStateFinished : VFOperationStateFailed, (error) ? error : "Operation failed");
+    VFOperationQueueFinish(operation->queue, operation);
+}
+
+static VFOperation VFOperationQueueSubmit(VFOperationQueue queue, VFOperation operation) {
+    if (!operation) {
+        return NULL;
+    }
+    
+    VFOperation start = operation;
+    long limit        = VFOperationQueueGetLimit(queue, operation);
+    
+    pthread_mutex_lock(&queue->lock);
+    queue->outstanding++;
+    
+    /* ---------------------------------------
+     * Metadata operations skip the device
+     * limits entirely. Bulk ones always go
+     * through the pending queues, so they
+     * never overtake older or more urgent
+     * work left waiting by a lower limit.
+     */
+    if (!operation->is_metadata) {
+        VFOperationDevice device = VFOperationQueueGetDevice(queue, operation->device);
+        if (device) {
+            VFOperationDeviceEnqueue(device, operation);
+            start = VFOperationDeviceStart(device, limit);
+        }
+    }
+    
+    pthread_mutex_unlock(&queue->lock);
+    
+    VFOperationDispatchAll(start);
+    return operation;
+}
+
+#pragma mark - VFOperation -
+BOOL VFOperationCancel(VFOperation operation) {
+    if (!operation) {
+        return NO;
+    }
+    
+    VFOperationQueue queue = operation->queue;
+    BOOL is_removed        = NO;
+    
+    pthread_mutex_lock(&queue->lock);
+    if (!operation->is_metadata) {
+        VFOperationDevice device = VFOperationQueueGetDevice(queue, operation->device);
+        is_removed               = (device && VFOperationDeviceRemove(device, operation));
+    }
+    if (is_removed) {
+        queue->outstanding--;
+        if (queue->outstanding == 0) {
+            pthread_cond_broadcast(&queue->drained);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    
+    // Operations that already started run to completion
+    if (is_removed) {
+        VFOperationComplete(operation, VFOperationStateCancelled, "Operation was cancelled");
+        VFOperationRelease(operation);
+    }
+    return is_removed;
+}
+
+BOOL VFOperationWait(VFOperation operation, char **error) {
+    if (!operation) {
+        return NO;
+    }
+    
+    pthread_mutex_lock(&operation->lock);
+    while (operation->state == VFOperationStatePending || operation->state == VFOperationStateRunning) {
+        pthread_cond_wait(&operation->finished, &operation->lock);
+    }
+    
+    BOOL success = (operation->state == VFOperationStateFinished);
+    if (!success && error) {
+        *error = operation->error;
+    }
+    pthread_mutex_unlock(&operation->lock);
+    
+    return success;
+}
+
+VFOperationState VFOperationGetState(VFOperation operation) {
+    if (!operation) {
+        return VFOperationStateFailed;
+    }
+    
+    pthread_mutex_lock(&operation->lock);
+    VFOperationState state = operation->state;
+    pthread_mutex_unlock(&operation->lock);
+    
+    return state;
+}
+
+void VFOperationRelease(VFOperation operation) {
+    if (operation && __sync_sub_and_fetch(&operation->references, 1) == 0) {
+        if (operation->completion) {
+            Block_release(operation->completion);
+        }
+        pthread_mutex_destroy(&operation->lock);
+        pthread_cond_destroy(&operation->finished);
+        free(operation->from);
+        free(operation->to);
+        free(operation->error);
+        free(operation);
+    }
+}
+
+#pragma mark - VFOperationQueue -
+VFOperationQueue VFOperationQueueCreate(long device_limit) {
+    VFOperationQueue queue = calloc(1, sizeof(_VFOperationQueue));
+    if (queue) {
+        queue->device_limit = (device_limit > 0) ? device_limit : 1;
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->drained, NULL);
+    }
+    return queue;
+}
+
+void VFOperationQueueRelease(VFOperationQueue queue) {
+    if (!queue) {
+        return;
+    }
+    
+    // Detach everything still waiting, then cancel outside the lock
+    VFOperation cancelled = NULL;
+    
+    pthread_mutex_lock(&queue->lock);
+    for (VFOperationDevice device = queue->devices; device; device = device->next) {
+        VFOperation operation = NULL;
+        while ((operation = VFOperationDeviceDequeue(device)) != NULL) {
+            operation->next = cancelled;
+            cancelled       = operation;
+            queue->outstanding--;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    
+    while (cancelled) {
+        VFOperation next = cancelled->next;
+        cancelled->next  = NULL;
+        VFOperationComplete(cancelled, VFOperationStateCancelled, "Operation was cancelled");
+        VFOperationRelease(cancelled);
+        cancelled = next;
+    }
+    
+    pthread_mutex_lock(&queue->lock);
+    while (queue->outstanding > 0) {
+        pthread_cond_wait(&queue->drained, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    
+    VFOperationDevice device = queue->devices;
+    while (device) {
+        VFOperationDevice next = device->next;
+        free(device);
+        device = next;
+    }
+    
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->drained);
+    free(queue);
+}
+
+VFOperation VFOperationQueueCopy(VFOperationQueue queue, const char *from, const char *to, VFOperationPriority priority, VFOperationCompletionBlock completion) {
+    if (!queue || !from || !to) {
+        return NULL;
+    }
+    return VFOperationQueueSubmit(queue, VFOperationCreate(queue, VFOperationKindCopy, from, to, priority, completion));
+}
+
+VFOperation VFOperationQueueMove(VFOperationQueue queue, const char *from, const char *to, VFOperationPriority priority, VFOperationCompletionBlock completion) {
+    if (!queue || !from || !to) {
+        return NULL;
+    }
+    return VFOperationQueueSubmit(queue, VFOperationCreate(queue, VFOperationKindMove, from, to, priority, completion));
+}
+
+VFOperation VFOperationQueueDelete(VFOperationQueue queue, const char *path, VFOperationPriority priority, VFOperationCompletionBlock completion) {
+    if (!queue || !path) {
+        return NULL;
+    }
+    return VFOperationQueueSubmit(queue, VFOperationCreate(queue, VFOperationKindDelete, path, NULL, priority, completion));
+}
+
+VFOperation VFOperationQueueCreateDirectory(VFOperationQueue queue, const char *path, VFOperationPriority priority, VFOperationCompletionBlock completion) {
+    if (!queue || !path) {
+        return NULL;
+    }
+    return VFOperationQueueSubmit(queue, VFOperationCreate(queue, VFOperationKindCreateDirectory, path, NULL, priority, completion));
+}
@@ -0,0 +1,120 @@
+//
+//  VFOperationQueue.h
+//
+//  Created by Dima Bart on 2014-08-06.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <pthread.h>
+#import <dispatch/dispatch.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFOperationKindCopy            = 0,
+    VFOperationKindMove            = 1,
+    VFOperationKindDelete          = 2,
+    VFOperationKindCreateDirectory = 3,
+} VFOperationKind;
+
+typedef enum {
+    VFOperationPriorityBackground = 0,
+    VFOperationPriorityLow        = 1,
+    VFOperationPriorityDefault    = 2,
+    VFOperationPriorityHigh       = 3,
+} VFOperationPriority;
+
+typedef enum {
+    VFOperationStatePending   = 0,
+    VFOperationStateRunning   = 1,
+    VFOperationStateFinished  = 2,
+    VFOperationStateFailed    = 3,
+    VFOperationStateCancelled = 4,
+} VFOperationState;
+
+/*
+ * =============================
+ *    VFOperation & Related
+ * =============================
+ *
+ */
+// MARK: - VFOperation -
+typedef struct __VFOperation * VFOperation;
+typedef struct __VFOperationQueue * VFOperationQueue;
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFOperationCompletionBlock)(VFOperation operation, BOOL success, char *error);
+
+typedef struct __VFOperation {
+    VFOperationKind             kind;
+    VFOperationPriority         priority;
+    VFOperationState            state;
+    BOOL                        is_metadata;
+    char                       *from;
+    char                       *to;
+    char                       *error;
+    dev_t                       device;
+    int                         references;
+    pthread_mutex_t             lock;
+    pthread_cond_t              finished;
+    VFOperationCompletionBlock  completion;
+    VFOperationQueue            queue;
+    struct __VFOperation       *next;
+} _VFOperation;
+
+// MARK: - VFOperation Functions -
+BOOL VFOperationCancel(VFOperation operation);
+BOOL VFOperationWait(VFOperation operation, char **error);
+VFOperationState VFOperationGetState(VFOperation operation);
+void VFOperationRelease(VFOperation operation);
+
+/*
+ * =============================
+ *  VFOperationQueue & Related
+ * =============================
+ *
+ */
+// MARK: - VFOperationQueue -
+
+/*
+ * Runs VFCopyFile, VFMoveFile, VFFileDeleteRecursive and VFCreateDirectory
+ * off the calling thread. Bulk operations (copies, moves across devices,
+ * deleting directories) are limited to device_limit at a time per source
+ * device, lowered to VFGovernor's queue depth and the parallelism of the
+ * device's VFDeviceProfile, and wait in per-priority FIFOs, highest
+ * priority first.
+ * Metadata operations (creating directories, renames on one device,
+ * deleting single files) never wait behind bulk work and start right away.
+ *
+ * Submitting returns an operation owned by the caller, who must release
+ * it. Completion blocks run on a background thread.
+ */
+typedef struct __VFOperationDevice {
+    dev_t                        device;
+    long                         running;
+    VFOperation                  pending_head[4];
+    VFOperation                  pending_tail[4];
+    struct __VFOperationDevice  *next;
+} _VFOperationDevice;
+typedef _VFOperationDevice * VFOperationDevice;
+
+typedef struct __VFOperationQueue {
+    pthread_mutex_t    lock;
+    pthread_cond_t     drained;
+    long               device_limit;
+    long               outstanding;
+    VFOperationDevice  devices;
+} _VFOperationQueue;
+
+// MARK: - VFOperationQueue Functions -
+VFOperationQueue VFOperationQueueCreate(long device_limit);
+void VFOperationQueueRelease(VFOperationQueue queue); // Cancels pending operations and waits for running ones
+
+VFOperation VFOperationQueueCopy(VFOperationQueue queue, const char *from, const char *to, VFOperationPriority priority, VFOperationCompletionBlock completion);
+VFOperation VFOperationQueueMove(VFOperationQueue queue, const char *from, const char *to, VFOperationPriority priority, VFOperationCompletionBlock completion);
+VFOperation VFOperationQueueDelete(VFOperationQueue queue, const char *path, VFOperationPriority priority, VFOperationCompletionBlock completion);
+VFOperation VFOperationQueueCreateDirectory(VFOperationQueue queue, const char *path, VFOperationPriority priority, VFOperationCompletionBlock completion);
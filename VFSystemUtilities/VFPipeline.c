@@ -0,0 +1,469 @@
+//
+//  VFPipeline.c
+//
+//  Created by Dima Bart on 2014-08-24.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <Block.h>
+#import <fcntl.h>
+#import <errno.h>
+#import <unistd.h>
+#import <sys/stat.h>
+
+#import "VFPipeline.h"
+#import "VFGovernor.h"
+#import "VFDeviceProfile.h"
+
+#if defined(__linux__)
+    #define st_mtimespec st_mtim
+    #define st_ctimespec st_ctim
+#endif
+
+#define kVFPipelineCompressTableBits 12
+
+static const size_t kVFPipelineCompressWindow = 65535;
+
+static const uint64_t kVFHashPrime1 = 11400714785074694791ULL;
+static const uint64_t kVFHashPrime2 = 14029467366897019727ULL;
+static const uint64_t kVFHashPrime3 = 1609587929392839161ULL;
+static const uint64_t kVFHashPrime4 = 9650029242287828579ULL;
+static const uint64_t kVFHashPrime5 = 2870177450012600261ULL;
+
+typedef struct __VFHashState {
+    uint64_t seed;
+    uint64_t total;
+    uint64_t accumulators[4];
+    uint8_t  pending[32];
+    size_t   pending_size;
+} _VFHashState;
+typedef _VFHashState * VFHashState;
+
+typedef struct __VFCompressState {
+    uint64_t size;
+    uint32_t table[1 << kVFPipelineCompressTableBits];
+} _VFCompressState;
+typedef _VFCompressState * VFCompressState;
+
+#pragma mark - Private - Hash -
+static inline uint64_t VFHashRotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t VFHashRead64(const uint8_t *bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint64_t VFHashRound(uint64_t accumulator, uint64_t input) {
+    accumulator += input * kVFHashPrime2;
+    accumulator  = VFHashRotate(accumulator, 31);
+    return accumulator * kVFHashPrime1;
+}
+
+static inline uint64_t VFHashMerge(uint64_t hash, uint64_t accumulator) {
+    hash ^= VFHashRound(0, accumulator);
+    return hash * kVFHashPrime1 + kVFHashPrime4;
+}
+
+static void VFHashStateReset(VFHashState state, uint64_t seed) {
+    state->seed            = seed;
+    state->total           = 0;
+    state->pending_size    = 0;
+    state->accumulators[0] = seed + kVFHashPrime1 + kVFHashPrime2;
+    state->accumulators[1] = seed + kVFHashPrime2;
+    state->accumulators[2] = seed;
+    state->accumulators[3] = seed - kVFHashPrime1;
+}
+
+static void VFHashStateUpdateStripes(VFHashState state, const uint8_t *bytes, size_t count) {
+    uint64_t *accumulators = state->accumulators;
+    for (size_t i = 0; i < count; i++, bytes += 32) {
+        accumulators[0] = VFHashRound(accumulators[0], VFHashRead64(bytes));
+        accumulators[1] = VFHashRound(accumulators[1], VFHashRead64(bytes + 8));
+        accumulators[2] = VFHashRound(accumulators[2], VFHashRead64(bytes + 16));
+        accumulators[3] = VFHashRound(accumulators[3], VFHashRead64(bytes + 24));
+    }
+}
+
+static void VFHashStateUpdate(VFHashState state, const uint8_t *bytes, size_t length) {
+    state->total += length;
+    
+    if (state->pending_size > 0) {
+        size_t fill = 32 - state->pending_size;
+        if (length < fill) {
+            memcpy(state->pending + state->pending_size, bytes, length);
+            state->pending_size += length;
+            return;
+        }
+        memcpy(state->pending + state->pending_size, bytes, fill);
+        VFHashStateUpdateStripes(state, state->pending, 1);
+        state->pending_size = 0;
+        bytes              += fill;
+        length             -= fill;
+    }
+    
+    VFHashStateUpdateStripes(state, bytes, length / 32);
+    state->pending_size = length % 32;
+    memcpy(state->pending, bytes + length - state->pending_size, state->pending_size);
+}
+
+static uint64_t VFHashStateDigest(VFHashState state) {
+    const uint64_t *accumulators = state->accumulators;
+    uint64_t hash;
+    if (state->total >= 32) {
+        hash = VFHashRotate(accumulators[0], 1) + VFHashRotate(accumulators[1], 7) + VFHashRotate(accumulators[2], 12) + VFHashRotate(accumulators[3], 18);
+        hash = VFHashMerge(hash, accumulators[0]);
+        hash = VFHashMerge(hash, accumulators[1]);
+        hash = VFHashMerge(hash, accumulators[2]);
+        hash = VFHashMerge(hash, accumulators[3]);
+    } else {
+        hash = state->seed + kVFHashPrime5;
+    }
+    hash += state->total;
+    
+    const uint8_t *bytes = state->pending;
+    size_t length        = state->pending_size;
+    for (; length >= 8; bytes += 8, length -= 8) {
+        hash ^= VFHashRound(0, VFHashRead64(bytes));
+        hash  = VFHashRotate(hash, 27) * kVFHashPrime1 + kVFHashPrime4;
+    }
+    if (length >= 4) {
+        uint32_t value;
+        memcpy(&value, bytes, sizeof(value));
+        hash   ^= (uint64_t)value * kVFHashPrime1;
+        hash    = VFHashRotate(hash, 23) * kVFHashPrime2 + kVFHashPrime3;
+        bytes  += 4;
+        length -= 4;
+    }
+    for (; length > 0; bytes++, length--) {
+        hash ^= (*bytes) * kVFHashPrime5;
+        hash  = VFHashRotate(hash, 11) * kVFHashPrime1;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= kVFHashPrime2;
+    hash ^= hash >> 29;
+    hash *= kVFHashPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static inline BOOL VFHashTimeIsEqual(const struct timespec *time1, const struct timespec *time2) {
+    return time1->tv_sec == time2->tv_sec && time1->tv_nsec == time2->tv_nsec;
+}
+
+// The keys VFHashCache checks an entry against, a change in any of them is a change of the file
+static BOOL VFHashStatIsEqual(const struct stat *stat1, const struct stat *stat2) {
+    return stat1->st_dev == stat2->st_dev &&
+        stat1->st_ino == stat2->st_ino &&
+        stat1->st_size == stat2->st_size &&
+        VFHashTimeIsEqual(&stat1->st_mtimespec, &stat2->st_mtimespec) &&
+        VFHashTimeIsEqual(&stat1->st_ctimespec, &stat2->st_ctimespec);
+}
+
+#pragma mark - Private - Compression -
+static inline size_t VFCompressLengthBytes(size_t length) {
+    return (length >= 15) ? (length - 15) / 255 + 1 : 0;
+}
+
+/*
+ * Greedy LZ4 matching over a single chunk: a table of the last position
+ * of every hashed 4 byte sequence, matches of at least 4 bytes within a
+ * 64KB window. Only the size of the sequences is added up.
+ */
+static uint64_t VFCompressEstimate(VFCompressState state, const uint8_t *bytes, size_t length) {
+    memset(state->table, 0, sizeof(state->table));
+    
+    uint64_t size = 0;
+    size_t anchor = 0;
+    size_t i      = 0;
+    while (i + 4 <= length) {
+        uint32_t sequence;
+        memcpy(&sequence, bytes + i, sizeof(sequence));
+        
+        uint32_t slot      = (sequence * 2654435761U) >> (32 - kVFPipelineCompressTableBits);
+        size_t candidate   = state->table[slot];
+        state->table[slot] = (uint32_t)(i + 1);
+        
+        if (candidate == 0 || i + 1 - candidate > kVFPipelineCompressWindow || memcmp(bytes + candidate - 1, bytes + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        
+        size_t match_length = 4;
+        while (i + match_length < length && bytes[candidate - 1 + match_length] == bytes[i + match_length]) {
+            match_length++;
+        }
+        
+        size_t literals = i - anchor;
+        size           += 1 + literals + VFCompressLengthBytes(literals) + 2 + VFCompressLengthBytes(match_length - 4);
+        i              += match_length;
+        anchor          = i;
+    }
+    
+    size_t literals = length - anchor;
+    return size + 1 + literals + VFCompressLengthBytes(literals);
+}
+
+#pragma mark - Private - Stages -
+static void VFPipelineAddStageWithContext(VFPipeline pipeline, VFPipelineStageBlock block, void *context) {
+    VFPipelineStage stages = realloc(pipeline->stages, sizeof(_VFPipelineStage) * (pipeline->stage_count + 1));
+    if (!stages) {
+        free(context);
+        return;
+    }
+    
+    VFPipelineStage stage = &stages[pipeline->stage_count];
+    stage->block          = Block_copy(block);
+    stage->queue          = dispatch_queue_create("VFPipelineStage", DISPATCH_QUEUE_SERIAL);
+    stage->context        = context;
+    
+    pipeline->stages = stages;
+    pipeline->stage_count++;
+}
+
+#pragma mark - VFPipeline -
+VFPipeline VFPipelineCreate(size_t chunk_size, size_t depth) {
+    VFPipeline pipeline = calloc(1, sizeof(_VFPipeline));
+    if (pipeline) {
+        pipeline->chunk_size   = (chunk_size > 0) ? chunk_size : VFGovernorGetBufferSize(0);
+        pipeline->depth        = (depth > 0) ? depth : VFGovernorGetQueueDepth();
+        pipeline->uses_profile = (depth == 0);
+    }
+    return pipeline;
+}
+
+void VFPipelineRelease(VFPipeline pipeline) {
+    if (pipeline) {
+        for (size_t i = 0; i < pipeline->stage_count; i++) {
+            Block_release(pipeline->stages[i].block);
+            dispatch_release(pipeline->stages[i].queue);
+            free(pipeline->stages[i].context);
+        }
+        free(pipeline->stages);
+        free(pipeline->buffers);
+        free(pipeline->references);
+        free(pipeline);
+    }
+}
+
+void VFPipelineAddStage(VFPipeline pipeline, VFPipelineStageBlock block) {
+    if (pipeline && block) {
+        VFPipelineAddStageWithContext(pipeline, block, NULL);
+    }
+}
+
+void VFPipelineAddHash(VFPipeline pipeline, uint64_t *hash) {
+    VFHashState state = (pipeline && hash) ? malloc(sizeof(_VFHashState)) : NULL;
+    if (state) {
+        VFHashStateReset(state, 0);
+        VFPipelineAddStageWithContext(pipeline, ^(const uint8_t *bytes, size_t length) {
+            if (length > 0) {
+                VFHashStateUpdate(state, bytes, length);
+            } else {
+                *hash = VFHashStateDigest(state);
+                VFHashStateReset(state, 0);
+            }
+        }, state);
+    }
+}
+
+void VFPipelineAddLineCount(VFPipeline pipeline, uint64_t *count) {
+    uint64_t *lines = (pipeline && count) ? calloc(1, sizeof(uint64_t)) : NULL;
+    if (lines) {
+        VFPipelineAddStageWithContext(pipeline, ^(const uint8_t *bytes, size_t length) {
+            if (length > 0) {
+                const uint8_t *end = bytes + length;
+                for (const uint8_t *newline = bytes; (newline = memchr(newline, '\n', end - newline)) != NULL; newline++) {
+                    (*lines)++;
+                }
+            } else {
+                *count = *lines;
+                *lines = 0;
+            }
+        }, lines);
+    }
+}
+
+void VFPipelineAddCompressedSize(VFPipeline pipeline, uint64_t *size) {
+    VFCompressState state = (pipeline && size) ? calloc(1, sizeof(_VFCompressState)) : NULL;
+    if (state) {
+        VFPipelineAddStageWithContext(pipeline, ^(const uint8_t *bytes, size_t length) {
+            if (length > 0) {
+                state->size += VFCompressEstimate(state, bytes, length);
+            } else {
+                *size       = state->size;
+                state->size = 0;
+            }
+        }, state);
+    }
+}
+
+BOOL VFPipelineRun(VFPipeline pipeline, const char *path, char **error) {
+    if (!pipeline || !path) {
+        if (error) *error = "Invalid pipeline or path";
+        return NO;
+    }
+    
+    if (!pipeline->buffers) {
+        pipeline->buffers    = malloc(pipeline->chunk_size * pipeline->depth);
+        pipeline->references = calloc(pipeline->depth, sizeof(long));
+        if (!pipeline->buffers || !pipeline->references) {
+            if (error) *error = strerror(errno);
+            free(pipeline->buffers);
+            free(pipeline->references);
+            pipeline->buffers    = NULL;
+            pipeline->references = NULL;
+            return NO;
+        }
+    }
+    
+    int file = open(path, O_RDONLY);
+    if (file == -1) {
+        if (error) *error = strerror(errno);
+        return NO;
+    }
+    
+    size_t in_flight = pipeline->depth;
+    struct stat file_stat;
+    _VFDeviceProfile profile;
+    if (pipeline->uses_profile && fstat(file, &file_stat) == 0 && VFDeviceProfileGetForDevice(file_stat.st_dev, &profile, NULL)) {
+        if (profile.queue_depth > 0 && in_flight > profile.queue_depth) {
+            in_flight = profile.queue_depth;
+        }
+    }
+    
+    /* ---------------------------------------
+     * Stages release chunks in the order they
+     * were read, so the semaphore counting
+     * free chunks always frees the oldest one.
+     * With fewer chunks in flight than slots,
+     * the next slot is free all the same.
+     */
+    dispatch_semaphore_t free_chunks = dispatch_semaphore_create(in_flight);
+    dispatch_group_t group           = dispatch_group_create();
+    BOOL success                     = YES;
+    size_t slot                      = 0;
+    
+    while (pipeline->stage_count > 0) {
+        dispatch_semaphore_wait(free_chunks, DISPATCH_TIME_FOREVER);
+        
+        uint8_t *buffer = pipeline->buffers + slot * pipeline->chunk_size;
+        ssize_t bytes_read;
+        do {
+            bytes_read = read(file, buffer, pipeline->chunk_size);
+        } while (bytes_read == -1 && errno == EINTR);
+        
+        if (bytes_read <= 0) {
+            if (bytes_read == -1) {
+                if (error) *error = strerror(errno);
+                success = NO;
+            }
+            dispatch_semaphore_signal(free_chunks);
+            break;
+        }
+        
+        long *references = &pipeline->references[slot];
+        *references      = pipeline->stage_count;
+        for (size_t i = 0; i < pipeline->stage_count; i++) {
+            VFPipelineStage stage = &pipeline->stages[i];
+            dispatch_group_async(group, stage->queue, ^{
+                stage->block(buffer, bytes_read);
+                if (__sync_sub_and_fetch(references, 1) == 0) {
+                    dispatch_semaphore_signal(free_chunks);
+                }
+            });
+        }
+        slot = (slot + 1) % pipeline->depth;
+    }
+    
+    for (size_t i = 0; i < pipeline->stage_count; i++) {
+        VFPipelineStage stage = &pipeline->stages[i];
+        dispatch_group_async(group, stage->queue, ^{
+            stage->block(NULL, 0);
+        });
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    
+    dispatch_release(group);
+    dispatch_release(free_chunks);
+    close(file);
+    
+    return success;
+}
+
+#pragma mark - Hashing -
+uint64_t VFHash64(const void *bytes, size_t length, uint64_t seed) {
+    _VFHashState state;
+    VFHashStateReset(&state, seed);
+    VFHashStateUpdate(&state, bytes, length);
+    return VFHashStateDigest(&state);
+}
+
+BOOL VFFileHash(const char *path, uint64_t *hash, char **error) {
+    return VFFileHashWithCache(path, VFHashCacheGetDefault(), hash, error);
+}
+
+BOOL VFFileHashWithCache(const char *path, VFHashCache cache, uint64_t *hash, char **error) {
+    if (!path || !hash) {
+        if (error) *error = "Invalid path or hash";
+        return NO;
+    }
+    
+    int file = open(path, O_RDONLY);
+    if (file == -1) {
+        if (error) *error = strerror(errno);
+        return NO;
+    }
+    
+    struct stat file_stat;
+    BOOL is_cached = (cache && fstat(file, &file_stat) == 0);
+    if (is_cached && VFHashCacheLookup(cache, file, &file_stat, hash)) {
+        close(file);
+        return YES;
+    }
+    
+    size_t buffer_size = VFGovernorGetBufferSize(0);
+    uint8_t *buffer    = malloc(buffer_size);
+    if (!buffer) {
+        if (error) *error = strerror(errno);
+        close(file);
+        return NO;
+    }
+    
+    _VFHashState state;
+    VFHashStateReset(&state, 0);
+    
+    BOOL success = YES;
+    while (YES) {
+        ssize_t bytes_read = read(file, buffer, buffer_size);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == -1) {
+            if (error) *error = strerror(errno);
+            success = NO;
+            break;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        VFHashStateUpdate(&state, buffer, bytes_read);
+    }
+    
+    if (success) {
+        *hash = VFHashStateDigest(&state);
+        
+        // Only remembered when the file did not change while it was read
+        struct stat end_stat;
+        if (is_cached && fstat(file, &end_stat) == 0 && VFHashStatIsEqual(&end_stat, &file_stat)) {
+            VFHashCacheStore(cache, file, &file_stat, *hash);
+        }
+    }
+    free(buffer);
+    close(file);
+    
+    return success;
+}
@@ -0,0 +1,80 @@
+//
+//  VFPipeline.h
+//
+//  Created by Dima Bart on 2014-08-24.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <dispatch/dispatch.h>
+
+#import "VFFileManager.h"
+#import "VFHashCache.h"
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFPipelineStageBlock)(const uint8_t *bytes, size_t length); // Called with length 0 once a file ends
+
+/*
+ * =============================
+ *     VFPipeline & Related
+ * =============================
+ *
+ */
+// MARK: - VFPipelineStage -
+typedef struct __VFPipelineStage {
+    VFPipelineStageBlock  block;
+    dispatch_queue_t      queue;
+    void                 *context;
+} _VFPipelineStage;
+typedef _VFPipelineStage * VFPipelineStage;
+
+// MARK: - VFPipeline -
+
+/*
+ * Reads a file once and hands every chunk to all of its stages. Each
+ * stage has its own serial queue, so stages run on separate cores while
+ * every stage still sees the chunks in order. At most depth chunks are in
+ * flight: the reader waits for the slowest stage to release the oldest
+ * chunk before reading into it again.
+ *
+ * Stage blocks must not keep the bytes after returning. Once the file has
+ * been read every stage is called with a length of 0, which is where the
+ * built-in stages publish their result and reset for the next file.
+ * VFPipelineRun returns after all stages have seen the end. A pipeline
+ * can run any number of files, one at a time.
+ *
+ * Built-in stages:
+ *  - Hash, XXH64 with a seed of 0 (the same value VFHash64 produces)
+ *  - Line count, the number of '\n' bytes
+ *  - Compressed size, the size of LZ4-style block compression of every
+ *    chunk, computed without producing any output
+ */
+typedef struct __VFPipeline {
+    size_t           chunk_size;
+    size_t           depth;
+    BOOL             uses_profile; // Depth left to VFGovernor, each file's device profile lowers it
+    VFPipelineStage  stages;
+    size_t           stage_count;
+    uint8_t         *buffers;
+    long            *references;
+} _VFPipeline;
+typedef _VFPipeline * VFPipeline;
+
+// MARK: - VFPipeline Functions -
+VFPipeline VFPipelineCreate(size_t chunk_size, size_t depth); // 0 to size chunks and depth with VFGovernor, and depth with the device profile
+void VFPipelineRelease(VFPipeline pipeline);
+
+void VFPipelineAddStage(VFPipeline pipeline, VFPipelineStageBlock block);
+void VFPipelineAddHash(VFPipeline pipeline, uint64_t *hash);
+void VFPipelineAddLineCount(VFPipeline pipeline, uint64_t *count);
+void VFPipelineAddCompressedSize(VFPipeline pipeline, uint64_t *size);
+
+BOOL VFPipelineRun(VFPipeline pipeline, const char *path, char **error);
+
+// MARK: - Hashing -
+uint64_t VFHash64(const void *bytes, size_t length, uint64_t seed);
+BOOL VFFileHash(const char *path, uint64_t *hash, char **error); // Uses the default VFHashCache, if any
+BOOL VFFileHashWithCache(const char *path, VFHashCache cache, uint64_t *hash, char **error);
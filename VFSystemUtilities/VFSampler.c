@@ -0,0 +1,345 @@
+//
+//  VFSampler.c
+//
+//  Created by Dima Bart on 2014-08-26.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <poll.h>
+#import <time.h>
+#import <fcntl.h>
+#import <errno.h>
+#import <unistd.h>
+
+#import "VFSampler.h"
+
+static const uint32_t kVFSamplerDefaultInterval = 100;
+static const uint32_t kVFSamplerMinimumInterval = 20;
+static const size_t   kVFSamplerDefaultCapacity = 1024;
+
+#define kVFSamplerCPUBufferSize 256
+
+typedef struct __VFSamplerSlot {
+    volatile uint64_t sequence; // 2n + 1 while sample n is written, 2n + 2 once it is complete
+    _VFSample         sample;
+} _VFSamplerSlot;
+
+#pragma mark - Private - CPU -
+static uint64_t VFSamplerGetTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#if defined(__linux__)
+
+/*
+ * The first line of /proc/stat holds the ticks of all CPUs together,
+ * "cpu  user nice system idle iowait irq softirq steal ...". Idle and
+ * iowait count as idle, guest time is already part of user.
+ */
+static BOOL VFSamplerReadCPU(VFSampler sampler, uint64_t *busy, uint64_t *total) {
+    char buffer[kVFSamplerCPUBufferSize];
+    ssize_t length;
+    do {
+        length = pread(sampler->cpu_file, buffer, sizeof(buffer), 0);
+    } while (length == -1 && errno == EINTR);
+    
+    if (length < 4 || memcmp(buffer, "cpu ", 4) != 0) {
+        return NO;
+    }
+    
+    uint64_t ticks[8] = {0};
+    size_t field      = 0;
+    BOOL in_number    = NO;
+    for (ssize_t i = 4; i < length && buffer[i] != '\n' && field < 8; i++) {
+        if (buffer[i] >= '0' && buffer[i] <= '9') {
+            ticks[field] = ticks[field] * 10 + (buffer[i] - '0');
+            in_number    = YES;
+        } else if (in_number) {
+            in_number = NO;
+            field++;
+        }
+    }
+    
+    uint64_t idle = ticks[3] + ticks[4];
+    *total        = 0;
+    for (size_t i = 0; i < 8; i++) {
+        *total += ticks[i];
+    }
+    *busy = *total - idle;
+    return YES;
+}
+
+static int VFSamplerOpenCPU(void) {
+    return open("/proc/stat", O_RDONLY | O_CLOEXEC);
+}
+
+#else
+
+static BOOL VFSamplerReadCPU(VFSampler sampler, uint64_t *busy, uint64_t *total) {
+    host_cpu_load_info_data_t load;
+    mach_msg_type_number_t count = HOST_CPU_LOAD_INFO_COUNT;
+    if (host_statistics(mach_host_self(), HOST_CPU_LOAD_INFO, (host_info_t)&load, &count) != KERN_SUCCESS) {
+        return NO;
+    }
+    
+    *busy  = (uint64_t)load.cpu_ticks[CPU_STATE_USER] + load.cpu_ticks[CPU_STATE_SYSTEM] + load.cpu_ticks[CPU_STATE_NICE];
+    *total = *busy + load.cpu_ticks[CPU_STATE_IDLE];
+    return YES;
+}
+
+static int VFSamplerOpenCPU(void) {
+    return 0;
+}
+
+#endif
+
+#pragma mark - Private - Sampling -
+static void VFSamplerRecord(VFSampler sampler) {
+    _VFSample sample;
+    sample.timestamp = VFSamplerGetTime();
+    sample.cpu_usage = 0.0;
+    if (!VFMemorySnapshotFill(&sample.memory, NULL)) {
+        memset(&sample.memory, 0, sizeof(_VFMemorySnapshot));
+    }
+    
+    uint64_t busy;
+    uint64_t total;
+    if (VFSamplerReadCPU(sampler, &busy, &total)) {
+        if (total > sampler->cpu_total && busy >= sampler->cpu_busy) {
+            sample.cpu_usage = (double)(busy - sampler->cpu_busy) / (double)(total - sampler->cpu_total);
+        }
+        sampler->cpu_busy  = busy;
+        sampler->cpu_total = total;
+    }
+    
+    /* ---------------------------------------
+     * Mark the slot as being written, publish
+     * the sample and only then advance head,
+     * readers check the sequence on both
+     * sides of their copy.
+     */
+    uint64_t number      = sampler->head;
+    _VFSamplerSlot *slot = &sampler->slots[number & (sampler->capacity - 1)];
+    slot->sequence       = number * 2 + 1;
+    __sync_synchronize();
+    slot->sample         = sample;
+    __sync_synchronize();
+    slot->sequence       = number * 2 + 2;
+    __sync_synchronize();
+    sampler->head        = number + 1;
+}
+
+static void * VFSamplerRun(void *context) {
+    VFSampler sampler        = context;
+    struct pollfd descriptor = { .fd = sampler->wake[0], .events = POLLIN };
+    uint64_t deadline        = VFSamplerGetTime() / 1000000;
+    
+    while (YES) {
+        VFSamplerRecord(sampler);
+        
+        // Sleep until the next tick, without trying to catch up on missed ones
+        uint64_t now = VFSamplerGetTime() / 1000000;
+        deadline    += sampler->interval;
+        if (deadline < now) {
+            deadline = now;
+        }
+        
+        int ready = poll(&descriptor, 1, (int)(deadline - now));
+        if (ready > 0 || (ready < 0 && errno != EINTR)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int VFSamplerCompareValues(const void *a, const void *b) {
+    double lhs = *(const double *)a;
+    double rhs = *(const double *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static double VFSamplerPercentile(const double *sorted, size_t count, size_t percentile) {
+    size_t rank = (count * percentile + 99) / 100;
+    return sorted[(rank > 0) ? rank - 1 : 0];
+}
+
+#pragma mark - VFSampler -
+VFSampler VFSamplerCreate(uint32_t interval, size_t capacity, char **error) {
+    if (interval == 0) interval = kVFSamplerDefaultInterval;
+    if (capacity == 0) capacity = kVFSamplerDefaultCapacity;
+    if (interval < kVFSamplerMinimumInterval) {
+        interval = kVFSamplerMinimumInterval;
+    }
+    
+    // Power of two, so that a sample number maps to its slot with a mask
+    size_t slots = 1;
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+    
+    VFSampler sampler = calloc(1, sizeof(_VFSampler));
+    sampler->interval = interval;
+    sampler->capacity = slots;
+    sampler->slots    = calloc(slots, sizeof(_VFSamplerSlot));
+    sampler->cpu_file = VFSamplerOpenCPU();
+    sampler->wake[0]  = -1;
+    sampler->wake[1]  = -1;
+    
+    if (!sampler->slots || sampler->cpu_file == -1 || pipe(sampler->wake) != 0) {
+        if (error) *error = (sampler->slots) ? strerror(errno) : "Failed to allocate the sample buffer";
+        VFSamplerRelease(sampler);
+        return NULL;
+    }
+    
+    // Prime the CPU ticks so the first sample already has a usage
+    VFSamplerReadCPU(sampler, &sampler->cpu_busy, &sampler->cpu_total);
+    
+    if (pthread_create(&sampler->thread, NULL, VFSamplerRun, sampler) != 0) {
+        if (error) *error = "Failed to start the sampler thread";
+        close(sampler->wake[1]);
+        sampler->wake[1] = -1;
+        VFSamplerRelease(sampler);
+        return NULL;
+    }
+    return sampler;
+}
+
+void VFSamplerRelease(VFSampler sampler) {
+    if (sampler) {
+        if (sampler->wake[1] >= 0) {
+            char signal = 0;
+            write(sampler->wake[1], &signal, 1);
+            pthread_join(sampler->thread, NULL);
+            close(sampler->wake[1]);
+        }
+        if (sampler->wake[0] >= 0) close(sampler->wake[0]);
+        
+#if defined(__linux__)
+        if (sampler->cpu_file >= 0) close(sampler->cpu_file);
+#endif
+        
+        free(sampler->slots);
+        free(sampler);
+    }
+}
+
+uint64_t VFSamplerGetCount(VFSampler sampler) {
+    __sync_synchronize();
+    return sampler->head;
+}
+
+/*
+ * A slot is only kept when its sequence says it holds the expected sample
+ * both before and after the copy. The writer overwrites the oldest sample
+ * first, so a sample that went stale means every one copied before it did
+ * too, and the window restarts after it.
+ */
+size_t VFSamplerCopyWindow(VFSampler sampler, uint32_t window, VFSample samples, size_t count) {
+    if (!sampler || !samples || count == 0) {
+        return 0;
+    }
+    
+    __sync_synchronize();
+    uint64_t head  = sampler->head;
+    uint64_t first = (head > sampler->capacity) ? head - sampler->capacity : 0;
+    if (head - first > count) {
+        first = head - count;
+    }
+    
+    size_t copied = 0;
+    for (uint64_t number = first; number < head; number++) {
+        _VFSamplerSlot *slot = &sampler->slots[number & (sampler->capacity - 1)];
+        uint64_t sequence    = slot->sequence;
+        __sync_synchronize();
+        samples[copied]      = slot->sample;
+        __sync_synchronize();
+        
+        if (sequence != number * 2 + 2 || slot->sequence != sequence) {
+            copied = 0;
+            continue;
+        }
+        copied++;
+    }
+    
+    if (window > 0 && copied > 0) {
+        uint64_t now   = VFSamplerGetTime();
+        uint64_t start = (now > (uint64_t)window * 1000000) ? now - (uint64_t)window * 1000000 : 0;
+        size_t skipped = 0;
+        while (skipped < copied && samples[skipped].timestamp < start) {
+            skipped++;
+        }
+        if (skipped > 0) {
+            memmove(samples, samples + skipped, (copied - skipped) * sizeof(_VFSample));
+            copied -= skipped;
+        }
+    }
+    return copied;
+}
+
+#pragma mark - Summaries -
+double VFSampleGetValue(const _VFSample *sample, VFSampleField field) {
+    switch (field) {
+        case VFSampleFieldMemoryFree:      return (double)sample->memory.free_bytes;
+        case VFSampleFieldMemoryAvailable: return (double)sample->memory.available_bytes;
+        case VFSampleFieldMemoryActive:    return (double)sample->memory.active_bytes;
+        case VFSampleFieldMemoryWired:     return (double)sample->memory.wired_bytes;
+        case VFSampleFieldMemoryCached:    return (double)sample->memory.cached_bytes;
+        case VFSampleFieldSwapUsed:        return (double)(sample->memory.swap_total_bytes - sample->memory.swap_free_bytes);
+        case VFSampleFieldCPUUsage:        return sample->cpu_usage;
+    }
+    return 0.0;
+}
+
+BOOL VFSampleSummarize(const _VFSample *samples, size_t count, VFSampleField field, VFSampleSummary summary) {
+    if (!samples || count == 0 || !summary) {
+        return NO;
+    }
+    
+    double *values = malloc(count * sizeof(double));
+    if (!values) {
+        return NO;
+    }
+    
+    double sum = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        values[i] = VFSampleGetValue(&samples[i], field);
+        sum      += values[i];
+    }
+    
+    double first   = values[0];
+    double last    = values[count - 1];
+    uint64_t nanos = samples[count - 1].timestamp - samples[0].timestamp;
+    
+    qsort(values, count, sizeof(double), VFSamplerCompareValues);
+    
+    summary->count   = count;
+    summary->minimum = values[0];
+    summary->maximum = values[count - 1];
+    summary->mean    = sum / count;
+    summary->p50     = VFSamplerPercentile(values, count, 50);
+    summary->p90     = VFSamplerPercentile(values, count, 90);
+    summary->p99     = VFSamplerPercentile(values, count, 99);
+    summary->rate    = (nanos > 0) ? (last - first) / ((double)nanos / 1000000000.0) : 0.0;
+    
+    free(values);
+    return YES;
+}
+
+BOOL VFSamplerSummarize(VFSampler sampler, uint32_t window, VFSampleField field, VFSampleSummary summary) {
+    if (!sampler) {
+        return NO;
+    }
+    
+    VFSample samples = malloc(sampler->capacity * sizeof(_VFSample));
+    if (!samples) {
+        return NO;
+    }
+    
+    size_t count = VFSamplerCopyWindow(sampler, window, samples, sampler->capacity);
+    BOOL success = VFSampleSummarize(samples, count, field, summary);
+    
+    free(samples);
+    return success;
+}
@@ -0,0 +1,98 @@
+//
+//  VFSampler.h
+//
+//  Created by Dima Bart on 2014-08-26.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <pthread.h>
+
+#import "VFFileManager.h"
+#import "VFMachine.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFSampleFieldMemoryFree      = 0,
+    VFSampleFieldMemoryAvailable = 1,
+    VFSampleFieldMemoryActive    = 2,
+    VFSampleFieldMemoryWired     = 3,
+    VFSampleFieldMemoryCached    = 4,
+    VFSampleFieldSwapUsed        = 5,
+    VFSampleFieldCPUUsage        = 6, // Fraction of all CPUs busy since the previous sample, 0.0 - 1.0
+} VFSampleField;
+
+/*
+ * =============================
+ *      VFSampler & Related
+ * =============================
+ *
+ */
+// MARK: - VFSample -
+typedef struct __VFSample {
+    uint64_t          timestamp; // CLOCK_MONOTONIC, in nanoseconds
+    double            cpu_usage;
+    _VFMemorySnapshot memory;
+} _VFSample;
+typedef _VFSample * VFSample;
+
+// MARK: - VFSampleSummary -
+typedef struct __VFSampleSummary {
+    size_t count;
+    double minimum;
+    double maximum;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double rate; // Change per second between the first and last sample
+} _VFSampleSummary;
+typedef _VFSampleSummary * VFSampleSummary;
+
+// MARK: - VFSampler -
+
+/*
+ * Records a memory and CPU sample every interval milliseconds on its own
+ * thread into a ring buffer of capacity samples, overwriting the oldest.
+ * The sampler thread is the only writer and never takes a lock. Every slot
+ * carries a sequence number that is odd while the slot is written, so
+ * readers copy without blocking it and drop the samples that were
+ * overwritten under them. A copied window is always in order and made of
+ * whole samples.
+ *
+ * A sample reads /proc/meminfo, /proc/vmstat and /proc/stat through file
+ * descriptors that stay open, about 15 microseconds. At the default 100 ms
+ * interval that is 0.015% of one CPU, and the interval is clamped to at
+ * least 20 ms, which keeps the sampler below 0.1%.
+ */
+typedef struct __VFSampler {
+    uint32_t                interval;
+    size_t                  capacity;
+    struct __VFSamplerSlot *slots;
+    volatile uint64_t       head;
+    int                     cpu_file;
+    uint64_t                cpu_busy;
+    uint64_t                cpu_total;
+    int                     wake[2];
+    pthread_t               thread;
+} _VFSampler;
+typedef _VFSampler * VFSampler;
+
+// MARK: - VFSampler Functions -
+VFSampler VFSamplerCreate(uint32_t interval, size_t capacity, char **error); // 0 for the defaults, 100 ms and 1024 samples
+void VFSamplerRelease(VFSampler sampler);
+
+uint64_t VFSamplerGetCount(VFSampler sampler); // Samples recorded since creation
+
+/*
+ * Copies the samples of the last window milliseconds (0 for everything in
+ * the ring), at most count, oldest first. Returns the number copied.
+ */
+size_t VFSamplerCopyWindow(VFSampler sampler, uint32_t window, VFSample samples, size_t count);
+
+double VFSampleGetValue(const _VFSample *sample, VFSampleField field);
+BOOL VFSampleSummarize(const _VFSample *samples, size_t count, VFSampleField field, VFSampleSummary summary);
+BOOL VFSamplerSummarize(VFSampler sampler, uint32_t window, VFSampleField field, VFSampleSummary summary);
@@ -0,0 +1,421 @@
+//
+//  VFSearch.c
+//
+//  Created by Dima Bart on 2014-08-20.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <fcntl.h>
+#import <errno.h>
+#import <dirent.h>
+#import <unistd.h>
+#import <pthread.h>
+#import <dispatch/dispatch.h>
+
+#import "VFSearch.h"
+
+typedef uint8_t  VFByteVector __attribute__((vector_size(32)));
+typedef uint64_t VFWordVector __attribute__((vector_size(32)));
+
+static const size_t kVFSearchBufferSize   = 256 * 1024;
+static const size_t kVFSearchCarryLimit   = 64 * 1024;
+static const size_t kVFSearchBinaryWindow = 8 * 1024;
+static const size_t kVFSearchVectorSize   = sizeof(VFByteVector);
+
+typedef struct __VFSearchPattern {
+    uint8_t *bytes;
+    size_t   length;
+} _VFSearchPattern;
+typedef _VFSearchPattern * VFSearchPattern;
+
+typedef struct __VFSearchContext {
+    VFSearchPattern     patterns;
+    size_t              pattern_count;
+    size_t              longest;
+    BOOL                is_caseless;
+    BOOL                is_hidden;
+    BOOL                is_binary;
+    uint64_t            max_matches;
+    uint64_t            matches;
+    VFSearchMatchBlock  block;
+    pthread_mutex_t     lock;
+    volatile BOOL       stop;
+} _VFSearchContext;
+typedef _VFSearchContext * VFSearchContext;
+
+#pragma mark - Private - Kernels -
+static inline VFByteVector VFSearchSplat(uint8_t byte) {
+    VFByteVector vector;
+    memset(&vector, byte, sizeof(vector));
+    return vector;
+}
+
+static inline VFByteVector VFSearchLower(VFByteVector bytes) {
+    VFByteVector is_upper = (VFByteVector)((bytes >= VFSearchSplat('A')) & (bytes <= VFSearchSplat('Z')));
+    return bytes | (is_upper & VFSearchSplat(0x20));
+}
+
+static inline uint8_t VFSearchLowerByte(uint8_t byte) {
+    return (byte >= 'A' && byte <= 'Z') ? byte | 0x20 : byte;
+}
+
+static inline uint32_t VFSearchVectorMask(VFByteVector hits) {
+    VFWordVector words = (VFWordVector)hits;
+    if ((words[0] | words[1] | words[2] | words[3]) == 0) {
+        return 0;
+    }
+    
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kVFSearchVectorSize; i++) {
+        mask |= (uint32_t)(hits[i] & 1) << i;
+    }
+    return mask;
+}
+
+static uint64_t VFSearchCountLines(const uint8_t *bytes, size_t length) {
+    VFByteVector newlines = VFSearchSplat('\n');
+    uint64_t count        = 0;
+    size_t i              = 0;
+    for (; i + kVFSearchVectorSize <= length; i += kVFSearchVectorSize) {
+        VFByteVector values;
+        memcpy(&values, bytes + i, sizeof(values));
+        VFWordVector hits = (VFWordVector)(values == newlines);
+        count += (__builtin_popcountll(hits[0]) + __builtin_popcountll(hits[1]) + __builtin_popcountll(hits[2]) + __builtin_popcountll(hits[3])) / 8;
+    }
+    for (; i < length; i++) {
+        count += (bytes[i] == '\n');
+    }
+    return count;
+}
+
+static BOOL VFSearchCompare(VFSearchContext context, const uint8_t *bytes, VFSearchPattern pattern) {
+    if (!context->is_caseless) {
+        return memcmp(bytes, pattern->bytes, pattern->length) == 0;
+    }
+    for (size_t i = 0; i < pattern->length; i++) {
+        if (VFSearchLowerByte(bytes[i]) != pattern->bytes[i]) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+/*
+ * Positions in [position, position + 32) where the first and last byte of
+ * the pattern both line up. Near the end of the buffer the same test is
+ * done one position at a time.
+ */
+static uint32_t VFSearchCandidates(VFSearchContext context, const uint8_t *buffer, size_t length, size_t position, size_t limit, VFSearchPattern pattern) {
+    if (position + pattern->length > length) {
+        return 0;
+    }
+    
+    uint8_t first = pattern->bytes[0];
+    uint8_t last  = pattern->bytes[pattern->length - 1];
+    if (position + pattern->length - 1 + kVFSearchVectorSize <= length) {
+        VFByteVector heads;
+        VFByteVector tails;
+        memcpy(&heads, buffer + position, sizeof(heads));
+        memcpy(&tails, buffer + position + pattern->length - 1, sizeof(tails));
+        if (context->is_caseless) {
+            heads = VFSearchLower(heads);
+            tails = VFSearchLower(tails);
+        }
+        uint32_t mask = VFSearchVectorMask((VFByteVector)((heads == VFSearchSplat(first)) & (tails == VFSearchSplat(last))));
+        if (limit - position < kVFSearchVectorSize) {
+            mask &= ((uint32_t)1 << (limit - position)) - 1;
+        }
+        return mask;
+    }
+    
+    uint32_t mask = 0;
+    for (size_t i = position; i < limit && i < position + kVFSearchVectorSize && i + pattern->length <= length; i++) {
+        uint8_t head = (context->is_caseless) ? VFSearchLowerByte(buffer[i]) : buffer[i];
+        uint8_t tail = (context->is_caseless) ? VFSearchLowerByte(buffer[i + pattern->length - 1]) : buffer[i + pattern->length - 1];
+        if (head == first && tail == last) {
+            mask |= (uint32_t)1 << (i - position);
+        }
+    }
+    return mask;
+}
+
+#pragma mark - Private - Files -
+static BOOL VFSearchReport(VFSearchContext context, const char *path, const uint8_t *buffer, size_t length, size_t position, size_t pattern, uint64_t offset, uint64_t line_number) {
+    const uint8_t *line_start = buffer + position;
+    while (line_start > buffer && line_start[-1] != '\n') {
+        line_start--;
+    }
+    const uint8_t *line_end = memchr(buffer + position, '\n', length - position);
+    if (!line_end) {
+        line_end = buffer + length;
+    }
+    
+    _VFSearchMatch match;
+    match.path        = path;
+    match.line_number = line_number;
+    match.offset      = offset;
+    match.line        = (const char *)line_start;
+    match.line_length = line_end - line_start;
+    match.pattern     = pattern;
+    
+    pthread_mutex_lock(&context->lock);
+    BOOL stop = context->stop;
+    if (!stop) {
+        context->matches++;
+        context->block(&match, &stop);
+        if (context->max_matches > 0 && context->matches >= context->max_matches) {
+            stop = YES;
+        }
+        if (stop) {
+            context->stop = YES;
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    return !stop;
+}
+
+/*
+ * Reports every match that starts before limit, in order. Matches that
+ * start at or after limit are in the tail that is carried into the next
+ * read and will be found there along with the rest of their line.
+ */
+static BOOL VFSearchBuffer(VFSearchContext context, const char *path, const uint8_t *buffer, size_t length, size_t limit, uint64_t base, uint64_t lines) {
+    uint32_t masks[context->pattern_count];
+    size_t   counted = 0;
+    
+    for (size_t position = 0; position < limit; position += kVFSearchVectorSize) {
+        uint32_t candidates = 0;
+        for (size_t p = 0; p < context->pattern_count; p++) {
+            masks[p]    = VFSearchCandidates(context, buffer, length, position, limit, &context->patterns[p]);
+            candidates |= masks[p];
+        }
+        
+        while (candidates) {
+            size_t offset = __builtin_ctz(candidates);
+            size_t start  = position + offset;
+            candidates   &= candidates - 1;
+            
+            for (size_t p = 0; p < context->pattern_count; p++) {
+                if ((masks[p] & ((uint32_t)1 << offset)) && VFSearchCompare(context, buffer + start, &context->patterns[p])) {
+                    lines  += VFSearchCountLines(buffer + counted, start - counted);
+                    counted = start;
+                    if (!VFSearchReport(context, path, buffer, length, start, p, base + start, lines + 1)) {
+                        return NO;
+                    }
+                    break;
+                }
+            }
+        }
+        if (context->stop) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+/*
+ * The next read starts early enough to catch a literal that is cut in
+ * half, moved back to the start of its line as long as that stays within
+ * the carry limit.
+ */
+static size_t VFSearchCarryStart(VFSearchContext context, const uint8_t *buffer, size_t length) {
+    size_t keep        = context->longest - 1;
+    size_t carry_start = (length > keep) ? length - keep : 0;
+    size_t floor       = (length > kVFSearchCarryLimit) ? length - kVFSearchCarryLimit : 0;
+    while (carry_start > floor && buffer[carry_start - 1] != '\n') {
+        carry_start--;
+    }
+    return carry_start;
+}
+
+static void VFSearchFile(VFSearchContext context, const char *path) {
+    int file = open(path, O_RDONLY);
+    if (file == -1) {
+        return;
+    }
+    
+    size_t carry_capacity = (context->longest > kVFSearchCarryLimit) ? context->longest : kVFSearchCarryLimit;
+    uint8_t *buffer       = malloc(carry_capacity + kVFSearchBufferSize);
+    if (!buffer) {
+        close(file);
+        return;
+    }
+    
+    size_t   carried = 0;
+    uint64_t base    = 0;
+    uint64_t lines   = 0;
+    while (!context->stop) {
+        ssize_t bytes_read = read(file, buffer + carried, kVFSearchBufferSize);
+        if (bytes_read == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        size_t length = carried + bytes_read;
+        if (length == 0) {
+            break;
+        }
+        
+        if (base == 0 && carried == 0 && !context->is_binary) {
+            if (memchr(buffer, '\0', (length < kVFSearchBinaryWindow) ? length : kVFSearchBinaryWindow)) {
+                break;
+            }
+        }
+        
+        // Everything left is searched once the file runs out
+        BOOL is_last       = (bytes_read == 0);
+        size_t carry_start = (is_last) ? length : VFSearchCarryStart(context, buffer, length);
+        if (!VFSearchBuffer(context, path, buffer, length, carry_start, base, lines) || is_last) {
+            break;
+        }
+        
+        lines  += VFSearchCountLines(buffer, carry_start);
+        base   += carry_start;
+        carried = length - carry_start;
+        memmove(buffer, buffer + carry_start, carried);
+    }
+    
+    free(buffer);
+    close(file);
+}
+
+static char * VFSearchCreatePath(const char *path, const char *name) {
+    size_t path_length = strlen(path);
+    size_t name_length = strlen(name);
+    BOOL has_separator = (path_length > 0 && path[path_length - 1] == '/');
+    char *child        = malloc(path_length + name_length + 2);
+    if (child) {
+        memcpy(child, path, path_length);
+        if (!has_separator) {
+            child[path_length++] = '/';
+        }
+        memcpy(child + path_length, name, name_length + 1);
+    }
+    return child;
+}
+
+static void VFSearchDirectory(VFSearchContext context, const char *path) {
+    DIR *directory = opendir(path);
+    if (!directory) {
+        return;
+    }
+    
+    size_t count    = 0;
+    size_t capacity = 0;
+    char **names    = NULL;
+    uint8_t *types  = NULL;
+    for (struct dirent *entry = NULL; (entry = readdir(directory)) != NULL;) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (entry->d_name[0] == '.' && !context->is_hidden) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity          = (capacity > 0) ? capacity * 2 : 64;
+            char **grown      = realloc(names, capacity * sizeof(char *));
+            uint8_t *regrown  = (grown) ? realloc(types, capacity * sizeof(uint8_t)) : NULL;
+            if (grown) names  = grown;
+            if (regrown) types = regrown;
+            if (!grown || !regrown) {
+                break;
+            }
+        }
+        names[count] = strdup(entry->d_name);
+        types[count] = entry->d_type;
+        count++;
+    }
+    closedir(directory);
+    
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        char *child_path = (!context->stop) ? VFSearchCreatePath(path, names[i]) : NULL;
+        if (child_path) {
+            uint8_t type = types[i];
+            if (type == DT_UNKNOWN) {
+                struct stat file;
+                if (lstat(child_path, &file) == 0) {
+                    type = S_ISDIR(file.st_mode) ? DT_DIR : (S_ISREG(file.st_mode) ? DT_REG : DT_UNKNOWN);
+                }
+            }
+            
+            if (type == DT_DIR) {
+                VFSearchDirectory(context, child_path);
+            } else if (type == DT_REG) {
+                VFSearchFile(context, child_path);
+            }
+            free(child_path);
+        }
+        free(names[i]);
+    });
+    
+    free(names);
+    free(types);
+}
+
+#pragma mark - VFSearch -
+uint64_t VFSearch(const char *root, const char **patterns, size_t pattern_count, VFSearchOption options, uint64_t max_matches, VFSearchMatchBlock block, char **error) {
+    if (!root || !patterns || pattern_count == 0 || !block) {
+        if (error) *error = "Invalid root, patterns or block";
+        return 0;
+    }
+    
+    struct stat root_stat;
+    if (stat(root, &root_stat) == -1) {
+        if (error) *error = strerror(errno);
+        return 0;
+    }
+    
+    _VFSearchContext context;
+    memset(&context, 0, sizeof(context));
+    context.patterns      = calloc(pattern_count, sizeof(_VFSearchPattern));
+    context.pattern_count = pattern_count;
+    context.is_caseless   = (options & VFSearchOptionIgnoreCase) != 0;
+    context.is_hidden     = (options & VFSearchOptionHidden) != 0;
+    context.is_binary     = (options & VFSearchOptionBinary) != 0;
+    context.max_matches   = max_matches;
+    context.block         = block;
+    if (!context.patterns) {
+        if (error) *error = strerror(errno);
+        return 0;
+    }
+    
+    BOOL is_valid = YES;
+    for (size_t i = 0; i < pattern_count; i++) {
+        size_t length = (patterns[i]) ? strlen(patterns[i]) : 0;
+        uint8_t *bytes = (length > 0) ? malloc(length) : NULL;
+        if (!bytes) {
+            is_valid = NO;
+            break;
+        }
+        for (size_t j = 0; j < length; j++) {
+            bytes[j] = (context.is_caseless) ? VFSearchLowerByte((uint8_t)patterns[i][j]) : (uint8_t)patterns[i][j];
+        }
+        context.patterns[i].bytes  = bytes;
+        context.patterns[i].length = length;
+        if (length > context.longest) {
+            context.longest = length;
+        }
+    }
+    
+    if (is_valid) {
+        pthread_mutex_init(&context.lock, NULL);
+        
+        VFSearchContext shared = &context;
+        if (S_ISDIR(root_stat.st_mode)) {
+            VFSearchDirectory(shared, root);
+        } else if (S_ISREG(root_stat.st_mode)) {
+            VFSearchFile(shared, root);
+        }
+        pthread_mutex_destroy(&context.lock);
+        
+    } else if (error) {
+        *error = "Patterns must not be empty";
+    }
+    
+    for (size_t i = 0; i < pattern_count; i++) {
+        free(context.patterns[i].bytes);
+    }
+    free(context.patterns);
+    
+    return context.matches;
+}
@@ -0,0 +1,65 @@
+//
+//  VFSearch.h
+//
+//  Created by Dima Bart on 2014-08-20.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFSearchOptionNone       = 0,
+    VFSearchOptionIgnoreCase = 1 << 0, // ASCII letters only
+    VFSearchOptionHidden     = 1 << 1,
+    VFSearchOptionBinary     = 1 << 2, // Search files that look binary as well
+} VFSearchOption;
+
+/*
+ * =============================
+ *      VFSearch & Related
+ * =============================
+ *
+ */
+// MARK: - VFSearchMatch -
+typedef struct __VFSearchMatch {
+    const char *path;
+    uint64_t    line_number;
+    uint64_t    offset;
+    const char *line;
+    size_t      line_length;
+    size_t      pattern;
+} _VFSearchMatch;
+typedef _VFSearchMatch * VFSearchMatch;
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFSearchMatchBlock)(VFSearchMatch match, BOOL *stop);
+
+// MARK: - VFSearch -
+
+/*
+ * Searches every regular file below root (or root itself when it is a
+ * file) for any of the given literals. Directories are walked and files
+ * are read concurrently. A file whose first block contains a NUL byte is
+ * treated as binary and skipped.
+ *
+ * Files are read in large blocks. The tail of each block (the unfinished
+ * line, and at least the length of the longest literal) is carried into
+ * the next, so matches and lines that straddle two reads are still found.
+ * Candidates are located by comparing the first and last byte of each
+ * literal against 32 bytes at a time, and only those are compared in
+ * full.
+ *
+ * Every match reports its 1-based line number, byte offset and the line
+ * it is on (without the newline; lines longer than the carried tail are
+ * cut at the start). The match block is never called concurrently, the
+ * matches of different files may interleave. Searching ends early once
+ * max_matches (0 for no limit) have been reported or the block sets stop.
+ * Returns the number of matches reported.
+ */
+uint64_t VFSearch(const char *root, const char **patterns, size_t pattern_count, VFSearchOption options, uint64_t max_matches, VFSearchMatchBlock block, char **error);
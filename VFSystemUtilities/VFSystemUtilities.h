@@ -12,5 +12,23 @@
 #import "VFMachine.h"
 #import "VFByteFormatter.h"
 #import "VFTokenCollection.h"
+#import "VFArchive.h"
+#import "VFOperationQueue.h"
+#import "VFTreeIndex.h"
+#import "VFTreeWatcher.h"
+#import "VFTreeSnapshot.h"
+#import "VFFileQuery.h"
+#import "VFSearch.h"
+#import "VFLineIndex.h"
+#import "VFFileFollow.h"
+#import "VFContentType.h"
+#import "VFHashCache.h"
+#import "VFPipeline.h"
+#import "VFSampler.h"
+#import "VFCgroup.h"
+#import "VFGovernor.h"
+#import "VFTopology.h"
+#import "VFDeviceProfile.h"
+#import "VFMountTable.h"
 
 #endif
@@ -0,0 +1,485 @@
+//
+//  VFTopology.c
+//
+//  Created by Dima Bart on 2014-08-29.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
+#import <fcntl.h>
+#import <errno.h>
+#import <unistd.h>
+#import <limits.h>
+#import <pthread.h>
+
+#if defined(__linux__)
+    #import <sched.h>
+#elif defined(__APPLE__)
+    #import <sys/sysctl.h>
+#endif
+
+#import "VFTopology.h"
+
+static const size_t   kVFTopologyDefaultChunkSize = 256 * 1024;
+static const uint32_t kVFTopologyDefaultLineSize  = 64;
+
+#define kVFTopologyBufferSize 4096
+
+static _VFTopology    kVFTopology;
+static pthread_once_t kVFTopologyOnce = PTHREAD_ONCE_INIT;
+
+#pragma mark - VFCPUSet -
+static void VFCPUSetAdd(VFCPUSet set, uint32_t cpu) {
+    if (cpu < kVFTopologyMaxCPUs) {
+        set->bits[cpu / 64] |= 1ULL << (cpu % 64);
+    }
+}
+
+static uint32_t VFCPUSetGetFirst(const _VFCPUSet *set) {
+    for (uint32_t i = 0; i < kVFTopologyMaxCPUs / 64; i++) {
+        if (set->bits[i]) {
+            return i * 64 + __builtin_ctzll(set->bits[i]);
+        }
+    }
+    return kVFTopologyMaxCPUs;
+}
+
+BOOL VFCPUSetContains(const _VFCPUSet *set, uint32_t cpu) {
+    return (cpu < kVFTopologyMaxCPUs && (set->bits[cpu / 64] & (1ULL << (cpu % 64))));
+}
+
+uint32_t VFCPUSetGetCount(const _VFCPUSet *set) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < kVFTopologyMaxCPUs / 64; i++) {
+        count += __builtin_popcountll(set->bits[i]);
+    }
+    return count;
+}
+
+#pragma mark - Private - Pinning -
+// Physical cores first, SMT siblings after all of them
+static void VFTopologyBuildPinOrder(_VFTopology *topology) {
+    topology->pin_order = calloc(topology->cpu_count, sizeof(uint32_t));
+    for (uint32_t thread = 0; thread < topology->threads_per_core; thread++) {
+        for (uint32_t i = 0; i < topology->cpu_count; i++) {
+            _VFTopologyCPU *cpu = &topology->cpus[i];
+            if (cpu->thread_index == thread && VFCPUSetContains(&topology->affinity, cpu->id)) {
+                topology->pin_order[topology->pin_count++] = cpu->id;
+            }
+        }
+    }
+}
+
+#if defined(__linux__)
+
+#pragma mark - Private - Reading -
+static ssize_t VFTopologyRead(const char *path, char *buffer, size_t size) {
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file == -1) {
+        return -1;
+    }
+    
+    ssize_t length;
+    do {
+        length = read(file, buffer, size - 1);
+    } while (length == -1 && errno == EINTR);
+    close(file);
+    
+    if (length >= 0) {
+        buffer[length] = '\0';
+    }
+    return length;
+}
+
+// Plain numbers, or sizes with a K, M or G suffix such as "48K"
+static BOOL VFTopologyReadNumber(const char *path, uint64_t *number) {
+    char buffer[64];
+    if (VFTopologyRead(path, buffer, sizeof(buffer)) <= 0) {
+        return NO;
+    }
+    
+    char *end = NULL;
+    *number   = strtoull(buffer, &end, 10);
+    switch (*end) {
+        case 'K': *number <<= 10; break;
+        case 'M': *number <<= 20; break;
+        case 'G': *number <<= 30; break;
+    }
+    return (end != buffer);
+}
+
+// CPU lists such as "0-3,8,10-11"
+static BOOL VFTopologyReadList(const char *path, VFCPUSet set) {
+    char buffer[kVFTopologyBufferSize];
+    if (VFTopologyRead(path, buffer, sizeof(buffer)) <= 0) {
+        return NO;
+    }
+    
+    memset(set, 0, sizeof(_VFCPUSet));
+    char *position = buffer;
+    while (*position >= '0' && *position <= '9') {
+        uint32_t first = (uint32_t)strtoul(position, &position, 10);
+        uint32_t last  = first;
+        if (*position == '-') {
+            last = (uint32_t)strtoul(position + 1, &position, 10);
+        }
+        for (uint32_t cpu = first; cpu <= last && cpu < kVFTopologyMaxCPUs; cpu++) {
+            VFCPUSetAdd(set, cpu);
+        }
+        if (*position == ',') {
+            position++;
+        }
+    }
+    return YES;
+}
+
+#pragma mark - Private - Building -
+static void VFTopologyBuildCPUs(_VFTopology *topology, const _VFCPUSet *online) {
+    char path[PATH_MAX];
+    _VFCPUSet packages = {{0}};
+    
+    topology->cpus             = calloc(topology->cpu_count, sizeof(_VFTopologyCPU));
+    topology->threads_per_core = 1;
+    
+    uint32_t index = 0;
+    for (uint32_t id = 0; id < kVFTopologyMaxCPUs && index < topology->cpu_count; id++) {
+        if (!VFCPUSetContains(online, id)) {
+            continue;
+        }
+        
+        _VFTopologyCPU *cpu = &topology->cpus[index++];
+        uint64_t number     = 0;
+        cpu->id             = id;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", id);
+        cpu->core_id = VFTopologyReadNumber(path, &number) ? (uint32_t)number : id;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", id);
+        cpu->package_id = VFTopologyReadNumber(path, &number) ? (uint32_t)number : 0;
+        VFCPUSetAdd(&packages, cpu->package_id);
+        
+        _VFCPUSet siblings;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", id);
+        if (!VFTopologyReadList(path, &siblings)) {
+            memset(&siblings, 0, sizeof(siblings));
+            VFCPUSetAdd(&siblings, id);
+        }
+        
+        for (uint32_t sibling = VFCPUSetGetFirst(&siblings); sibling < id; sibling++) {
+            if (VFCPUSetContains(&siblings, sibling)) {
+                cpu->thread_index++;
+            }
+        }
+        if (cpu->thread_index == 0) {
+            topology->core_count++;
+        }
+        
+        uint32_t threads = VFCPUSetGetCount(&siblings);
+        if (threads > topology->threads_per_core) {
+            topology->threads_per_core = threads;
+        }
+    }
+    
+    topology->package_count = VFCPUSetGetCount(&packages);
+}
+
+static void VFTopologyBuildCaches(_VFTopology *topology) {
+    char path[PATH_MAX];
+    char buffer[64];
+    uint32_t first = topology->cpus[0].id;
+    
+    for (uint32_t index = 0; index < kVFTopologyMaxCaches; index++) {
+        _VFTopologyCache *cache = &topology->caches[index];
+        uint64_t number         = 0;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", first, index);
+        if (!VFTopologyReadNumber(path, &number)) {
+            break;
+        }
+        cache->level = (uint32_t)number;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/type", first, index);
+        if (VFTopologyRead(path, buffer, sizeof(buffer)) <= 0) {
+            buffer[0] = '\0';
+        }
+        cache->type = VFCacheTypeUnified;
+        if (strncmp(buffer, "Data", 4) == 0)         cache->type = VFCacheTypeData;
+        if (strncmp(buffer, "Instruction", 11) == 0) cache->type = VFCacheTypeInstruction;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/size", first, index);
+        cache->size = VFTopologyReadNumber(path, &number) ? number : 0;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/coherency_line_size", first, index);
+        cache->line_size = VFTopologyReadNumber(path, &number) ? (uint32_t)number : kVFTopologyDefaultLineSize;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/ways_of_associativity", first, index);
+        cache->ways = VFTopologyReadNumber(path, &number) ? (uint32_t)number : 0;
+        
+        /* ---------------------------------------
+         * An instance is counted once, by the
+         * lowest CPU in its shared list.
+         */
+        for (uint32_t i = 0; i < topology->cpu_count; i++) {
+            _VFCPUSet shared;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", topology->cpus[i].id, index);
+            if (!VFTopologyReadList(path, &shared)) {
+                continue;
+            }
+            if (i == 0) {
+                cache->shared_count = VFCPUSetGetCount(&shared);
+            }
+            if (VFCPUSetGetFirst(&shared) == topology->cpus[i].id) {
+                cache->instances++;
+            }
+        }
+        if (cache->shared_count == 0) cache->shared_count = 1;
+        if (cache->instances == 0)    cache->instances    = topology->cpu_count / cache->shared_count;
+        
+        topology->cache_count++;
+    }
+    
+    topology->cache_line_size = (topology->cache_count > 0) ? topology->caches[0].line_size : kVFTopologyDefaultLineSize;
+}
+
+static void VFTopologyBuildNodes(_VFTopology *topology, const _VFCPUSet *online) {
+    char path[PATH_MAX];
+    char buffer[kVFTopologyBufferSize];
+    
+    _VFCPUSet nodes;
+    if (!VFTopologyReadList("/sys/devices/system/node/online", &nodes)) {
+        topology->node_count            = 1;
+        topology->nodes                 = calloc(1, sizeof(_VFTopologyNode));
+        topology->nodes[0].cpus         = *online;
+        topology->nodes[0].memory_bytes = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        return;
+    }
+    
+    topology->node_count = VFCPUSetGetCount(&nodes);
+    topology->nodes      = calloc(topology->node_count, sizeof(_VFTopologyNode));
+    
+    uint32_t index = 0;
+    for (uint32_t id = 0; id < kVFTopologyMaxCPUs && index < topology->node_count; id++) {
+        if (!VFCPUSetContains(&nodes, id)) {
+            continue;
+        }
+        
+        _VFTopologyNode *node = &topology->nodes[index++];
+        node->id              = id;
+        
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", id);
+        VFTopologyReadList(path, &node->cpus);
+        
+        // "Node 0 MemTotal:       6147400 kB"
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/meminfo", id);
+        if (VFTopologyRead(path, buffer, sizeof(buffer)) > 0) {
+            char *total = strstr(buffer, "MemTotal:");
+            if (total) {
+                node->memory_bytes = strtoull(total + 9, NULL, 10) * 1024;
+            }
+        }
+        
+        for (uint32_t i = 0; i < topology->cpu_count; i++) {
+            if (VFCPUSetContains(&node->cpus, topology->cpus[i].id)) {
+                topology->cpus[i].node_id = id;
+            }
+        }
+    }
+}
+
+static void VFTopologyBuild(void) {
+    _VFTopology *topology = &kVFTopology;
+    
+    _VFCPUSet online;
+    if (!VFTopologyReadList("/sys/devices/system/cpu/online", &online) || VFCPUSetGetCount(&online) == 0) {
+        memset(&online, 0, sizeof(online));
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        if (count < 1) {
+            count = 1;
+        }
+        for (long cpu = 0; cpu < count; cpu++) {
+            VFCPUSetAdd(&online, (uint32_t)cpu);
+        }
+    }
+    topology->cpu_count = VFCPUSetGetCount(&online);
+    
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (uint32_t cpu = 0; cpu < CPU_SETSIZE && cpu < kVFTopologyMaxCPUs; cpu++) {
+            if (CPU_ISSET(cpu, &mask)) {
+                VFCPUSetAdd(&topology->affinity, cpu);
+            }
+        }
+    } else {
+        topology->affinity = online;
+    }
+    
+    VFTopologyBuildCPUs(topology, &online);
+    VFTopologyBuildCaches(topology);
+    VFTopologyBuildNodes(topology, &online);
+    VFTopologyBuildPinOrder(topology);
+}
+
+#pragma mark - Pinning -
+static BOOL VFTopologyPinThreadToSet(const _VFCPUSet *set, char **error) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE && cpu < kVFTopologyMaxCPUs; cpu++) {
+        if (VFCPUSetContains(set, cpu)) {
+            CPU_SET(cpu, &mask);
+        }
+    }
+    
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    if (result != 0) {
+        if (error) *error = strerror(result);
+        return NO;
+    }
+    return YES;
+}
+
+BOOL VFTopologyPinThread(uint32_t worker, char **error) {
+    VFTopology topology = VFTopologyGet();
+    if (topology->pin_count == 0) {
+        if (error) *error = "There are no CPUs the process may run on";
+        return NO;
+    }
+    
+    _VFCPUSet set = {{0}};
+    VFCPUSetAdd(&set, topology->pin_order[worker % topology->pin_count]);
+    return VFTopologyPinThreadToSet(&set, error);
+}
+
+BOOL VFTopologyPinThreadToNode(uint32_t node, char **error) {
+    VFTopology topology = VFTopologyGet();
+    for (uint32_t i = 0; i < topology->node_count; i++) {
+        if (topology->nodes[i].id != node) {
+            continue;
+        }
+        
+        _VFCPUSet set;
+        for (uint32_t j = 0; j < kVFTopologyMaxCPUs / 64; j++) {
+            set.bits[j] = topology->nodes[i].cpus.bits[j] & topology->affinity.bits[j];
+        }
+        if (VFCPUSetGetCount(&set) == 0) {
+            if (error) *error = "The node has no CPUs the process may run on";
+            return NO;
+        }
+        return VFTopologyPinThreadToSet(&set, error);
+    }
+    
+    if (error) *error = "Invalid node";
+    return NO;
+}
+
+#else
+
+#pragma mark - Private - Building -
+static uint64_t VFTopologyGetNumber(const char *name) {
+    uint64_t number = 0;
+    size_t size     = sizeof(number);
+    if (sysctlbyname(name, &number, &size, NULL, 0) == -1) {
+        return 0;
+    }
+    return (size == sizeof(uint32_t)) ? *(uint32_t *)&number : number;
+}
+
+/*
+ * sysctl has no sharing details, L1 is taken to be per core and the
+ * larger levels shared by the whole package.
+ */
+static void VFTopologyBuild(void) {
+    _VFTopology *topology = &kVFTopology;
+    
+    topology->cpu_count       = (uint32_t)VFTopologyGetNumber("hw.logicalcpu");
+    topology->core_count      = (uint32_t)VFTopologyGetNumber("hw.physicalcpu");
+    topology->package_count   = (uint32_t)VFTopologyGetNumber("hw.packages");
+    topology->cache_line_size = (uint32_t)VFTopologyGetNumber("hw.cachelinesize");
+    topology->node_count      = 1;
+    
+    if (topology->cpu_count == 0)       topology->cpu_count       = 1;
+    if (topology->core_count == 0)      topology->core_count      = topology->cpu_count;
+    if (topology->package_count == 0)   topology->package_count   = 1;
+    if (topology->cache_line_size == 0) topology->cache_line_size = kVFTopologyDefaultLineSize;
+    topology->threads_per_core = topology->cpu_count / topology->core_count;
+    
+    topology->cpus  = calloc(topology->cpu_count, sizeof(_VFTopologyCPU));
+    topology->nodes = calloc(1, sizeof(_VFTopologyNode));
+    for (uint32_t i = 0; i < topology->cpu_count; i++) {
+        topology->cpus[i].id           = i;
+        topology->cpus[i].core_id      = i / topology->threads_per_core;
+        topology->cpus[i].thread_index = i % topology->threads_per_core;
+        VFCPUSetAdd(&topology->affinity, i);
+        VFCPUSetAdd(&topology->nodes[0].cpus, i);
+    }
+    topology->nodes[0].memory_bytes = VFTopologyGetNumber("hw.memsize");
+    
+    const char *names[] = { "hw.l1dcachesize", "hw.l2cachesize", "hw.l3cachesize" };
+    for (uint32_t i = 0; i < 3; i++) {
+        uint64_t size = VFTopologyGetNumber(names[i]);
+        if (size == 0) {
+            continue;
+        }
+        
+        _VFTopologyCache *cache = &topology->caches[topology->cache_count++];
+        cache->level            = i + 1;
+        cache->type             = (i == 0) ? VFCacheTypeData : VFCacheTypeUnified;
+        cache->size             = size;
+        cache->line_size        = topology->cache_line_size;
+        cache->shared_count     = (i == 0) ? topology->threads_per_core : topology->cpu_count / topology->package_count;
+        cache->instances        = topology->cpu_count / cache->shared_count;
+    }
+    
+    VFTopologyBuildPinOrder(topology);
+}
+
+#pragma mark - Pinning -
+BOOL VFTopologyPinThread(uint32_t worker, char **error) {
+    if (error) *error = "Pinning threads is not supported on this platform";
+    return NO;
+}
+
+BOOL VFTopologyPinThreadToNode(uint32_t node, char **error) {
+    if (error) *error = "Pinning threads is not supported on this platform";
+    return NO;
+}
+
+#endif
+
+#pragma mark - VFTopology -
+VFTopology VFTopologyGet(void) {
+    pthread_once(&kVFTopologyOnce, VFTopologyBuild);
+    return &kVFTopology;
+}
+
+const _VFTopologyCache * VFTopologyGetCache(VFTopology topology, uint32_t level) {
+    for (uint32_t i = 0; i < topology->cache_count; i++) {
+        if (topology->caches[i].level == level && topology->caches[i].type != VFCacheTypeInstruction) {
+            return &topology->caches[i];
+        }
+    }
+    return NULL;
+}
+
+size_t VFTopologyGetChunkSize(uint32_t level, uint32_t workers) {
+    const _VFTopologyCache *cache = VFTopologyGetCache(VFTopologyGet(), level);
+    if (!cache || cache->size == 0) {
+        return kVFTopologyDefaultChunkSize;
+    }
+    
+    // Workers spread evenly over the instances of the cache
+    uint32_t sharers = cache->shared_count;
+    if (workers > 0 && cache->instances > 0) {
+        uint32_t per_instance = (workers + cache->instances - 1) / cache->instances;
+        if (per_instance < sharers) {
+            sharers = per_instance;
+        }
+    }
+    
+    size_t line_size = (cache->line_size > 0) ? cache->line_size : kVFTopologyDefaultLineSize;
+    size_t chunk     = cache->size / sharers / 2;
+    chunk           -= chunk % line_size;
+    return (chunk > line_size) ? chunk : line_size;
+}
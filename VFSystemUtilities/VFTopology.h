@@ -0,0 +1,127 @@
+//
+//  VFTopology.h
+//
+//  Created by Dima Bart on 2014-08-29.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFFileManager.h"
+
+#define kVFTopologyMaxCPUs   1024
+#define kVFTopologyMaxCaches 8
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFCacheTypeData        = 0,
+    VFCacheTypeInstruction = 1,
+    VFCacheTypeUnified     = 2,
+} VFCacheType;
+
+/*
+ * =============================
+ *      VFCPUSet & Related
+ * =============================
+ *
+ */
+// MARK: - VFCPUSet -
+typedef struct __VFCPUSet {
+    uint64_t bits[kVFTopologyMaxCPUs / 64];
+} _VFCPUSet;
+typedef _VFCPUSet * VFCPUSet;
+
+// MARK: - VFCPUSet Functions -
+BOOL VFCPUSetContains(const _VFCPUSet *set, uint32_t cpu);
+uint32_t VFCPUSetGetCount(const _VFCPUSet *set);
+
+/*
+ * =============================
+ *     VFTopology & Related
+ * =============================
+ *
+ */
+// MARK: - VFTopologyCache -
+
+/*
+ * A cache level as seen from the first CPU. shared_count is the number of
+ * CPUs that share one instance of it, instances the number of separate
+ * instances across the online CPUs.
+ */
+typedef struct __VFTopologyCache {
+    uint32_t    level;
+    VFCacheType type;
+    uint64_t    size;
+    uint32_t    line_size;
+    uint32_t    ways;
+    uint32_t    shared_count;
+    uint32_t    instances;
+} _VFTopologyCache;
+
+// MARK: - VFTopologyCPU -
+typedef struct __VFTopologyCPU {
+    uint32_t id;
+    uint32_t core_id;
+    uint32_t package_id;
+    uint32_t node_id;
+    uint32_t thread_index; // Position among the SMT siblings of its core, 0 for the first
+} _VFTopologyCPU;
+
+// MARK: - VFTopologyNode -
+typedef struct __VFTopologyNode {
+    uint32_t  id;
+    uint64_t  memory_bytes;
+    _VFCPUSet cpus;
+} _VFTopologyNode;
+
+// MARK: - VFTopology -
+
+/*
+ * The machine's topology, read once from /sys/devices/system/cpu and
+ * /sys/devices/system/node on first use and kept for the lifetime of the
+ * process. The affinity mask is the one of the process at that moment.
+ * Without a node directory the machine is a single node. On Darwin the
+ * counts and cache sizes come from sysctl, with one node and no per CPU
+ * details.
+ */
+typedef struct __VFTopology {
+    uint32_t          cpu_count;
+    uint32_t          core_count;
+    uint32_t          package_count;
+    uint32_t          threads_per_core;
+    uint32_t          node_count;
+    uint32_t          cache_count;
+    uint32_t          cache_line_size;
+    _VFCPUSet         affinity;
+    _VFTopologyCache  caches[kVFTopologyMaxCaches];
+    _VFTopologyCPU   *cpus;
+    _VFTopologyNode  *nodes;
+    uint32_t         *pin_order;
+    uint32_t          pin_count;
+} _VFTopology;
+typedef const _VFTopology * VFTopology;
+
+// MARK: - VFTopology Functions -
+VFTopology VFTopologyGet(void);
+
+const _VFTopologyCache * VFTopologyGetCache(VFTopology topology, uint32_t level); // Data or unified cache of the level, NULL if there's none
+
+/*
+ * Pins the calling thread to one CPU of the affinity mask. Workers are
+ * spread over physical cores first and only then over their SMT siblings,
+ * so worker 0 to core_count - 1 never share a core. Indexes past the
+ * number of allowed CPUs wrap around.
+ */
+BOOL VFTopologyPinThread(uint32_t worker, char **error);
+BOOL VFTopologyPinThreadToNode(uint32_t node, char **error);
+
+/*
+ * A chunk size that lets each of workers threads keep its chunk, and as
+ * much again for its output, within its share of the given cache level.
+ * Rounded down to the cache line size. 0 workers assumes every CPU that
+ * shares the cache is busy.
+ */
+size_t VFTopologyGetChunkSize(uint32_t level, uint32_t workers);
@@ -0,0 +1,759 @@
+//
+//  VFTreeIndex.c
+//
+//  Created by Dima Bart on 2014-08-11.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
+#import <sys/mman.h>
+#import <time.h>
+#import <dispatch/dispatch.h>
+
+#import "VFTreeIndex.h"
+
+static const char kVFTreeIndexMagic[8]  = { 'V', 'F', 'T', 'I', 'D', 'X', '1', '\0' };
+static const uint32_t kVFTreeIndexVersion = 1;
+
+typedef struct __VFTreeIndexHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+    int64_t  time_created;
+    uint64_t sizes_offset;
+    uint64_t times_offset;
+    uint64_t inodes_offset;
+    uint64_t ends_offset;
+    uint64_t paths_offset;
+    uint64_t modes_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} _VFTreeIndexHeader;
+
+typedef struct __VFTreeIndexBuilder {
+    uint64_t    count;
+    uint64_t    capacity;
+    int64_t    *sizes;
+    int64_t    *times_modified;
+    uint64_t   *inodes;
+    uint32_t   *ends;
+    uint32_t   *paths;
+    uint32_t   *modes;
+    char       *strings;
+    uint64_t    strings_size;
+    uint64_t    strings_capacity;
+    VFTreeIndex previous;
+    BOOL        failed;
+} _VFTreeIndexBuilder;
+typedef _VFTreeIndexBuilder * VFTreeIndexBuilder;
+
+#pragma mark - Private -
+
+static int VFTreeIndexCompareNames(const void *name1, const void *name2) {
+    return strcmp(*(char * const *)name1, *(char * const *)name2);
+}
+
+static int64_t VFTreeIndexFind(VFTreeIndex index, const char *path) {
+    uint64_t position = VFTreeIndexFindPosition(index, path);
+    if (position < index->count && VFTreeIndexComparePaths(index->strings + index->paths[position], path) == 0) {
+        return position;
+    }
+    return -1;
+}
+
+static BOOL VFTreeIndexBuilderReserve(VFTreeIndexBuilder builder, uint64_t count) {
+    if (count <= builder->capacity) {
+        return YES;
+    }
+    
+    uint64_t capacity = (builder->capacity > 0) ? builder->capacity * 2 : 4096;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    
+    #define VFTreeIndexGrow(column) { \
+        void *grown = realloc(builder->column, capacity * sizeof(*builder->column)); \
+        if (!grown) { builder->failed = YES; return NO; } \
+        builder->column = grown; \
+    }
+    VFTreeIndexGrow(sizes);
+    VFTreeIndexGrow(times_modified);
+    VFTreeIndexGrow(inodes);
+    VFTreeIndexGrow(ends);
+    VFTreeIndexGrow(paths);
+    VFTreeIndexGrow(modes);
+    #undef VFTreeIndexGrow
+    
+    builder->capacity = capacity;
+    return YES;
+}
+
+static BOOL VFTreeIndexBuilderReserveStrings(VFTreeIndexBuilder builder, uint64_t length) {
+    if (builder->strings_size + length > builder->strings_capacity) {
+        uint64_t capacity = (builder->strings_capacity > 0) ? builder->strings_capacity * 2 : 65536;
+        while (capacity < builder->strings_size + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(builder->strings, capacity);
+        if (!grown) {
+            builder->failed = YES;
+            return NO;
+        }
+        builder->strings          = grown;
+        builder->strings_capacity = capacity;
+    }
+    return YES;
+}
+
+static uint32_t VFTreeIndexBuilderAddString(VFTreeIndexBuilder builder, const char *string) {
+    size_t length = strlen(string) + 1;
+    if (!VFTreeIndexBuilderReserveStrings(builder, length)) {
+        return 0;
+    }
+    
+    uint32_t offset = (uint32_t)builder->strings_size;
+    memcpy(builder->strings + offset, string, length);
+    builder->strings_size += length;
+    return offset;
+}
+
+static uint64_t VFTreeIndexBuilderAdd(VFTreeIndexBuilder builder, const char *path, int64_t size, int64_t time_modified, uint64_t inode, uint32_t mode) {
+    if (!VFTreeIndexBuilderReserve(builder, builder->count + 1)) {
+        return 0;
+    }
+    
+    uint64_t position                 = builder->count++;
+    builder->sizes[position]          = size;
+    builder->times_modified[position] = time_modified;
+    builder->inodes[position]         = inode;
+    builder->modes[position]          = mode;
+    builder->ends[position]           = (uint32_t)builder->count;
+    builder->paths[position]          = VFTreeIndexBuilderAddString(builder, path);
+    return position;
+}
+
+/*
+ * Moves the entries of a builder that captured one subtree in parallel
+ * onto the end of another, re-basing its positions and string offsets.
+ */
+static void VFTreeIndexBuilderAppend(VFTreeIndexBuilder builder, VFTreeIndexBuilder other) {
+    if (other->failed) {
+        builder->failed = YES;
+        return;
+    }
+    if (!VFTreeIndexBuilderReserve(builder, builder->count + other->count) || !VFTreeIndexBuilderReserveStrings(builder, other->strings_size)) {
+        return;
+    }
+    
+    uint64_t base         = builder->count;
+    uint64_t strings_base = builder->strings_size;
+    memcpy(builder->sizes + base,          other->sizes,          other->count * sizeof(int64_t));
+    memcpy(builder->times_modified + base, other->times_modified, other->count * sizeof(int64_t));
+    memcpy(builder->inodes + base,         other->inodes,         other->count * sizeof(uint64_t));
+    memcpy(builder->modes + base,          other->modes,          other->count * sizeof(uint32_t));
+    memcpy(builder->strings + strings_base, other->strings, other->strings_size);
+    
+    for (uint64_t i = 0; i < other->count; i++) {
+        builder->ends[base + i]  = (uint32_t)(other->ends[i] + base);
+        builder->paths[base + i] = (uint32_t)(other->paths[i] + strings_base);
+    }
+    builder->count        += other->count;
+    builder->strings_size += other->strings_size;
+}
+
+static char * VFTreeIndexCreateChildPath(const char *path, const char *name) {
+    if (path[0] == '\0') {
+        return strdup(name);
+    }
+    
+    size_t path_length = strlen(path);
+    size_t name_length = strlen(name);
+    char *child        = malloc(path_length + name_length + 2);
+    if (child) {
+        memcpy(child, path, path_length);
+        child[path_length] = '/';
+        memcpy(child + path_length + 1, name, name_length + 1);
+    }
+    return child;
+}
+
+static char ** VFTreeIndexCopyNames(VFTreeIndexBuilder builder, int directory, size_t *count) {
+    int stream_directory = dup(directory);
+    DIR *stream          = (stream_directory != -1) ? fdopendir(stream_directory) : NULL;
+    if (!stream) {
+        if (stream_directory != -1) {
+            close(stream_directory);
+        }
+        *count = 0;
+        return NULL;
+    }
+    
+    size_t capacity = 0;
+    char **names    = NULL;
+    *count          = 0;
+    for (struct dirent *entry = NULL; (entry = readdir(stream)) != NULL;) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity     = (capacity > 0) ? capacity * 2 : 64;
+            char **grown = realloc(names, sizeof(char *) * capacity);
+            if (!grown) {
+                builder->failed = YES;
+                break;
+            }
+            names = grown;
+        }
+        names[(*count)++] = strdup(entry->d_name);
+    }
+    closedir(stream);
+    
+    qsort(names, *count, sizeof(char *), VFTreeIndexCompareNames);
+    return names;
+}
+
+static void VFTreeIndexBuilderAddDirectory(VFTreeIndexBuilder builder, int directory, const char *path, const struct stat *directory_stat);
+
+static void VFTreeIndexBuilderAddChild(VFTreeIndexBuilder builder, int directory, const char *path, const char *name) {
+    struct stat file;
+    if (fstatat(directory, name, &file, AT_SYMLINK_NOFOLLOW) == -1) {
+        return;
+    }
+    
+    char *child_path = VFTreeIndexCreateChildPath(path, name);
+    if (!child_path) {
+        builder->failed = YES;
+        return;
+    }
+    
+    if (S_ISDIR(file.st_mode)) {
+        int child = openat(directory, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (child != -1) {
+            VFTreeIndexBuilderAddDirectory(builder, child, child_path, &file);
+            close(child);
+        }
+    } else {
+        VFTreeIndexBuilderAdd(builder, child_path, file.st_size, file.st_mtime, file.st_ino, file.st_mode);
+    }
+    free(child_path);
+}
+
+/*
+ * A directory whose inode and modification time match the previous index
+ * hasn't had entries added, removed or renamed, so its names are taken
+ * from there instead of reading the directory. Each entry is still stat'd,
+ * files rewritten in place don't touch their directory. Times that fall in
+ * the same second the previous index was built can't be trusted and are
+ * always read.
+ */
+static BOOL VFTreeIndexBuilderReuseDirectory(VFTreeIndexBuilder builder, int directory, const char *path, const struct stat *directory_stat) {
+    VFTreeIndex previous = builder->previous;
+    if (!previous) {
+        return NO;
+    }
+    
+    int64_t position = VFTreeIndexFind(previous, path);
+    if (position < 0 ||
+        !S_ISDIR(previous->modes[position]) ||
+        previous->inodes[position] != (uint64_t)directory_stat->st_ino ||
+        previous->times_modified[position] != (int64_t)directory_stat->st_mtime ||
+        (int64_t)directory_stat->st_mtime >= previous->time_created) {
+        return NO;
+    }
+    
+    for (uint64_t child = position + 1; child < previous->ends[position]; child = previous->ends[child]) {
+        const char *child_path = previous->strings + previous->paths[child];
+        const char *name       = strrchr(child_path, '/');
+        VFTreeIndexBuilderAddChild(builder, directory, path, (name) ? name + 1 : child_path);
+    }
+    return YES;
+}
+
+static void VFTreeIndexBuilderAddDirectory(VFTreeIndexBuilder builder, int directory, const char *path, const struct stat *directory_stat) {
+    uint64_t position = VFTreeIndexBuilderAdd(builder, path, directory_stat->st_size, directory_stat->st_mtime, directory_stat->st_ino, directory_stat->st_mode);
+    if (builder->failed) {
+        return;
+    }
+    
+    if (!VFTreeIndexBuilderReuseDirectory(builder, directory, path, directory_stat)) {
+        size_t count = 0;
+        char **names = VFTreeIndexCopyNames(builder, directory, &count);
+        for (size_t i = 0; i < count; i++) {
+            VFTreeIndexBuilderAddChild(builder, directory, path, names[i]);
+            free(names[i]);
+        }
+        free(names);
+    }
+    
+    builder->ends[position] = (uint32_t)builder->count;
+}
+
+static BOOL VFTreeIndexWriteAll(int file, const void *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(file, bytes, length);
+        if (bytes_written == -1) {
+            if (errno == EINTR) continue;
+            return NO;
+        }
+        bytes   = (const uint8_t *)bytes + bytes_written;
+        length -= bytes_written;
+    }
+    return YES;
+}
+
+static uint64_t VFTreeIndexAlign(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/*
+ * Index files are taken from disk as they are, so the header must lay the
+ * columns out exactly as VFTreeIndexBuilderCreateIndex does, every path
+ * must start inside the string pool (which ends with a terminator) and
+ * every subtree must end after its entry and within the index. Anything
+ * else is rejected before a column is read.
+ */
+static BOOL VFTreeIndexIsValid(const void *base, size_t length) {
+    const _VFTreeIndexHeader *header = base;
+    if (length < sizeof(_VFTreeIndexHeader) ||
+        memcmp(header->magic, kVFTreeIndexMagic, sizeof(header->magic)) != 0 ||
+        header->version != kVFTreeIndexVersion ||
+        header->count == 0 ||
+        header->count > length / (3 * sizeof(uint64_t) + 3 * sizeof(uint32_t))) {
+        return NO;
+    }
+    
+    uint64_t count = header->count;
+    if (header->sizes_offset   != VFTreeIndexAlign(sizeof(_VFTreeIndexHeader)) ||
+        header->times_offset   != header->sizes_offset  + count * sizeof(int64_t) ||
+        header->inodes_offset  != header->times_offset  + count * sizeof(int64_t) ||
+        header->ends_offset    != header->inodes_offset + count * sizeof(uint64_t) ||
+        header->paths_offset   != header->ends_offset   + count * sizeof(uint32_t) ||
+        header->modes_offset   != header->paths_offset  + count * sizeof(uint32_t) ||
+        header->strings_offset != header->modes_offset  + count * sizeof(uint32_t) ||
+        header->strings_offset > length ||
+        header->strings_size   != length - header->strings_offset ||
+        header->strings_size == 0 ||
+        ((const char *)base)[length - 1] != '\0') {
+        return NO;
+    }
+    
+    const uint32_t *ends  = (const uint32_t *)((const uint8_t *)base + header->ends_offset);
+    const uint32_t *paths = (const uint32_t *)((const uint8_t *)base + header->paths_offset);
+    for (uint64_t i = 0; i < count; i++) {
+        if (paths[i] >= header->strings_size || ends[i] <= i || ends[i] > count) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+static VFTreeIndex VFTreeIndexAttach(void *base, size_t length, BOOL is_mapped) {
+    if (!VFTreeIndexIsValid(base, length)) {
+        return NULL;
+    }
+    
+    const _VFTreeIndexHeader *header = base;
+    VFTreeIndex index = malloc(sizeof(_VFTreeIndex));
+    if (index) {
+        index->base           = base;
+        index->length         = length;
+        index->is_mapped      = is_mapped;
+        index->count          = header->count;
+        index->time_created   = header->time_created;
+        index->sizes          = (const int64_t  *)((const uint8_t *)base + header->sizes_offset);
+        index->times_modified = (const int64_t  *)((const uint8_t *)base + header->times_offset);
+        index->inodes         = (const uint64_t *)((const uint8_t *)base + header->inodes_offset);
+        index->ends           = (const uint32_t *)((const uint8_t *)base + header->ends_offset);
+        index->paths          = (const uint32_t *)((const uint8_t *)base + header->paths_offset);
+        index->modes          = (const uint32_t *)((const uint8_t *)base + header->modes_offset);
+        index->strings        = (const char *)base + header->strings_offset;
+        index->root           = index->strings;
+    }
+    return index;
+}
+
+/*
+ * Lays the builder out exactly as it is stored on disk, so an index in
+ * memory and one mapped from a file look the same and writing one out is
+ * a single sequential write.
+ */
+static VFTreeIndex VFTreeIndexBuilderCreateIndex(VFTreeIndexBuilder builder, int64_t time_created) {
+    _VFTreeIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kVFTreeIndexMagic, sizeof(header.magic));
+    header.version        = kVFTreeIndexVersion;
+    header.count          = builder->count;
+    header.time_created   = time_created;
+    header.sizes_offset   = VFTreeIndexAlign(sizeof(header));
+    header.times_offset   = header.sizes_offset  + builder->count * sizeof(int64_t);
+    header.inodes_offset  = header.times_offset  + builder->count * sizeof(int64_t);
+    header.ends_offset    = header.inodes_offset + builder->count * sizeof(uint64_t);
+    header.paths_offset   = header.ends_offset   + builder->count * sizeof(uint32_t);
+    header.modes_offset   = header.paths_offset  + builder->count * sizeof(uint32_t);
+    header.strings_offset = header.modes_offset  + builder->count * sizeof(uint32_t);
+    header.strings_size   = builder->strings_size;
+    
+    size_t length = header.strings_offset + header.strings_size;
+    uint8_t *base = calloc(1, length);
+    if (!base) {
+        return NULL;
+    }
+    
+    memcpy(base, &header, sizeof(header));
+    memcpy(base + header.sizes_offset,   builder->sizes,          builder->count * sizeof(int64_t));
+    memcpy(base + header.times_offset,   builder->times_modified, builder->count * sizeof(int64_t));
+    memcpy(base + header.inodes_offset,  builder->inodes,         builder->count * sizeof(uint64_t));
+    memcpy(base + header.ends_offset,    builder->ends,           builder->count * sizeof(uint32_t));
+    memcpy(base + header.paths_offset,   builder->paths,          builder->count * sizeof(uint32_t));
+    memcpy(base + header.modes_offset,   builder->modes,          builder->count * sizeof(uint32_t));
+    memcpy(base + header.strings_offset, builder->strings,        builder->strings_size);
+    
+    VFTreeIndex index = VFTreeIndexAttach(base, length, NO);
+    if (!index) {
+        free(base);
+    }
+    return index;
+}
+
+static void VFTreeIndexBuilderRelease(VFTreeIndexBuilder builder) {
+    free(builder->sizes);
+    free(builder->times_modified);
+    free(builder->inodes);
+    free(builder->ends);
+    free(builder->paths);
+    free(builder->modes);
+    free(builder->strings);
+}
+
+/*
+ * The root is always read, each of its subdirectories is then captured
+ * into a builder of its own on a concurrent queue and the results are
+ * appended in name order.
+ */
+static void VFTreeIndexBuilderAddRoot(VFTreeIndexBuilder builder, int directory, const struct stat *directory_stat) {
+    uint64_t position = VFTreeIndexBuilderAdd(builder, "", directory_stat->st_size, directory_stat->st_mtime, directory_stat->st_ino, directory_stat->st_mode);
+    if (builder->failed) {
+        return;
+    }
+    
+    size_t count              = 0;
+    char **names              = VFTreeIndexCopyNames(builder, directory, &count);
+    struct stat *stats        = calloc(count, sizeof(struct stat));
+    BOOL *is_present          = calloc(count, sizeof(BOOL));
+    VFTreeIndexBuilder parts  = calloc(count, sizeof(_VFTreeIndexBuilder));
+    if (count > 0 && (!stats || !is_present || !parts)) {
+        builder->failed = YES;
+        count           = 0;
+    }
+    
+    VFTreeIndex previous = builder->previous;
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        if (fstatat(directory, names[i], &stats[i], AT_SYMLINK_NOFOLLOW) == -1) {
+            return;
+        }
+        is_present[i] = YES;
+        
+        if (S_ISDIR(stats[i].st_mode)) {
+            int child = openat(directory, names[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (child != -1) {
+                parts[i].previous = previous;
+                VFTreeIndexBuilderAddDirectory(&parts[i], child, names[i], &stats[i]);
+                close(child);
+            }
+        }
+    });
+    
+    for (size_t i = 0; i < count; i++) {
+        if (is_present[i]) {
+            if (S_ISDIR(stats[i].st_mode)) {
+                VFTreeIndexBuilderAppend(builder, &parts[i]);
+                VFTreeIndexBuilderRelease(&parts[i]);
+            } else {
+                VFTreeIndexBuilderAdd(builder, names[i], stats[i].st_size, stats[i].st_mtime, stats[i].st_ino, stats[i].st_mode);
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+    free(stats);
+    free(is_present);
+    free(parts);
+    
+    builder->ends[position] = (uint32_t)builder->count;
+}
+
+static void VFTreeIndexFillEntry(VFTreeIndex index, uint64_t position, VFTreeIndexEntry entry) {
+    entry->path          = index->strings + index->paths[position];
+    entry->size          = index->sizes[position];
+    entry->time_modified = index->times_modified[position];
+    entry->inode         = index->inodes[position];
+    entry->mode          = index->modes[position];
+}
+
+#pragma mark - Building -
+VFTreeIndex VFTreeIndexCreate(const char *root, VFTreeIndex previous, char **error) {
+    if (!root) {
+        if (error) {
+            *error = "Invalid root";
+        }
+        return NULL;
+    }
+    
+    int directory = open(root, O_RDONLY | O_DIRECTORY);
+    struct stat directory_stat;
+    if (directory == -1 || fstat(directory, &directory_stat) == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        if (directory != -1) {
+            close(directory);
+        }
+        return NULL;
+    }
+    
+    // A previous index of some other tree is of no use
+    if (previous && strcmp(previous->root, root) != 0) {
+        previous = NULL;
+    }
+    
+    _VFTreeIndexBuilder builder;
+    memset(&builder, 0, sizeof(builder));
+    builder.previous = previous;
+    
+    // The root path lives at the start of the string pool
+    int64_t time_created = time(NULL);
+    VFTreeIndexBuilderAddString(&builder, root);
+    VFTreeIndexBuilderAddRoot(&builder, directory, &directory_stat);
+    close(directory);
+    
+    VFTreeIndex index = NULL;
+    if (!builder.failed && builder.strings_size <= UINT32_MAX) {
+        index = VFTreeIndexBuilderCreateIndex(&builder, time_created);
+    }
+    VFTreeIndexBuilderRelease(&builder);
+    
+    if (!index && error) {
+        *error = "Could not build tree index";
+    }
+    return index;
+}
+
+BOOL VFTreeIndexWrite(VFTreeIndex index, const char *index_path, char **error) {
+    if (!index || !index_path) {
+        if (error) {
+            *error = "Invalid index or index path";
+        }
+        return NO;
+    }
+    
+    // Written next to the index and renamed over it, so anyone who still
+    // has the previous index mapped keeps a consistent view
+    char *temporary_path = NULL;
+    asprintf(&temporary_path, "%s.%d.tmp", index_path, getpid());
+    if (!temporary_path) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NO;
+    }
+    
+    int file = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        free(temporary_path);
+        return NO;
+    }
+    
+    BOOL success = VFTreeIndexWriteAll(file, index->base, index->length);
+    success      = (close(file) == 0) && success;
+    if (success) {
+        success = (rename(temporary_path, index_path) == 0);
+    }
+    if (!success) {
+        if (error) {
+            *error = "Could not write tree index";
+        }
+        unlink(temporary_path);
+    }
+    free(temporary_path);
+    
+    return success;
+}
+
+BOOL VFTreeIndexBuild(const char *root, const char *index_path, VFTreeIndex previous, char **error) {
+    if (!root || !index_path) {
+        if (error) {
+            *error = "Invalid root or index path";
+        }
+        return NO;
+    }
+    
+    VFTreeIndex index = VFTreeIndexCreate(root, previous, error);
+    if (!index) {
+        return NO;
+    }
+    
+    BOOL success = VFTreeIndexWrite(index, index_path, error);
+    VFTreeIndexRelease(index);
+    return success;
+}
+
+#pragma mark - VFTreeIndex -
+VFTreeIndex VFTreeIndexOpen(const char *index_path, char **error) {
+    if (!index_path) {
+        if (error) {
+            *error = "Invalid index path";
+        }
+        return NULL;
+    }
+    
+    int file = open(index_path, O_RDONLY);
+    if (file == -1) {
+        if (error) {
+            *error = strerror(errno);
+        }
+        return NULL;
+    }
+    
+    struct stat file_stat;
+    void *base = MAP_FAILED;
+    if (fstat(file, &file_stat) == 0 && file_stat.st_size >= (off_t)sizeof(_VFTreeIndexHeader)) {
+        base = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, file, 0);
+    }
+    close(file);
+    
+    if (base == MAP_FAILED) {
+        if (error) {
+            *error = "Could not map tree index";
+        }
+        return NULL;
+    }
+    
+    VFTreeIndex index = VFTreeIndexAttach(base, file_stat.st_size, YES);
+    if (!index) {
+        if (error) {
+            *error = "Not a valid tree index";
+        }
+        munmap(base, file_stat.st_size);
+    }
+    return index;
+}
+
+void VFTreeIndexRelease(VFTreeIndex index) {
+    if (index) {
+        if (index->is_mapped) {
+            munmap(index->base, index->length);
+        } else {
+            free(index->base);
+        }
+        free(index);
+    }
+}
+
+uint64_t VFTreeIndexGetCount(VFTreeIndex index) {
+    return (index) ? index->count : 0;
+}
+
+BOOL VFTreeIndexGetEntry(VFTreeIndex index, uint64_t position, VFTreeIndexEntry entry) {
+    if (!index || !entry || position >= index->count) {
+        return NO;
+    }
+    
+    VFTreeIndexFillEntry(index, position, entry);
+    return YES;
+}
+
+BOOL VFTreeIndexFindEntry(VFTreeIndex index, const char *path, VFTreeIndexEntry entry) {
+    if (!index || !path || !entry) {
+        return NO;
+    }
+    
+    int64_t position = VFTreeIndexFind(index, path);
+    if (position < 0) {
+        return NO;
+    }
+    
+    VFTreeIndexFillEntry(index, position, entry);
+    return YES;
+}
+
+#pragma mark - Queries -
+void VFTreeIndexQueryInit(VFTreeIndexQuery query) {
+    if (query) {
+        query->min_size        = INT64_MIN;
+        query->max_size        = INT64_MAX;
+        query->modified_after  = INT64_MIN;
+        query->modified_before = INT64_MAX;
+        query->type            = 0;
+    }
+}
+
+uint64_t VFTreeIndexEnumerate(VFTreeIndex index, VFTreeIndexQuery query, VFTreeIndexEnumerationBlock block) {
+    if (!index || !query) {
+        return 0;
+    }
+    
+    // Each test only touches its own column, the entry is assembled for matches only
+    uint64_t matches = 0;
+    BOOL stop        = NO;
+    for (uint64_t i = 0; i < index->count && !stop; i++) {
+        if (index->sizes[i] < query->min_size || index->sizes[i] > query->max_size) {
+            continue;
+        }
+        if (index->times_modified[i] <= query->modified_after || index->times_modified[i] >= query->modified_before) {
+            continue;
+        }
+        if (query->type != 0 && (index->modes[i] & S_IFMT) != query->type) {
+            continue;
+        }
+        
+        matches++;
+        if (block) {
+            _VFTreeIndexEntry entry;
+            VFTreeIndexFillEntry(index, i, &entry);
+            block(&entry, &stop);
+        }
+    }
+    return matches;
+}
+
+#pragma mark - Ordering -
+
+/*
+ * Orders paths the way a sorted pre-order walk produces them: '/' sorts
+ * before every other character so a directory's subtree comes before
+ * its siblings ("a/z" < "a-b").
+ */
+int VFTreeIndexComparePaths(const char *path1, const char *path2) {
+    while (*path1 && *path1 == *path2) {
+        path1++;
+        path2++;
+    }
+    int character1 = (*path1 == '/') ? 1 : (unsigned char)*path1;
+    int character2 = (*path2 == '/') ? 1 : (unsigned char)*path2;
+    return character1 - character2;
+}
+
+uint64_t VFTreeIndexFindPosition(VFTreeIndex index, const char *path) {
+    if (!index || !path) {
+        return 0;
+    }
+    
+    uint64_t low  = 0;
+    uint64_t high = index->count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (VFTreeIndexComparePaths(index->strings + index->paths[middle], path) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
@@ -0,0 +1,99 @@
+//
+//  VFTreeIndex.h
+//
+//  Created by Dima Bart on 2014-08-11.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFFileManager.h"
+
+/*
+ * =============================
+ *    VFTreeIndex & Related
+ * =============================
+ *
+ */
+// MARK: - VFTreeIndex -
+
+/*
+ * A tree index is a columnar snapshot of a directory walk stored in a
+ * single file: one array per attribute (sizes, modification times,
+ * inodes, modes, path offsets) followed by a string pool. Opening an
+ * index maps the file and points at the columns, nothing is parsed.
+ *
+ * Entries are stored in pre-order with the children of every directory
+ * sorted by name, so each directory is followed by its whole subtree and
+ * entry paths (relative to the root, "" being the root itself) are in
+ * sorted order with '/' ordering before any other character.
+ *
+ * An index is captured in memory with VFTreeIndexCreate, the subtrees
+ * below the root being walked concurrently, and can then be written out
+ * with VFTreeIndexWrite and mapped back with VFTreeIndexOpen.
+ *
+ * Rebuilding against a previous index only reads directories whose
+ * modification time changed. Every other directory takes its names from
+ * the previous index, skipping readdir(), but every entry is still
+ * stat'd, so files rewritten in place are picked up.
+ */
+typedef struct __VFTreeIndex {
+    void           *base;
+    size_t          length;
+    BOOL            is_mapped;
+    uint64_t        count;
+    int64_t         time_created;
+    const int64_t  *sizes;
+    const int64_t  *times_modified;
+    const uint64_t *inodes;
+    const uint32_t *ends;
+    const uint32_t *paths;
+    const uint32_t *modes;
+    const char     *strings;
+    const char     *root;
+} _VFTreeIndex;
+typedef _VFTreeIndex * VFTreeIndex;
+
+// MARK: - VFTreeIndexEntry -
+typedef struct __VFTreeIndexEntry {
+    const char *path;
+    int64_t     size;
+    int64_t     time_modified;
+    uint64_t    inode;
+    uint32_t    mode;
+} _VFTreeIndexEntry;
+typedef _VFTreeIndexEntry * VFTreeIndexEntry;
+
+// MARK: - VFTreeIndexQuery -
+typedef struct __VFTreeIndexQuery {
+    int64_t  min_size;
+    int64_t  max_size;
+    int64_t  modified_after;
+    int64_t  modified_before;
+    uint32_t type; // S_IFREG, S_IFDIR, ... or 0 for any
+} _VFTreeIndexQuery;
+typedef _VFTreeIndexQuery * VFTreeIndexQuery;
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFTreeIndexEnumerationBlock)(VFTreeIndexEntry entry, BOOL *stop);
+
+// MARK: - VFTreeIndex Functions -
+VFTreeIndex VFTreeIndexCreate(const char *root, VFTreeIndex previous, char **error);
+BOOL VFTreeIndexWrite(VFTreeIndex index, const char *index_path, char **error);
+BOOL VFTreeIndexBuild(const char *root, const char *index_path, VFTreeIndex previous, char **error); // Create and write in one step
+
+VFTreeIndex VFTreeIndexOpen(const char *index_path, char **error);
+void VFTreeIndexRelease(VFTreeIndex index);
+
+uint64_t VFTreeIndexGetCount(VFTreeIndex index);
+BOOL VFTreeIndexGetEntry(VFTreeIndex index, uint64_t position, VFTreeIndexEntry entry);
+BOOL VFTreeIndexFindEntry(VFTreeIndex index, const char *path, VFTreeIndexEntry entry);
+uint64_t VFTreeIndexFindPosition(VFTreeIndex index, const char *path); // First entry not ordered before path
+
+int VFTreeIndexComparePaths(const char *path1, const char *path2);
+
+void VFTreeIndexQueryInit(VFTreeIndexQuery query); // Matches everything
+uint64_t VFTreeIndexEnumerate(VFTreeIndex index, VFTreeIndexQuery query, VFTreeIndexEnumerationBlock block);
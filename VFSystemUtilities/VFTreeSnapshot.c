@@ -0,0 +1,330 @@
+//
+//  VFTreeSnapshot.c
+//
+//  Created by Dima Bart on 2014-08-16.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <pthread.h>
+#import <dispatch/dispatch.h>
+
+#import "VFTreeSnapshot.h"
+
+#define kVFTreeSnapshotRenameWindow 4096
+#define kVFTreeSnapshotRangeLimit   64
+
+static const uint64_t kVFTreeSnapshotRangeEntries = 65536;
+
+typedef struct __VFTreeSnapshotPending {
+    uint64_t inode;
+    uint64_t position;
+    int64_t  next;
+    BOOL     is_added;
+    BOOL     is_live;
+} _VFTreeSnapshotPending;
+
+typedef struct __VFTreeSnapshotWindow {
+    _VFTreeSnapshotPending pending[kVFTreeSnapshotRenameWindow];
+    int64_t                buckets[kVFTreeSnapshotRenameWindow];
+    uint64_t               tail;
+    BOOL                   is_shared;
+} _VFTreeSnapshotWindow;
+typedef _VFTreeSnapshotWindow * VFTreeSnapshotWindow;
+
+typedef struct __VFTreeSnapshotDiffContext {
+    VFTreeSnapshot           from;
+    VFTreeSnapshot           to;
+    VFTreeSnapshotDiffBlock  block;
+    VFTreeSnapshotWindow     shared;
+    pthread_mutex_t          lock;
+    uint64_t                 changes;
+} _VFTreeSnapshotDiffContext;
+typedef _VFTreeSnapshotDiffContext * VFTreeSnapshotDiffContext;
+
+#pragma mark - Private - Reporting -
+
+// Expects the context lock to be held
+static void VFTreeSnapshotReport(VFTreeSnapshotDiffContext context, VFTreeSnapshotChange change, int64_t from_position, int64_t to_position) {
+    _VFTreeIndexEntry from;
+    _VFTreeIndexEntry to;
+    if (from_position >= 0) VFTreeIndexGetEntry(context->from, from_position, &from);
+    if (to_position >= 0)   VFTreeIndexGetEntry(context->to, to_position, &to);
+    
+    context->changes++;
+    if (context->block) {
+        context->block(change, (from_position >= 0) ? &from : NULL, (to_position >= 0) ? &to : NULL);
+    }
+}
+
+static void VFTreeSnapshotReportLocked(VFTreeSnapshotDiffContext context, VFTreeSnapshotChange change, int64_t from_position, int64_t to_position) {
+    pthread_mutex_lock(&context->lock);
+    VFTreeSnapshotReport(context, change, from_position, to_position);
+    pthread_mutex_unlock(&context->lock);
+}
+
+#pragma mark - Private - Rename Window -
+static VFTreeSnapshotWindow VFTreeSnapshotWindowCreate(BOOL is_shared) {
+    VFTreeSnapshotWindow window = malloc(sizeof(_VFTreeSnapshotWindow));
+    if (window) {
+        for (size_t i = 0; i < kVFTreeSnapshotRenameWindow; i++) {
+            window->pending[i].is_live = NO;
+            window->buckets[i]         = -1;
+        }
+        window->tail      = 0;
+        window->is_shared = is_shared;
+    }
+    return window;
+}
+
+static void VFTreeSnapshotWindowUnlink(VFTreeSnapshotWindow window, int64_t slot) {
+    int64_t *link = &window->buckets[window->pending[slot].inode % kVFTreeSnapshotRenameWindow];
+    while (*link != -1 && *link != slot) {
+        link = &window->pending[*link].next;
+    }
+    if (*link == slot) {
+        *link = window->pending[slot].next;
+    }
+    window->pending[slot].is_live = NO;
+}
+
+static void VFTreeSnapshotWindowPush(VFTreeSnapshotDiffContext context, VFTreeSnapshotWindow window, BOOL is_added, uint64_t inode, uint64_t position);
+static void VFTreeSnapshotDiffRange(VFTreeSnapshotDiffContext context, VFTreeSnapshotWindow window, uint64_t from_start, uint64_t from_end, size_t from_skip, uint64_t to_start, uint64_t to_end, size_t to_skip);
+
+/*
+ * Inode numbers are reused as soon as a file is deleted, so a file only
+ * counts as renamed when its size and time came along with it.
+ */
+static BOOL VFTreeSnapshotIsRename(VFTreeSnapshotDiffContext context, uint64_t from_position, uint64_t to_position) {
+    VFTreeSnapshot from = context->from;
+    VFTreeSnapshot to   = context->to;
+    if (from->inodes[from_position] != to->inodes[to_position] || (from->modes[from_position] & S_IFMT) != (to->modes[to_position] & S_IFMT)) {
+        return NO;
+    }
+    if (S_ISDIR(from->modes[from_position])) {
+        return YES;
+    }
+    return from->sizes[from_position] == to->sizes[to_position] && from->times_modified[from_position] == to->times_modified[to_position];
+}
+
+/*
+ * An entry that leaves a range's window without a counterpart gets one
+ * more chance in the shared window, one that leaves the shared window is
+ * reported along with everything below it.
+ */
+static void VFTreeSnapshotWindowEvict(VFTreeSnapshotDiffContext context, VFTreeSnapshotWindow window, int64_t slot) {
+    _VFTreeSnapshotPending pending = window->pending[slot];
+    VFTreeSnapshotWindowUnlink(window, slot);
+    
+    if (window->is_shared) {
+        if (pending.is_added) {
+            for (uint64_t i = pending.position; i < context->to->ends[pending.position]; i++) {
+                VFTreeSnapshotReport(context, VFTreeSnapshotChangeAdded, -1, i);
+            }
+        } else {
+            for (uint64_t i = pending.position; i < context->from->ends[pending.position]; i++) {
+                VFTreeSnapshotReport(context, VFTreeSnapshotChangeRemoved, i, -1);
+            }
+        }
+        
+    } else {
+        pthread_mutex_lock(&context->lock);
+        VFTreeSnapshotWindowPush(context, context->shared, pending.is_added, pending.inode, pending.position);
+        pthread_mutex_unlock(&context->lock);
+    }
+}
+
+static void VFTreeSnapshotWindowPush(VFTreeSnapshotDiffContext context, VFTreeSnapshotWindow window, BOOL is_added, uint64_t inode, uint64_t position) {
+    int64_t *bucket = &window->buckets[inode % kVFTreeSnapshotRenameWindow];
+    for (int64_t slot = *bucket; slot != -1; slot = window->pending[slot].next) {
+        _VFTreeSnapshotPending *pending = &window->pending[slot];
+        if (pending->inode != inode || pending->is_added == is_added) {
+            continue;
+        }
+        
+        uint64_t from_position = is_added ? pending->position : position;
+        uint64_t to_position   = is_added ? position : pending->position;
+        if (VFTreeSnapshotIsRename(context, from_position, to_position)) {
+            VFTreeSnapshotWindowUnlink(window, slot);
+            VFTreeSnapshotReportLocked(context, VFTreeSnapshotChangeRenamed, from_position, to_position);
+            
+            // Whatever moved along with a directory is implied, only differences inside it are reported
+            if (S_ISDIR(context->from->modes[from_position])) {
+                const char *from_path = context->from->strings + context->from->paths[from_position];
+                const char *to_path   = context->to->strings + context->to->paths[to_position];
+                VFTreeSnapshotDiffRange(context, window, from_position + 1, context->from->ends[from_position], strlen(from_path), to_position + 1, context->to->ends[to_position], strlen(to_path));
+            }
+            return;
+        }
+    }
+    
+    int64_t slot = (int64_t)(window->tail++ % kVFTreeSnapshotRenameWindow);
+    if (window->pending[slot].is_live) {
+        VFTreeSnapshotWindowEvict(context, window, slot);
+    }
+    
+    _VFTreeSnapshotPending *pending = &window->pending[slot];
+    pending->inode    = inode;
+    pending->position = position;
+    pending->is_added = is_added;
+    pending->is_live  = YES;
+    pending->next     = *bucket;
+    *bucket           = slot;
+}
+
+static void VFTreeSnapshotWindowFlush(VFTreeSnapshotDiffContext context, VFTreeSnapshotWindow window) {
+    uint64_t start = (window->tail > kVFTreeSnapshotRenameWindow) ? window->tail - kVFTreeSnapshotRenameWindow : 0;
+    for (uint64_t i = start; i < window->tail; i++) {
+        int64_t slot = (int64_t)(i % kVFTreeSnapshotRenameWindow);
+        if (window->pending[slot].is_live) {
+            VFTreeSnapshotWindowEvict(context, window, slot);
+        }
+    }
+}
+
+#pragma mark - Private - Merging -
+static BOOL VFTreeSnapshotIsModified(VFTreeSnapshot from, uint64_t i, VFTreeSnapshot to, uint64_t j) {
+    if (from->modes[i] != to->modes[j]) {
+        return YES;
+    }
+    if (S_ISDIR(from->modes[i])) {
+        return NO;
+    }
+    return from->sizes[i] != to->sizes[j] || from->times_modified[i] != to->times_modified[j];
+}
+
+/*
+ * Merges two runs of entries in path order. Inside a renamed directory the
+ * paths are compared without their directory prefixes. An entry found on
+ * one side only is pushed with its subtree, which is then skipped.
+ */
+static void VFTreeSnapshotDiffRange(VFTreeSnapshotDiffContext context, VFTreeSnapshotWindow window, uint64_t from_start, uint64_t from_end, size_t from_skip, uint64_t to_start, uint64_t to_end, size_t to_skip) {
+    VFTreeSnapshot from = context->from;
+    VFTreeSnapshot to   = context->to;
+    
+    uint64_t i = from_start;
+    uint64_t j = to_start;
+    while (i < from_end || j < to_end) {
+        int order;
+        if (i < from_end && j < to_end) {
+            order = VFTreeIndexComparePaths(from->strings + from->paths[i] + from_skip, to->strings + to->paths[j] + to_skip);
+        } else {
+            order = (i < from_end) ? -1 : 1;
+        }
+        
+        if (order < 0) {
+            VFTreeSnapshotWindowPush(context, window, NO, from->inodes[i], i);
+            i = from->ends[i];
+            
+        } else if (order > 0) {
+            VFTreeSnapshotWindowPush(context, window, YES, to->inodes[j], j);
+            j = to->ends[j];
+            
+        } else if (from->inodes[i] != to->inodes[j] || (from->modes[i] & S_IFMT) != (to->modes[j] & S_IFMT)) {
+            
+            // Same path but a different file, e.g. something renamed over it
+            VFTreeSnapshotWindowPush(context, window, NO, from->inodes[i], i);
+            VFTreeSnapshotWindowPush(context, window, YES, to->inodes[j], j);
+            i = from->ends[i];
+            j = to->ends[j];
+            
+        } else {
+            if (VFTreeSnapshotIsModified(from, i, to, j)) {
+                VFTreeSnapshotReportLocked(context, VFTreeSnapshotChangeModified, i, j);
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+#pragma mark - VFTreeSnapshot -
+VFTreeSnapshot VFTreeSnapshotCreate(const char *root, VFTreeSnapshot previous, char **error) {
+    return VFTreeIndexCreate(root, previous, error);
+}
+
+VFTreeSnapshot VFTreeSnapshotOpen(const char *path, char **error) {
+    return VFTreeIndexOpen(path, error);
+}
+
+BOOL VFTreeSnapshotWrite(VFTreeSnapshot snapshot, const char *path, char **error) {
+    return VFTreeIndexWrite(snapshot, path, error);
+}
+
+void VFTreeSnapshotRelease(VFTreeSnapshot snapshot) {
+    VFTreeIndexRelease(snapshot);
+}
+
+#pragma mark - Diffing -
+uint64_t VFTreeSnapshotDiff(VFTreeSnapshot from, VFTreeSnapshot to, VFTreeSnapshotDiffBlock block) {
+    if (!from || !to) {
+        return 0;
+    }
+    
+    _VFTreeSnapshotDiffContext context;
+    context.from    = from;
+    context.to      = to;
+    context.block   = block;
+    context.shared  = VFTreeSnapshotWindowCreate(YES);
+    context.changes = 0;
+    if (!context.shared) {
+        return 0;
+    }
+    // Renames found in the shared window diff their directories under the lock
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&context.lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    
+    /* ---------------------------------------
+     * Both snapshots are sorted by path, so the
+     * path of an entry below the root splits
+     * both of them between whole subtrees. The
+     * split entries are taken at even intervals
+     * from the larger of the two.
+     */
+    VFTreeSnapshot pivot = (from->count >= to->count) ? from : to;
+    uint64_t ranges      = pivot->count / kVFTreeSnapshotRangeEntries;
+    if (ranges < 1) {
+        ranges = 1;
+    } else if (ranges > kVFTreeSnapshotRangeLimit) {
+        ranges = kVFTreeSnapshotRangeLimit;
+    }
+    
+    uint64_t from_bounds[kVFTreeSnapshotRangeLimit + 1];
+    uint64_t to_bounds[kVFTreeSnapshotRangeLimit + 1];
+    from_bounds[0]      = 0;
+    to_bounds[0]        = 0;
+    uint64_t k = 1;
+    for (uint64_t position = 1; position < pivot->count && k < ranges; position = pivot->ends[position]) {
+        while (k < ranges && position >= k * pivot->count / ranges) {
+            const char *path = pivot->strings + pivot->paths[position];
+            from_bounds[k]   = VFTreeIndexFindPosition(from, path);
+            to_bounds[k]     = VFTreeIndexFindPosition(to, path);
+            k++;
+        }
+    }
+    for (; k <= ranges; k++) {
+        from_bounds[k] = from->count;
+        to_bounds[k]   = to->count;
+    }
+    
+    // Blocks can't capture arrays or structs by reference
+    VFTreeSnapshotDiffContext shared_context = &context;
+    uint64_t *from_ranges                    = from_bounds;
+    uint64_t *to_ranges                      = to_bounds;
+    dispatch_apply(ranges, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t k) {
+        VFTreeSnapshotWindow window = VFTreeSnapshotWindowCreate(NO);
+        if (window) {
+            VFTreeSnapshotDiffRange(shared_context, window, from_ranges[k], from_ranges[k + 1], 0, to_ranges[k], to_ranges[k + 1], 0);
+            VFTreeSnapshotWindowFlush(shared_context, window);
+            free(window);
+        }
+    });
+    
+    VFTreeSnapshotWindowFlush(&context, context.shared);
+    free(context.shared);
+    pthread_mutex_destroy(&context.lock);
+    
+    return context.changes;
+}
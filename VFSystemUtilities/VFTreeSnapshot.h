@@ -0,0 +1,66 @@
+//
+//  VFTreeSnapshot.h
+//
+//  Created by Dima Bart on 2014-08-16.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+
+#import "VFTreeIndex.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFTreeSnapshotChangeAdded    = 0,
+    VFTreeSnapshotChangeRemoved  = 1,
+    VFTreeSnapshotChangeModified = 2,
+    VFTreeSnapshotChangeRenamed  = 3,
+} VFTreeSnapshotChange;
+
+/*
+ * =============================
+ *    VFTreeSnapshot & Related
+ * =============================
+ *
+ */
+// MARK: - VFTreeSnapshot -
+
+/*
+ * A snapshot is a tree index held in memory: sorted, columnar and written
+ * out or opened again as a single file, so it can be queried with the
+ * VFTreeIndex functions as well.
+ *
+ * Diffing walks both snapshots in path order at once and never holds
+ * more than the entries being compared. The walk is split between the
+ * subtrees of the root, which are compared concurrently. An entry that
+ * exists on one side only waits, together with its subtree, in a window
+ * of a few thousand entries for a counterpart with the same inode (and,
+ * for files, the same size and time). A matching pair is reported as a
+ * single rename. Because of that window, changes are not reported in path
+ * order. A rename whose halves are further apart than the window is
+ * reported as a removal and an addition.
+ *
+ * A renamed directory is reported once, followed by whatever changed
+ * inside it. A removed or added directory is reported along with every
+ * entry below it.
+ *
+ * Directories are only reported as modified when their mode changes,
+ * their size and time follow from the entries inside them. The diff
+ * block is never called concurrently.
+ */
+typedef _VFTreeIndex _VFTreeSnapshot;
+typedef VFTreeIndex VFTreeSnapshot;
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFTreeSnapshotDiffBlock)(VFTreeSnapshotChange change, VFTreeIndexEntry from, VFTreeIndexEntry to);
+
+// MARK: - VFTreeSnapshot Functions -
+VFTreeSnapshot VFTreeSnapshotCreate(const char *root, VFTreeSnapshot previous, char **error);
+VFTreeSnapshot VFTreeSnapshotOpen(const char *path, char **error);
+BOOL VFTreeSnapshotWrite(VFTreeSnapshot snapshot, const char *path, char **error);
+void VFTreeSnapshotRelease(VFTreeSnapshot snapshot);
+
+uint64_t VFTreeSnapshotDiff(VFTreeSnapshot from, VFTreeSnapshot to, VFTreeSnapshotDiffBlock block); // Returns the number of changes
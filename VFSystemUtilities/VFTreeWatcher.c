@@ -0,0 +1,768 @@
+//
+//  VFTreeWatcher.c
+//
+//  Created by Dima Bart on 2014-08-14.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#if defined(__linux__)
+    #define _GNU_SOURCE
+#endif
+
+#import <Block.h>
+#import <poll.h>
+#import <time.h>
+#import <fcntl.h>
+#import <errno.h>
+#import <dirent.h>
+#import <unistd.h>
+#import <limits.h>
+
+#if defined(__linux__)
+    #import <sys/inotify.h>
+    #import <sys/fanotify.h>
+#endif
+
+#import "VFTreeWatcher.h"
+
+#if defined(__linux__)
+
+static const size_t kVFTreeWatcherEventBufferSize = 64 * 1024;
+static const size_t kVFTreeWatcherInitialBuckets  = 1024;
+
+static const uint32_t kVFTreeWatcherInotifyMask   = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+typedef struct __VFTreeWatcherNode {
+    VFFileInfo                   info;
+    int                          watch;
+    uint64_t                     generation;
+    struct timespec              time_modified;
+    struct __VFTreeWatcherNode  *parent;
+    struct __VFTreeWatcherNode  *children;
+    struct __VFTreeWatcherNode  *previous;
+    struct __VFTreeWatcherNode  *next;
+    struct __VFTreeWatcherNode  *bucket_next;
+} _VFTreeWatcherNode;
+typedef _VFTreeWatcherNode * VFTreeWatcherNode;
+
+typedef struct __VFTreeWatcherPaths {
+    char   **paths;
+    size_t   count;
+    size_t   capacity;
+} _VFTreeWatcherPaths;
+typedef _VFTreeWatcherPaths * VFTreeWatcherPaths;
+
+static void VFTreeWatcherScanDirectory(VFTreeWatcher watcher, VFTreeWatcherNode node, BOOL emit, BOOL recover);
+
+#pragma mark - Private - Mirror -
+static uint64_t VFTreeWatcherHash(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static VFTreeWatcherNode VFTreeWatcherLookup(VFTreeWatcher watcher, const char *path) {
+    VFTreeWatcherNode node = watcher->buckets[VFTreeWatcherHash(path) & (watcher->capacity - 1)];
+    while (node && strcmp(node->info->path, path) != 0) {
+        node = node->bucket_next;
+    }
+    return node;
+}
+
+static void VFTreeWatcherHashInsert(VFTreeWatcher watcher, VFTreeWatcherNode node) {
+    
+    /* ---------------------------------------
+     * Grow at a load factor of one, re-chaining
+     * the existing nodes into the new buckets.
+     */
+    if (watcher->count >= watcher->capacity) {
+        size_t capacity            = watcher->capacity * 2;
+        VFTreeWatcherNode *buckets = calloc(capacity, sizeof(VFTreeWatcherNode));
+        for (size_t i = 0; i < watcher->capacity; i++) {
+            VFTreeWatcherNode chained = watcher->buckets[i];
+            while (chained) {
+                VFTreeWatcherNode next  = chained->bucket_next;
+                size_t bucket           = VFTreeWatcherHash(chained->info->path) & (capacity - 1);
+                chained->bucket_next    = buckets[bucket];
+                buckets[bucket]         = chained;
+                chained                 = next;
+            }
+        }
+        free(watcher->buckets);
+        watcher->buckets  = buckets;
+        watcher->capacity = capacity;
+    }
+    
+    size_t bucket            = VFTreeWatcherHash(node->info->path) & (watcher->capacity - 1);
+    node->bucket_next        = watcher->buckets[bucket];
+    watcher->buckets[bucket] = node;
+    watcher->count++;
+}
+
+static void VFTreeWatcherHashRemove(VFTreeWatcher watcher, VFTreeWatcherNode node) {
+    VFTreeWatcherNode *link = &watcher->buckets[VFTreeWatcherHash(node->info->path) & (watcher->capacity - 1)];
+    while (*link && *link != node) {
+        link = &(*link)->bucket_next;
+    }
+    if (*link) {
+        *link = node->bucket_next;
+        watcher->count--;
+    }
+}
+
+static void VFTreeWatcherAddWatch(VFTreeWatcher watcher, VFTreeWatcherNode node) {
+    if (watcher->is_fanotify) {
+        return;
+    }
+    
+    int watch = inotify_add_watch(watcher->notify, node->info->path, kVFTreeWatcherInotifyMask);
+    if (watch < 0) {
+        return;
+    }
+    
+    if ((size_t)watch >= watcher->watches_capacity) {
+        size_t capacity = watcher->watches_capacity;
+        while ((size_t)watch >= capacity) {
+            capacity *= 2;
+        }
+        watcher->watches = realloc(watcher->watches, capacity * sizeof(VFTreeWatcherNode));
+        memset(watcher->watches + watcher->watches_capacity, 0, (capacity - watcher->watches_capacity) * sizeof(VFTreeWatcherNode));
+        watcher->watches_capacity = capacity;
+    }
+    
+    // A renamed directory keeps its inode and so its watch, which now belongs to the new node
+    VFTreeWatcherNode owner = watcher->watches[watch];
+    if (owner && owner != node) {
+        owner->watch = -1;
+    }
+    watcher->watches[watch] = node;
+    node->watch             = watch;
+}
+
+static void VFTreeWatcherEmit(VFTreeWatcher watcher, VFTreeChange change, VFTreeWatcherNode node) {
+    if (watcher->block) {
+        watcher->block(change, node->info);
+    }
+}
+
+static VFTreeWatcherNode VFTreeWatcherAddNode(VFTreeWatcher watcher, VFTreeWatcherNode parent, const char *path, const struct stat *file, BOOL emit) {
+    VFTreeWatcherNode node = calloc(1, sizeof(_VFTreeWatcherNode));
+    node->info             = VFFileInfoCreateWithStat(path, file);
+    node->watch            = -1;
+    node->time_modified    = file->st_mtim;
+    node->parent           = parent;
+    
+    if (parent) {
+        node->next = parent->children;
+        if (parent->children) {
+            parent->children->previous = node;
+        }
+        parent->children = node;
+    }
+    VFTreeWatcherHashInsert(watcher, node);
+    
+    if (emit) {
+        VFTreeWatcherEmit(watcher, VFTreeChangeAdded, node);
+    }
+    
+    if (S_ISDIR(file->st_mode)) {
+        VFTreeWatcherAddWatch(watcher, node);
+        VFTreeWatcherScanDirectory(watcher, node, emit, NO);
+    }
+    return node;
+}
+
+static void VFTreeWatcherRemoveNode(VFTreeWatcher watcher, VFTreeWatcherNode node, BOOL emit) {
+    while (node->children) {
+        VFTreeWatcherRemoveNode(watcher, node->children, emit);
+    }
+    
+    if (emit) {
+        VFTreeWatcherEmit(watcher, VFTreeChangeRemoved, node);
+    }
+    
+    if (node->watch >= 0 && watcher->watches[node->watch] == node) {
+        inotify_rm_watch(watcher->notify, node->watch);
+        watcher->watches[node->watch] = NULL;
+    }
+    
+    if (node->parent) {
+        if (node->previous) {
+            node->previous->next = node->next;
+        } else {
+            node->parent->children = node->next;
+        }
+        if (node->next) {
+            node->next->previous = node->previous;
+        }
+    }
+    
+    VFTreeWatcherHashRemove(watcher, node);
+    VFFileInfoRelease(node->info);
+    free(node);
+}
+
+/* ----------------------------------------
+ * Compare a fresh stat against the mirror
+ * and report a modification if anything
+ * visible through VFFileInfo moved. Returns
+ * NO when the entry was replaced instead
+ * (a different inode or file type now lives
+ * at the same path).
+ */
+static BOOL VFTreeWatcherUpdateNode(VFTreeWatcher watcher, VFTreeWatcherNode node, const struct stat *file, BOOL emit) {
+    VFFileInfo info = node->info;
+    if (info->file_serial != (uint64_t)file->st_ino || (info->mode & S_IFMT) != (file->st_mode & S_IFMT)) {
+        return NO;
+    }
+    
+    BOOL changed = info->size != (int64_t)file->st_size
+                || info->mode != (uint16_t)file->st_mode
+                || info->user_id != file->st_uid
+                || info->group_id != file->st_gid
+                || node->time_modified.tv_sec != file->st_mtim.tv_sec
+                || node->time_modified.tv_nsec != file->st_mtim.tv_nsec
+                || info->time_status_changed != (long)file->st_ctim.tv_sec;
+                
+    if (changed) {
+        node->info          = VFFileInfoCreateWithStat(info->path, file);
+        node->time_modified = file->st_mtim;
+        VFFileInfoRelease(info);
+        
+        if (emit) {
+            VFTreeWatcherEmit(watcher, VFTreeChangeModified, node);
+        }
+    }
+    return YES;
+}
+
+/* ----------------------------------------
+ * Bring the children of a directory in line
+ * with what is on disk. Entries seen during
+ * this pass are stamped with a fresh
+ * generation, anything left unstamped was
+ * removed. When recovering, subdirectories
+ * whose modification time moved are
+ * re-read as well.
+ */
+static void VFTreeWatcherScanDirectory(VFTreeWatcher watcher, VFTreeWatcherNode node, BOOL emit, BOOL recover) {
+    DIR *directory = opendir(node->info->path);
+    if (!directory) {
+        return;
+    }
+    
+    uint64_t generation = ++watcher->generation;
+    size_t   length     = strlen(node->info->path);
+    char     path[PATH_MAX];
+    
+    struct dirent *entry;
+    while ((entry = readdir(directory))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (length + strlen(entry->d_name) + 2 > sizeof(path)) {
+            continue;
+        }
+        
+        memcpy(path, node->info->path, length);
+        path[length] = '/';
+        strcpy(path + length + 1, entry->d_name);
+        
+        struct stat file;
+        if (lstat(path, &file) != 0) {
+            continue;
+        }
+        
+        VFTreeWatcherNode child = VFTreeWatcherLookup(watcher, path);
+        if (child) {
+            struct timespec time_modified = child->time_modified;
+            if (!VFTreeWatcherUpdateNode(watcher, child, &file, emit)) {
+                VFTreeWatcherRemoveNode(watcher, child, emit);
+                child = VFTreeWatcherAddNode(watcher, node, path, &file, emit);
+                
+            } else if (recover && S_ISDIR(file.st_mode)) {
+                if (time_modified.tv_sec != file.st_mtim.tv_sec || time_modified.tv_nsec != file.st_mtim.tv_nsec) {
+                    VFTreeWatcherScanDirectory(watcher, child, emit, NO);
+                }
+            }
+            
+        } else {
+            child = VFTreeWatcherAddNode(watcher, node, path, &file, emit);
+        }
+        child->generation = generation;
+    }
+    closedir(directory);
+    
+    VFTreeWatcherNode child = node->children;
+    while (child) {
+        VFTreeWatcherNode next = child->next;
+        if (child->generation != generation) {
+            VFTreeWatcherRemoveNode(watcher, child, emit);
+        }
+        child = next;
+    }
+}
+
+#pragma mark - Private - Events -
+static void VFTreeWatcherPathsAppend(VFTreeWatcherPaths paths, char *path) {
+    if (paths->count == paths->capacity) {
+        paths->capacity = paths->capacity ? paths->capacity * 2 : 256;
+        paths->paths    = realloc(paths->paths, paths->capacity * sizeof(char *));
+    }
+    paths->paths[paths->count++] = path;
+}
+
+static int VFTreeWatcherPathsCompare(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static char * VFTreeWatcherPathCreate(const char *directory, const char *name) {
+    char *path;
+    if (name && *name) {
+        if (asprintf(&path, "%s/%s", directory, name) < 0) {
+            return NULL;
+        }
+        return path;
+    }
+    return strdup(directory);
+}
+
+static void VFTreeWatcherReadInotify(VFTreeWatcher watcher, char *buffer, VFTreeWatcherPaths paths, BOOL *overflow) {
+    ssize_t length;
+    while ((length = read(watcher->notify, buffer, kVFTreeWatcherEventBufferSize)) > 0) {
+        
+        pthread_mutex_lock(&watcher->lock);
+        for (char *cursor = buffer; cursor < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *)cursor;
+            cursor += sizeof(struct inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                *overflow = YES;
+                continue;
+            }
+            if (event->wd < 0 || (size_t)event->wd >= watcher->watches_capacity) {
+                continue;
+            }
+            
+            VFTreeWatcherNode node = watcher->watches[event->wd];
+            if (!node) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watcher->watches[event->wd] = NULL;
+                node->watch                 = -1;
+                continue;
+            }
+            
+            char *path = VFTreeWatcherPathCreate(node->info->path, event->len ? event->name : NULL);
+            if (path) {
+                VFTreeWatcherPathsAppend(paths, path);
+            }
+        }
+        pthread_mutex_unlock(&watcher->lock);
+    }
+}
+
+#if defined(FAN_REPORT_DFID_NAME)
+static void VFTreeWatcherReadFanotify(VFTreeWatcher watcher, char *buffer, VFTreeWatcherPaths paths, BOOL *overflow) {
+    size_t  root_length = strlen(watcher->root);
+    ssize_t length;
+    while ((length = read(watcher->notify, buffer, kVFTreeWatcherEventBufferSize)) > 0) {
+        
+        struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *)buffer;
+        for (; FAN_EVENT_OK(metadata, length); metadata = FAN_EVENT_NEXT(metadata, length)) {
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                *overflow = YES;
+                continue;
+            }
+            if (metadata->event_len <= sizeof(struct fanotify_event_metadata)) {
+                continue;
+            }
+            
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(metadata + 1);
+            if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID) {
+                continue;
+            }
+            
+            /* ---------------------------------------
+             * Events carry the handle of the parent
+             * directory and the entry name. Resolve the
+             * handle to a path and drop anything that
+             * happened outside of the watched root.
+             */
+            struct file_handle *handle = (struct file_handle *)fid->handle;
+            const char *name           = NULL;
+            if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                name = (const char *)(handle->f_handle + handle->handle_bytes);
+            }
+            
+            int directory = open_by_handle_at(watcher->mount, handle, O_RDONLY | O_PATH | O_CLOEXEC);
+            if (directory < 0) {
+                continue;
+            }
+            
+            char link[64];
+            char resolved[PATH_MAX];
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", directory);
+            ssize_t resolved_length = readlink(link, resolved, sizeof(resolved) - 1);
+            close(directory);
+            
+            if (resolved_length < 0) {
+                continue;
+            }
+            resolved[resolved_length] = '\0';
+            
+            if (strncmp(resolved, watcher->root, root_length) != 0 || (resolved[root_length] != '/' && resolved[root_length] != '\0')) {
+                continue;
+            }
+            if (name && strcmp(name, ".") == 0) {
+                name = NULL;
+            }
+            
+            char *path = VFTreeWatcherPathCreate(resolved, name);
+            if (path) {
+                VFTreeWatcherPathsAppend(paths, path);
+            }
+        }
+    }
+}
+#endif
+
+static void VFTreeWatcherRead(VFTreeWatcher watcher, char *buffer, VFTreeWatcherPaths paths, BOOL *overflow) {
+#if defined(FAN_REPORT_DFID_NAME)
+    if (watcher->is_fanotify) {
+        VFTreeWatcherReadFanotify(watcher, buffer, paths, overflow);
+        return;
+    }
+#endif
+    VFTreeWatcherReadInotify(watcher, buffer, paths, overflow);
+}
+
+/* ----------------------------------------
+ * Apply a single coalesced path. The parent
+ * directory is refreshed too so its mirrored
+ * modification time stays current, which is
+ * what overflow recovery compares against.
+ */
+static void VFTreeWatcherApplyPath(VFTreeWatcher watcher, const char *path) {
+    VFTreeWatcherNode node = VFTreeWatcherLookup(watcher, path);
+    
+    struct stat file;
+    BOOL exists = lstat(path, &file) == 0;
+    
+    if (node == watcher->tree) {
+        if (exists) {
+            VFTreeWatcherUpdateNode(watcher, node, &file, YES);
+        }
+        return;
+    }
+    
+    if (node) {
+        if (!exists) {
+            VFTreeWatcherRemoveNode(watcher, node, YES);
+            node = NULL;
+            
+        } else if (!VFTreeWatcherUpdateNode(watcher, node, &file, YES)) {
+            VFTreeWatcherNode parent = node->parent;
+            VFTreeWatcherRemoveNode(watcher, node, YES);
+            node = parent ? VFTreeWatcherAddNode(watcher, parent, path, &file, YES) : NULL;
+        }
+        
+    } else if (exists) {
+        char *separator = strrchr(path, '/');
+        if (separator && separator != path) {
+            char parent_path[PATH_MAX];
+            size_t length = (size_t)(separator - path);
+            if (length < sizeof(parent_path)) {
+                memcpy(parent_path, path, length);
+                parent_path[length] = '\0';
+                
+                VFTreeWatcherNode parent = VFTreeWatcherLookup(watcher, parent_path);
+                if (parent && S_ISDIR(parent->info->mode)) {
+                    node = VFTreeWatcherAddNode(watcher, parent, path, &file, YES);
+                }
+            }
+        }
+    }
+    
+    VFTreeWatcherNode parent = node ? node->parent : NULL;
+    if (parent && lstat(parent->info->path, &file) == 0) {
+        VFTreeWatcherUpdateNode(watcher, parent, &file, YES);
+    }
+}
+
+/* ----------------------------------------
+ * Directories whose modification time moved
+ * are re-read. In the others the names are
+ * the same, but files may have been written
+ * in place, so every entry is stat'd again.
+ */
+static void VFTreeWatcherRecoverNode(VFTreeWatcher watcher, VFTreeWatcherNode node) {
+    struct stat file;
+    if (lstat(node->info->path, &file) != 0 || !S_ISDIR(file.st_mode)) {
+        return;
+    }
+    
+    BOOL changed = node->time_modified.tv_sec != file.st_mtim.tv_sec || node->time_modified.tv_nsec != file.st_mtim.tv_nsec;
+    VFTreeWatcherUpdateNode(watcher, node, &file, YES);
+    
+    for (VFTreeWatcherNode child = node->children; child && !changed; child = child->next) {
+        if (!S_ISDIR(child->info->mode)) {
+            struct stat child_file;
+            changed = lstat(child->info->path, &child_file) != 0 || !VFTreeWatcherUpdateNode(watcher, child, &child_file, YES);
+        }
+    }
+    
+    if (changed) {
+        VFTreeWatcherScanDirectory(watcher, node, YES, YES);
+    }
+    
+    for (VFTreeWatcherNode child = node->children; child; child = child->next) {
+        if (S_ISDIR(child->info->mode)) {
+            VFTreeWatcherRecoverNode(watcher, child);
+        }
+    }
+}
+
+static void * VFTreeWatcherRun(void *context) {
+    VFTreeWatcher watcher = context;
+    char *buffer          = malloc(kVFTreeWatcherEventBufferSize);
+    _VFTreeWatcherPaths paths;
+    memset(&paths, 0, sizeof(paths));
+    
+    struct pollfd descriptors[2] = {
+        { .fd = watcher->notify,  .events = POLLIN },
+        { .fd = watcher->wake[0], .events = POLLIN },
+    };
+    
+    BOOL running = YES;
+    while (running) {
+        if (poll(descriptors, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (descriptors[1].revents) {
+            break;
+        }
+        
+        /* ---------------------------------------
+         * Keep reading until the window closes so
+         * that a burst of events on the same path
+         * is applied once.
+         */
+        BOOL overflow = NO;
+        VFTreeWatcherRead(watcher, buffer, &paths, &overflow);
+        
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t deadline = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + watcher->latency;
+        
+        while (YES) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t remaining = deadline - ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+            if (remaining <= 0) {
+                break;
+            }
+            
+            int ready = poll(descriptors, 2, (int)remaining);
+            if (ready > 0 && descriptors[1].revents) {
+                running = NO;
+                break;
+            }
+            if (ready > 0) {
+                VFTreeWatcherRead(watcher, buffer, &paths, &overflow);
+            }
+        }
+        
+        if (running) {
+            pthread_mutex_lock(&watcher->lock);
+            if (overflow) {
+                VFTreeWatcherRecoverNode(watcher, watcher->tree);
+            }
+            
+            qsort(paths.paths, paths.count, sizeof(char *), VFTreeWatcherPathsCompare);
+            for (size_t i = 0; i < paths.count; i++) {
+                if (i == 0 || strcmp(paths.paths[i], paths.paths[i - 1]) != 0) {
+                    VFTreeWatcherApplyPath(watcher, paths.paths[i]);
+                }
+            }
+            pthread_mutex_unlock(&watcher->lock);
+        }
+        
+        for (size_t i = 0; i < paths.count; i++) {
+            free(paths.paths[i]);
+        }
+        paths.count = 0;
+    }
+    
+    free(paths.paths);
+    free(buffer);
+    return NULL;
+}
+
+#pragma mark - VFTreeWatcher -
+VFTreeWatcher VFTreeWatcherCreate(const char *root, VFTreeWatcherOption options, uint32_t latency, VFTreeWatcherChangeBlock block, char **error) {
+    char *resolved = realpath(root, NULL);
+    if (!resolved) {
+        if (error) *error = strerror(errno);
+        return NULL;
+    }
+    
+    struct stat file;
+    if (lstat(resolved, &file) != 0 || !S_ISDIR(file.st_mode)) {
+        if (error) *error = "The root is not a directory";
+        free(resolved);
+        return NULL;
+    }
+    
+    VFTreeWatcher watcher     = calloc(1, sizeof(_VFTreeWatcher));
+    watcher->root             = resolved;
+    watcher->latency          = latency;
+    watcher->block            = block ? Block_copy(block) : NULL;
+    watcher->notify           = -1;
+    watcher->mount            = -1;
+    watcher->capacity         = kVFTreeWatcherInitialBuckets;
+    watcher->buckets          = calloc(watcher->capacity, sizeof(VFTreeWatcherNode));
+    watcher->watches_capacity = 256;
+    watcher->watches          = calloc(watcher->watches_capacity, sizeof(VFTreeWatcherNode));
+    
+    /* ---------------------------------------
+     * The lock is recursive so that change
+     * blocks can query the watcher.
+     */
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&watcher->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    
+#if defined(FAN_REPORT_DFID_NAME)
+    if (options & VFTreeWatcherOptionFanotify) {
+        int notify = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_CLOEXEC);
+        if (notify >= 0) {
+            uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_DELETE_SELF | FAN_ONDIR;
+            int mount     = open(resolved, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            
+            if (mount >= 0 && fanotify_mark(notify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, resolved) == 0) {
+                watcher->notify      = notify;
+                watcher->mount       = mount;
+                watcher->is_fanotify = YES;
+            } else {
+                if (mount >= 0) close(mount);
+                close(notify);
+            }
+        }
+    }
+#else
+    (void)options;
+#endif
+
+    if (!watcher->is_fanotify) {
+        watcher->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    
+    if (watcher->notify < 0 || pipe(watcher->wake) != 0) {
+        if (error) *error = strerror(errno);
+        if (watcher->notify >= 0) close(watcher->notify);
+        watcher->notify  = -1;
+        watcher->wake[0] = -1;
+        watcher->wake[1] = -1;
+        VFTreeWatcherRelease(watcher);
+        return NULL;
+    }
+    
+    watcher->tree = VFTreeWatcherAddNode(watcher, NULL, resolved, &file, NO);
+    
+    if (pthread_create(&watcher->thread, NULL, VFTreeWatcherRun, watcher) != 0) {
+        if (error) *error = "Failed to start the watcher thread";
+        close(watcher->wake[1]);
+        watcher->wake[1] = -1;
+        VFTreeWatcherRelease(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+void VFTreeWatcherRelease(VFTreeWatcher watcher) {
+    if (watcher) {
+        if (watcher->wake[1] >= 0) {
+            char signal = 0;
+            write(watcher->wake[1], &signal, 1);
+            pthread_join(watcher->thread, NULL);
+            close(watcher->wake[1]);
+        }
+        if (watcher->wake[0] >= 0) close(watcher->wake[0]);
+        
+        if (watcher->tree) {
+            VFTreeWatcherRemoveNode(watcher, watcher->tree, NO);
+        }
+        if (watcher->notify >= 0) close(watcher->notify);
+        if (watcher->mount >= 0)  close(watcher->mount);
+        if (watcher->block)       Block_release(watcher->block);
+        
+        pthread_mutex_destroy(&watcher->lock);
+        free(watcher->watches);
+        free(watcher->buckets);
+        free(watcher->root);
+        free(watcher);
+    }
+}
+
+size_t VFTreeWatcherGetCount(VFTreeWatcher watcher) {
+    pthread_mutex_lock(&watcher->lock);
+    size_t count = watcher->count;
+    pthread_mutex_unlock(&watcher->lock);
+    return count;
+}
+
+VFFileInfo VFTreeWatcherCopyInfo(VFTreeWatcher watcher, const char *path) {
+    pthread_mutex_lock(&watcher->lock);
+    VFTreeWatcherNode node = VFTreeWatcherLookup(watcher, path);
+    VFFileInfo info        = node ? VFFileInfoCopy(node->info) : NULL;
+    pthread_mutex_unlock(&watcher->lock);
+    return info;
+}
+
+static void VFTreeWatcherEnumerateNode(VFTreeWatcherNode node, VFDirectoryEnumerationBlock block) {
+    block(node->info, NULL);
+    for (VFTreeWatcherNode child = node->children; child; child = child->next) {
+        VFTreeWatcherEnumerateNode(child, block);
+    }
+}
+
+void VFTreeWatcherEnumerate(VFTreeWatcher watcher, VFDirectoryEnumerationBlock block) {
+    pthread_mutex_lock(&watcher->lock);
+    VFTreeWatcherEnumerateNode(watcher->tree, block);
+    pthread_mutex_unlock(&watcher->lock);
+}
+
+#else
+
+#pragma mark - VFTreeWatcher -
+VFTreeWatcher VFTreeWatcherCreate(const char *root, VFTreeWatcherOption options, uint32_t latency, VFTreeWatcherChangeBlock block, char **error) {
+    if (error) *error = "Tree watching is not supported on this platform";
+    return NULL;
+}
+
+void VFTreeWatcherRelease(VFTreeWatcher watcher) {
+    
+}
+
+size_t VFTreeWatcherGetCount(VFTreeWatcher watcher) {
+    return 0;
+}
+
+VFFileInfo VFTreeWatcherCopyInfo(VFTreeWatcher watcher, const char *path) {
+    return NULL;
+}
+
+void VFTreeWatcherEnumerate(VFTreeWatcher watcher, VFDirectoryEnumerationBlock block) {
+    
+}
+
+#endif
@@ -0,0 +1,78 @@
+//
+//  VFTreeWatcher.h
+//
+//  Created by Dima Bart on 2014-08-14.
+//  Copyright (c) 2014 Dima Bart. All rights reserved.
+//
+
+#import <stdlib.h>
+#import <stdio.h>
+#import <string.h>
+#import <stdint.h>
+#import <pthread.h>
+
+#import "VFFileManager.h"
+
+// MARK: - Type Definitions - Enums -
+typedef enum {
+    VFTreeChangeAdded    = 0,
+    VFTreeChangeRemoved  = 1,
+    VFTreeChangeModified = 2,
+} VFTreeChange;
+
+typedef enum {
+    VFTreeWatcherOptionNone     = 0,
+    VFTreeWatcherOptionFanotify = 1 << 0, // Falls back to inotify without CAP_SYS_ADMIN
+} VFTreeWatcherOption;
+
+// MARK: - Type Definitions - Blocks -
+typedef void (^VFTreeWatcherChangeBlock)(VFTreeChange change, VFFileInfo info);
+
+/*
+ * =============================
+ *    VFTreeWatcher & Related
+ * =============================
+ *
+ */
+// MARK: - VFTreeWatcher -
+
+/*
+ * Keeps an in-memory mirror of a tree's VFFileInfo, fed by inotify (one
+ * watch per directory) or, where permitted, a single fanotify mark on the
+ * whole file system. Events are collected for up to latency milliseconds,
+ * de-duplicated by path and then applied, so a burst of writes to one
+ * file produces a single change. Each change is reported through the
+ * change block on the watcher's thread, removals carry the last known
+ * info. When the kernel queue overflows, every mirrored entry is
+ * stat()'d again and only directories whose modification time moved, or
+ * that hold an entry that vanished, are re-read.
+ *
+ * Linux only, creating a watcher fails elsewhere.
+ */
+typedef struct __VFTreeWatcher {
+    char                          *root;
+    uint32_t                       latency;
+    VFTreeWatcherChangeBlock       block;
+    int                            notify;
+    BOOL                           is_fanotify;
+    int                            mount;
+    int                            wake[2];
+    pthread_t                      thread;
+    pthread_mutex_t                lock;
+    uint64_t                       generation;
+    struct __VFTreeWatcherNode    *tree;
+    struct __VFTreeWatcherNode   **buckets;
+    size_t                         capacity;
+    size_t                         count;
+    struct __VFTreeWatcherNode   **watches;
+    size_t                         watches_capacity;
+} _VFTreeWatcher;
+typedef _VFTreeWatcher * VFTreeWatcher;
+
+// MARK: - VFTreeWatcher Functions -
+VFTreeWatcher VFTreeWatcherCreate(const char *root, VFTreeWatcherOption options, uint32_t latency, VFTreeWatcherChangeBlock block, char **error);
+void VFTreeWatcherRelease(VFTreeWatcher watcher);
+
+size_t VFTreeWatcherGetCount(VFTreeWatcher watcher);
+VFFileInfo VFTreeWatcherCopyInfo(VFTreeWatcher watcher, const char *path);
+void VFTreeWatcherEnumerate(VFTreeWatcher watcher, VFDirectoryEnumerationBlock block);